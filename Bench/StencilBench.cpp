@@ -0,0 +1,599 @@
+//***************************************************************************************
+// StencilBench.cpp
+//
+// Microbenchmarks for the CPU work the client repeats every tick or at every load:
+// reading and writing network messages, applying world snapshots, building player
+// transforms, loading the models and generating shapes.  Each benchmark runs its
+// body in batches long enough to time, and reports the median time per call, the
+// heap allocations per call and, for those that scale with player or render item
+// count, the throughput per item at each count.
+//
+// The network benchmarks replay the same work HandleDatagram, DrainPackets,
+// ProcessMessages and SendPacket do, on payloads shaped like real traffic, without
+// the rest of the application around them.
+//
+// Usage: StencilBench [-filter <text>] [-csv <file>] [-models <dir>]
+//   -filter   only run benchmarks whose name contains text
+//   -csv      also write every result to file
+//   -models   directory holding skull.txt and car.txt (default Models)
+//***************************************************************************************
+
+#include "d3dUtil.h"
+#include "NetProtocol.h"
+#include "SnapshotCodec.h"
+#include "SpscRing.h"
+#include "EntityRegistry.h"
+#include "InterpolationBuffer.h"
+#include "TransformKernel.h"
+#include "MeshCache.h"
+#include "GeometryGenerator.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+
+using namespace DirectX;
+using NetProtocol::Packet;
+
+//
+// Allocation counting.  Every heap allocation in the process goes through these.
+//
+
+namespace
+{
+	std::atomic<uint64_t> gAllocations{ 0 };
+}
+
+void* operator new(size_t size)
+{
+	gAllocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size != 0 ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	std::free(p);
+}
+
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	// Each benchmark is timed over this many batches, each at least this long.
+	const int kBatches = 5;
+	const double kBatchSeconds = 0.05;
+
+	// Player counts the network benchmarks run at; kMaxPlayers is a full server.
+	const uint32_t kPlayerCounts[] = { 1, 8, NetProtocol::kMaxPlayers };
+
+	// Render item counts for the transform benchmarks.  Three items per player, up
+	// to far more than the game draws, to show where the per-item cost settles.
+	const uint32_t kItemCounts[] = { 3, 24, 96, 1024, 8192 };
+
+	// Results are folded in here so the optimizer cannot drop the work.
+	volatile uint64_t gSink = 0;
+
+	struct Result
+	{
+		std::string Name;
+		uint32_t Items = 1;
+		double NsPerOp = 0.0;
+		double AllocsPerOp = 0.0;
+	};
+
+	std::wstring gFilter;
+	std::ofstream gCsv;
+
+	bool Selected(const std::string& name)
+	{
+		return gFilter.empty() || std::wstring(name.begin(), name.end()).find(gFilter) != std::wstring::npos;
+	}
+
+	void Report(const Result& r)
+	{
+		double nsPerItem = r.NsPerOp / r.Items;
+		double itemsPerSecond = r.NsPerOp > 0.0 ? r.Items * 1e9 / r.NsPerOp : 0.0;
+		printf("%-40s %6u %12.1f %10.1f %10.2f %14.0f\n",
+			r.Name.c_str(), r.Items, r.NsPerOp, nsPerItem, r.AllocsPerOp, itemsPerSecond);
+
+		if (gCsv.is_open())
+		{
+			gCsv << r.Name << ',' << r.Items << ',' << r.NsPerOp << ',' << nsPerItem << ','
+				<< r.AllocsPerOp << ',' << itemsPerSecond << '\n';
+		}
+	}
+
+	// Times body, which does items units of work per call.
+	template<typename Body>
+	void Run(const std::string& name, uint32_t items, Body body)
+	{
+		if (!Selected(name))
+			return;
+
+		// Warm caches and any lazily built state, then double the batch until one takes
+		// long enough to time.
+		body();
+
+		uint64_t iterations = 1;
+		for (;;)
+		{
+			Clock::time_point start = Clock::now();
+			for (uint64_t i = 0; i < iterations; ++i)
+				body();
+			double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+			if (seconds >= kBatchSeconds || iterations >= (1ull << 30))
+				break;
+
+			// Jump most of the way at once when the batch was far too short.
+			uint64_t estimate = seconds > 0.0 ? (uint64_t)(iterations * kBatchSeconds / seconds) : iterations * 100;
+			iterations = (std::max)(iterations * 2, (std::min)(estimate, iterations * 100));
+		}
+
+		double ns[kBatches];
+		uint64_t allocations = 0;
+		for (int b = 0; b < kBatches; ++b)
+		{
+			uint64_t allocationsBefore = gAllocations.load(std::memory_order_relaxed);
+			Clock::time_point start = Clock::now();
+			for (uint64_t i = 0; i < iterations; ++i)
+				body();
+			ns[b] = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / iterations;
+			allocations += gAllocations.load(std::memory_order_relaxed) - allocationsBefore;
+		}
+		std::sort(ns, ns + kBatches);
+
+		Result r;
+		r.Name = name;
+		r.Items = items;
+		r.NsPerOp = ns[kBatches / 2];
+		r.AllocsPerOp = (double)allocations / (iterations * kBatches);
+		Report(r);
+	}
+
+	std::string Named(const char* base, uint32_t count)
+	{
+		return std::string(base) + "/" + std::to_string(count);
+	}
+
+	//
+	// Payloads
+	//
+
+	Packet MakeMovement(uint16_t playerId, uint32_t tick)
+	{
+		Packet packet;
+		packet.packetType = static_cast<uint8_t>(NetProtocol::PacketType::Movement);
+		packet.playerId = playerId;
+		packet.movementState = 1;
+		packet.direction = (uint8_t)(1 + (playerId + tick) % 8);
+		packet.timestamp = 1000 + tick * 16;
+		packet.inputSeq = tick;
+		packet.inputUs = 16667;
+		packet.x = -10.0f + 0.05f * tick + playerId;
+		packet.y = 1.0f;
+		packet.z = -10.0f + 0.5f * playerId;
+
+		char name[NetProtocol::kMaxNameLength];
+		int length = snprintf(name, sizeof(name), "Player%u", playerId);
+		NetProtocol::SetName(packet, name, (size_t)length);
+		return packet;
+	}
+
+	// One datagram holding a tick's movement from each of players peers, coalesced the
+	// way SendQueue sends them.
+	std::vector<uint8_t> MakeMovementDatagram(uint32_t players, uint32_t tick)
+	{
+		std::vector<uint8_t> datagram;
+		for (uint32_t i = 0; i < players; ++i)
+		{
+			uint8_t buf[NetProtocol::kMaxPacketSize];
+			size_t length = NetProtocol::EncodePacket(MakeMovement((uint16_t)i, tick), buf, sizeof(buf));
+			datagram.insert(datagram.end(), buf, buf + length);
+		}
+		return datagram;
+	}
+
+	// Everyone walks a little each tick, so consecutive snapshots differ in x and z
+	// and, every so often, in health.
+	void MakeWorld(uint32_t players, uint32_t seq, NetProtocol::WorldSnapshot& world)
+	{
+		world = NetProtocol::WorldSnapshot();
+		world.seq = seq;
+		for (uint32_t i = 0; i < players; ++i)
+		{
+			NetProtocol::PlayerState& state = world.players[i];
+			state.seq = seq;
+			state.health = 100 - (int)((seq / 30 + i) % 50);
+			state.ack = seq * 2 + i;
+			state.x = -10.0f + 5.0f * ((i + 1) % 7) + 0.05f * (seq % 40);
+			state.y = 1.0f;
+			state.z = -10.0f + 3.0f * ((i + 1) / 7) + 0.03f * (seq % 50);
+			state.nameLength = (uint8_t)snprintf(state.name, sizeof(state.name), "Player%u", i);
+			world.presentMask |= 1u << i;
+		}
+	}
+
+	std::string MakeWorldText(const NetProtocol::WorldSnapshot& world)
+	{
+		std::string text;
+		char record[256];
+		for (uint32_t i = 0; i < NetProtocol::kMaxPlayers; ++i)
+		{
+			if ((world.presentMask & (1u << i)) == 0)
+				continue;
+
+			const NetProtocol::PlayerState& s = world.players[i];
+			snprintf(record, sizeof(record), "%%ip:192.168.1.%u;player:%u;name:%.*s;health:%d;x:%.3f;y:%.3f;z:%.3f;ack:%u",
+				10 + i, i, (int)s.nameLength, s.name, s.health, s.x, s.y, s.z, s.ack);
+			text += record;
+		}
+		text += '\n';
+		return text;
+	}
+
+	//
+	// Network
+	//
+
+	void BenchPackets()
+	{
+		// SendPacket: the name is filled in and the packet encoded for every send.
+		Packet movement = MakeMovement(1, 7);
+		const std::string localName = "Eric";
+		Run("packet/encode", 1, [&]()
+		{
+			Packet out = movement;
+			NetProtocol::SetName(out, localName.data(), localName.size());
+
+			uint8_t buf[NetProtocol::kMaxPacketSize];
+			gSink += NetProtocol::EncodePacket(out, buf, sizeof(buf));
+		});
+
+		// ParsePacket on its own.
+		uint8_t wire[NetProtocol::kMaxPacketSize];
+		size_t wireLength = NetProtocol::EncodePacket(movement, wire, sizeof(wire));
+		Run("packet/decode", 1, [&]()
+		{
+			Packet packet;
+			gSink += NetProtocol::DecodePacket(wire, wireLength, packet) ? packet.inputSeq : 0;
+		});
+
+		// HandleDatagram through DrainPackets for one tick of movement from every peer:
+		// walk the coalesced messages, decode each into the ring, then drain the ring
+		// into the per-player history.
+		for (uint32_t players : kPlayerCounts)
+		{
+			std::vector<std::vector<uint8_t>> datagrams;
+			for (uint32_t tick = 0; tick < 64; ++tick)
+				datagrams.push_back(MakeMovementDatagram(players, tick));
+
+			auto ring = std::make_unique<SpscRing<Packet, 256>>();
+			std::vector<Packet> lastPackets(NetProtocol::kMaxPlayers);
+			std::vector<InterpolationBuffer> remotePlayers(NetProtocol::kMaxPlayers);
+			uint32_t next = 0;
+			uint32_t now = 0;
+
+			Run(Named("packet/receive", players), players, [&]()
+			{
+				const std::vector<uint8_t>& datagram = datagrams[next++ % datagrams.size()];
+				const uint8_t* bytes = datagram.data();
+				size_t remaining = datagram.size();
+
+				NetProtocol::PacketType type;
+				size_t messageLength;
+				while ((messageLength = NetProtocol::ReadHeader(bytes, remaining, type)) != 0)
+				{
+					Packet packet;
+					if (NetProtocol::DecodePacket(bytes, messageLength, packet))
+						ring->TryPush(packet);
+					bytes += messageLength;
+					remaining -= messageLength;
+				}
+
+				// Timestamps keep rising across passes over the datagrams, as they would live.
+				now += 16;
+				Packet packet;
+				while (ring->TryPop(packet))
+				{
+					lastPackets[packet.playerId] = packet;
+					remotePlayers[packet.playerId].Push(packet.timestamp + now, XMFLOAT3(packet.x, packet.y, packet.z), now);
+				}
+			});
+		}
+	}
+
+	void BenchSnapshots()
+	{
+		for (uint32_t players : kPlayerCounts)
+		{
+			// A run of consecutive worlds, each delta-encoded against the one before.
+			const uint32_t worldCount = 64;
+			std::vector<NetProtocol::WorldSnapshot> worlds(worldCount + 1);
+			for (uint32_t i = 0; i <= worldCount; ++i)
+				MakeWorld(players, i + 1, worlds[i]);
+
+			std::vector<std::vector<uint8_t>> full(worldCount), deltas(worldCount);
+			std::vector<std::string> texts(worldCount);
+			for (uint32_t i = 0; i < worldCount; ++i)
+			{
+				uint8_t buf[NetProtocol::kMaxSnapshotSize];
+				size_t length = NetProtocol::EncodeSnapshot(worlds[i + 1], nullptr, buf, sizeof(buf));
+				full[i].assign(buf, buf + length);
+				length = NetProtocol::EncodeSnapshot(worlds[i + 1], &worlds[i], buf, sizeof(buf));
+				deltas[i].assign(buf, buf + length);
+				texts[i] = MakeWorldText(worlds[i + 1]);
+			}
+
+			uint32_t next = 0;
+			Run(Named("snapshot/encode-delta", players), players, [&]()
+			{
+				uint32_t i = next++ % worldCount;
+				uint8_t buf[NetProtocol::kMaxSnapshotSize];
+				gSink += NetProtocol::EncodeSnapshot(worlds[i + 1], &worlds[i], buf, sizeof(buf));
+			});
+
+			NetProtocol::WorldSnapshot decoded;
+			Run(Named("snapshot/decode-full", players), players, [&]()
+			{
+				const std::vector<uint8_t>& data = full[next++ % worldCount];
+				gSink += NetProtocol::DecodeSnapshot(data.data(), data.size(), nullptr, decoded) ? decoded.seq : 0;
+			});
+
+			Run(Named("snapshot/decode-delta", players), players, [&]()
+			{
+				uint32_t i = next++ % worldCount;
+				gSink += NetProtocol::DecodeSnapshot(deltas[i].data(), deltas[i].size(), &worlds[i], decoded) ? decoded.seq : 0;
+			});
+
+			std::vector<NetProtocol::PlayerState> states(NetProtocol::kMaxPlayers);
+			Run(Named("snapshot/parse-text", players), players, [&]()
+			{
+				const std::string& text = texts[next++ % worldCount];
+				gSink += NetProtocol::ParseWorldSnapshot(text, next, states.data(), states.size());
+			});
+
+			// ProcessMessages for a binary delta: decode it into the history, copy the
+			// present players into the per-player state and update everyone who is
+			// already in the registry.
+			EntityRegistry registry(NetProtocol::kMaxPlayers, NetProtocol::kMaxPlayers);
+			for (uint32_t i = 0; i < players; ++i)
+			{
+				uint32_t slot = registry.Join((uint16_t)i);
+				const NetProtocol::PlayerState& s = worlds[0].players[i];
+				registry.NameId[slot] = registry.InternName(std::string_view(s.name, s.nameLength));
+			}
+
+			std::vector<NetProtocol::WorldSnapshot> history(worldCount + 1);
+			for (uint32_t i = 0; i <= worldCount; ++i)
+				history[i] = worlds[i];
+
+			Run(Named("snapshot/process", players), players, [&]()
+			{
+				uint32_t i = next++ % worldCount;
+				NetProtocol::WorldSnapshot& out = history[i + 1];
+				if (!NetProtocol::DecodeSnapshot(deltas[i].data(), deltas[i].size(), &history[i], out))
+					return;
+
+				for (uint32_t p = 0; p < NetProtocol::kMaxPlayers; ++p)
+				{
+					if ((out.presentMask & (1u << p)) == 0)
+						continue;
+
+					states[p] = out.players[p];
+					const NetProtocol::PlayerState& state = states[p];
+
+					uint32_t slot = registry.Find((uint16_t)p);
+					if (slot == EntityRegistry::InvalidSlot)
+						continue;
+
+					registry.Move(slot, XMFLOAT3(state.x, state.y, state.z), 1.0f / 60.0f);
+					registry.Health[slot] = state.health;
+
+					std::string_view stateName(state.name, state.nameLength);
+					if (registry.Name(registry.NameId[slot]) != stateName)
+						registry.NameId[slot] = registry.InternName(stateName);
+				}
+				gSink += out.seq;
+			});
+		}
+	}
+
+	//
+	// Transforms
+	//
+
+	// Every render item draws one instance, and the CPU keeps both its row-major world
+	// matrix and the transposed copy uploaded to the instance buffer.
+	struct ItemTransform
+	{
+		XMFLOAT4X4 World;
+		XMFLOAT4X4 InstanceWorld;
+	};
+
+	void BenchTransforms()
+	{
+		const XMMATRIX local = XMMatrixRotationY(0.5f * MathHelper::Pi) * XMMatrixScaling(0.45f, 0.45f, 0.45f);
+		const XMVECTOR mirrorPlane = XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f);
+		const XMFLOAT3 lightDirection(0.57735f, -0.57735f, 0.57735f);
+
+		TransformKernel kernel;
+		kernel.SetLocalTransform(local);
+		kernel.SetMirrorPlane(mirrorPlane);
+		kernel.SetShadowLight(lightDirection);
+
+		for (uint32_t itemCount : kItemCounts)
+		{
+			// A player owns three items: itself, its reflection and its shadow.
+			uint32_t entities = itemCount / 3;
+			std::vector<XMFLOAT3> positions(entities);
+			for (uint32_t i = 0; i < entities; ++i)
+				positions[i] = XMFLOAT3(-10.0f + 0.01f * i, 1.0f, -10.0f + 0.02f * i);
+
+			std::vector<ItemTransform> items(entities * 3);
+
+			// One matrix chain per item, rebuilt from scratch, and a separate pass to
+			// transpose every item into the instance data.
+			Run(Named("transform/per-item", itemCount), itemCount, [&]()
+			{
+				XMMATRIX R = XMMatrixReflect(mirrorPlane);
+				XMVECTOR shadowPlane = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+				XMMATRIX S = XMMatrixShadow(shadowPlane, -XMLoadFloat3(&lightDirection));
+				XMMATRIX shadowOffsetY = XMMatrixTranslation(0.0f, 0.001f, 0.0f);
+
+				for (uint32_t i = 0; i < entities; ++i)
+				{
+					const XMFLOAT3& p = positions[i];
+					XMMATRIX world = local * XMMatrixTranslation(p.x, p.y, p.z);
+					XMStoreFloat4x4(&items[i * 3 + 0].World, world);
+					XMStoreFloat4x4(&items[i * 3 + 1].World, world * R);
+					XMStoreFloat4x4(&items[i * 3 + 2].World, world * S * shadowOffsetY);
+				}
+
+				for (ItemTransform& item : items)
+					XMStoreFloat4x4(&item.InstanceWorld, XMMatrixTranspose(XMLoadFloat4x4(&item.World)));
+				gSink += (uint64_t)items.back().InstanceWorld._14;
+			});
+
+			std::vector<TransformKernel::Target> targets(entities);
+			for (uint32_t i = 0; i < entities; ++i)
+			{
+				targets[i].Slot = i;
+				for (int k = 0; k < TransformKernel::MatrixCount; ++k)
+				{
+					targets[i].Rows[k] = &items[i * 3 + k].World;
+					targets[i].Transposed[k] = &items[i * 3 + k].InstanceWorld;
+				}
+			}
+
+			Run(Named("transform/kernel", itemCount), itemCount, [&]()
+			{
+				kernel.Run(positions.data(), targets.data(), targets.size());
+				gSink += (uint64_t)items.back().InstanceWorld._14;
+			});
+		}
+	}
+
+	//
+	// Models
+	//
+
+	void BenchModels(const std::wstring& modelDir)
+	{
+		// Baking replaces the .mesh next to its source, so it works on a copy rather
+		// than the caches the game loads.
+		wchar_t tempPath[MAX_PATH];
+		GetTempPathW(MAX_PATH, tempPath);
+		std::wstring workDir = std::wstring(tempPath) + L"StencilBench\\";
+		CreateDirectoryW(workDir.c_str(), nullptr);
+
+		struct Model
+		{
+			const wchar_t* File;
+			const char* Name;
+		};
+		const Model models[] = { { L"skull.txt", "skull" }, { L"car.txt", "car" } };
+
+		for (const Model& model : models)
+		{
+			std::wstring source = modelDir + L"\\" + model.File;
+			std::wstring copy = workDir + model.File;
+			if (!CopyFileW(source.c_str(), copy.c_str(), FALSE))
+			{
+				wprintf(L"skipping %s: cannot read %s\n", model.File, source.c_str());
+				continue;
+			}
+
+			std::string name = model.Name;
+			Run("model/bake/" + name, 1, [&]()
+			{
+				gSink += MeshCache::Bake(copy) ? 1 : 0;
+			});
+
+			// Open on an up-to-date cache: the stale check and mapping the file.
+			MeshCache cache;
+			Run("model/open/" + name, 1, [&]()
+			{
+				gSink += cache.Open(copy) ? cache.IndexCount() : 0;
+			});
+		}
+	}
+
+	void BenchGeometry()
+	{
+		// Parameters from the shapes the samples build.
+		GeometryGenerator geoGen;
+		Run("geometry/box", 1, [&]()
+		{
+			gSink += geoGen.CreateBox(1.5f, 0.5f, 1.5f, 3).Vertices.size();
+		});
+		Run("geometry/grid", 1, [&]()
+		{
+			gSink += geoGen.CreateGrid(20.0f, 30.0f, 60, 40).Vertices.size();
+		});
+		Run("geometry/sphere", 1, [&]()
+		{
+			gSink += geoGen.CreateSphere(0.5f, 20, 20).Vertices.size();
+		});
+		Run("geometry/geosphere", 1, [&]()
+		{
+			gSink += geoGen.CreateGeosphere(0.5f, 3).Vertices.size();
+		});
+		Run("geometry/cylinder", 1, [&]()
+		{
+			gSink += geoGen.CreateCylinder(0.5f, 0.3f, 3.0f, 20, 20).Vertices.size();
+		});
+	}
+}
+
+int main()
+{
+	d3dUtil::GetCommandLineValue(L"filter", gFilter);
+
+	std::wstring csvPath;
+	if (d3dUtil::GetCommandLineValue(L"csv", csvPath))
+	{
+		gCsv.open(csvPath, std::ios::out | std::ios::trunc);
+		if (!gCsv)
+		{
+			wprintf(L"cannot create %s\n", csvPath.c_str());
+			return 1;
+		}
+		gCsv << "benchmark,items,ns_per_op,ns_per_item,allocs_per_op,items_per_sec\n";
+	}
+
+	std::wstring modelDir = L"Models";
+	d3dUtil::GetCommandLineValue(L"models", modelDir);
+
+	printf("%-40s %6s %12s %10s %10s %14s\n", "benchmark", "items", "ns/op", "ns/item", "allocs/op", "items/s");
+	BenchPackets();
+	BenchSnapshots();
+	BenchTransforms();
+	BenchModels(modelDir);
+	BenchGeometry();
+	return 0;
+}
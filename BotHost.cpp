@@ -0,0 +1,530 @@
+//***************************************************************************************
+// BotHost.cpp
+//***************************************************************************************
+
+#include "BotHost.h"
+#include "SnapshotCodec.h"
+#include "SocketBackend.h"
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+using namespace DirectX;
+
+namespace
+{
+	// Set by the console handler; every bot leaves on the next tick.
+	std::atomic<bool> gStopRequested{ false };
+
+	BOOL WINAPI OnConsoleCtrl(DWORD ctrlType)
+	{
+		if (ctrlType == CTRL_C_EVENT || ctrlType == CTRL_BREAK_EVENT || ctrlType == CTRL_CLOSE_EVENT)
+		{
+			gStopRequested = true;
+			return TRUE;
+		}
+		return FALSE;
+	}
+
+	uint8_t ParseKeys(const std::string& text)
+	{
+		uint8_t keys = 0;
+		for (char c : text)
+		{
+			switch (toupper((unsigned char)c))
+			{
+			case 'A': keys |= PredictionBuffer::KeyA; break;
+			case 'D': keys |= PredictionBuffer::KeyD; break;
+			case 'W': keys |= PredictionBuffer::KeyW; break;
+			case 'S': keys |= PredictionBuffer::KeyS; break;
+			}
+		}
+		return keys;
+	}
+
+	// Same numbering as StencilApp's DetermineDirection.
+	uint8_t KeysToDirection(uint8_t keys)
+	{
+		bool a = (keys & PredictionBuffer::KeyA) != 0;
+		bool d = (keys & PredictionBuffer::KeyD) != 0;
+		bool w = (keys & PredictionBuffer::KeyW) != 0;
+		bool s = (keys & PredictionBuffer::KeyS) != 0;
+
+		if (w && !a && !d && !s) return 1;
+		if (s && !a && !d && !w) return 2;
+		if (d && !w && !s && !a) return 3;
+		if (a && !w && !s && !d) return 4;
+		if (w && d) return 5;
+		if (w && a) return 6;
+		if (s && a) return 7;
+		if (s && d) return 8;
+		return 0;
+	}
+
+	void Print(const std::string& text)
+	{
+		OutputDebugStringA(text.c_str());
+		fputs(text.c_str(), stdout);
+		fflush(stdout);
+	}
+}
+
+//
+// BotInput
+//
+
+bool BotInput::LoadScript(const std::wstring& filename)
+{
+	std::ifstream fin(filename);
+	if (!fin)
+		return false;
+
+	mScript.clear();
+	std::string line;
+	while (std::getline(fin, line))
+	{
+		std::istringstream iss(line);
+		std::string keys;
+		Step step;
+		if (!(iss >> keys >> step.Seconds) || keys[0] == '#' || step.Seconds <= 0.0f)
+			continue;
+
+		step.Keys = ParseKeys(keys);
+		mScript.push_back(step);
+	}
+
+	return !mScript.empty();
+}
+
+void BotInput::Start(uint32_t botIndex)
+{
+	mRandom.seed(botIndex + 1);
+
+	if (Scripted())
+	{
+		mStep = botIndex % mScript.size();
+		mKeys = mScript[mStep].Keys;
+		mRemaining = mScript[mStep].Seconds;
+	}
+	else
+	{
+		RandomStep();
+	}
+}
+
+uint8_t BotInput::Next(float dt)
+{
+	while (mRemaining <= 0.0f)
+	{
+		if (Scripted())
+		{
+			mStep = (mStep + 1) % mScript.size();
+			mKeys = mScript[mStep].Keys;
+			mRemaining += mScript[mStep].Seconds;
+		}
+		else
+		{
+			RandomStep();
+		}
+	}
+
+	mRemaining -= dt;
+	return mKeys;
+}
+
+bool BotInput::Scripted()const
+{
+	return !mScript.empty();
+}
+
+void BotInput::RandomStep()
+{
+	// Hold one of the eight directions the protocol knows, or stand still a quarter
+	// of the time, for 0.25 to 2 seconds.
+	static const uint8_t directions[] = {
+		PredictionBuffer::KeyW, PredictionBuffer::KeyS, PredictionBuffer::KeyD, PredictionBuffer::KeyA,
+		PredictionBuffer::KeyW | PredictionBuffer::KeyD, PredictionBuffer::KeyW | PredictionBuffer::KeyA,
+		PredictionBuffer::KeyS | PredictionBuffer::KeyA, PredictionBuffer::KeyS | PredictionBuffer::KeyD
+	};
+
+	std::uniform_int_distribution<int> pick(0, 31);
+	int choice = pick(mRandom);
+	mKeys = choice < 8 ? 0 : directions[choice % 8];
+
+	std::uniform_real_distribution<float> hold(0.25f, 2.0f);
+	mRemaining += hold(mRandom);
+}
+
+//
+// BotClient
+//
+
+BotClient::BotClient(uint16_t playerId, const std::string& name, const BotInput& input)
+	: mPlayerId(playerId), mName(name), mInput(input)
+{
+	mPendingLength = ReliableChannel::ChannelHeaderSize;
+}
+
+BotClient::~BotClient()
+{
+	if (mSocket != INVALID_SOCKET)
+		closesocket(mSocket);
+}
+
+bool BotClient::Open(const XMFLOAT3& spawn, uint32_t botIndex)
+{
+	mSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (mSocket == INVALID_SOCKET)
+		return false;
+
+	// Hundreds of bots share a few threads, so no receive may block.
+	u_long nonBlocking = 1;
+	if (ioctlsocket(mSocket, FIONBIO, &nonBlocking) != 0)
+		return false;
+
+	sockaddr_in localAddr = {};
+	localAddr.sin_family = AF_INET;
+	localAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	localAddr.sin_port = 0;
+	if (bind(mSocket, (const sockaddr*)&localAddr, sizeof(localAddr)) != 0)
+		return false;
+
+	mPosition = spawn;
+	mInput.Start(botIndex);
+
+	NetProtocol::Packet join;
+	join.packetType = static_cast<uint8_t>(NetProtocol::PacketType::Join);
+	join.playerId = mPlayerId;
+	join.timestamp = NetProtocol::NowMs();
+	join.x = mPosition.x;
+	join.y = mPosition.y;
+	join.z = mPosition.z;
+	NetProtocol::SetName(join, mName.data(), mName.size());
+
+	uint8_t buf[NetProtocol::kMaxPacketSize];
+	size_t length = NetProtocol::EncodePacket(join, buf, sizeof(buf));
+	return length != 0 && mChannel.SendReliable(buf, length);
+}
+
+void BotClient::Tick(float dt, const sockaddr_in& server)
+{
+	uint32_t now = NetProtocol::NowMs();
+	Receive(now);
+
+	if (mAckedSnapshotSeq != mSnapshotSeq)
+	{
+		uint8_t ack[NetProtocol::kAckSize];
+		size_t length = NetProtocol::EncodeAck(mPlayerId, mSnapshotSeq, ack, sizeof(ack));
+		Append(ack, length);
+		mAckedSnapshotSeq = mSnapshotSeq;
+	}
+
+	// Bots have no camera, so their interest is centred on themselves.
+	mSubscriptionAge += dt;
+	if (mSubscriptionAge >= 1.0f && !mLeaving)
+	{
+		NetProtocol::Subscription subscription;
+		subscription.playerId = mPlayerId;
+		subscription.x = mPosition.x;
+		subscription.y = mPosition.y;
+		subscription.z = mPosition.z;
+		subscription.radius = NetProtocol::kDefaultInterestRadius;
+
+		uint8_t buf[NetProtocol::kSubscribeSize];
+		size_t length = NetProtocol::EncodeSubscribe(subscription, buf, sizeof(buf));
+		Append(buf, length);
+		mSubscriptionAge = 0.0f;
+	}
+
+	// Same rule as StencilApp::SimulateInput: every tick of held keys is sent as a
+	// numbered input, plus one for the tick they are released.
+	uint8_t keys = mLeaving ? 0 : mInput.Next(dt);
+	bool moving = keys != 0;
+	if (moving || mWasMoving)
+	{
+		uint32_t inputUs = moving ? static_cast<uint32_t>(dt * 1000000.0f) : 0;
+		float inputDt = inputUs / 1000000.0f;
+		if (moving)
+			PredictionBuffer::ApplyInput(keys, inputDt, mPosition);
+
+		NetProtocol::Packet input;
+		input.packetType = static_cast<uint8_t>(NetProtocol::PacketType::Movement);
+		input.playerId = mPlayerId;
+		input.movementState = moving ? 1 : 0;
+		input.direction = KeysToDirection(keys);
+		input.timestamp = now;
+		input.inputSeq = mPrediction.Record(keys, inputDt, mPosition);
+		input.inputUs = inputUs;
+		input.x = mPosition.x;
+		input.y = mPosition.y;
+		input.z = mPosition.z;
+		NetProtocol::SetName(input, mName.data(), mName.size());
+
+		uint8_t buf[NetProtocol::kMaxPacketSize];
+		size_t length = NetProtocol::EncodePacket(input, buf, sizeof(buf));
+		Append(buf, length);
+	}
+	mWasMoving = moving;
+
+	Flush(server, now);
+}
+
+bool BotClient::Leave()
+{
+	mLeaving = true;
+
+	uint8_t buf[NetProtocol::kLeaveSize];
+	size_t length = NetProtocol::EncodeLeave(mPlayerId, buf, sizeof(buf));
+	return mChannel.SendReliable(buf, length);
+}
+
+bool BotClient::HasUnacked()
+{
+	return mChannel.HasUnacked();
+}
+
+uint64_t BotClient::DatagramsSent()const
+{
+	return mDatagramsSent;
+}
+
+uint64_t BotClient::DatagramsReceived()const
+{
+	return mDatagramsReceived;
+}
+
+void BotClient::Receive(uint32_t nowMs)
+{
+	char buf[SocketBackend::SlotSize];
+	for (;;)
+	{
+		int length = recvfrom(mSocket, buf, sizeof(buf), 0, nullptr, nullptr);
+		if (length <= 0)
+			break;
+		++mDatagramsReceived;
+
+		// Walk the datagram as StencilApp::HandleDatagram does, keeping only what a
+		// bot needs: acks for the channel and the newest snapshot seq.
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(buf);
+		size_t remaining = static_cast<size_t>(length);
+		NetProtocol::PacketType type;
+		size_t messageLength;
+		while ((messageLength = NetProtocol::ReadHeader(bytes, remaining, type)) != 0)
+		{
+			uint32_t seq = 0;
+			uint32_t baselineSeq = 0;
+			if (type == NetProtocol::PacketType::Channel)
+			{
+				mChannel.ReceiveHeader(bytes, messageLength, nowMs);
+			}
+			else if (type == NetProtocol::PacketType::Reliable)
+			{
+				// Consumed so the delivery window moves on; bots have no use for them.
+				mChannel.ReceiveReliable(bytes, messageLength, [](const uint8_t*, size_t) {});
+			}
+			else if (NetProtocol::ReadSnapshotSeq(bytes, messageLength, seq, baselineSeq))
+			{
+				if (mSnapshotSeq == 0 || static_cast<int32_t>(seq - mSnapshotSeq) > 0)
+					mSnapshotSeq = seq;
+			}
+
+			bytes += messageLength;
+			remaining -= messageLength;
+		}
+	}
+}
+
+void BotClient::Append(const uint8_t* data, size_t length)
+{
+	if (length == 0)
+		return;
+
+	// Keeps the same room for retransmits as SendQueue.
+	const size_t capacity = sizeof(mPending) - 2 * (ReliableChannel::ReliableHeaderSize + ReliableChannel::MaxReliableSize);
+	if (mPendingLength + length > capacity)
+		return;
+
+	memcpy(mPending + mPendingLength, data, length);
+	mPendingLength += length;
+}
+
+void BotClient::Flush(const sockaddr_in& server, uint32_t nowMs)
+{
+	if (mPendingLength == ReliableChannel::ChannelHeaderSize && !mChannel.HasDue(nowMs))
+		return;
+
+	size_t length = mChannel.Seal(mPending, mPendingLength, sizeof(mPending), nowMs);
+	if (sendto(mSocket, (const char*)mPending, (int)length, 0, (const sockaddr*)&server, sizeof(server)) == (int)length)
+		++mDatagramsSent;
+
+	mPendingLength = ReliableChannel::ChannelHeaderSize;
+}
+
+//
+// BotHost
+//
+
+BotHost::~BotHost()
+{
+	// Sockets close before Winsock is torn down.
+	mBots.clear();
+	if (mNetworkingStarted)
+		WSACleanup();
+}
+
+bool BotHost::Initialize(const std::string& host, int port)
+{
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+		return false;
+	mNetworkingStarted = true;
+
+	// A console for the stats and for Ctrl+C; there is no window to close.
+	if (AllocConsole())
+	{
+		FILE* stream = nullptr;
+		freopen_s(&stream, "CONOUT$", "w", stdout);
+	}
+	SetConsoleCtrlHandler(OnConsoleCtrl, TRUE);
+
+	addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+
+	addrinfo* result = nullptr;
+	if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || result == nullptr)
+		return false;
+	mServerAddr = *(const sockaddr_in*)result->ai_addr;
+	mServerAddr.sin_port = htons((u_short)port);
+	freeaddrinfo(result);
+
+	float tickRate = d3dUtil::GetCommandLineFloat(L"tickrate", mTickRate);
+	if (tickRate > 0.0f)
+		mTickRate = tickRate;
+	mDurationSeconds = d3dUtil::GetCommandLineFloat(L"botseconds", 0.0f);
+
+	int count = MathHelper::Max((int)d3dUtil::GetCommandLineFloat(L"bots", 1.0f), 1);
+	int firstId = MathHelper::Clamp((int)d3dUtil::GetCommandLineFloat(L"botid", 2.0f), 0, 0xffff - count);
+
+	// Workers besides the ticking thread, which takes bots too.
+	unsigned hardware = MathHelper::Max(std::thread::hardware_concurrency(), 2u);
+	int threads = (int)d3dUtil::GetCommandLineFloat(L"botthreads", (float)(hardware - 1));
+	mPool = std::make_unique<ThreadPool>((unsigned)MathHelper::Max(threads, 0));
+
+	BotInput input;
+	std::wstring script;
+	if (d3dUtil::GetCommandLineValue(L"botscript", script) && !input.LoadScript(script))
+	{
+		Print("Failed to load bot script; using random input\n");
+	}
+
+	for (int i = 0; i < count; ++i)
+	{
+		uint16_t playerId = static_cast<uint16_t>(firstId + i);
+		auto bot = std::make_unique<BotClient>(playerId, "Bot" + std::to_string(playerId), input);
+
+		// Same layout as StencilApp::SpawnPosition.
+		XMFLOAT3 spawn(-10.0f + 5.0f * ((playerId + 1) % 7), 1.0f, -10.0f + 3.0f * ((playerId + 1) / 7));
+		if (!bot->Open(spawn, (uint32_t)i))
+		{
+			Print("Failed to open bot " + std::to_string(playerId) + "\n");
+			return false;
+		}
+		mBots.push_back(std::move(bot));
+	}
+
+	std::ostringstream oss;
+	oss << mBots.size() << " bots (ids " << firstId << "-" << firstId + count - 1 << ") on "
+		<< mPool->ThreadCount() + 1 << " threads, " << mTickRate << " Hz, "
+		<< (input.Scripted() ? "scripted" : "random") << " input\n";
+	Print(oss.str());
+	return true;
+}
+
+int BotHost::Run()
+{
+	using Clock = std::chrono::steady_clock;
+
+	const float tickDt = 1.0f / mTickRate;
+	const auto tickDuration = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(tickDt));
+	const auto start = Clock::now();
+	auto nextTick = start;
+	auto nextReport = start + std::chrono::seconds(5);
+
+	for (;;)
+	{
+		double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+		if (gStopRequested || (mDurationSeconds > 0.0 && elapsed >= mDurationSeconds))
+			break;
+
+		TickAll(tickDt);
+
+		if (Clock::now() >= nextReport)
+		{
+			ReportStats(elapsed);
+			nextReport += std::chrono::seconds(5);
+		}
+
+		// Fixed ticks as in D3DApp::Run.  A host that falls behind drops the ticks it
+		// missed rather than bursting to catch up.
+		nextTick += tickDuration;
+		auto now = Clock::now();
+		if (nextTick < now)
+			nextTick = now;
+		else
+			std::this_thread::sleep_until(nextTick);
+	}
+
+	// Keep ticking until every Leave is acked, but don't hold up shutdown for long.
+	// Bots that could not queue one time out on the server instead.
+	size_t leaveFailures = 0;
+	for (auto& bot : mBots)
+	{
+		if (!bot->Leave())
+			++leaveFailures;
+	}
+	if (leaveFailures > 0)
+		Print(std::to_string(leaveFailures) + " bots could not queue their Leave\n");
+
+	const auto lingerEnd = Clock::now() + std::chrono::seconds(1);
+	while (Clock::now() < lingerEnd)
+	{
+		TickAll(tickDt);
+
+		bool unacked = false;
+		for (auto& bot : mBots)
+			unacked = unacked || bot->HasUnacked();
+		if (!unacked)
+			break;
+
+		std::this_thread::sleep_for(tickDuration);
+	}
+
+	ReportStats(std::chrono::duration<double>(Clock::now() - start).count());
+	return 0;
+}
+
+void BotHost::TickAll(float dt)
+{
+	mPool->ParallelFor((unsigned)mBots.size(), [this, dt](unsigned i) {
+		mBots[i]->Tick(dt, mServerAddr);
+	});
+}
+
+void BotHost::ReportStats(double elapsedSeconds)
+{
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	for (auto& bot : mBots)
+	{
+		sent += bot->DatagramsSent();
+		received += bot->DatagramsReceived();
+	}
+
+	std::ostringstream oss;
+	oss << (int)elapsedSeconds << "s: " << sent << " datagrams sent, " << received << " received\n";
+	Print(oss.str());
+}
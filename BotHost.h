@@ -0,0 +1,148 @@
+//***************************************************************************************
+// BotHost.h
+//
+// Headless load generator.  StencilDemo run with -bots <count> builds a BotHost
+// instead of the app: no window, no device, just count simulated players talking to
+// the relay over the real wire protocol.
+//
+// Every bot owns a non-blocking UDP socket, a ReliableChannel for its Join and Leave,
+// and a PredictionBuffer for numbering its inputs, so the server sees exactly what a
+// real client would send.  Each fixed tick the host runs every bot once on a
+// ThreadPool: the bot drains its socket, acks the newest snapshot, picks its keys
+// and sends one datagram with its movement.  Once a second it also subscribes to
+// the area around itself, so the server filters its snapshots as it would a real
+// client's.
+//
+// Input comes from a script (-botscript <file>) or, without one, a random walk.  A
+// script is one step per line, "<keys> <seconds>", keys being any of WASD or "-" for
+// none; bots loop it, each starting on a different step so they do not all move in
+// lockstep.
+//
+// Bots only read the snapshot header.  The server is authoritative for their
+// position, but nothing is drawn, so it is never worth decoding.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+#include "PredictionBuffer.h"
+#include "ReliableChannel.h"
+#include "ThreadPool.h"
+#include <random>
+
+class BotInput
+{
+public:
+	struct Step
+	{
+		uint8_t Keys = 0;
+		float Seconds = 0.0f;
+	};
+
+	// Returns false if the file cannot be read or has no valid step.
+	bool LoadScript(const std::wstring& filename);
+
+	// Positions bot botIndex at its first step.
+	void Start(uint32_t botIndex);
+
+	// Keys to hold for the next dt seconds.
+	uint8_t Next(float dt);
+
+	bool Scripted()const;
+
+private:
+	void RandomStep();
+
+private:
+	std::vector<Step> mScript;
+	size_t mStep = 0;
+	float mRemaining = 0.0f;
+	uint8_t mKeys = 0;
+	std::minstd_rand mRandom;
+};
+
+class BotClient
+{
+public:
+	BotClient(uint16_t playerId, const std::string& name, const BotInput& input);
+	BotClient(const BotClient& rhs) = delete;
+	BotClient& operator=(const BotClient& rhs) = delete;
+	~BotClient();
+
+	// Creates the socket and queues the Join.
+	bool Open(const DirectX::XMFLOAT3& spawn, uint32_t botIndex);
+
+	// One fixed tick: receive, choose input, send.  Called on a pool thread, but never
+	// for the same bot from two threads at once.
+	void Tick(float dt, const sockaddr_in& server);
+
+	// Queues the Leave.  Later ticks keep resending it until acked.  Returns false if
+	// the send window is full and the Leave could not be queued.
+	bool Leave();
+
+	bool HasUnacked();
+
+	uint64_t DatagramsSent()const;
+	uint64_t DatagramsReceived()const;
+
+private:
+	void Receive(uint32_t nowMs);
+	void Append(const uint8_t* data, size_t length);
+	void Flush(const sockaddr_in& server, uint32_t nowMs);
+
+private:
+	uint16_t mPlayerId = 0;
+	std::string mName;
+	BotInput mInput;
+
+	SOCKET mSocket = INVALID_SOCKET;
+	ReliableChannel mChannel;
+	PredictionBuffer mPrediction;
+
+	DirectX::XMFLOAT3 mPosition = { 0.0f, 0.0f, 0.0f };
+	bool mWasMoving = false;
+	bool mLeaving = false;
+
+	// Newest snapshot seen and the one last acked.
+	uint32_t mSnapshotSeq = 0;
+	uint32_t mAckedSnapshotSeq = 0;
+
+	// Seconds since the last Subscribe.  Starts due.
+	float mSubscriptionAge = 1.0f;
+
+	// The datagram being built this tick; the channel header goes in front of it.
+	uint8_t mPending[1200];
+	size_t mPendingLength = 0;
+
+	uint64_t mDatagramsSent = 0;
+	uint64_t mDatagramsReceived = 0;
+};
+
+class BotHost
+{
+public:
+	BotHost() = default;
+	BotHost(const BotHost& rhs) = delete;
+	BotHost& operator=(const BotHost& rhs) = delete;
+	~BotHost();
+
+	// Resolves the relay, reads the -bot* options and -tickrate, and opens every bot.
+	bool Initialize(const std::string& host, int port);
+
+	// Ticks every bot until -botseconds have passed, or until Ctrl+C on the console if
+	// none were given, then sends each bot's Leave.  Returns the process exit code.
+	int Run();
+
+private:
+	void TickAll(float dt);
+	void ReportStats(double elapsedSeconds);
+
+private:
+	sockaddr_in mServerAddr = {};
+	float mTickRate = 60.0f; // D3DApp's default
+	double mDurationSeconds = 0.0;
+
+	std::unique_ptr<ThreadPool> mPool;
+	std::vector<std::unique_ptr<BotClient>> mBots;
+	bool mNetworkingStarted = false;
+};
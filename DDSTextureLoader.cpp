@@ -1302,14 +1302,21 @@ static HRESULT CreateD3DResources12(
 			}
 			else
 			{
-				cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(texture.Get(),
-					D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST));
+				// A copy list cannot transition to shader states.  There the texture is left
+				// in COMMON: it is promoted to COPY_DEST by the copy, decays back once the
+				// copy queue finishes, and is promoted again on first use as an SRV.
+				bool copyList = cmdList->GetType() == D3D12_COMMAND_LIST_TYPE_COPY;
+
+				if (!copyList)
+					cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(texture.Get(),
+						D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST));
 
 				// Use Heap-allocating UpdateSubresources implementation for variable number of subresources (which is the case for textures).
 				UpdateSubresources(cmdList, texture.Get(), textureUploadHeap.Get(), 0, 0, num2DSubresources, initData);
 
-				cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(texture.Get(),
-					D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE));
+				if (!copyList)
+					cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(texture.Get(),
+						D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE));
 			}
 		}
 	} break;
@@ -1669,29 +1676,29 @@ static HRESULT CreateTextureFromDDS( _In_ ID3D11Device* d3dDevice,
     return hr;
 }
 
-static HRESULT CreateTextureFromDDS12(
-	_In_ ID3D12Device* device,
-	_In_opt_ ID3D12GraphicsCommandList* cmdList,
+//--------------------------------------------------------------------------------------
+// Reads and bounds-checks the texture description in a DDS header.
+static HRESULT GetTextureDesc12(
 	_In_ const DDS_HEADER* header,
-	_In_reads_bytes_(bitSize) const uint8_t* bitData,
-	_In_ size_t bitSize,
-	_In_ size_t maxsize,
-	_In_ bool forceSRGB,
-	ComPtr<ID3D12Resource>& texture,
-	ComPtr<ID3D12Resource>& textureUploadHeap)
+	_Out_ uint32_t& resDim,
+	_Out_ UINT& width,
+	_Out_ UINT& height,
+	_Out_ UINT& depth,
+	_Out_ size_t& mipCount,
+	_Out_ UINT& arraySize,
+	_Out_ DXGI_FORMAT& format,
+	_Out_ bool& isCubeMap)
 {
-	HRESULT hr = S_OK;
-
-	UINT width = header->width;
-	UINT height = header->height;
-	UINT depth = header->depth;
+	width = header->width;
+	height = header->height;
+	depth = header->depth;
 
-	uint32_t resDim = D3D12_RESOURCE_DIMENSION_UNKNOWN;
-	UINT arraySize = 1;
-	DXGI_FORMAT format = DXGI_FORMAT_UNKNOWN;
-	bool isCubeMap = false;
+	resDim = D3D12_RESOURCE_DIMENSION_UNKNOWN;
+	arraySize = 1;
+	format = DXGI_FORMAT_UNKNOWN;
+	isCubeMap = false;
 
-	size_t mipCount = header->mipMapCount;
+	mipCount = header->mipMapCount;
 	if (0 == mipCount) mipCount = 1;
 
 	if ((header->ddspf.flags & DDS_FOURCC) && (MAKEFOURCC('D', 'X', '1', '0') == header->ddspf.fourCC))
@@ -1835,6 +1842,35 @@ static HRESULT CreateTextureFromDDS12(
 		return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
 	}
 
+	return S_OK;
+}
+
+static HRESULT CreateTextureFromDDS12(
+	_In_ ID3D12Device* device,
+	_In_opt_ ID3D12GraphicsCommandList* cmdList,
+	_In_ const DDS_HEADER* header,
+	_In_reads_bytes_(bitSize) const uint8_t* bitData,
+	_In_ size_t bitSize,
+	_In_ size_t maxsize,
+	_In_ bool forceSRGB,
+	ComPtr<ID3D12Resource>& texture,
+	ComPtr<ID3D12Resource>& textureUploadHeap)
+{
+	HRESULT hr = S_OK;
+
+	UINT width = 0;
+	UINT height = 0;
+	UINT depth = 0;
+	uint32_t resDim = D3D12_RESOURCE_DIMENSION_UNKNOWN;
+	UINT arraySize = 1;
+	DXGI_FORMAT format = DXGI_FORMAT_UNKNOWN;
+	bool isCubeMap = false;
+	size_t mipCount = 1;
+
+	hr = GetTextureDesc12(header, resDim, width, height, depth, mipCount, arraySize, format, isCubeMap);
+	if (FAILED(hr))
+		return hr;
+
 	// Create the texture
 	std::unique_ptr<D3D12_SUBRESOURCE_DATA[]> initData(
 		new (std::nothrow) D3D12_SUBRESOURCE_DATA[mipCount * arraySize]
@@ -1903,38 +1939,21 @@ static DDS_ALPHA_MODE GetAlphaMode( _In_ const DDS_HEADER* header )
 
 
 //--------------------------------------------------------------------------------------
-_Use_decl_annotations_
-HRESULT DirectX::CreateDDSTextureFromMemory( ID3D11Device* d3dDevice,
-                                             const uint8_t* ddsData,
-                                             size_t ddsDataSize,
-                                             ID3D11Resource** texture,
-                                             ID3D11ShaderResourceView** textureView,
-                                             size_t maxsize,
-                                             DDS_ALPHA_MODE* alphaMode )
-{
-    return CreateDDSTextureFromMemoryEx( d3dDevice, nullptr, ddsData, ddsDataSize, maxsize,
-                                         D3D11_USAGE_DEFAULT, D3D11_BIND_SHADER_RESOURCE, 0, 0, false,
-                                         texture, textureView, alphaMode );
-}
-
-_Use_decl_annotations_
-HRESULT DirectX::CreateDDSTextureFromMemory12(
-	ID3D12Device* device,
-	_In_ ID3D12GraphicsCommandList* cmdList,
+// Validates the magic value and headers of a DDS file in memory.  offset is where
+// the texture data starts.
+static HRESULT GetDDSHeader12(
 	_In_reads_bytes_(ddsDataSize) const uint8_t* ddsData,
 	_In_ size_t ddsDataSize,
-	ComPtr<ID3D12Resource>& texture,
-	ComPtr<ID3D12Resource>& textureUploadHeap,
-	_In_ size_t maxsize,
-	_Out_opt_ DDS_ALPHA_MODE* alphaMode
-	)
+	_Out_ const DDS_HEADER*& header,
+	_Out_ ptrdiff_t& offset)
 {
-	if (alphaMode)
-		(*alphaMode) = DDS_ALPHA_MODE_UNKNOWN;
+	header = nullptr;
+	offset = 0;
 
-	if (!device || !cmdList || !ddsData || !ddsDataSize)
+	// Must be long enough for the magic value and the basic header
+	if (ddsDataSize < (sizeof(uint32_t) + sizeof(DDS_HEADER)))
 	{
-		return E_INVALIDARG;
+		return E_FAIL;
 	}
 
 	uint32_t dwMagicNumber = *(const uint32_t*)(ddsData);
@@ -1943,7 +1962,7 @@ HRESULT DirectX::CreateDDSTextureFromMemory12(
 		return E_FAIL;
 	}
 
-	auto header = reinterpret_cast<const DDS_HEADER*>(ddsData + sizeof(uint32_t));
+	header = reinterpret_cast<const DDS_HEADER*>(ddsData + sizeof(uint32_t));
 
 	// Verify header to validate DDS file
 	if (header->size != sizeof(DDS_HEADER) ||
@@ -1966,11 +1985,57 @@ HRESULT DirectX::CreateDDSTextureFromMemory12(
 		bDXT10Header = true;
 	}
 
-	ptrdiff_t offset = sizeof(uint32_t)
+	offset = sizeof(uint32_t)
 		+ sizeof(DDS_HEADER)
 		+ (bDXT10Header ? sizeof(DDS_HEADER_DXT10) : 0);
 
-	HRESULT hr = CreateTextureFromDDS12(
+	return S_OK;
+}
+
+//--------------------------------------------------------------------------------------
+_Use_decl_annotations_
+HRESULT DirectX::CreateDDSTextureFromMemory( ID3D11Device* d3dDevice,
+                                             const uint8_t* ddsData,
+                                             size_t ddsDataSize,
+                                             ID3D11Resource** texture,
+                                             ID3D11ShaderResourceView** textureView,
+                                             size_t maxsize,
+                                             DDS_ALPHA_MODE* alphaMode )
+{
+    return CreateDDSTextureFromMemoryEx( d3dDevice, nullptr, ddsData, ddsDataSize, maxsize,
+                                         D3D11_USAGE_DEFAULT, D3D11_BIND_SHADER_RESOURCE, 0, 0, false,
+                                         texture, textureView, alphaMode );
+}
+
+_Use_decl_annotations_
+HRESULT DirectX::CreateDDSTextureFromMemory12(
+	ID3D12Device* device,
+	_In_ ID3D12GraphicsCommandList* cmdList,
+	_In_reads_bytes_(ddsDataSize) const uint8_t* ddsData,
+	_In_ size_t ddsDataSize,
+	ComPtr<ID3D12Resource>& texture,
+	ComPtr<ID3D12Resource>& textureUploadHeap,
+	_In_ size_t maxsize,
+	_Out_opt_ DDS_ALPHA_MODE* alphaMode
+	)
+{
+	if (alphaMode)
+		(*alphaMode) = DDS_ALPHA_MODE_UNKNOWN;
+
+	if (!device || !cmdList || !ddsData || !ddsDataSize)
+	{
+		return E_INVALIDARG;
+	}
+
+	const DDS_HEADER* header = nullptr;
+	ptrdiff_t offset = 0;
+	HRESULT hr = GetDDSHeader12(ddsData, ddsDataSize, header, offset);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	hr = CreateTextureFromDDS12(
 		device,
 		cmdList,
 		header,
@@ -1991,6 +2056,96 @@ HRESULT DirectX::CreateDDSTextureFromMemory12(
 	return hr;
 }
 
+_Use_decl_annotations_
+HRESULT DirectX::GetDDSTextureInfo12(
+	const uint8_t* ddsData,
+	size_t ddsDataSize,
+	DDS_TEXTURE_INFO12& info)
+{
+	info = DDS_TEXTURE_INFO12();
+
+	if (!ddsData || !ddsDataSize)
+	{
+		return E_INVALIDARG;
+	}
+
+	const DDS_HEADER* header = nullptr;
+	ptrdiff_t offset = 0;
+	HRESULT hr = GetDDSHeader12(ddsData, ddsDataSize, header, offset);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	UINT width = 0;
+	UINT height = 0;
+	UINT depth = 0;
+	uint32_t resDim = D3D12_RESOURCE_DIMENSION_UNKNOWN;
+	UINT arraySize = 1;
+	DXGI_FORMAT format = DXGI_FORMAT_UNKNOWN;
+	bool isCubeMap = false;
+	size_t mipCount = 1;
+
+	hr = GetTextureDesc12(header, resDim, width, height, depth, mipCount, arraySize, format, isCubeMap);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	// Same restriction as CreateD3DResources12.
+	if (resDim != D3D12_RESOURCE_DIMENSION_TEXTURE2D)
+	{
+		return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+	}
+
+	std::unique_ptr<D3D12_SUBRESOURCE_DATA[]> initData(
+		new (std::nothrow) D3D12_SUBRESOURCE_DATA[mipCount * arraySize]
+		);
+
+	if (!initData)
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	size_t skipMip = 0;
+	size_t twidth = 0;
+	size_t theight = 0;
+	size_t tdepth = 0;
+
+	hr = FillInitData12(
+		width, height, depth, mipCount, arraySize, format, 0, ddsDataSize - offset, ddsData + offset,
+		twidth, theight, tdepth, skipMip, initData.get()
+		);
+
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	ZeroMemory(&info.Desc, sizeof(D3D12_RESOURCE_DESC));
+	info.Desc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+	info.Desc.Width = twidth;
+	info.Desc.Height = (uint32_t)theight;
+	info.Desc.DepthOrArraySize = (uint16_t)arraySize;
+	info.Desc.MipLevels = (uint16_t)mipCount;
+	info.Desc.Format = format;
+	info.Desc.SampleDesc.Count = 1;
+	info.Desc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
+	info.Desc.Flags = D3D12_RESOURCE_FLAG_NONE;
+	info.IsCubeMap = isCubeMap;
+	info.AlphaMode = GetAlphaMode(header);
+
+	info.Subresources.resize(mipCount * arraySize);
+	for (size_t i = 0; i < info.Subresources.size(); ++i)
+	{
+		info.Subresources[i].Offset = (const uint8_t*)initData[i].pData - ddsData;
+		info.Subresources[i].RowPitch = (UINT)initData[i].RowPitch;
+		info.Subresources[i].SlicePitch = (UINT)initData[i].SlicePitch;
+	}
+
+	return S_OK;
+}
+
 _Use_decl_annotations_
 HRESULT DirectX::CreateDDSTextureFromMemory( ID3D11Device* d3dDevice,
                                              ID3D11DeviceContext* d3dContext,
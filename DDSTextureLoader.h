@@ -32,6 +32,8 @@
 
 #pragma warning(pop)
 
+#include <vector>
+
 #if defined(_MSC_VER) && (_MSC_VER<1610) && !defined(_In_reads_)
 #define _In_reads_(exp)
 #define _Out_writes_(exp)
@@ -92,6 +94,31 @@ namespace DirectX
 		                               _Out_opt_ DDS_ALPHA_MODE* alphaMode = nullptr
 		                               );
 
+	// Where each subresource of a DDS file lives, for callers that upload it
+	// themselves.  Subresources are in D3D12 order (mips of slice 0, then slice 1...)
+	// and offsets are from the start of ddsData.  Desc describes a 2D texture, array
+	// or cube (6 slices per cube) with the layout left UNKNOWN.
+	struct DDS_SUBRESOURCE_INFO12
+	{
+		size_t Offset;
+		UINT RowPitch;
+		UINT SlicePitch;
+	};
+
+	struct DDS_TEXTURE_INFO12
+	{
+		D3D12_RESOURCE_DESC Desc;
+		bool IsCubeMap;
+		DDS_ALPHA_MODE AlphaMode;
+		std::vector<DDS_SUBRESOURCE_INFO12> Subresources;
+	};
+
+	// Validates the file and fills in info without creating anything.
+	HRESULT GetDDSTextureInfo12(_In_reads_bytes_(ddsDataSize) const uint8_t* ddsData,
+		                        _In_ size_t ddsDataSize,
+		                        _Out_ DDS_TEXTURE_INFO12& info
+		                        );
+
     // Standard version with optional auto-gen mipmap support
     HRESULT CreateDDSTextureFromMemory( _In_ ID3D11Device* d3dDevice,
                                         _In_opt_ ID3D11DeviceContext* d3dContext,
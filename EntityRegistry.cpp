@@ -0,0 +1,109 @@
+//***************************************************************************************
+// EntityRegistry.cpp
+//***************************************************************************************
+
+#include "EntityRegistry.h"
+
+using namespace DirectX;
+
+EntityRegistry::EntityRegistry(uint32_t capacity, uint32_t maxPlayerId)
+	: Active(capacity, 0),
+	PlayerId(capacity, 0),
+	Position(capacity, XMFLOAT3(0.0f, 0.0f, 0.0f)),
+	Velocity(capacity, XMFLOAT3(0.0f, 0.0f, 0.0f)),
+	Health(capacity, 0),
+	NameId(capacity, 0),
+	Ritem(capacity, 0),
+	ReflectedRitem(capacity, 0),
+	ShadowRitem(capacity, 0),
+	mSlotOfPlayer(maxPlayerId, InvalidSlot)
+{
+	// Popped from the back, so the lowest slots are handed out first.
+	mFreeSlots.reserve(capacity);
+	for (uint32_t slot = capacity; slot > 0; --slot)
+		mFreeSlots.push_back(slot - 1);
+
+	mNames.push_back(std::string());
+	mNameIds[std::string()] = 0;
+}
+
+uint32_t EntityRegistry::Join(uint16_t playerId)
+{
+	if (playerId >= mSlotOfPlayer.size())
+		return InvalidSlot;
+
+	uint32_t slot = mSlotOfPlayer[playerId];
+	if (slot != InvalidSlot)
+		return slot;
+
+	if (mFreeSlots.empty())
+		return InvalidSlot;
+
+	slot = mFreeSlots.back();
+	mFreeSlots.pop_back();
+	mSlotOfPlayer[playerId] = slot;
+
+	Active[slot] = 1;
+	PlayerId[slot] = playerId;
+	Position[slot] = XMFLOAT3(0.0f, 0.0f, 0.0f);
+	Velocity[slot] = XMFLOAT3(0.0f, 0.0f, 0.0f);
+	Health[slot] = 0;
+	NameId[slot] = 0;
+	return slot;
+}
+
+uint32_t EntityRegistry::Leave(uint16_t playerId)
+{
+	uint32_t slot = Find(playerId);
+	if (slot == InvalidSlot)
+		return InvalidSlot;
+
+	mSlotOfPlayer[playerId] = InvalidSlot;
+	Active[slot] = 0;
+	mFreeSlots.push_back(slot);
+	return slot;
+}
+
+uint32_t EntityRegistry::Find(uint16_t playerId)const
+{
+	return playerId < mSlotOfPlayer.size() ? mSlotOfPlayer[playerId] : InvalidSlot;
+}
+
+uint32_t EntityRegistry::Capacity()const
+{
+	return (uint32_t)Active.size();
+}
+
+uint32_t EntityRegistry::ActiveCount()const
+{
+	return (uint32_t)(Active.size() - mFreeSlots.size());
+}
+
+void EntityRegistry::Move(uint32_t slot, const XMFLOAT3& position, float dt)
+{
+	if (dt > 0.0f)
+	{
+		XMVECTOR delta = XMLoadFloat3(&position) - XMLoadFloat3(&Position[slot]);
+		XMStoreFloat3(&Velocity[slot], delta / dt);
+	}
+
+	Position[slot] = position;
+}
+
+uint32_t EntityRegistry::InternName(std::string_view name)
+{
+	std::string key(name);
+	auto it = mNameIds.find(key);
+	if (it != mNameIds.end())
+		return it->second;
+
+	uint32_t nameId = (uint32_t)mNames.size();
+	mNames.push_back(key);
+	mNameIds[key] = nameId;
+	return nameId;
+}
+
+const std::string& EntityRegistry::Name(uint32_t nameId)const
+{
+	return mNames[nameId < mNames.size() ? nameId : 0];
+}
@@ -0,0 +1,73 @@
+//***************************************************************************************
+// EntityRegistry.h
+//
+// Player state stored as parallel arrays, one element per slot.  A player id from the
+// wire maps to a slot through a flat table.  Join takes a slot from a free list and
+// Leave puts it back, both in constant time, and a player keeps its slot for as long
+// as it is connected so anything else indexed by slot stays valid.  Every column is
+// sized for the full capacity up front; loops run over [0, Capacity()) and skip
+// slots that are not Active.
+//***************************************************************************************
+
+#pragma once
+
+#include <DirectXMath.h>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class EntityRegistry
+{
+public:
+	static constexpr uint32_t InvalidSlot = 0xffffffff;
+
+	// Player ids must stay below maxPlayerId.
+	EntityRegistry(uint32_t capacity, uint32_t maxPlayerId);
+	EntityRegistry(const EntityRegistry& rhs) = delete;
+	EntityRegistry& operator=(const EntityRegistry& rhs) = delete;
+
+	// Returns the player's slot, giving it a fresh one first if it has none.  A fresh
+	// slot has every column reset.  InvalidSlot if the id is out of range or every
+	// slot is taken.
+	uint32_t Join(uint16_t playerId);
+
+	// Returns the slot the player held, or InvalidSlot if it held none.
+	uint32_t Leave(uint16_t playerId);
+
+	uint32_t Find(uint16_t playerId)const;
+
+	uint32_t Capacity()const;
+	uint32_t ActiveCount()const;
+
+	// Sets a slot's position, and its velocity from how far it moved over dt.  With
+	// dt = 0 the velocity is left alone.
+	void Move(uint32_t slot, const DirectX::XMFLOAT3& position, float dt);
+
+	// Names are stored once and referred to by id; id 0 is the empty name.
+	uint32_t InternName(std::string_view name);
+	const std::string& Name(uint32_t nameId)const;
+
+public:
+	// Columns, indexed by slot.
+	std::vector<uint8_t> Active;
+	std::vector<uint16_t> PlayerId;
+	std::vector<DirectX::XMFLOAT3> Position;
+	std::vector<DirectX::XMFLOAT3> Velocity;
+	std::vector<int> Health;
+	std::vector<uint32_t> NameId;
+
+	// Indices into the application's render items: the player's skull, its
+	// reflection and its shadow.
+	std::vector<uint32_t> Ritem;
+	std::vector<uint32_t> ReflectedRitem;
+	std::vector<uint32_t> ShadowRitem;
+
+private:
+	std::vector<uint32_t> mSlotOfPlayer;
+	std::vector<uint32_t> mFreeSlots;
+
+	std::vector<std::string> mNames;
+	std::unordered_map<std::string, uint32_t> mNameIds;
+};
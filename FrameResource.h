@@ -4,12 +4,30 @@
 #include "MathHelper.h"
 #include "UploadBuffer.h"
 
-struct ObjectConstants
+// Per-instance data read by the vertex shader through SV_InstanceID.
+struct InstanceData
 {
     DirectX::XMFLOAT4X4 World = MathHelper::Identity4x4();
 	DirectX::XMFLOAT4X4 TexTransform = MathHelper::Identity4x4();
 };
 
+// One element per material, indexed by Material::MatCBIndex.
+struct MaterialData
+{
+	DirectX::XMFLOAT4 DiffuseAlbedo = { 1.0f, 1.0f, 1.0f, 1.0f };
+	DirectX::XMFLOAT3 FresnelR0 = { 0.01f, 0.01f, 0.01f };
+	float Roughness = 0.25f;
+
+	// Used in texture mapping.
+	DirectX::XMFLOAT4X4 MatTransform = MathHelper::Identity4x4();
+
+	// SRV heap index of the diffuse map, and its most detailed resident mip.
+	UINT DiffuseMapIndex = 0;
+	float MinLod = 0.0f;
+	UINT MaterialPad0 = 0;
+	UINT MaterialPad1 = 0;
+};
+
 struct PassConstants
 {
     DirectX::XMFLOAT4X4 View = MathHelper::Identity4x4();
@@ -47,12 +65,10 @@ struct Vertex
     Vertex(float x, float y, float z, float nx, float ny, float nz, float u, float v) :
         Pos(x, y, z),
         Normal(nx, ny, nz),
-        Color(0, 0, 0),
 		TexC(u, v) {}
 
     DirectX::XMFLOAT3 Pos;
     DirectX::XMFLOAT3 Normal;
-    DirectX::XMFLOAT3 Color;
 	DirectX::XMFLOAT2 TexC;
 };
 
@@ -62,7 +78,7 @@ struct FrameResource
 {
 public:
     
-    FrameResource(ID3D12Device* device, UINT passCount, UINT objectCount, UINT materialCount);
+    FrameResource(ID3D12Device* device, UINT passCount, UINT maxInstanceCount, UINT materialCount, UINT layerCount);
     FrameResource(const FrameResource& rhs) = delete;
     FrameResource& operator=(const FrameResource& rhs) = delete;
     ~FrameResource();
@@ -71,12 +87,20 @@ public:
     // So each frame needs their own allocator.
     Microsoft::WRL::ComPtr<ID3D12CommandAllocator> CmdListAlloc;
 
+    // One allocator per render layer, so each layer's command list can be recorded
+    // on its own thread.
+    std::vector<Microsoft::WRL::ComPtr<ID3D12CommandAllocator>> LayerCmdListAllocs;
+
     // We cannot update a cbuffer until the GPU is done processing the commands
     // that reference it.  So each frame needs their own cbuffers.
    // std::unique_ptr<UploadBuffer<FrameConstants>> FrameCB = nullptr;
     std::unique_ptr<UploadBuffer<PassConstants>> PassCB = nullptr;
-    std::unique_ptr<UploadBuffer<MaterialConstants>> MaterialCB = nullptr;
-    std::unique_ptr<UploadBuffer<ObjectConstants>> ObjectCB = nullptr;
+    // Also a structured buffer: draws pick their material with a root constant.
+    std::unique_ptr<UploadBuffer<MaterialData>> MaterialBuffer = nullptr;
+
+    // NOTE: Not a constant buffer; it is bound as a structured buffer so a single
+    // instanced draw can index every instance's data.
+    std::unique_ptr<UploadBuffer<InstanceData>> InstanceBuffer = nullptr;
 
     // Fence value to mark commands up to this fence point.  This lets us
     // check if these frame resources are still in use by the GPU.
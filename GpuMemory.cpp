@@ -0,0 +1,228 @@
+//***************************************************************************************
+// GpuMemory.cpp
+//***************************************************************************************
+
+#include "GpuMemory.h"
+
+using Microsoft::WRL::ComPtr;
+
+static UINT64 AlignUp(UINT64 value, UINT64 alignment)
+{
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+UploadArena::UploadArena(ID3D12Device* device, UINT64 pageSize)
+	: mDevice(device), mPageSize(pageSize)
+{
+}
+
+std::unique_ptr<UploadArena::Page> UploadArena::CreatePage(UINT64 size)
+{
+	auto page = std::make_unique<Page>();
+	page->Size = size;
+
+	ThrowIfFailed(mDevice->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+		D3D12_HEAP_FLAG_NONE,
+		&CD3DX12_RESOURCE_DESC::Buffer(size),
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		nullptr,
+		IID_PPV_ARGS(page->Resource.GetAddressOf())));
+
+	// The CPU only writes, so an empty read range.
+	CD3DX12_RANGE readRange(0, 0);
+	ThrowIfFailed(page->Resource->Map(0, &readRange, reinterpret_cast<void**>(&page->CPU)));
+
+	return page;
+}
+
+UploadArena::Allocation UploadArena::Allocate(UINT64 byteSize, UINT64 alignment)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	Allocation alloc;
+
+	if (byteSize > mPageSize)
+	{
+		// Oversized requests get a page of their own; the current page keeps filling.
+		mActivePages.push_back(CreatePage(byteSize));
+		Page* page = mActivePages.back().get();
+		page->Offset = byteSize;
+
+		alloc.Resource = page->Resource.Get();
+		alloc.CPU = page->CPU;
+		return alloc;
+	}
+
+	UINT64 offset = mCurrentPage != nullptr ? AlignUp(mCurrentPage->Offset, alignment) : 0;
+	if (mCurrentPage == nullptr || offset + byteSize > mCurrentPage->Size)
+	{
+		std::unique_ptr<Page> page;
+		if (!mFreePages.empty())
+		{
+			page = std::move(mFreePages.back());
+			mFreePages.pop_back();
+		}
+		else
+		{
+			page = CreatePage(mPageSize);
+		}
+
+		page->Offset = 0;
+		mCurrentPage = page.get();
+		mActivePages.push_back(std::move(page));
+		offset = 0;
+	}
+
+	mCurrentPage->Offset = offset + byteSize;
+
+	alloc.Resource = mCurrentPage->Resource.Get();
+	alloc.Offset = offset;
+	alloc.CPU = mCurrentPage->CPU + offset;
+	return alloc;
+}
+
+void UploadArena::Retire(UINT64 fenceValue)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	for (auto& page : mActivePages)
+	{
+		page->FenceValue = fenceValue;
+		mRetiredPages.push_back(std::move(page));
+	}
+	mActivePages.clear();
+	mCurrentPage = nullptr;
+}
+
+void UploadArena::Recycle(UINT64 completedFenceValue)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	for (size_t i = 0; i < mRetiredPages.size();)
+	{
+		if (mRetiredPages[i]->FenceValue <= completedFenceValue)
+		{
+			// Only standard pages are worth keeping around.
+			if (mRetiredPages[i]->Size == mPageSize)
+				mFreePages.push_back(std::move(mRetiredPages[i]));
+
+			mRetiredPages[i] = std::move(mRetiredPages.back());
+			mRetiredPages.pop_back();
+		}
+		else
+		{
+			++i;
+		}
+	}
+}
+
+void UploadArena::Trim()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	mFreePages.clear();
+}
+
+UINT UploadArena::PageCount()const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return (UINT)(mActivePages.size() + mRetiredPages.size() + mFreePages.size());
+}
+
+StaticBufferHeap::StaticBufferHeap(ID3D12Device* device, UINT64 heapSize)
+	: mDevice(device), mHeapSize(heapSize)
+{
+}
+
+ComPtr<ID3D12Heap> StaticBufferHeap::CreateHeap(UINT64 size)
+{
+	D3D12_HEAP_DESC heapDesc = {};
+	heapDesc.SizeInBytes = AlignUp(size, D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT);
+	heapDesc.Properties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+	heapDesc.Alignment = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+	heapDesc.Flags = D3D12_HEAP_FLAG_ALLOW_ONLY_BUFFERS;
+
+	ComPtr<ID3D12Heap> heap;
+	ThrowIfFailed(mDevice->CreateHeap(&heapDesc, IID_PPV_ARGS(heap.GetAddressOf())));
+	return heap;
+}
+
+ComPtr<ID3D12Resource> StaticBufferHeap::CreatePlacedBuffer(UINT64 byteSize)
+{
+	CD3DX12_RESOURCE_DESC desc = CD3DX12_RESOURCE_DESC::Buffer(byteSize);
+	D3D12_RESOURCE_ALLOCATION_INFO info = mDevice->GetResourceAllocationInfo(0, 1, &desc);
+
+	ID3D12Heap* heap = nullptr;
+	UINT64 offset = 0;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		if (info.SizeInBytes > mHeapSize)
+		{
+			mDedicatedHeaps.push_back(CreateHeap(info.SizeInBytes));
+			heap = mDedicatedHeaps.back().Get();
+		}
+		else
+		{
+			offset = AlignUp(mHeapOffset, info.Alignment);
+			if (mHeaps.empty() || offset + info.SizeInBytes > mHeapSize)
+			{
+				mHeaps.push_back(CreateHeap(mHeapSize));
+				offset = 0;
+			}
+
+			heap = mHeaps.back().Get();
+			mHeapOffset = offset + info.SizeInBytes;
+		}
+
+		mBytesPlaced += info.SizeInBytes;
+	}
+
+	ComPtr<ID3D12Resource> buffer;
+	ThrowIfFailed(mDevice->CreatePlacedResource(
+		heap,
+		offset,
+		&desc,
+		D3D12_RESOURCE_STATE_COMMON,
+		nullptr,
+		IID_PPV_ARGS(buffer.GetAddressOf())));
+
+	return buffer;
+}
+
+ComPtr<ID3D12Resource> StaticBufferHeap::CreateBuffer(
+	ID3D12GraphicsCommandList* cmdList,
+	const void* initData,
+	UINT64 byteSize,
+	UploadArena& arena)
+{
+	ComPtr<ID3D12Resource> buffer = CreatePlacedBuffer(byteSize);
+
+	UploadArena::Allocation staging = arena.Allocate(byteSize);
+	memcpy(staging.CPU, initData, (size_t)byteSize);
+
+	bool copyList = cmdList->GetType() == D3D12_COMMAND_LIST_TYPE_COPY;
+	if (!copyList)
+		cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(buffer.Get(),
+			D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST));
+
+	cmdList->CopyBufferRegion(buffer.Get(), 0, staging.Resource, staging.Offset, byteSize);
+
+	if (!copyList)
+		cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(buffer.Get(),
+			D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_GENERIC_READ));
+
+	return buffer;
+}
+
+UINT StaticBufferHeap::HeapCount()const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return (UINT)(mHeaps.size() + mDedicatedHeaps.size());
+}
+
+UINT64 StaticBufferHeap::BytesPlaced()const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mBytesPlaced;
+}
@@ -0,0 +1,109 @@
+//***************************************************************************************
+// GpuMemory.h
+//
+// Allocators that replace a pair of committed resources per static buffer.
+//
+// StaticBufferHeap places default-heap buffers in a few large ID3D12Heaps, bumping
+// an offset through each.  Nothing is freed individually; the heaps live as long as
+// the allocator, which suits geometry loaded once at startup.
+//
+// UploadArena hands out ranges of large, persistently mapped upload pages.  Pages
+// written since the last Retire are tagged with that fence value, and Recycle makes
+// them reusable once the GPU has passed it, so staging memory costs nothing after
+// the copies finish.  Trim releases the idle pages outright.
+//
+// Both are safe to call from several loader threads at once.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+#include <mutex>
+
+class UploadArena
+{
+public:
+	struct Allocation
+	{
+		ID3D12Resource* Resource = nullptr;
+		UINT64 Offset = 0;
+		void* CPU = nullptr;
+	};
+
+	explicit UploadArena(ID3D12Device* device, UINT64 pageSize = 4 * 1024 * 1024);
+	UploadArena(const UploadArena& rhs) = delete;
+	UploadArena& operator=(const UploadArena& rhs) = delete;
+
+	// Allocations larger than a page get a page of their own.  The default alignment
+	// is enough for texture data as well as buffers.
+	Allocation Allocate(UINT64 byteSize, UINT64 alignment = D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT);
+
+	// Everything allocated so far is read by GPU work that signals fenceValue.
+	void Retire(UINT64 fenceValue);
+
+	// Returns pages whose fence value has completed to the free list.
+	void Recycle(UINT64 completedFenceValue);
+
+	// Releases every free page.
+	void Trim();
+
+	UINT PageCount()const;
+
+private:
+	struct Page
+	{
+		Microsoft::WRL::ComPtr<ID3D12Resource> Resource;
+		uint8_t* CPU = nullptr;
+		UINT64 Size = 0;
+		UINT64 Offset = 0;
+		UINT64 FenceValue = 0;
+	};
+
+	std::unique_ptr<Page> CreatePage(UINT64 size);
+
+private:
+	ID3D12Device* mDevice = nullptr;
+	UINT64 mPageSize = 0;
+
+	mutable std::mutex mMutex;
+	std::vector<std::unique_ptr<Page>> mActivePages; // written since the last Retire
+	Page* mCurrentPage = nullptr;                    // standard page being filled, in mActivePages
+	std::vector<std::unique_ptr<Page>> mRetiredPages;
+	std::vector<std::unique_ptr<Page>> mFreePages;
+};
+
+class StaticBufferHeap
+{
+public:
+	explicit StaticBufferHeap(ID3D12Device* device, UINT64 heapSize = 16 * 1024 * 1024);
+	StaticBufferHeap(const StaticBufferHeap& rhs) = delete;
+	StaticBufferHeap& operator=(const StaticBufferHeap& rhs) = delete;
+
+	// A placed default-heap buffer in the COMMON state.
+	Microsoft::WRL::ComPtr<ID3D12Resource> CreatePlacedBuffer(UINT64 byteSize);
+
+	// Same job as d3dUtil::CreateDefaultBuffer: records a copy of initData into a new
+	// placed buffer, staged through arena.  Works on copy and direct lists; on a copy
+	// list the buffer is left in COMMON and promoted implicitly.
+	Microsoft::WRL::ComPtr<ID3D12Resource> CreateBuffer(
+		ID3D12GraphicsCommandList* cmdList,
+		const void* initData,
+		UINT64 byteSize,
+		UploadArena& arena);
+
+	UINT HeapCount()const;
+	UINT64 BytesPlaced()const;
+
+private:
+	Microsoft::WRL::ComPtr<ID3D12Heap> CreateHeap(UINT64 size);
+
+private:
+	ID3D12Device* mDevice = nullptr;
+	UINT64 mHeapSize = 0;
+
+	mutable std::mutex mMutex;
+	std::vector<Microsoft::WRL::ComPtr<ID3D12Heap>> mHeaps;
+	std::vector<Microsoft::WRL::ComPtr<ID3D12Heap>> mDedicatedHeaps; // one per buffer larger than mHeapSize
+	UINT64 mHeapOffset = 0;                                          // into mHeaps.back()
+	UINT64 mBytesPlaced = 0;
+};
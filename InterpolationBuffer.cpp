@@ -0,0 +1,120 @@
+//***************************************************************************************
+// InterpolationBuffer.cpp
+//***************************************************************************************
+
+#include "InterpolationBuffer.h"
+
+using namespace DirectX;
+
+static_assert((InterpolationBuffer::Capacity & (InterpolationBuffer::Capacity - 1)) == 0, "Capacity must be a power of two.");
+
+void InterpolationBuffer::Push(uint32_t timestamp, const XMFLOAT3& position, uint32_t arrivalMs)
+{
+	if (mCount > 0 && static_cast<int32_t>(timestamp - Back(0).Time) <= 0)
+	{
+		++mStats.Late;
+		return;
+	}
+
+	Entry& entry = mEntries[mNext];
+	entry.Time = timestamp;
+	entry.Position = position;
+	mNext = (mNext + 1) & (Capacity - 1);
+	mCount = mCount < Capacity ? mCount + 1 : Capacity;
+	mStats.Buffered = mCount;
+
+	float transitMs = static_cast<float>(static_cast<int32_t>(arrivalMs - timestamp));
+	if (!mHasTransit)
+	{
+		mHasTransit = true;
+		mMinTransitMs = transitMs;
+		mLastTransitMs = transitMs;
+		return;
+	}
+
+	// Follow a faster path immediately but forget it slowly, so one lucky packet or
+	// a drifting clock cannot pin the estimate forever.
+	if (transitMs < mMinTransitMs)
+		mMinTransitMs = transitMs;
+	else
+		mMinTransitMs += (transitMs - mMinTransitMs) * 0.001f;
+
+	float d = transitMs - mLastTransitMs;
+	mStats.JitterMs += ((d < 0.0f ? -d : d) - mStats.JitterMs) / 16.0f;
+	mLastTransitMs = transitMs;
+}
+
+bool InterpolationBuffer::Sample(uint32_t nowMs, float delayMs, float maxExtrapolationMs, XMFLOAT3& position)
+{
+	if (mCount == 0)
+		return false;
+
+	// Render time on the sender's clock, relative to the newest sample.  Negative
+	// values lie inside the buffer.
+	const Entry& newest = Back(0);
+	float t = static_cast<float>(static_cast<int32_t>(nowMs - newest.Time)) - mMinTransitMs - delayMs;
+
+	if (t >= 0.0f)
+	{
+		if (mCount < 2)
+		{
+			position = newest.Position;
+			return true;
+		}
+
+		// Past the newest sample: keep going at the last known velocity, up to the limit.
+		const Entry& previous = Back(1);
+		float spanMs = static_cast<float>(static_cast<int32_t>(newest.Time - previous.Time));
+
+		float ahead = t;
+		if (ahead > maxExtrapolationMs)
+		{
+			ahead = maxExtrapolationMs;
+			++mStats.Starved;
+		}
+		else
+		{
+			++mStats.Extrapolated;
+		}
+
+		XMVECTOR p0 = XMLoadFloat3(&previous.Position);
+		XMVECTOR p1 = XMLoadFloat3(&newest.Position);
+		XMVECTOR velocity = XMVectorScale(XMVectorSubtract(p1, p0), 1.0f / spanMs);
+		XMStoreFloat3(&position, XMVectorMultiplyAdd(velocity, XMVectorReplicate(ahead), p1));
+		return true;
+	}
+
+	// Walk back to the pair of samples that brackets the render time.
+	for (uint32_t i = 0; i + 1 < mCount; ++i)
+	{
+		const Entry& b = Back(i);
+		const Entry& a = Back(i + 1);
+		float ta = static_cast<float>(static_cast<int32_t>(a.Time - newest.Time));
+		if (t < ta)
+			continue;
+
+		float tb = static_cast<float>(static_cast<int32_t>(b.Time - newest.Time));
+		float alpha = (t - ta) / (tb - ta);
+		XMStoreFloat3(&position, XMVectorLerp(XMLoadFloat3(&a.Position), XMLoadFloat3(&b.Position), alpha));
+		return true;
+	}
+
+	// Older than anything buffered; the delay is longer than the history we keep.
+	position = Back(mCount - 1).Position;
+	return true;
+}
+
+bool InterpolationBuffer::Empty()const
+{
+	return mCount == 0;
+}
+
+const InterpolationBuffer::Stats& InterpolationBuffer::GetStats()const
+{
+	return mStats;
+}
+
+const InterpolationBuffer::Entry& InterpolationBuffer::Back(uint32_t i)const
+{
+	return mEntries[(mNext - 1 - i) & (Capacity - 1)];
+}
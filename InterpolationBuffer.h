@@ -0,0 +1,75 @@
+//***************************************************************************************
+// InterpolationBuffer.h
+//
+// Jitter buffer for one remote entity.  Position samples are stored with the sender's
+// timestamp, and the entity is drawn a fixed delay behind the newest data, so there
+// is almost always a sample on either side of the render time to interpolate between.
+// When samples stop arriving the last velocity is extrapolated for a bounded time and
+// the entity then holds still.
+//
+// The sender's clock is never compared with ours directly.  Each arrival measures
+// transit = arrival - timestamp; the smallest transit seen is the best estimate of
+// the clock offset plus the one-way latency, and the spread around it is the jitter.
+//***************************************************************************************
+
+#pragma once
+
+#include <DirectXMath.h>
+#include <array>
+#include <cstdint>
+
+class InterpolationBuffer
+{
+public:
+	// Samples kept per entity.  At one sample per sender frame this covers well over
+	// the longest interpolation delay we would configure.
+	static const uint32_t Capacity = 64;
+
+	struct Stats
+	{
+		// RFC 3550 style smoothed variation in transit time, in milliseconds.
+		float JitterMs = 0.0f;
+
+		// Samples currently buffered.
+		uint32_t Buffered = 0;
+
+		// Samples dropped because they were not newer than the latest one.
+		uint64_t Late = 0;
+
+		// Frames drawn past the newest sample, and frames held because even the
+		// extrapolation limit was exceeded.
+		uint64_t Extrapolated = 0;
+		uint64_t Starved = 0;
+	};
+
+	// Adds a sample stamped with the sender's clock; arrivalMs is the local clock.
+	void Push(uint32_t timestamp, const DirectX::XMFLOAT3& position, uint32_t arrivalMs);
+
+	// Writes the position at nowMs - delayMs into position.  Returns false if no
+	// sample has been received yet.
+	bool Sample(uint32_t nowMs, float delayMs, float maxExtrapolationMs, DirectX::XMFLOAT3& position);
+
+	bool Empty()const;
+	const Stats& GetStats()const;
+
+private:
+	struct Entry
+	{
+		uint32_t Time = 0;
+		DirectX::XMFLOAT3 Position = { 0.0f, 0.0f, 0.0f };
+	};
+
+	// Entry i samples ago, 0 being the newest.
+	const Entry& Back(uint32_t i)const;
+
+private:
+	std::array<Entry, Capacity> mEntries;
+	uint32_t mNext = 0;
+	uint32_t mCount = 0;
+
+	bool mHasTransit = false;
+	float mMinTransitMs = 0.0f;
+	float mLastTransitMs = 0.0f;
+
+	Stats mStats;
+};
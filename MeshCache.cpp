@@ -0,0 +1,349 @@
+//***************************************************************************************
+// MeshCache.cpp
+//***************************************************************************************
+
+#include "MeshCache.h"
+#include "MeshOptimizer.h"
+
+using namespace DirectX;
+
+// Reads the next number after p, skipping anything that cannot start one (labels,
+// braces, punctuation).  Returns false at the end of the text.
+template<typename T>
+static bool NextNumber(const char*& p, const char* end, T& value)
+{
+	while (p < end && !(*p == '-' || *p == '+' || *p == '.' || (*p >= '0' && *p <= '9')))
+		++p;
+	if (p >= end)
+		return false;
+
+	char* next = nullptr;
+	if (std::is_floating_point<T>::value)
+		value = (T)strtof(p, &next);
+	else
+		value = (T)strtol(p, &next, 10);
+
+	if (next == p)
+		return false;
+	p = next;
+	return true;
+}
+
+// Parses the Luna text model format:
+//   VertexCount: n  TriangleCount: m  VertexList (pos, normal) { px py pz nx ny nz ... }
+//   TriangleList { i0 i1 i2 ... }
+static bool ParseTextModel(const std::wstring& sourcePath, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+{
+	std::ifstream fin(sourcePath, std::ios::binary);
+	if (!fin)
+		return false;
+
+	// One read and an in-place scan, rather than a formatted extraction per token.
+	std::string text((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+	const char* p = text.c_str();
+	const char* end = p + text.size();
+
+	UINT vcount = 0;
+	UINT tcount = 0;
+	if (!NextNumber(p, end, vcount) || !NextNumber(p, end, tcount))
+		return false;
+
+	// Skip to the vertex list; "(pos, normal)" holds no digits.
+	p = (const char*)memchr(p, '{', end - p);
+	if (p == nullptr)
+		return false;
+
+	vertices.resize(vcount);
+	for (UINT i = 0; i < vcount; ++i)
+	{
+		Vertex& v = vertices[i];
+		if (!NextNumber(p, end, v.Pos.x) || !NextNumber(p, end, v.Pos.y) || !NextNumber(p, end, v.Pos.z) ||
+			!NextNumber(p, end, v.Normal.x) || !NextNumber(p, end, v.Normal.y) || !NextNumber(p, end, v.Normal.z))
+			return false;
+
+		// Model does not have texture coordinates, so just zero them out.
+		v.TexC = { 0.0f, 0.0f };
+	}
+
+	p = (const char*)memchr(p, '{', end - p);
+	if (p == nullptr)
+		return false;
+
+	indices.resize(3 * tcount);
+	for (UINT i = 0; i < 3 * tcount; ++i)
+	{
+		if (!NextNumber(p, end, indices[i]) || indices[i] >= vcount)
+			return false;
+	}
+
+	return true;
+}
+
+MeshCache::~MeshCache()
+{
+	Close();
+}
+
+std::wstring MeshCache::CachePathFor(const std::wstring& sourcePath)
+{
+	size_t dot = sourcePath.find_last_of(L'.');
+	return sourcePath.substr(0, dot) + L".mesh";
+}
+
+bool MeshCache::Bake(const std::wstring& sourcePath)
+{
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+	if (!ParseTextModel(sourcePath, vertices, indices))
+		return false;
+
+	// Coarser levels come from the original triangles, with cells twice the size
+	// each time.  A level that saves less than a third of the triangles of the one
+	// before it is not worth a switch.
+	static const UINT lodGrids[MaxLods - 1] = { 64, 32, 16 };
+
+	std::vector<std::vector<uint32_t>> lodIndices(1);
+	std::vector<float> lodErrors(1, 0.0f);
+	lodIndices[0] = indices;
+	for (UINT grid : lodGrids)
+	{
+		std::vector<uint32_t> simplified;
+		float error = MeshOptimizer::SimplifyByClustering(vertices, indices, grid, simplified);
+		if (simplified.empty() || simplified.size() * 3 > lodIndices.back().size() * 2)
+			continue;
+
+		lodIndices.push_back(std::move(simplified));
+		lodErrors.push_back(error);
+	}
+
+	for (auto& lod : lodIndices)
+		MeshOptimizer::OptimizeVertexCache(lod, vertices.size());
+
+	float acmr = MeshOptimizer::ComputeAcmr(lodIndices[0], vertices.size(), 32);
+
+	// LOD 0 decides the vertex order; coarser levels only use a subset of it.
+	std::vector<std::vector<uint32_t>*> lists;
+	for (auto& lod : lodIndices)
+		lists.push_back(&lod);
+	MeshOptimizer::OptimizeVertexFetch(vertices, lists);
+
+	indices.clear();
+	for (auto& lod : lodIndices)
+		indices.insert(indices.end(), lod.begin(), lod.end());
+
+	XMFLOAT3 vMinf3(+MathHelper::Infinity, +MathHelper::Infinity, +MathHelper::Infinity);
+	XMFLOAT3 vMaxf3(-MathHelper::Infinity, -MathHelper::Infinity, -MathHelper::Infinity);
+
+	XMVECTOR vMin = XMLoadFloat3(&vMinf3);
+	XMVECTOR vMax = XMLoadFloat3(&vMaxf3);
+	for (const Vertex& v : vertices)
+	{
+		XMVECTOR P = XMLoadFloat3(&v.Pos);
+		vMin = XMVectorMin(vMin, P);
+		vMax = XMVectorMax(vMax, P);
+	}
+
+	bool use16 = vertices.size() <= 0xffff;
+
+	MeshCacheHeader header = {};
+	header.Magic = Magic;
+	header.Version = Version;
+	header.VertexStride = sizeof(Vertex);
+	header.VertexCount = (uint32_t)vertices.size();
+	header.IndexCount = (uint32_t)indices.size();
+	header.IndexByteSize = use16 ? 2 : 4;
+	header.VertexOffset = sizeof(MeshCacheHeader);
+	header.IndexOffset = header.VertexOffset + (uint64_t)vertices.size() * sizeof(Vertex);
+	XMStoreFloat3(&header.BoundsCenter, 0.5f * (vMin + vMax));
+	XMStoreFloat3(&header.BoundsExtents, 0.5f * (vMax - vMin));
+	header.LodCount = (uint32_t)lodIndices.size();
+	for (uint32_t i = 0, start = 0; i < header.LodCount; ++i)
+	{
+		header.Lods[i].StartIndex = start;
+		header.Lods[i].IndexCount = (uint32_t)lodIndices[i].size();
+		header.Lods[i].Error = lodErrors[i];
+		start += header.Lods[i].IndexCount;
+	}
+
+	std::ostringstream oss;
+	oss << "Baked mesh: " << vertices.size() << " vertices, ACMR " << acmr << ", triangles per LOD";
+	for (auto& lod : lodIndices)
+		oss << " " << lod.size() / 3;
+	oss << "\n";
+	OutputDebugStringA(oss.str().c_str());
+
+	// Write beside the cache and swap it in, so an interrupted bake never leaves a
+	// truncated file that looks valid.
+	std::wstring cachePath = CachePathFor(sourcePath);
+	std::wstring tempPath = cachePath + L".tmp";
+	{
+		std::ofstream fout(tempPath, std::ios::binary | std::ios::trunc);
+		if (!fout)
+			return false;
+
+		fout.write((const char*)&header, sizeof(header));
+		fout.write((const char*)vertices.data(), vertices.size() * sizeof(Vertex));
+		if (use16)
+		{
+			std::vector<uint16_t> indices16(indices.begin(), indices.end());
+			fout.write((const char*)indices16.data(), indices16.size() * sizeof(uint16_t));
+		}
+		else
+		{
+			fout.write((const char*)indices.data(), indices.size() * sizeof(uint32_t));
+		}
+
+		if (!fout)
+			return false;
+	}
+
+	return MoveFileExW(tempPath.c_str(), cachePath.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+bool MeshCache::IsStale(const std::wstring& sourcePath, const std::wstring& cachePath)
+{
+	WIN32_FILE_ATTRIBUTE_DATA cacheInfo;
+	if (!GetFileAttributesExW(cachePath.c_str(), GetFileExInfoStandard, &cacheInfo))
+		return true;
+
+	// No source shipped means the cache is all there is.
+	WIN32_FILE_ATTRIBUTE_DATA sourceInfo;
+	if (!GetFileAttributesExW(sourcePath.c_str(), GetFileExInfoStandard, &sourceInfo))
+		return false;
+
+	return CompareFileTime(&sourceInfo.ftLastWriteTime, &cacheInfo.ftLastWriteTime) > 0;
+}
+
+bool MeshCache::Open(const std::wstring& sourcePath)
+{
+	Close();
+
+	std::wstring cachePath = CachePathFor(sourcePath);
+	if (!IsStale(sourcePath, cachePath) && Map(cachePath))
+		return true;
+
+	// Missing, stale or unreadable: rebuild it once and try again.
+	Close();
+	return Bake(sourcePath) && Map(cachePath);
+}
+
+bool MeshCache::Map(const std::wstring& cachePath)
+{
+	mFile = CreateFileW(cachePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (mFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mFile, &size) || size.QuadPart < (LONGLONG)sizeof(MeshCacheHeader))
+		return false;
+
+	mMapping = CreateFileMappingW(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mMapping == nullptr)
+		return false;
+
+	mView = (const uint8_t*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+	if (mView == nullptr)
+		return false;
+
+	// Anything from another version or vertex layout, or cut short, is rebuilt.
+	mHeader = (const MeshCacheHeader*)mView;
+	uint64_t vertexBytes = (uint64_t)mHeader->VertexCount * mHeader->VertexStride;
+	uint64_t indexBytes = (uint64_t)mHeader->IndexCount * mHeader->IndexByteSize;
+	if (mHeader->Magic != Magic || mHeader->Version != Version || mHeader->VertexStride != sizeof(Vertex) ||
+		(mHeader->IndexByteSize != 2 && mHeader->IndexByteSize != 4) ||
+		mHeader->LodCount == 0 || mHeader->LodCount > MaxLods ||
+		mHeader->VertexOffset + vertexBytes > (uint64_t)size.QuadPart ||
+		mHeader->IndexOffset + indexBytes > (uint64_t)size.QuadPart)
+	{
+		mHeader = nullptr;
+		return false;
+	}
+
+	for (uint32_t i = 0; i < mHeader->LodCount; ++i)
+	{
+		if ((uint64_t)mHeader->Lods[i].StartIndex + mHeader->Lods[i].IndexCount > mHeader->IndexCount)
+		{
+			mHeader = nullptr;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void MeshCache::Close()
+{
+	mHeader = nullptr;
+
+	if (mView != nullptr)
+	{
+		UnmapViewOfFile(mView);
+		mView = nullptr;
+	}
+
+	if (mMapping != nullptr)
+	{
+		CloseHandle(mMapping);
+		mMapping = nullptr;
+	}
+
+	if (mFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(mFile);
+		mFile = INVALID_HANDLE_VALUE;
+	}
+}
+
+const void* MeshCache::Vertices()const
+{
+	return mView + mHeader->VertexOffset;
+}
+
+UINT MeshCache::VertexCount()const
+{
+	return mHeader->VertexCount;
+}
+
+UINT MeshCache::VertexBufferByteSize()const
+{
+	return mHeader->VertexCount * mHeader->VertexStride;
+}
+
+const void* MeshCache::Indices()const
+{
+	return mView + mHeader->IndexOffset;
+}
+
+UINT MeshCache::IndexCount()const
+{
+	return mHeader->IndexCount;
+}
+
+UINT MeshCache::IndexBufferByteSize()const
+{
+	return mHeader->IndexCount * mHeader->IndexByteSize;
+}
+
+DXGI_FORMAT MeshCache::IndexFormat()const
+{
+	return mHeader->IndexByteSize == 2 ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT;
+}
+
+UINT MeshCache::LodCount()const
+{
+	return mHeader->LodCount;
+}
+
+const MeshCacheLod& MeshCache::Lod(UINT lod)const
+{
+	return mHeader->Lods[lod];
+}
+
+BoundingBox MeshCache::Bounds()const
+{
+	BoundingBox bounds;
+	bounds.Center = mHeader->BoundsCenter;
+	bounds.Extents = mHeader->BoundsExtents;
+	return bounds;
+}
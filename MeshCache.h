@@ -0,0 +1,99 @@
+//***************************************************************************************
+// MeshCache.h
+//
+// Binary cache for the text models in Models/*.txt.  Parsing ~90k lines of text per
+// skull with iostreams dominated startup, so each model is baked once into a .mesh
+// file next to its source and memory-mapped on later runs.  The vertex and index
+// blobs are stored exactly as the GPU buffers want them, so they are uploaded
+// straight from the mapped view with no intermediate copy.
+//
+// Baking also runs MeshOptimizer over the model: triangles are ordered for the vertex
+// cache, vertices for fetch locality, and up to three coarser LODs are generated by
+// vertex clustering.  The LODs share the vertex buffer and follow LOD 0 in the index
+// buffer; each records the largest distance a vertex moved, which drawing compares
+// against the projected size of a pixel to pick one.
+//
+// A cache is rebuilt automatically when it is missing, older than its .txt, or was
+// written by another format version or vertex layout; running with -bakemeshes
+// rebuilds every cache and exits.
+//
+// File layout:
+//   MeshCacheHeader
+//   vertices   VertexCount * VertexStride bytes, at VertexOffset
+//   indices    IndexCount * 2 or 4 bytes, at IndexOffset; 16-bit whenever every
+//              index fits.  Lods[0, LodCount) are ranges in it, finest first.
+//***************************************************************************************
+
+#pragma once
+
+#include "FrameResource.h"
+
+struct MeshCacheLod
+{
+	uint32_t StartIndex;
+	uint32_t IndexCount;
+	float Error;
+	uint32_t Reserved;
+};
+
+struct MeshCacheHeader
+{
+	uint32_t Magic;
+	uint32_t Version;
+	uint32_t VertexStride;
+	uint32_t VertexCount;
+	uint32_t IndexCount;
+	uint32_t IndexByteSize;
+	uint64_t VertexOffset;
+	uint64_t IndexOffset;
+	DirectX::XMFLOAT3 BoundsCenter;
+	DirectX::XMFLOAT3 BoundsExtents;
+	uint32_t LodCount;
+	MeshCacheLod Lods[4];
+};
+
+class MeshCache
+{
+public:
+	static const uint32_t Magic = 0x4853454D; // "MESH"
+	static const uint32_t Version = 2;
+	static const uint32_t MaxLods = 4;
+
+	MeshCache() = default;
+	MeshCache(const MeshCache& rhs) = delete;
+	MeshCache& operator=(const MeshCache& rhs) = delete;
+	~MeshCache();
+
+	// Maps the cache for sourcePath, baking it first if needed.  Returns false if
+	// neither the cache nor the source can be read.
+	bool Open(const std::wstring& sourcePath);
+	void Close();
+
+	// Parses sourcePath and writes its cache unconditionally.
+	static bool Bake(const std::wstring& sourcePath);
+
+	// Models/skull.txt -> Models/skull.mesh
+	static std::wstring CachePathFor(const std::wstring& sourcePath);
+
+	// Valid while the cache is open.
+	const void* Vertices()const;
+	UINT VertexCount()const;
+	UINT VertexBufferByteSize()const;
+	const void* Indices()const;
+	UINT IndexCount()const;
+	UINT IndexBufferByteSize()const;
+	DXGI_FORMAT IndexFormat()const;
+	DirectX::BoundingBox Bounds()const;
+	UINT LodCount()const;
+	const MeshCacheLod& Lod(UINT lod)const;
+
+private:
+	bool Map(const std::wstring& cachePath);
+	static bool IsStale(const std::wstring& sourcePath, const std::wstring& cachePath);
+
+private:
+	HANDLE mFile = INVALID_HANDLE_VALUE;
+	HANDLE mMapping = nullptr;
+	const uint8_t* mView = nullptr;
+	const MeshCacheHeader* mHeader = nullptr;
+};
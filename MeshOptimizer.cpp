@@ -0,0 +1,315 @@
+//***************************************************************************************
+// MeshOptimizer.cpp
+//***************************************************************************************
+
+#include "MeshOptimizer.h"
+#include <cmath>
+#include <unordered_map>
+
+using namespace DirectX;
+
+namespace
+{
+	// Simulated cache size for scoring.  Bigger than any real FIFO so the ordering
+	// suits every GPU; the tail of the curve barely matters.
+	const int kCacheSize = 32;
+
+	// Forsyth's vertex score: recently used vertices score high so their triangles
+	// are emitted next, the three from the last triangle slightly less so strips do
+	// not run on forever, and vertices with few triangles left get a boost so they
+	// are finished off rather than left behind.
+	float VertexScore(int cachePosition, uint32_t remainingTriangles)
+	{
+		if (remainingTriangles == 0)
+			return -1.0f;
+
+		float score = 0.0f;
+		if (cachePosition >= 0)
+		{
+			if (cachePosition < 3)
+				score = 0.75f;
+			else
+				score = powf(1.0f - (float)(cachePosition - 3) / (kCacheSize - 3), 1.5f);
+		}
+
+		return score + 2.0f / sqrtf((float)remainingTriangles);
+	}
+}
+
+void MeshOptimizer::OptimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount)
+{
+	const size_t triangleCount = indices.size() / 3;
+	if (triangleCount == 0)
+		return;
+
+	// Triangles using each vertex, as one flat array with offsets.
+	std::vector<uint32_t> remaining(vertexCount, 0);
+	for (uint32_t index : indices)
+		++remaining[index];
+
+	std::vector<uint32_t> offsets(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; ++v)
+		offsets[v + 1] = offsets[v] + remaining[v];
+
+	std::vector<uint32_t> vertexTriangles(indices.size());
+	{
+		std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+		for (size_t t = 0; t < triangleCount; ++t)
+		{
+			for (int k = 0; k < 3; ++k)
+				vertexTriangles[fill[indices[t * 3 + k]]++] = (uint32_t)t;
+		}
+	}
+
+	std::vector<int> cachePosition(vertexCount, -1);
+	std::vector<float> vertexScore(vertexCount);
+	for (size_t v = 0; v < vertexCount; ++v)
+		vertexScore[v] = VertexScore(-1, remaining[v]);
+
+	std::vector<float> triangleScore(triangleCount);
+	std::vector<bool> emitted(triangleCount, false);
+	for (size_t t = 0; t < triangleCount; ++t)
+	{
+		triangleScore[t] = vertexScore[indices[t * 3 + 0]] +
+			vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+	}
+
+	// Room for the cache plus the three vertices pushed in front of it.
+	int cache[kCacheSize + 3];
+	int cacheCount = 0;
+
+	std::vector<uint32_t> output;
+	output.reserve(indices.size());
+
+	size_t scanCursor = 0;
+	int64_t best = -1;
+
+	// The first triangle is the best one overall; after that only triangles touching
+	// the cache are candidates, and a full scan is needed only when none are left.
+	float bestScore = -1.0f;
+	for (size_t t = 0; t < triangleCount; ++t)
+	{
+		if (triangleScore[t] > bestScore)
+		{
+			bestScore = triangleScore[t];
+			best = (int64_t)t;
+		}
+	}
+
+	while (best >= 0)
+	{
+		const uint32_t* tri = &indices[(size_t)best * 3];
+		emitted[(size_t)best] = true;
+		output.insert(output.end(), tri, tri + 3);
+
+		// Move the triangle's vertices to the front of the cache and drop the
+		// triangle from their lists.
+		int newCache[kCacheSize + 3];
+		int newCount = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			uint32_t v = tri[k];
+			newCache[newCount++] = (int)v;
+
+			uint32_t* begin = &vertexTriangles[offsets[v]];
+			uint32_t* end = begin + remaining[v];
+			uint32_t* found = std::find(begin, end, (uint32_t)best);
+			*found = *(end - 1);
+			--remaining[v];
+		}
+		for (int i = 0; i < cacheCount; ++i)
+		{
+			int v = cache[i];
+			if (v != (int)tri[0] && v != (int)tri[1] && v != (int)tri[2])
+				newCache[newCount++] = v;
+		}
+
+		// Vertices falling off the end lose their position, then everything left in
+		// the cache is rescored along with its triangles.
+		for (int i = kCacheSize; i < newCount; ++i)
+		{
+			cachePosition[newCache[i]] = -1;
+			vertexScore[newCache[i]] = VertexScore(-1, remaining[newCache[i]]);
+		}
+		cacheCount = MathHelper::Min(newCount, kCacheSize);
+		for (int i = 0; i < cacheCount; ++i)
+		{
+			cache[i] = newCache[i];
+			cachePosition[cache[i]] = i;
+			vertexScore[cache[i]] = VertexScore(i, remaining[cache[i]]);
+		}
+
+		best = -1;
+		bestScore = -1.0f;
+		for (int i = 0; i < newCount; ++i)
+		{
+			uint32_t v = (uint32_t)newCache[i];
+			for (uint32_t j = 0; j < remaining[v]; ++j)
+			{
+				uint32_t t = vertexTriangles[offsets[v] + j];
+				float score = vertexScore[indices[t * 3 + 0]] +
+					vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+				triangleScore[t] = score;
+				if (i < cacheCount && score > bestScore)
+				{
+					bestScore = score;
+					best = t;
+				}
+			}
+		}
+
+		if (best < 0)
+		{
+			// Nothing in the cache has triangles left; carry on from the next one
+			// not yet emitted.
+			while (scanCursor < triangleCount && emitted[scanCursor])
+				++scanCursor;
+			if (scanCursor < triangleCount)
+				best = (int64_t)scanCursor;
+		}
+	}
+
+	// Some exporters optimize already; keep their order if it measures better.
+	if (ComputeAcmr(output, vertexCount, kCacheSize) < ComputeAcmr(indices, vertexCount, kCacheSize))
+		indices.swap(output);
+}
+
+void MeshOptimizer::OptimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<std::vector<uint32_t>*>& lists)
+{
+	const uint32_t unused = 0xffffffff;
+	std::vector<uint32_t> remap(vertices.size(), unused);
+	std::vector<Vertex> reordered;
+	reordered.reserve(vertices.size());
+
+	for (std::vector<uint32_t>* list : lists)
+	{
+		for (uint32_t& index : *list)
+		{
+			if (remap[index] == unused)
+			{
+				remap[index] = (uint32_t)reordered.size();
+				reordered.push_back(vertices[index]);
+			}
+			index = remap[index];
+		}
+	}
+
+	vertices.swap(reordered);
+}
+
+float MeshOptimizer::SimplifyByClustering(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+	UINT gridSize, std::vector<uint32_t>& simplified)
+{
+	simplified.clear();
+	if (vertices.empty())
+		return 0.0f;
+
+	XMVECTOR vMin = XMLoadFloat3(&vertices[0].Pos);
+	XMVECTOR vMax = vMin;
+	for (const Vertex& v : vertices)
+	{
+		XMVECTOR P = XMLoadFloat3(&v.Pos);
+		vMin = XMVectorMin(vMin, P);
+		vMax = XMVectorMax(vMax, P);
+	}
+
+	XMFLOAT3 minPos, size;
+	XMStoreFloat3(&minPos, vMin);
+	XMStoreFloat3(&size, vMax - vMin);
+	float cellSize = MathHelper::Max(size.x, MathHelper::Max(size.y, size.z)) / gridSize;
+	if (cellSize <= 0.0f)
+		return 0.0f;
+
+	auto cellOf = [&](const XMFLOAT3& p)
+	{
+		uint64_t x = (uint64_t)MathHelper::Min((p.x - minPos.x) / cellSize, (float)gridSize - 1.0f);
+		uint64_t y = (uint64_t)MathHelper::Min((p.y - minPos.y) / cellSize, (float)gridSize - 1.0f);
+		uint64_t z = (uint64_t)MathHelper::Min((p.z - minPos.z) / cellSize, (float)gridSize - 1.0f);
+		return (x << 42) | (y << 21) | z;
+	};
+
+	// Average position of every occupied cell, then the vertex closest to it
+	// represents the whole cell.  Picking an existing vertex keeps its normal and
+	// lets every LOD share one vertex buffer.
+	struct Cell
+	{
+		XMFLOAT3 Sum = { 0.0f, 0.0f, 0.0f };
+		UINT Count = 0;
+		uint32_t Representative = 0;
+		float BestDistSq = FLT_MAX;
+	};
+	std::unordered_map<uint64_t, Cell> cells;
+	std::vector<uint64_t> vertexCell(vertices.size());
+
+	for (size_t i = 0; i < vertices.size(); ++i)
+	{
+		const XMFLOAT3& p = vertices[i].Pos;
+		vertexCell[i] = cellOf(p);
+		Cell& cell = cells[vertexCell[i]];
+		cell.Sum.x += p.x;
+		cell.Sum.y += p.y;
+		cell.Sum.z += p.z;
+		++cell.Count;
+	}
+
+	for (size_t i = 0; i < vertices.size(); ++i)
+	{
+		Cell& cell = cells[vertexCell[i]];
+		XMVECTOR centroid = XMLoadFloat3(&cell.Sum) / (float)cell.Count;
+		float distSq = XMVectorGetX(XMVector3LengthSq(XMLoadFloat3(&vertices[i].Pos) - centroid));
+		if (distSq < cell.BestDistSq)
+		{
+			cell.BestDistSq = distSq;
+			cell.Representative = (uint32_t)i;
+		}
+	}
+
+	float maxError = 0.0f;
+	for (size_t i = 0; i < vertices.size(); ++i)
+	{
+		const Vertex& rep = vertices[cells[vertexCell[i]].Representative];
+		float error = XMVectorGetX(XMVector3Length(XMLoadFloat3(&vertices[i].Pos) - XMLoadFloat3(&rep.Pos)));
+		maxError = MathHelper::Max(maxError, error);
+	}
+
+	simplified.reserve(indices.size());
+	for (size_t t = 0; t + 2 < indices.size(); t += 3)
+	{
+		uint32_t a = cells[vertexCell[indices[t + 0]]].Representative;
+		uint32_t b = cells[vertexCell[indices[t + 1]]].Representative;
+		uint32_t c = cells[vertexCell[indices[t + 2]]].Representative;
+
+		// Triangles inside one cell, or along one edge of it, collapse to nothing.
+		if (a == b || b == c || c == a)
+			continue;
+
+		simplified.push_back(a);
+		simplified.push_back(b);
+		simplified.push_back(c);
+	}
+
+	return maxError;
+}
+
+float MeshOptimizer::ComputeAcmr(const std::vector<uint32_t>& indices, size_t vertexCount, UINT cacheSize)
+{
+	if (indices.empty())
+		return 0.0f;
+
+	// Each vertex remembers when it entered the FIFO; it is a hit while fewer than
+	// cacheSize misses have happened since.
+	std::vector<size_t> insertedAt(vertexCount, 0);
+	std::vector<bool> seen(vertexCount, false);
+	size_t misses = 0;
+	for (uint32_t index : indices)
+	{
+		if (!seen[index] || misses - insertedAt[index] >= cacheSize)
+		{
+			seen[index] = true;
+			insertedAt[index] = misses;
+			++misses;
+		}
+	}
+
+	return (float)misses / (indices.size() / 3);
+}
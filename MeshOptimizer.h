@@ -0,0 +1,40 @@
+//***************************************************************************************
+// MeshOptimizer.h
+//
+// Offline processing applied to models when MeshCache bakes them.
+//
+//   OptimizeVertexCache  reorders triangles for the post-transform vertex cache
+//                        (Forsyth's linear-speed algorithm), so each vertex is
+//                        shaded close to once instead of up to six times.  An
+//                        input order that already measures better is kept.
+//   OptimizeVertexFetch  renumbers vertices in the order the index buffer first uses
+//                        them, so vertex fetches walk memory forwards; vertices no
+//                        index refers to are dropped.
+//   SimplifyByClustering builds a coarser index list over the same vertices by
+//                        snapping every vertex to a representative per grid cell
+//                        and dropping the triangles that collapse.
+//
+// All of them work on triangle lists with 32-bit indices.
+//***************************************************************************************
+
+#pragma once
+
+#include "FrameResource.h"
+
+namespace MeshOptimizer
+{
+	void OptimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount);
+
+	// Applies the same renumbering to every index list in lists; the first one
+	// decides the order.
+	void OptimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<std::vector<uint32_t>*>& lists);
+
+	// gridSize cells along the longest side of the bounds.  Returns the largest
+	// distance any vertex moved, in model units.
+	float SimplifyByClustering(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+		UINT gridSize, std::vector<uint32_t>& simplified);
+
+	// Average cache miss ratio: transformed vertices per triangle for a FIFO cache of
+	// cacheSize entries.  Between 0.5 and 3; lower is better.
+	float ComputeAcmr(const std::vector<uint32_t>& indices, size_t vertexCount, UINT cacheSize);
+}
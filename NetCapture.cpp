@@ -0,0 +1,126 @@
+//***************************************************************************************
+// NetCapture.cpp
+//***************************************************************************************
+
+#include "NetCapture.h"
+#include "NetProtocol.h"
+#include "d3dUtil.h"
+
+namespace
+{
+	const char kMagic[4] = { 'S', 'D', 'N', 'C' };
+	const uint16_t kVersion = 1;
+	const size_t kFileHeaderSize = 8;
+	const size_t kRecordHeaderSize = 7;
+
+	int64_t NowTicks()
+	{
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		return now.QuadPart;
+	}
+}
+
+//
+// NetCaptureWriter
+//
+
+bool NetCaptureWriter::Open(const std::wstring& filename)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	mFile.open(filename, std::ios::binary | std::ios::trunc);
+	if (!mFile)
+		return false;
+
+	uint8_t header[kFileHeaderSize] = {};
+	memcpy(header, kMagic, sizeof(kMagic));
+	NetProtocol::StoreU16(header + 4, kVersion);
+	mFile.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	mTicksPerUs = frequency.QuadPart / 1000000.0;
+	mLastTicks = NowTicks();
+	mRecordCount = 0;
+	mOpen = true;
+	return true;
+}
+
+void NetCaptureWriter::Close()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mOpen)
+		mFile.close();
+	mOpen = false;
+}
+
+bool NetCaptureWriter::IsOpen()const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mOpen;
+}
+
+void NetCaptureWriter::Record(Direction direction, const void* data, size_t length)
+{
+	if (length > 0xffff)
+		return;
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (!mOpen)
+		return;
+
+	// Stamped under the lock so deltas never go negative between the two threads.
+	int64_t now = NowTicks();
+	uint64_t deltaUs = (uint64_t)((now - mLastTicks) / mTicksPerUs);
+	mLastTicks = now;
+
+	uint8_t header[kRecordHeaderSize];
+	header[0] = direction;
+	NetProtocol::StoreU32(header + 1, (uint32_t)(deltaUs < 0xffffffffull ? deltaUs : 0xffffffffull));
+	NetProtocol::StoreU16(header + 5, (uint16_t)length);
+	mFile.write(reinterpret_cast<const char*>(header), sizeof(header));
+	mFile.write(reinterpret_cast<const char*>(data), length);
+	++mRecordCount;
+}
+
+uint64_t NetCaptureWriter::RecordCount()const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mRecordCount;
+}
+
+//
+// NetCaptureReader
+//
+
+bool NetCaptureReader::Open(const std::wstring& filename)
+{
+	mFile.open(filename, std::ios::binary);
+	if (!mFile)
+		return false;
+
+	uint8_t header[kFileHeaderSize];
+	if (!mFile.read(reinterpret_cast<char*>(header), sizeof(header)))
+		return false;
+
+	mTimeUs = 0;
+	return memcmp(header, kMagic, sizeof(kMagic)) == 0 && NetProtocol::LoadU16(header + 4) == kVersion;
+}
+
+bool NetCaptureReader::Next(Record& record)
+{
+	uint8_t header[kRecordHeaderSize];
+	if (!mFile.read(reinterpret_cast<char*>(header), sizeof(header)))
+		return false;
+
+	uint16_t length = NetProtocol::LoadU16(header + 5);
+	record.Data.resize(length);
+	if (length > 0 && !mFile.read(reinterpret_cast<char*>(record.Data.data()), length))
+		return false;
+
+	mTimeUs += NetProtocol::LoadU32(header + 1);
+	record.Direction = (NetCaptureWriter::Direction)header[0];
+	record.TimeUs = mTimeUs;
+	return true;
+}
@@ -0,0 +1,83 @@
+//***************************************************************************************
+// NetCapture.h
+//
+// Capture files of everything the client received and sent, for replaying real
+// match traffic through the same parse and update code.
+//
+// Layout, little-endian:
+//   [0]  char   magic[4]       "SDNC"
+//   [4]  uint16 version
+//   [6]  uint16 reserved
+//   then one record per datagram:
+//   [0]  uint8  direction      0 = received, 1 = sent
+//   [1]  uint32 deltaUs        microseconds since the previous record
+//   [5]  uint16 length
+//   [7]  uint8  data[length]   the datagram exactly as it was on the wire
+//
+// The writer is shared by the receiver thread and the send thread; each record is
+// appended under a short lock into a buffered stream.
+//***************************************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class NetCaptureWriter
+{
+public:
+	enum Direction : uint8_t
+	{
+		Received = 0,
+		Sent = 1
+	};
+
+	NetCaptureWriter() = default;
+	NetCaptureWriter(const NetCaptureWriter& rhs) = delete;
+	NetCaptureWriter& operator=(const NetCaptureWriter& rhs) = delete;
+
+	// Truncates filename.  Returns false if it cannot be created.
+	bool Open(const std::wstring& filename);
+	void Close();
+	bool IsOpen()const;
+
+	// Any thread.  No-op unless open.
+	void Record(Direction direction, const void* data, size_t length);
+
+	uint64_t RecordCount()const;
+
+private:
+	mutable std::mutex mMutex;
+	std::ofstream mFile;
+	bool mOpen = false;
+	int64_t mLastTicks = 0;
+	double mTicksPerUs = 0.0;
+	uint64_t mRecordCount = 0;
+};
+
+class NetCaptureReader
+{
+public:
+	struct Record
+	{
+		NetCaptureWriter::Direction Direction = NetCaptureWriter::Received;
+
+		// Microseconds since the first record.
+		uint64_t TimeUs = 0;
+		std::vector<uint8_t> Data;
+	};
+
+	// Returns false if filename is missing or not a capture.
+	bool Open(const std::wstring& filename);
+
+	// Reads the next record into record.  Returns false at the end of the file or on
+	// a truncated record.
+	bool Next(Record& record);
+
+private:
+	std::ifstream mFile;
+	uint64_t mTimeUs = 0;
+};
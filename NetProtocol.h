@@ -0,0 +1,390 @@
+//***************************************************************************************
+// NetProtocol.h
+//
+// Binary wire format for the datagrams exchanged between clients and the relay server.
+// Every message starts with a small header (type, version, total length) followed by
+// typed fields at fixed offsets.  All multi-byte fields are little-endian.  Encoding
+// and decoding operate on caller-provided buffers and never allocate.
+//***************************************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <chrono>
+#include <charconv>
+#include <string_view>
+
+namespace NetProtocol
+{
+	// Bump whenever the layout of any message changes.
+	const uint8_t kVersion = 4;
+
+	// Largest datagram we ever build or accept for a Packet.  Keeping it within a
+	// cache line means a whole message is touched with a single line fill.
+	const size_t kMaxPacketSize = 64;
+
+	// Longest player name carried on the wire.
+	const size_t kMaxNameLength = 24;
+
+	// Player ids index per-player arrays directly, so they must stay below this.
+	const size_t kMaxPlayers = 32;
+
+	// Largest world-state snapshot the server sends in one datagram.
+	const size_t kMaxSnapshotSize = 4096;
+
+	enum class PacketType : uint8_t
+	{
+		Movement = 0,
+		Join = 1,
+		Snapshot = 2,
+		Ack = 3,
+		Channel = 4,
+		Reliable = 5,
+		Leave = 6,
+		Subscribe = 7,
+		Count
+	};
+
+	//
+	// Header layout (4 bytes):
+	//   [0] uint8  type
+	//   [1] uint8  version
+	//   [2] uint16 length     total message size in bytes, header included
+	//
+	const size_t kHeaderSize = 4;
+
+	//
+	// Packet body layout, following the header:
+	//   [4]  uint16 playerId
+	//   [6]  uint8  movementState
+	//   [7]  uint8  direction
+	//   [8]  uint32 timestamp
+	//   [12] uint32 inputSeq
+	//   [16] uint32 inputUs
+	//   [20] float  x
+	//   [24] float  y
+	//   [28] float  z
+	//   [32] uint8  nameLength
+	//   [33] char   name[nameLength]   not null terminated on the wire
+	//
+	const size_t kPacketFixedSize = 33;
+
+	static_assert(kPacketFixedSize + kMaxNameLength <= kMaxPacketSize, "Packet no longer fits in a cache line.");
+
+	struct Packet
+	{
+		// 0 = movement
+		// 1 = join
+		uint8_t packetType = 0;
+
+		uint16_t playerId = 0;
+
+		// 0 = stationary
+		// 1 = moving
+		uint8_t movementState = 0;
+
+		// 0 = x, y
+		// 1 = x, +y
+		// 2 = x, -y
+		// 3 = +x, y
+		// 4 = -x, y
+		// 5 = +x, +y
+		// 6 = -x, +y
+		// 7 = -x, -y
+		// 8 = +x, -y
+		uint8_t direction = 0;
+
+		uint32_t timestamp = 0;
+
+		// Sequence number of the local input this packet carries, and how long it was
+		// held in microseconds.  The server simulates each input for exactly inputUs and
+		// echoes the last sequence it applied back in the snapshot's ack field.
+		uint32_t inputSeq = 0;
+		uint32_t inputUs = 0;
+
+		// Sender's position after applying the input, sampled at timestamp.  Peers
+		// interpolate between these rather than integrating direction themselves.
+		float x = 0.0f;
+		float y = 0.0f;
+		float z = 0.0f;
+
+		uint8_t nameLength = 0;
+		char name[kMaxNameLength] = {};
+	};
+
+	inline void StoreU16(uint8_t* p, uint16_t v)
+	{
+		p[0] = static_cast<uint8_t>(v);
+		p[1] = static_cast<uint8_t>(v >> 8);
+	}
+
+	inline void StoreU32(uint8_t* p, uint32_t v)
+	{
+		p[0] = static_cast<uint8_t>(v);
+		p[1] = static_cast<uint8_t>(v >> 8);
+		p[2] = static_cast<uint8_t>(v >> 16);
+		p[3] = static_cast<uint8_t>(v >> 24);
+	}
+
+	inline uint16_t LoadU16(const uint8_t* p)
+	{
+		return static_cast<uint16_t>(p[0] | (p[1] << 8));
+	}
+
+	inline uint32_t LoadU32(const uint8_t* p)
+	{
+		return static_cast<uint32_t>(p[0]) |
+			(static_cast<uint32_t>(p[1]) << 8) |
+			(static_cast<uint32_t>(p[2]) << 16) |
+			(static_cast<uint32_t>(p[3]) << 24);
+	}
+
+	inline void StoreF32(uint8_t* p, float v)
+	{
+		uint32_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		StoreU32(p, bits);
+	}
+
+	inline float LoadF32(const uint8_t* p)
+	{
+		uint32_t bits = LoadU32(p);
+		float v;
+		memcpy(&v, &bits, sizeof(v));
+		return v;
+	}
+
+	// Milliseconds since the epoch truncated to 32 bits, the unit of Packet::timestamp.
+	inline uint32_t NowMs()
+	{
+		auto duration = std::chrono::system_clock::now().time_since_epoch();
+		return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(duration).count());
+	}
+
+	inline void SetName(Packet& packet, const char* name, size_t length)
+	{
+		if (length > kMaxNameLength)
+			length = kMaxNameLength;
+
+		memcpy(packet.name, name, length);
+		packet.nameLength = static_cast<uint8_t>(length);
+	}
+
+	inline void WriteHeader(uint8_t* out, PacketType type, size_t length)
+	{
+		out[0] = static_cast<uint8_t>(type);
+		out[1] = kVersion;
+		StoreU16(out + 2, static_cast<uint16_t>(length));
+	}
+
+	// Validates the header at the front of data and returns the message length it
+	// declares, or 0 if the bytes are not a message of the current version.
+	inline size_t ReadHeader(const uint8_t* data, size_t size, PacketType& type)
+	{
+		if (size < kHeaderSize)
+			return 0;
+
+		if (data[0] >= static_cast<uint8_t>(PacketType::Count) || data[1] != kVersion)
+			return 0;
+
+		size_t length = LoadU16(data + 2);
+		if (length < kHeaderSize || length > size)
+			return 0;
+
+		type = static_cast<PacketType>(data[0]);
+		return length;
+	}
+
+	// Writes packet into out and returns the number of bytes used, or 0 if capacity
+	// is too small.
+	inline size_t EncodePacket(const Packet& packet, uint8_t* out, size_t capacity)
+	{
+		size_t nameLength = packet.nameLength <= kMaxNameLength ? packet.nameLength : kMaxNameLength;
+		size_t length = kPacketFixedSize + nameLength;
+		if (length > capacity)
+			return 0;
+
+		WriteHeader(out, static_cast<PacketType>(packet.packetType), length);
+		StoreU16(out + 4, packet.playerId);
+		out[6] = packet.movementState;
+		out[7] = packet.direction;
+		StoreU32(out + 8, packet.timestamp);
+		StoreU32(out + 12, packet.inputSeq);
+		StoreU32(out + 16, packet.inputUs);
+		StoreF32(out + 20, packet.x);
+		StoreF32(out + 24, packet.y);
+		StoreF32(out + 28, packet.z);
+		out[32] = static_cast<uint8_t>(nameLength);
+		memcpy(out + kPacketFixedSize, packet.name, nameLength);
+
+		return length;
+	}
+
+	// Decodes a Packet from the first message in data.  Returns false if the bytes
+	// are truncated, from another protocol version, or not a Packet at all.
+	inline bool DecodePacket(const uint8_t* data, size_t size, Packet& packet)
+	{
+		PacketType type;
+		size_t length = ReadHeader(data, size, type);
+		if (length < kPacketFixedSize)
+			return false;
+
+		if (type != PacketType::Movement && type != PacketType::Join)
+			return false;
+
+		size_t nameLength = data[32];
+		if (nameLength > kMaxNameLength || kPacketFixedSize + nameLength > length)
+			return false;
+
+		packet.packetType = data[0];
+		packet.playerId = LoadU16(data + 4);
+		packet.movementState = data[6];
+		packet.direction = data[7];
+		packet.timestamp = LoadU32(data + 8);
+		packet.inputSeq = LoadU32(data + 12);
+		packet.inputUs = LoadU32(data + 16);
+		packet.x = LoadF32(data + 20);
+		packet.y = LoadF32(data + 24);
+		packet.z = LoadF32(data + 28);
+		packet.nameLength = static_cast<uint8_t>(nameLength);
+		memcpy(packet.name, data + kPacketFixedSize, nameLength);
+
+		return true;
+	}
+
+	//
+	// Leave layout, following the header:
+	//   [4]  uint16 playerId
+	//
+	// Sent reliably when a client shuts down, so the server can drop it at once rather
+	// than waiting for it to time out.
+	//
+	const size_t kLeaveSize = 6;
+
+	inline size_t EncodeLeave(uint16_t playerId, uint8_t* out, size_t capacity)
+	{
+		if (capacity < kLeaveSize)
+			return 0;
+
+		WriteHeader(out, PacketType::Leave, kLeaveSize);
+		StoreU16(out + 4, playerId);
+		return kLeaveSize;
+	}
+
+	inline bool DecodeLeave(const uint8_t* data, size_t size, uint16_t& playerId)
+	{
+		PacketType type;
+		size_t length = ReadHeader(data, size, type);
+		if (length < kLeaveSize || type != PacketType::Leave)
+			return false;
+
+		playerId = LoadU16(data + 4);
+		return true;
+	}
+
+	//
+	// World-state snapshot
+	//
+	// The server broadcasts the state of every client as text, one record per client:
+	//   %ip:<addr>;player:<id>;name:<name>;health:<hp>;x:<f>;y:<f>;z:<f>;ack:<seq>
+	// Records are concatenated, optionally split across lines.  ack is the last input
+	// sequence the server simulated for that player, and x/y/z is the position after it.
+	//
+
+	struct PlayerState
+	{
+		// Sequence number of the snapshot that last wrote this entry; 0 = never seen.
+		uint32_t seq = 0;
+
+		int health = 0;
+		uint32_t ack = 0;
+		float x = 0.0f;
+		float y = 0.0f;
+		float z = 0.0f;
+
+		uint8_t nameLength = 0;
+		char name[kMaxNameLength] = {};
+	};
+
+	inline std::string_view TrimLeft(std::string_view text)
+	{
+		size_t i = 0;
+		while (i < text.size() && (text[i] == ' ' || text[i] == '\t'))
+			++i;
+		return text.substr(i);
+	}
+
+	template<typename T>
+	inline bool ParseNumber(std::string_view text, T& value)
+	{
+		text = TrimLeft(text);
+		return std::from_chars(text.data(), text.data() + text.size(), value).ec == std::errc();
+	}
+
+	// Parses every record in text in a single pass and writes it into states[player],
+	// stamping the entry with seq.  Records with a missing or out-of-range player id
+	// are skipped.  Returns the number of records written.
+	inline size_t ParseWorldSnapshot(std::string_view text, uint32_t seq, PlayerState* states, size_t stateCount)
+	{
+		size_t written = 0;
+		size_t pos = text.find('%');
+
+		while (pos != std::string_view::npos)
+		{
+			++pos;
+
+			int player = -1;
+			PlayerState record;
+
+			// Walk key:value fields until the next record or end of line.
+			while (pos < text.size() && text[pos] != '%' && text[pos] != '\n' && text[pos] != '\r')
+			{
+				size_t fieldEnd = text.find_first_of(";%\r\n", pos);
+				if (fieldEnd == std::string_view::npos)
+					fieldEnd = text.size();
+
+				std::string_view field = text.substr(pos, fieldEnd - pos);
+				size_t colon = field.find(':');
+				if (colon != std::string_view::npos)
+				{
+					std::string_view key = field.substr(0, colon);
+					std::string_view value = field.substr(colon + 1);
+
+					if (key == "player")
+						ParseNumber(value, player);
+					else if (key == "health")
+						ParseNumber(value, record.health);
+					else if (key == "x")
+						ParseNumber(value, record.x);
+					else if (key == "y")
+						ParseNumber(value, record.y);
+					else if (key == "z")
+						ParseNumber(value, record.z);
+					else if (key == "ack")
+						ParseNumber(value, record.ack);
+					else if (key == "name")
+					{
+						size_t length = value.size() < kMaxNameLength ? value.size() : kMaxNameLength;
+						memcpy(record.name, value.data(), length);
+						record.nameLength = static_cast<uint8_t>(length);
+					}
+				}
+
+				pos = (fieldEnd < text.size() && text[fieldEnd] == ';') ? fieldEnd + 1 : fieldEnd;
+			}
+
+			if (player >= 0 && static_cast<size_t>(player) < stateCount)
+			{
+				record.seq = seq;
+				states[player] = record;
+				++written;
+			}
+
+			pos = text.find('%', pos);
+		}
+
+		return written;
+	}
+}
@@ -0,0 +1,120 @@
+//***************************************************************************************
+// NetStats.cpp
+//***************************************************************************************
+
+#include "NetStats.h"
+#include "d3dUtil.h"
+
+NetStats::NetStats()
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	mTicksPerMicrosecond = frequency.QuadPart / 1000000.0;
+}
+
+void NetStats::Add(Counter counter, uint64_t amount)
+{
+	mCounters[counter].Value.fetch_add(amount, std::memory_order_relaxed);
+}
+
+uint64_t NetStats::Total(Counter counter)const
+{
+	return mCounters[counter].Value.load(std::memory_order_relaxed);
+}
+
+bool NetStats::SampleDue(double nowSeconds, double intervalSeconds)const
+{
+	return mLastSampleTime < 0.0 || nowSeconds - mLastSampleTime >= intervalSeconds;
+}
+
+bool NetStats::Update(double nowSeconds, const External& external, double intervalSeconds)
+{
+	// The first call only sets the baseline.
+	if (mLastSampleTime < 0.0)
+	{
+		mLastSampleTime = nowSeconds;
+		for (int i = 0; i < CounterCount; ++i)
+			mLastTotals[i] = Total((Counter)i);
+		mLastExternal = external;
+		return false;
+	}
+
+	double elapsed = nowSeconds - mLastSampleTime;
+	if (elapsed < intervalSeconds)
+		return false;
+
+	uint64_t delta[CounterCount];
+	for (int i = 0; i < CounterCount; ++i)
+	{
+		uint64_t total = Total((Counter)i);
+		delta[i] = total - mLastTotals[i];
+		mLastTotals[i] = total;
+	}
+
+	float perSecond = (float)(1.0 / elapsed);
+	mLatest.Time = nowSeconds;
+	mLatest.DatagramsInPerSec = delta[DatagramsIn] * perSecond;
+	mLatest.BytesInPerSec = delta[BytesIn] * perSecond;
+	mLatest.MessagesInPerSec = delta[MessagesIn] * perSecond;
+	mLatest.DatagramsOutPerSec = delta[DatagramsOut] * perSecond;
+	mLatest.BytesOutPerSec = delta[BytesOut] * perSecond;
+	mLatest.ParseUsPerDatagram = delta[DatagramsIn] != 0 ?
+		(float)(delta[ParseTicks] / mTicksPerMicrosecond / delta[DatagramsIn]) : 0.0f;
+	mLatest.QueueDepth = external.QueueDepth;
+	mLatest.DroppedIn = external.DroppedIn - mLastExternal.DroppedIn;
+	mLatest.DroppedOut = external.DroppedOut - mLastExternal.DroppedOut;
+	mLatest.OutOfOrder = external.OutOfOrder - mLastExternal.OutOfOrder;
+	mLatest.Retransmits = external.Retransmits - mLastExternal.Retransmits;
+	mLatest.RttMs = external.RttMs;
+
+	mLastExternal = external;
+	mLastSampleTime = nowSeconds;
+
+	if (mCsv.is_open())
+		WriteCsvRow();
+	return true;
+}
+
+const NetStats::Sample& NetStats::Latest()const
+{
+	return mLatest;
+}
+
+std::wstring NetStats::CaptionText()const
+{
+	std::wostringstream oss;
+	oss.setf(std::ios::fixed);
+	oss.precision(1);
+	oss << L"   in: " << mLatest.DatagramsInPerSec << L"/s " << mLatest.BytesInPerSec / 1024.0f << L"KB/s"
+		<< L"   out: " << mLatest.DatagramsOutPerSec << L"/s " << mLatest.BytesOutPerSec / 1024.0f << L"KB/s"
+		<< L"   parse: " << mLatest.ParseUsPerDatagram << L"us"
+		<< L"   queue: " << mLatest.QueueDepth
+		<< L"   dropped: " << mLatest.DroppedIn + mLatest.DroppedOut
+		<< L"   ooo: " << mLatest.OutOfOrder
+		<< L"   rtt: " << mLatest.RttMs << L"ms";
+	return oss.str();
+}
+
+bool NetStats::OpenCsv(const std::wstring& filename)
+{
+	mCsv.open(filename, std::ios::out | std::ios::trunc);
+	if (!mCsv)
+		return false;
+
+	mCsv << "time,datagrams_in_per_sec,bytes_in_per_sec,messages_in_per_sec,"
+		"datagrams_out_per_sec,bytes_out_per_sec,parse_us_per_datagram,queue_depth,"
+		"dropped_in,dropped_out,out_of_order,retransmits,rtt_ms\n";
+	return true;
+}
+
+void NetStats::WriteCsvRow()
+{
+	const Sample& s = mLatest;
+	mCsv << s.Time << ',' << s.DatagramsInPerSec << ',' << s.BytesInPerSec << ',' << s.MessagesInPerSec << ','
+		<< s.DatagramsOutPerSec << ',' << s.BytesOutPerSec << ',' << s.ParseUsPerDatagram << ','
+		<< s.QueueDepth << ',' << s.DroppedIn << ',' << s.DroppedOut << ',' << s.OutOfOrder << ','
+		<< s.Retransmits << ',' << s.RttMs << '\n';
+
+	// A crash or a killed process should still leave every sample up to now.
+	mCsv.flush();
+}
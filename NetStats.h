@@ -0,0 +1,106 @@
+//***************************************************************************************
+// NetStats.h
+//
+// Network performance counters.  The receiver thread, the send thread and the game
+// thread bump counters with relaxed atomic adds; each counter sits on its own cache
+// line so the threads never contend for one.  Nothing here takes a lock.
+//
+// The game thread calls Update every frame.  Once per interval it takes the
+// difference since the last sample, turning totals into per-second rates, and folds
+// in values other objects already keep (ring overflows, stale packets, RTT).  The
+// latest sample feeds the window caption and, if a CSV file is open, one row of it.
+//***************************************************************************************
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+class NetStats
+{
+public:
+	enum Counter
+	{
+		DatagramsIn = 0,
+		BytesIn,
+		MessagesIn,
+		DatagramsOut,
+		BytesOut,
+		ParseTicks, // QueryPerformanceCounter ticks spent in HandleDatagram
+		CounterCount
+	};
+
+	// Totals kept elsewhere, read by the game thread at each sample.
+	struct External
+	{
+		uint64_t DroppedIn = 0;   // receive ring overflows
+		uint64_t DroppedOut = 0;  // send ring overflows
+		uint64_t OutOfOrder = 0;  // packets older than the last one from their sender
+		uint64_t Retransmits = 0;
+		uint32_t QueueDepth = 0;  // packets waiting for the game thread
+		float RttMs = 0.0f;
+	};
+
+	struct Sample
+	{
+		double Time = 0.0;
+		float DatagramsInPerSec = 0.0f;
+		float BytesInPerSec = 0.0f;
+		float MessagesInPerSec = 0.0f;
+		float DatagramsOutPerSec = 0.0f;
+		float BytesOutPerSec = 0.0f;
+		float ParseUsPerDatagram = 0.0f;
+		uint32_t QueueDepth = 0;
+		uint64_t DroppedIn = 0;   // since the previous sample, as are the two below
+		uint64_t DroppedOut = 0;
+		uint64_t OutOfOrder = 0;
+		uint64_t Retransmits = 0;
+		float RttMs = 0.0f;
+	};
+
+	NetStats();
+	NetStats(const NetStats& rhs) = delete;
+	NetStats& operator=(const NetStats& rhs) = delete;
+
+	// Any thread.
+	void Add(Counter counter, uint64_t amount = 1);
+	uint64_t Total(Counter counter)const;
+
+	// Game thread.  Whether Update would take a sample now, so the caller only
+	// gathers External, some of which takes locks, when it is needed.
+	bool SampleDue(double nowSeconds, double intervalSeconds = 1.0)const;
+
+	// Game thread.  Samples once intervalSeconds have passed since the last sample and
+	// returns true when it did.
+	bool Update(double nowSeconds, const External& external, double intervalSeconds = 1.0);
+
+	const Sample& Latest()const;
+
+	// Text appended to the window caption.
+	std::wstring CaptionText()const;
+
+	// Starts writing every sample as a CSV row.  Returns false if the file cannot be
+	// created.
+	bool OpenCsv(const std::wstring& filename);
+
+private:
+	struct alignas(64) PaddedCounter
+	{
+		std::atomic<uint64_t> Value{ 0 };
+	};
+
+	void WriteCsvRow();
+
+private:
+	PaddedCounter mCounters[CounterCount];
+
+	// Game thread only.
+	double mTicksPerMicrosecond = 0.0;
+	double mLastSampleTime = -1.0;
+	uint64_t mLastTotals[CounterCount] = {};
+	External mLastExternal;
+	Sample mLatest;
+	std::ofstream mCsv;
+};
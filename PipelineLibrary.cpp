@@ -0,0 +1,115 @@
+//***************************************************************************************
+// PipelineLibrary.cpp
+//***************************************************************************************
+
+#include "PipelineLibrary.h"
+
+using Microsoft::WRL::ComPtr;
+
+void PipelineLibrary::Open(ID3D12Device* device, const std::wstring& filename)
+{
+	mDevice = device;
+	mFilename = filename;
+
+	if (FAILED(device->QueryInterface(IID_PPV_ARGS(mDevice1.GetAddressOf()))))
+		return;
+
+	if (GetFileAttributesW(filename.c_str()) != INVALID_FILE_ATTRIBUTES)
+	{
+		mSerialized = d3dUtil::LoadBinary(filename);
+
+		// A library from another driver or adapter, or a damaged file, is rejected
+		// here; start again from an empty one.
+		HRESULT hr = mDevice1->CreatePipelineLibrary(mSerialized->GetBufferPointer(),
+			mSerialized->GetBufferSize(), IID_PPV_ARGS(mLibrary.GetAddressOf()));
+		if (SUCCEEDED(hr))
+			return;
+
+		mSerialized = nullptr;
+	}
+
+	Reset();
+}
+
+void PipelineLibrary::Reset()
+{
+	mLibrary = nullptr;
+	mSerialized = nullptr;
+	mDirty = true;
+
+	// Some tools and older runtimes report libraries as unsupported.
+	if (FAILED(mDevice1->CreatePipelineLibrary(nullptr, 0, IID_PPV_ARGS(mLibrary.GetAddressOf()))))
+	{
+		mLibrary = nullptr;
+		mDirty = false;
+	}
+}
+
+ComPtr<ID3D12PipelineState> PipelineLibrary::CreateGraphicsPipeline(
+	const std::wstring& name, const D3D12_GRAPHICS_PIPELINE_STATE_DESC& desc)
+{
+	ComPtr<ID3D12PipelineState> pso;
+
+	if (mLibrary != nullptr &&
+		SUCCEEDED(mLibrary->LoadGraphicsPipeline(name.c_str(), &desc, IID_PPV_ARGS(pso.GetAddressOf()))))
+	{
+		++mHitCount;
+		mPipelines[name] = pso;
+		return pso;
+	}
+
+	++mMissCount;
+	ThrowIfFailed(mDevice->CreateGraphicsPipelineState(&desc, IID_PPV_ARGS(pso.GetAddressOf())));
+	mPipelines[name] = pso;
+
+	if (mLibrary != nullptr)
+	{
+		// E_INVALIDARG means the name is taken by a PSO with an older description.
+		// Entries cannot be replaced, so rebuild the library from this run's PSOs.
+		HRESULT hr = mLibrary->StorePipeline(name.c_str(), pso.Get());
+		if (hr == E_INVALIDARG)
+		{
+			Reset();
+			for (auto& p : mPipelines)
+			{
+				if (mLibrary != nullptr)
+					ThrowIfFailed(mLibrary->StorePipeline(p.first.c_str(), p.second.Get()));
+			}
+		}
+		else
+		{
+			ThrowIfFailed(hr);
+		}
+		mDirty = true;
+	}
+
+	return pso;
+}
+
+void PipelineLibrary::Save()
+{
+	if (!mDirty || mLibrary == nullptr)
+		return;
+
+	std::vector<uint8_t> data(mLibrary->GetSerializedSize());
+	ThrowIfFailed(mLibrary->Serialize(data.data(), data.size()));
+
+	// A library that cannot be written only costs the PSO compiles next launch.
+	size_t slash = mFilename.find_last_of(L"\\/");
+	if (slash != std::wstring::npos)
+		CreateDirectoryW(mFilename.substr(0, slash).c_str(), nullptr);
+	if (!d3dUtil::SaveBinary(mFilename, data.data(), data.size()))
+		OutputDebugStringA("Failed to write pipeline library\n");
+
+	mDirty = false;
+}
+
+UINT PipelineLibrary::HitCount()const
+{
+	return mHitCount;
+}
+
+UINT PipelineLibrary::MissCount()const
+{
+	return mMissCount;
+}
@@ -0,0 +1,52 @@
+//***************************************************************************************
+// PipelineLibrary.h
+//
+// Graphics PSOs cached on disk through ID3D12PipelineLibrary.  A PSO found in the
+// library by name, with a matching description, is loaded without the driver
+// compiling it again; a miss creates it normally and adds it to the library, which
+// Save writes back.  The library is thrown away and rebuilt when the driver or
+// adapter changed, and without ID3D12Device1 every PSO is simply created directly.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+
+class PipelineLibrary
+{
+public:
+	PipelineLibrary() = default;
+	PipelineLibrary(const PipelineLibrary& rhs) = delete;
+	PipelineLibrary& operator=(const PipelineLibrary& rhs) = delete;
+	~PipelineLibrary() = default;
+
+	void Open(ID3D12Device* device, const std::wstring& filename);
+
+	Microsoft::WRL::ComPtr<ID3D12PipelineState> CreateGraphicsPipeline(
+		const std::wstring& name, const D3D12_GRAPHICS_PIPELINE_STATE_DESC& desc);
+
+	// Writes the library back if anything was added since Open.
+	void Save();
+
+	UINT HitCount()const;
+	UINT MissCount()const;
+
+private:
+	void Reset();
+
+private:
+	ID3D12Device* mDevice = nullptr;
+	Microsoft::WRL::ComPtr<ID3D12Device1> mDevice1;
+	Microsoft::WRL::ComPtr<ID3D12PipelineLibrary> mLibrary;
+
+	// The library reads from this memory for as long as it exists.
+	Microsoft::WRL::ComPtr<ID3DBlob> mSerialized;
+
+	// Every PSO handed out, so they can be stored again if the library is rebuilt.
+	std::unordered_map<std::wstring, Microsoft::WRL::ComPtr<ID3D12PipelineState>> mPipelines;
+
+	std::wstring mFilename;
+	bool mDirty = false;
+	UINT mHitCount = 0;
+	UINT mMissCount = 0;
+};
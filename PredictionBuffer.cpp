@@ -0,0 +1,99 @@
+//***************************************************************************************
+// PredictionBuffer.cpp
+//***************************************************************************************
+
+#include "PredictionBuffer.h"
+
+using namespace DirectX;
+
+static_assert((PredictionBuffer::Capacity & (PredictionBuffer::Capacity - 1)) == 0, "Capacity must be a power of two.");
+
+// Differences smaller than this are float noise, not a misprediction.
+static const float kCorrectionEpsilon = 0.001f;
+
+uint8_t PredictionBuffer::PackKeys(bool A, bool D, bool W, bool S)
+{
+	return (A ? KeyA : 0) | (D ? KeyD : 0) | (W ? KeyW : 0) | (S ? KeyS : 0);
+}
+
+void PredictionBuffer::ApplyInput(uint8_t keys, float dt, XMFLOAT3& position)
+{
+	if (keys & KeyA) position.x -= 1.0f * dt;
+	if (keys & KeyD) position.x += 1.0f * dt;
+	if (keys & KeyW) position.y += 1.0f * dt;
+	if (keys & KeyS) position.y -= 1.0f * dt;
+	position.y = position.y > 0.0f ? position.y : 0.0f;
+}
+
+uint32_t PredictionBuffer::Record(uint8_t keys, float dt, const XMFLOAT3& position)
+{
+	PredictedInput& input = mInputs[mNextSeq & (Capacity - 1)];
+	input.Seq = mNextSeq;
+	input.Keys = keys;
+	input.Dt = dt;
+	input.Position = position;
+
+	return mNextSeq++;
+}
+
+bool PredictionBuffer::Reconcile(uint32_t ackSeq, const XMFLOAT3& authoritative, XMFLOAT3& position)
+{
+	// Snapshots can arrive out of order; an older ack has nothing new to say.
+	if (static_cast<int32_t>(ackSeq - mAckedSeq) <= 0)
+		return false;
+
+	// Nor does one for an input we never sent.
+	if (static_cast<int32_t>(mNextSeq - 1 - ackSeq) < 0)
+		return false;
+	mAckedSeq = ackSeq;
+
+	// If the acked input is still buffered and we predicted it correctly, every later
+	// prediction built on it is still valid.
+	const PredictedInput& acked = mInputs[ackSeq & (Capacity - 1)];
+	if (acked.Seq == ackSeq)
+	{
+		float dx = authoritative.x - acked.Position.x;
+		float dy = authoritative.y - acked.Position.y;
+		float dz = authoritative.z - acked.Position.z;
+		if (dx * dx + dy * dy + dz * dz < kCorrectionEpsilon * kCorrectionEpsilon)
+			return false;
+	}
+
+	// Replay is a handful of adds per input, so even a full buffer costs next to nothing.
+	// Inputs that already fell out of the buffer are lost; start at the oldest one left.
+	uint32_t first = ackSeq + 1;
+	if (mNextSeq - first > Capacity)
+		first = mNextSeq - Capacity;
+
+	XMFLOAT3 replayed = authoritative;
+	for (uint32_t seq = first; seq != mNextSeq; ++seq)
+	{
+		PredictedInput& input = mInputs[seq & (Capacity - 1)];
+		if (input.Seq != seq)
+			continue;
+
+		ApplyInput(input.Keys, input.Dt, replayed);
+		input.Position = replayed;
+	}
+
+	position = replayed;
+	++mCorrectionCount;
+	return true;
+}
+
+void PredictionBuffer::Reset()
+{
+	for (PredictedInput& input : mInputs)
+		input.Seq = 0;
+	mAckedSeq = mNextSeq - 1;
+}
+
+uint32_t PredictionBuffer::PendingCount()const
+{
+	return mNextSeq - 1 - mAckedSeq;
+}
+
+uint64_t PredictionBuffer::CorrectionCount()const
+{
+	return mCorrectionCount;
+}
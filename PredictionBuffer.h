@@ -0,0 +1,66 @@
+//***************************************************************************************
+// PredictionBuffer.h
+//
+// Client-side prediction for the local player.  Every input the client applies is
+// recorded with a sequence number and the position it produced.  When a snapshot
+// arrives, the server's position for the last acknowledged input is compared with
+// what we predicted for it; on a mismatch the player is rewound to the server's
+// position and every input the server has not seen yet is replayed on top.
+//***************************************************************************************
+
+#pragma once
+
+#include <DirectXMath.h>
+#include <array>
+#include <cstdint>
+
+class PredictionBuffer
+{
+public:
+	// Inputs kept for replay.  Must cover the worst round trip we care about at the
+	// highest frame rate; 512 frames is over two seconds at 240 Hz.
+	static const uint32_t Capacity = 512;
+
+	// Bits of PredictedInput::Keys.
+	static const uint8_t KeyA = 1 << 0;
+	static const uint8_t KeyD = 1 << 1;
+	static const uint8_t KeyW = 1 << 2;
+	static const uint8_t KeyS = 1 << 3;
+
+	struct PredictedInput
+	{
+		uint32_t Seq = 0;
+		uint8_t Keys = 0;
+		float Dt = 0.0f;
+
+		// Predicted position after this input was applied.
+		DirectX::XMFLOAT3 Position = { 0.0f, 0.0f, 0.0f };
+	};
+
+	static uint8_t PackKeys(bool A, bool D, bool W, bool S);
+
+	// The movement rule shared by live input and replay.  The server runs the same
+	// rule, so the two only diverge when the server overrides us.
+	static void ApplyInput(uint8_t keys, float dt, DirectX::XMFLOAT3& position);
+
+	// Records an input that has already been applied and returns its sequence number.
+	uint32_t Record(uint8_t keys, float dt, const DirectX::XMFLOAT3& position);
+
+	// Rewinds to the server's position for ackSeq and replays every later input into
+	// position.  Returns true if the prediction was wrong and position was corrected.
+	bool Reconcile(uint32_t ackSeq, const DirectX::XMFLOAT3& authoritative, DirectX::XMFLOAT3& position);
+
+	// Forgets every unacknowledged input, so acks for them correct nothing.  Sequence
+	// numbers carry on, since the server has seen some of them already.
+	void Reset();
+
+	uint32_t PendingCount()const;
+	uint64_t CorrectionCount()const;
+
+private:
+	std::array<PredictedInput, Capacity> mInputs;
+
+	uint32_t mNextSeq = 1;
+	uint32_t mAckedSeq = 0;
+	uint64_t mCorrectionCount = 0;
+};
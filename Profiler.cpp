@@ -0,0 +1,354 @@
+//***************************************************************************************
+// Profiler.cpp
+//***************************************************************************************
+
+#include "Profiler.h"
+#include <mutex>
+
+using Microsoft::WRL::ComPtr;
+
+namespace
+{
+	struct Event
+	{
+		const char* Name = nullptr;
+		int64_t Start = 0;
+		int64_t End = 0;
+	};
+
+	struct Track
+	{
+		std::string Name;
+		uint32_t Id = 0;
+		std::unique_ptr<Event[]> Events{ new Event[Profiler::EventsPerTrack] };
+
+		// Events ever recorded.  The writer bumps it after each store.
+		std::atomic<uint64_t> Count{ 0 };
+	};
+
+	// Events a reader leaves alone at the old end of a ring, in case the writer laps
+	// it while it reads.
+	const uint32_t kReadMargin = 256;
+
+	std::mutex gTrackMutex;
+	std::vector<std::unique_ptr<Track>> gTracks;
+	thread_local Track* tThreadTrack = nullptr;
+
+	double TicksPerMs()
+	{
+		static const double ticksPerMs = []()
+		{
+			LARGE_INTEGER frequency;
+			QueryPerformanceFrequency(&frequency);
+			return frequency.QuadPart / 1000.0;
+		}();
+		return ticksPerMs;
+	}
+
+	Track* AddTrack(const std::string& name)
+	{
+		std::lock_guard<std::mutex> lock(gTrackMutex);
+		auto track = std::make_unique<Track>();
+		track->Id = (uint32_t)gTracks.size();
+		track->Name = name;
+		gTracks.push_back(std::move(track));
+		return gTracks.back().get();
+	}
+
+	Track* ThreadTrack()
+	{
+		if (tThreadTrack == nullptr)
+			tThreadTrack = AddTrack("Thread " + std::to_string(GetCurrentThreadId()));
+		return tThreadTrack;
+	}
+
+	void Push(Track* track, const char* name, int64_t start, int64_t end)
+	{
+		uint64_t count = track->Count.load(std::memory_order_relaxed);
+		Event& e = track->Events[count % Profiler::EventsPerTrack];
+		e.Name = name;
+		e.Start = start;
+		e.End = end;
+		track->Count.store(count + 1, std::memory_order_release);
+	}
+
+	// Calls visit(event) for each event of track that is safe to read, oldest first.
+	template<typename Visit>
+	void ForEachEvent(const Track& track, Visit visit)
+	{
+		uint64_t count = track.Count.load(std::memory_order_acquire);
+		uint64_t available = count < Profiler::EventsPerTrack ? count : Profiler::EventsPerTrack - kReadMargin;
+		for (uint64_t i = count - available; i < count; ++i)
+			visit(track.Events[i % Profiler::EventsPerTrack]);
+	}
+
+	void AppendJsonString(std::string& out, const std::string& text)
+	{
+		out += '"';
+		for (char c : text)
+		{
+			if (c == '"' || c == '\\')
+				out += '\\';
+			out += c;
+		}
+		out += '"';
+	}
+}
+
+int64_t Profiler::Now()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+double Profiler::TicksToMs(int64_t ticks)
+{
+	return ticks / TicksPerMs();
+}
+
+void Profiler::SetThreadName(const char* name)
+{
+	Track* track = ThreadTrack();
+	std::lock_guard<std::mutex> lock(gTrackMutex);
+	track->Name = name;
+}
+
+uint32_t Profiler::CreateTrack(const char* name)
+{
+	return AddTrack(name)->Id;
+}
+
+void Profiler::Record(const char* name, int64_t start, int64_t end)
+{
+	Push(ThreadTrack(), name, start, end);
+}
+
+void Profiler::Record(uint32_t track, const char* name, int64_t start, int64_t end)
+{
+	Track* t = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(gTrackMutex);
+		t = gTracks[track].get();
+	}
+	Push(t, name, start, end);
+}
+
+void Profiler::Summarize(const char* trackName, double windowSeconds, std::vector<ScopeSummary>& scopes)
+{
+	scopes.clear();
+
+	std::lock_guard<std::mutex> lock(gTrackMutex);
+	const Track* track = nullptr;
+	for (const auto& t : gTracks)
+	{
+		if (t->Name == trackName)
+			track = t.get();
+	}
+	if (track == nullptr)
+		return;
+
+	int64_t since = Now() - (int64_t)(windowSeconds * 1000.0 * TicksPerMs());
+	ForEachEvent(*track, [&](const Event& e)
+	{
+		if (e.Start < since || e.Name == nullptr)
+			return;
+
+		auto it = std::find_if(scopes.begin(), scopes.end(), [&](const ScopeSummary& s) { return s.Name == e.Name; });
+		if (it == scopes.end())
+		{
+			scopes.push_back(ScopeSummary());
+			it = scopes.end() - 1;
+			it->Name = e.Name;
+		}
+		it->TotalMs += TicksToMs(e.End - e.Start);
+		++it->Count;
+	});
+}
+
+bool Profiler::WriteChromeTrace(const std::wstring& filename)
+{
+	std::string json = "{\"traceEvents\":[\n";
+	bool first = true;
+	auto separator = [&]()
+	{
+		if (!first)
+			json += ",\n";
+		first = false;
+	};
+
+	{
+		std::lock_guard<std::mutex> lock(gTrackMutex);
+
+		// Times are in microseconds from the oldest event kept.
+		int64_t origin = INT64_MAX;
+		for (const auto& track : gTracks)
+			ForEachEvent(*track, [&](const Event& e) { origin = (std::min)(origin, e.Start); });
+
+		for (const auto& track : gTracks)
+		{
+			separator();
+			json += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + std::to_string(track->Id) +
+				",\"args\":{\"name\":";
+			AppendJsonString(json, track->Name);
+			json += "}}";
+
+			ForEachEvent(*track, [&](const Event& e)
+			{
+				if (e.Name == nullptr)
+					return;
+
+				char line[256];
+				snprintf(line, sizeof(line), "{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"name\":",
+					track->Id, TicksToMs(e.Start - origin) * 1000.0, TicksToMs(e.End - e.Start) * 1000.0);
+				separator();
+				json += line;
+				AppendJsonString(json, e.Name);
+				json += '}';
+			});
+		}
+	}
+
+	json += "\n]}\n";
+	return d3dUtil::SaveBinary(filename, json.data(), json.size());
+}
+
+//
+// GpuProfiler
+//
+
+void GpuProfiler::Initialize(ID3D12Device* device, ID3D12CommandQueue* queue, UINT frameCount,
+	const std::vector<const char*>& rangeNames)
+{
+	mQueue = queue;
+	mFrameCount = frameCount;
+	mRangeNames = rangeNames;
+
+	// A start and an end timestamp for every range of every frame.
+	UINT queryCount = frameCount * RangeCount() * 2;
+
+	D3D12_QUERY_HEAP_DESC heapDesc = {};
+	heapDesc.Type = D3D12_QUERY_HEAP_TYPE_TIMESTAMP;
+	heapDesc.Count = queryCount;
+	ThrowIfFailed(device->CreateQueryHeap(&heapDesc, IID_PPV_ARGS(mQueryHeap.GetAddressOf())));
+
+	ThrowIfFailed(device->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
+		D3D12_HEAP_FLAG_NONE,
+		&CD3DX12_RESOURCE_DESC::Buffer(queryCount * sizeof(UINT64)),
+		D3D12_RESOURCE_STATE_COPY_DEST,
+		nullptr,
+		IID_PPV_ARGS(mReadback.GetAddressOf())));
+
+	ThrowIfFailed(queue->GetTimestampFrequency(&mTimestampFrequency));
+	ThrowIfFailed(queue->GetClockCalibration(&mGpuCalibration, &mCpuCalibration));
+	mLastCalibration = Profiler::Now();
+
+	mWritten.reset(new std::atomic<bool>[frameCount * RangeCount()]);
+	for (UINT i = 0; i < frameCount * RangeCount(); ++i)
+		mWritten[i] = false;
+	mResolved.assign(frameCount * RangeCount(), false);
+	mAverageMs.assign(RangeCount(), 0.0f);
+	mTrack = Profiler::CreateTrack("GPU");
+}
+
+void GpuProfiler::BeginFrame(UINT frameIndex)
+{
+	for (UINT range = 0; range < RangeCount(); ++range)
+	{
+		mWritten[frameIndex * RangeCount() + range] = false;
+		mResolved[frameIndex * RangeCount() + range] = false;
+	}
+}
+
+void GpuProfiler::BeginRange(ID3D12GraphicsCommandList* cmdList, UINT frameIndex, UINT range)
+{
+	cmdList->EndQuery(mQueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, QueryIndex(frameIndex, range));
+}
+
+void GpuProfiler::EndRange(ID3D12GraphicsCommandList* cmdList, UINT frameIndex, UINT range)
+{
+	cmdList->EndQuery(mQueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, QueryIndex(frameIndex, range) + 1);
+	mWritten[frameIndex * RangeCount() + range] = true;
+}
+
+void GpuProfiler::Resolve(ID3D12GraphicsCommandList* cmdList, UINT frameIndex)
+{
+	// Resolving a query that was never written is invalid, and culled layers skip
+	// theirs, so resolve each written range on its own.
+	for (UINT range = 0; range < RangeCount(); ++range)
+	{
+		UINT slot = frameIndex * RangeCount() + range;
+		if (!mWritten[slot])
+			continue;
+
+		UINT query = QueryIndex(frameIndex, range);
+		cmdList->ResolveQueryData(mQueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, query, 2,
+			mReadback.Get(), query * sizeof(UINT64));
+		mResolved[slot] = true;
+	}
+}
+
+void GpuProfiler::Collect(UINT frameIndex)
+{
+	// Clocks drift apart slowly; recalibrating once a second keeps traces aligned.
+	int64_t now = Profiler::Now();
+	if (Profiler::TicksToMs(now - mLastCalibration) > 1000.0)
+	{
+		ThrowIfFailed(mQueue->GetClockCalibration(&mGpuCalibration, &mCpuCalibration));
+		mLastCalibration = now;
+	}
+
+	UINT first = QueryIndex(frameIndex, 0);
+	CD3DX12_RANGE readRange(first * sizeof(UINT64), (first + RangeCount() * 2) * sizeof(UINT64));
+	UINT64* timestamps = nullptr;
+	ThrowIfFailed(mReadback->Map(0, &readRange, reinterpret_cast<void**>(&timestamps)));
+
+	LARGE_INTEGER qpcFrequency;
+	QueryPerformanceFrequency(&qpcFrequency);
+	double gpuToQpc = (double)qpcFrequency.QuadPart / mTimestampFrequency;
+
+	for (UINT range = 0; range < RangeCount(); ++range)
+	{
+		// Ranges a frame skipped count as free, so a culled pass decays to 0.
+		float ms = 0.0f;
+		if (mResolved[frameIndex * RangeCount() + range])
+		{
+			UINT query = QueryIndex(frameIndex, range);
+			UINT64 start = timestamps[query];
+			UINT64 end = timestamps[query + 1];
+			ms = (float)((end - start) * 1000.0 / mTimestampFrequency);
+
+			int64_t cpuStart = (int64_t)mCpuCalibration + (int64_t)(((int64_t)(start - mGpuCalibration)) * gpuToQpc);
+			int64_t cpuEnd = (int64_t)mCpuCalibration + (int64_t)(((int64_t)(end - mGpuCalibration)) * gpuToQpc);
+			Profiler::Record(mTrack, mRangeNames[range], cpuStart, cpuEnd);
+		}
+
+		mAverageMs[range] += 0.05f * (ms - mAverageMs[range]);
+	}
+
+	CD3DX12_RANGE writeRange(0, 0);
+	mReadback->Unmap(0, &writeRange);
+
+	BeginFrame(frameIndex);
+}
+
+UINT GpuProfiler::RangeCount()const
+{
+	return (UINT)mRangeNames.size();
+}
+
+const char* GpuProfiler::RangeName(UINT range)const
+{
+	return mRangeNames[range];
+}
+
+float GpuProfiler::AverageMs(UINT range)const
+{
+	return mAverageMs[range];
+}
+
+UINT GpuProfiler::QueryIndex(UINT frameIndex, UINT range)const
+{
+	return (frameIndex * RangeCount() + range) * 2;
+}
@@ -0,0 +1,139 @@
+//***************************************************************************************
+// Profiler.h
+//
+// Frame profiler.
+//
+// CPU side: PROFILE_SCOPE("name") times the rest of the enclosing block with
+// QueryPerformanceCounter.  Every thread that records gets its own track, a ring of
+// the last EventsPerTrack events that only that thread writes, so recording is two
+// counter reads and a store with no lock.  Names must be string literals; scopes
+// are grouped by pointer.
+//
+// GPU side: GpuProfiler writes a timestamp query before and after each named range
+// of command list work, one query block per frame resource.  A block is resolved at
+// the end of its frame and read back once that frame resource's fence has passed,
+// so results lag by the frame latency and never stall the CPU.  Collected ranges
+// are smoothed into a rolling average and, converted to CPU time, added to a "GPU"
+// track so they line up with the CPU scopes in a trace.
+//
+// WriteChromeTrace dumps every track as Chrome trace event JSON, which loads in
+// chrome://tracing or ui.perfetto.dev.  Tracks are read while other threads may be
+// recording; the oldest events of a busy track can be torn and are skipped.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+#include <atomic>
+
+namespace Profiler
+{
+	// Events each track keeps before the oldest are overwritten.
+	const uint32_t EventsPerTrack = 8192;
+
+	struct ScopeSummary
+	{
+		const char* Name = nullptr;
+		double TotalMs = 0.0;
+		uint32_t Count = 0;
+	};
+
+	int64_t Now();
+	double TicksToMs(int64_t ticks);
+
+	// Names the calling thread's track.
+	void SetThreadName(const char* name);
+
+	// Creates a track that is not tied to a thread.  Only one thread may record to it.
+	uint32_t CreateTrack(const char* name);
+
+	void Record(const char* name, int64_t start, int64_t end);
+	void Record(uint32_t track, const char* name, int64_t start, int64_t end);
+
+	// Time spent in each scope the named track recorded over the last windowSeconds,
+	// in order of first appearance.
+	void Summarize(const char* trackName, double windowSeconds, std::vector<ScopeSummary>& scopes);
+
+	bool WriteChromeTrace(const std::wstring& filename);
+}
+
+class ProfileScope
+{
+public:
+	explicit ProfileScope(const char* name)
+		: mName(name), mStart(Profiler::Now())
+	{
+	}
+	ProfileScope(const ProfileScope& rhs) = delete;
+	ProfileScope& operator=(const ProfileScope& rhs) = delete;
+
+	~ProfileScope()
+	{
+		Profiler::Record(mName, mStart, Profiler::Now());
+	}
+
+private:
+	const char* mName;
+	int64_t mStart;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+
+class GpuProfiler
+{
+public:
+	GpuProfiler() = default;
+	GpuProfiler(const GpuProfiler& rhs) = delete;
+	GpuProfiler& operator=(const GpuProfiler& rhs) = delete;
+
+	// One query block per frame resource, with room for rangeNames.size() ranges.
+	// Names must be string literals.
+	void Initialize(ID3D12Device* device, ID3D12CommandQueue* queue, UINT frameCount,
+		const std::vector<const char*>& rangeNames);
+
+	// Forgets what frame frameIndex recorded before reusing its block.
+	void BeginFrame(UINT frameIndex);
+
+	// Any thread, but each range from one thread per frame.
+	void BeginRange(ID3D12GraphicsCommandList* cmdList, UINT frameIndex, UINT range);
+	void EndRange(ID3D12GraphicsCommandList* cmdList, UINT frameIndex, UINT range);
+
+	// Records the resolve of every range frameIndex wrote.  Goes in the frame's last
+	// command list.
+	void Resolve(ID3D12GraphicsCommandList* cmdList, UINT frameIndex);
+
+	// Once frameIndex's fence has completed: reads back what Resolve copied.
+	void Collect(UINT frameIndex);
+
+	UINT RangeCount()const;
+	const char* RangeName(UINT range)const;
+
+	// Smoothed over the last several frames; 0 for a range not recorded lately.
+	float AverageMs(UINT range)const;
+
+private:
+	UINT QueryIndex(UINT frameIndex, UINT range)const;
+
+private:
+	Microsoft::WRL::ComPtr<ID3D12QueryHeap> mQueryHeap;
+	Microsoft::WRL::ComPtr<ID3D12Resource> mReadback;
+	ID3D12CommandQueue* mQueue = nullptr;
+	UINT64 mTimestampFrequency = 1;
+
+	// GPU timestamp and QPC value read at the same moment, refreshed while collecting,
+	// to place GPU ranges on the CPU timeline.
+	UINT64 mGpuCalibration = 0;
+	UINT64 mCpuCalibration = 0;
+	int64_t mLastCalibration = 0;
+
+	std::vector<const char*> mRangeNames;
+	UINT mFrameCount = 0;
+
+	// [frame][range]: whether the range was written, and whether it was resolved.
+	std::unique_ptr<std::atomic<bool>[]> mWritten;
+	std::vector<bool> mResolved;
+	std::vector<float> mAverageMs;
+	uint32_t mTrack = 0;
+};
@@ -0,0 +1,207 @@
+//***************************************************************************************
+// ReliableChannel.cpp
+//***************************************************************************************
+
+#include "ReliableChannel.h"
+
+using namespace NetProtocol;
+
+static_assert(256 % ReliableChannel::SendWindow == 0, "Message ids must wrap onto whole windows.");
+
+// Bounds on the retransmit timeout.  The initial value is used until the first RTT
+// sample; RFC 6298 suggests 1 s, which is too slow for a join on a LAN.
+static const float kInitialRtoMs = 250.0f;
+static const float kMinRtoMs = 50.0f;
+static const float kMaxRtoMs = 2000.0f;
+
+bool ReliableChannel::SendReliable(const uint8_t* data, size_t length)
+{
+	if (length > MaxReliableSize)
+		return false;
+
+	std::lock_guard<std::mutex> guard(mMutex);
+
+	OutgoingMessage& slot = mOutgoing[mNextMessageId % SendWindow];
+	if (slot.InUse)
+		return false;
+
+	slot.InUse = true;
+	slot.Id = mNextMessageId++;
+	slot.LastSentMs = 0;
+	slot.SendCount = 0;
+	slot.Length = static_cast<uint16_t>(length);
+	memcpy(slot.Data, data, length);
+	return true;
+}
+
+bool ReliableChannel::HasDue(uint32_t nowMs)
+{
+	std::lock_guard<std::mutex> guard(mMutex);
+
+	uint32_t rto = RetransmitTimeoutMs();
+	for (const OutgoingMessage& message : mOutgoing)
+	{
+		if (message.InUse && (message.SendCount == 0 || nowMs - message.LastSentMs >= rto))
+			return true;
+	}
+	return false;
+}
+
+bool ReliableChannel::HasUnacked()
+{
+	std::lock_guard<std::mutex> guard(mMutex);
+
+	for (const OutgoingMessage& message : mOutgoing)
+	{
+		if (message.InUse)
+			return true;
+	}
+	return false;
+}
+
+size_t ReliableChannel::Seal(uint8_t* data, size_t length, size_t capacity, uint32_t nowMs)
+{
+	std::lock_guard<std::mutex> guard(mMutex);
+
+	uint16_t seq = mNextSeq++;
+	if (mNextSeq == 0)
+		mNextSeq = 1;
+
+	WriteHeader(data, PacketType::Channel, ChannelHeaderSize);
+	StoreU16(data + 4, seq);
+	StoreU16(data + 6, mHasReceived ? mRemoteSeq : 0);
+	StoreU32(data + 8, mHasReceived ? mRemoteAckBits : 0);
+
+	SentDatagram& sent = mSent[seq % 256];
+	sent.Seq = seq;
+	sent.Valid = true;
+	sent.Acked = false;
+	sent.SentMs = nowMs;
+	sent.ReliableCount = 0;
+
+	// Oldest messages first, so a backlog drains in order.
+	uint32_t rto = RetransmitTimeoutMs();
+	for (uint16_t i = 0; i < SendWindow && sent.ReliableCount < MaxReliablePerDatagram; ++i)
+	{
+		OutgoingMessage& message = mOutgoing[static_cast<uint16_t>(mNextMessageId - SendWindow + i) % SendWindow];
+		if (!message.InUse)
+			continue;
+
+		bool due = message.SendCount == 0 || nowMs - message.LastSentMs >= rto;
+		size_t wrappedLength = ReliableHeaderSize + message.Length;
+		if (!due || length + wrappedLength > capacity)
+			continue;
+
+		WriteHeader(data + length, PacketType::Reliable, wrappedLength);
+		StoreU16(data + length + 4, message.Id);
+		memcpy(data + length + ReliableHeaderSize, message.Data, message.Length);
+		length += wrappedLength;
+
+		if (message.SendCount > 0)
+			++mRetransmitCount;
+		++message.SendCount;
+		message.LastSentMs = nowMs;
+
+		sent.ReliableIds[sent.ReliableCount++] = message.Id;
+	}
+
+	return length;
+}
+
+bool ReliableChannel::ReceiveHeader(const uint8_t* data, size_t length, uint32_t nowMs)
+{
+	PacketType type;
+	if (ReadHeader(data, length, type) < ChannelHeaderSize || type != PacketType::Channel)
+		return false;
+
+	uint16_t seq = LoadU16(data + 4);
+	uint16_t ack = LoadU16(data + 6);
+	uint32_t ackBits = LoadU32(data + 8);
+
+	std::lock_guard<std::mutex> guard(mMutex);
+
+	// Fold this datagram into what we ack back.
+	if (!mHasReceived)
+	{
+		mHasReceived = true;
+		mRemoteSeq = seq;
+		mRemoteAckBits = 0;
+	}
+	else
+	{
+		int16_t diff = static_cast<int16_t>(seq - mRemoteSeq);
+		if (diff > 0)
+		{
+			// At exactly 32 ahead the old mRemoteSeq still fits, in bit 31.
+			mRemoteAckBits = diff <= 32 ? ((diff < 32 ? mRemoteAckBits << diff : 0) | (1u << (diff - 1))) : 0;
+			mRemoteSeq = seq;
+		}
+		else if (diff < 0 && diff >= -32)
+		{
+			mRemoteAckBits |= 1u << (-diff - 1);
+		}
+	}
+
+	// And apply what the other side acked of ours.
+	if (ack == 0)
+		return true;
+
+	OnDatagramAcked(ack, nowMs);
+	for (uint16_t i = 0; i < 32; ++i)
+	{
+		if (ackBits & (1u << i))
+			OnDatagramAcked(static_cast<uint16_t>(ack - 1 - i), nowMs);
+	}
+
+	return true;
+}
+
+void ReliableChannel::OnDatagramAcked(uint16_t seq, uint32_t nowMs)
+{
+	SentDatagram& sent = mSent[seq % 256];
+	if (!sent.Valid || sent.Seq != seq || sent.Acked)
+		return;
+	sent.Acked = true;
+
+	// Every datagram has its own seq, so unlike a retransmitted message an ack can
+	// never be matched to the wrong send and every sample is usable.
+	float sample = static_cast<float>(nowMs - sent.SentMs);
+	if (!mHasRtt)
+	{
+		mHasRtt = true;
+		mSrtt = sample;
+		mRttVar = sample / 2.0f;
+	}
+	else
+	{
+		float error = sample - mSrtt;
+		mRttVar += ((error < 0.0f ? -error : error) - mRttVar) / 4.0f;
+		mSrtt += error / 8.0f;
+	}
+
+	for (int i = 0; i < sent.ReliableCount; ++i)
+	{
+		OutgoingMessage& message = mOutgoing[sent.ReliableIds[i] % SendWindow];
+		if (message.InUse && message.Id == sent.ReliableIds[i])
+			message.InUse = false;
+	}
+}
+
+uint32_t ReliableChannel::RetransmitTimeoutMs()const
+{
+	float rto = mHasRtt ? mSrtt + 4.0f * mRttVar : kInitialRtoMs;
+	rto = rto < kMinRtoMs ? kMinRtoMs : (rto > kMaxRtoMs ? kMaxRtoMs : rto);
+	return static_cast<uint32_t>(rto);
+}
+
+float ReliableChannel::SmoothedRttMs()
+{
+	std::lock_guard<std::mutex> guard(mMutex);
+	return mSrtt;
+}
+
+uint64_t ReliableChannel::RetransmitCount()
+{
+	std::lock_guard<std::mutex> guard(mMutex);
+	return mRetransmitCount;
+}
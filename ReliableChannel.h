@@ -0,0 +1,162 @@
+//***************************************************************************************
+// ReliableChannel.h
+//
+// Lightweight reliability beside the unreliable movement stream.  Every datagram
+// starts with a Channel message carrying its own sequence number plus an ack of the
+// newest datagram received from the other side and a 32-bit field acking the 32
+// before it, so acks ride along on regular traffic.  Anything wrapped in a Reliable
+// message is kept until a datagram that carried it is acked, and is resent on its
+// own - never the whole datagram - once it has been outstanding for longer than the
+// retransmit timeout.  Reliable messages are delivered once each and in order.
+//
+// Round-trip time is measured from datagram acks and smoothed as in RFC 6298; the
+// retransmit timeout is SRTT + 4 * RTTVAR.
+//
+// Channel layout, following the common header:
+//   [4]  uint16 seq
+//   [6]  uint16 ack        0 = nothing received yet; seq 0 is never sent
+//   [8]  uint32 ackBits    bit i set = datagram (ack - 1 - i) was received
+//
+// Reliable layout, following the common header:
+//   [4]  uint16 messageId
+//   [6]  the wrapped message, common header included
+//
+// Sending (SendReliable, Seal) happens on the game thread and receiving on the
+// receiver thread.  The state both touch is guarded by mMutex; the in-order
+// delivery window is only ever used by the receiver thread.
+//***************************************************************************************
+
+#pragma once
+
+#include "NetProtocol.h"
+#include <mutex>
+
+class ReliableChannel
+{
+public:
+	static const size_t ChannelHeaderSize = 12;
+	static const size_t ReliableHeaderSize = 6;
+
+	// Largest message that can be sent reliably, and how many may be in flight.
+	static const size_t MaxReliableSize = NetProtocol::kMaxPacketSize;
+	static const uint16_t SendWindow = 32;
+
+	// Reliable messages a single datagram can carry.
+	static const int MaxReliablePerDatagram = 8;
+
+	// Queues a message for reliable delivery.  Returns false if it is too large or
+	// SendWindow messages are already waiting for acks.
+	bool SendReliable(const uint8_t* data, size_t length);
+
+	// Whether any reliable message is due to be sent by nowMs.
+	bool HasDue(uint32_t nowMs);
+
+	// Whether any reliable message is still waiting for an ack.
+	bool HasUnacked();
+
+	// Finishes a datagram.  data[0, ChannelHeaderSize) was reserved for the channel
+	// header; due reliable messages are appended after the first length bytes while
+	// they fit in capacity.  Returns the datagram's final length.
+	size_t Seal(uint8_t* data, size_t length, size_t capacity, uint32_t nowMs);
+
+	// Receiver thread.  Processes the Channel message at the front of a datagram.
+	// Returns false if data does not start with one.
+	bool ReceiveHeader(const uint8_t* data, size_t length, uint32_t nowMs);
+
+	// Receiver thread.  Buffers a Reliable message and calls deliver(data, length)
+	// for it and any later ones it unblocks, in messageId order.
+	template<typename Deliver>
+	void ReceiveReliable(const uint8_t* data, size_t length, Deliver deliver);
+
+	float SmoothedRttMs();
+	uint64_t RetransmitCount();
+
+private:
+	struct OutgoingMessage
+	{
+		bool InUse = false;
+		uint16_t Id = 0;
+		uint32_t LastSentMs = 0;
+		uint32_t SendCount = 0;
+		uint16_t Length = 0;
+		uint8_t Data[MaxReliableSize];
+	};
+
+	struct SentDatagram
+	{
+		uint16_t Seq = 0;
+		bool Valid = false;
+		bool Acked = false;
+		uint32_t SentMs = 0;
+		int ReliableCount = 0;
+		uint16_t ReliableIds[MaxReliablePerDatagram];
+	};
+
+	struct IncomingMessage
+	{
+		bool Present = false;
+		uint16_t Length = 0;
+		uint8_t Data[MaxReliableSize];
+	};
+
+	void OnDatagramAcked(uint16_t seq, uint32_t nowMs);
+	uint32_t RetransmitTimeoutMs()const;
+
+private:
+	std::mutex mMutex;
+
+	// Send side.
+	uint16_t mNextSeq = 1;
+	uint16_t mNextMessageId = 0;
+	OutgoingMessage mOutgoing[SendWindow];
+	SentDatagram mSent[256];
+
+	// What we have received, echoed in every header we send.
+	bool mHasReceived = false;
+	uint16_t mRemoteSeq = 0;
+	uint32_t mRemoteAckBits = 0;
+
+	// RFC 6298 estimators, in milliseconds.
+	bool mHasRtt = false;
+	float mSrtt = 0.0f;
+	float mRttVar = 0.0f;
+	uint64_t mRetransmitCount = 0;
+
+	// In-order delivery window; receiver thread only.
+	uint16_t mNextDeliverId = 0;
+	IncomingMessage mIncoming[SendWindow];
+};
+
+template<typename Deliver>
+void ReliableChannel::ReceiveReliable(const uint8_t* data, size_t length, Deliver deliver)
+{
+	if (length < ReliableHeaderSize || length - ReliableHeaderSize > MaxReliableSize)
+		return;
+
+	uint16_t id = NetProtocol::LoadU16(data + 4);
+
+	// Already delivered, or too far ahead for the window: a duplicate or garbage.
+	uint16_t ahead = static_cast<uint16_t>(id - mNextDeliverId);
+	if (ahead >= SendWindow)
+		return;
+
+	IncomingMessage& slot = mIncoming[id % SendWindow];
+	if (!slot.Present)
+	{
+		slot.Present = true;
+		slot.Length = static_cast<uint16_t>(length - ReliableHeaderSize);
+		memcpy(slot.Data, data + ReliableHeaderSize, slot.Length);
+	}
+
+	// Deliver everything that is now contiguous.
+	for (;;)
+	{
+		IncomingMessage& next = mIncoming[mNextDeliverId % SendWindow];
+		if (!next.Present)
+			break;
+
+		deliver(next.Data, static_cast<size_t>(next.Length));
+		next.Present = false;
+		++mNextDeliverId;
+	}
+}
@@ -0,0 +1,166 @@
+//***************************************************************************************
+// SendQueue.cpp
+//***************************************************************************************
+
+#include "SendQueue.h"
+
+SendQueue::~SendQueue()
+{
+	Stop();
+}
+
+void SendQueue::SetChannel(ReliableChannel* channel)
+{
+	mChannel = channel;
+	Reset();
+}
+
+void SendQueue::SetStats(NetStats* stats)
+{
+	mStats = stats;
+}
+
+void SendQueue::SetCapture(NetCaptureWriter* capture)
+{
+	mCapture = capture;
+}
+
+bool SendQueue::Start(SocketBackend* backend, const char* host, int port)
+{
+	addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+
+	addrinfo* result = nullptr;
+	if (getaddrinfo(host, nullptr, &hints, &result) != 0 || result == nullptr)
+		return false;
+
+	mDestAddr = *(const sockaddr_in*)result->ai_addr;
+	mDestAddr.sin_port = htons((u_short)port);
+	freeaddrinfo(result);
+
+	mBackend = backend;
+	mWakeEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+	if (mWakeEvent == nullptr)
+		return false;
+
+	mRunning = true;
+	mThread = std::thread([this]() { Run(); });
+	return true;
+}
+
+void SendQueue::Stop()
+{
+	if (mThread.joinable())
+	{
+		// Run drains whatever is still queued before it returns.
+		Flush();
+		mRunning = false;
+		SetEvent(mWakeEvent);
+		mThread.join();
+	}
+
+	if (mWakeEvent != nullptr)
+	{
+		CloseHandle(mWakeEvent);
+		mWakeEvent = nullptr;
+	}
+}
+
+bool SendQueue::Append(const uint8_t* data, size_t length)
+{
+	if (length > MaxDatagramSize - HeaderReserve() - (mChannel != nullptr ? ReliableReserve : 0))
+		return false;
+
+	size_t capacity = MaxDatagramSize - (mChannel != nullptr ? ReliableReserve : 0);
+	if (mPending.Length + length > capacity)
+		Flush();
+
+	memcpy(mPending.Data + mPending.Length, data, length);
+	mPending.Length += (uint16_t)length;
+	++mMessagesQueued;
+	return true;
+}
+
+void SendQueue::Flush()
+{
+	if (!mRunning)
+	{
+		// Nowhere to send it, and Append must still find room after a flush.
+		Reset();
+		return;
+	}
+
+	if (mChannel != nullptr)
+	{
+		uint32_t now = NetProtocol::NowMs();
+		if (mPending.Length == HeaderReserve() && !mChannel->HasDue(now))
+			return;
+
+		mPending.Length = (uint16_t)mChannel->Seal(mPending.Data, mPending.Length, MaxDatagramSize, now);
+	}
+	else if (mPending.Length == 0)
+	{
+		return;
+	}
+
+	// If the network thread has fallen 64 datagrams behind, the ring counts this one
+	// as an overflow and it is dropped like any lost datagram.  The channel notices
+	// the missing ack and resends any reliable message it carried.
+	mRing.TryPush(mPending);
+	Reset();
+	SetEvent(mWakeEvent);
+}
+
+void SendQueue::Reset()
+{
+	mPending.Length = (uint16_t)HeaderReserve();
+}
+
+size_t SendQueue::HeaderReserve()const
+{
+	return mChannel != nullptr ? ReliableChannel::ChannelHeaderSize : 0;
+}
+
+uint64_t SendQueue::MessagesQueued()const
+{
+	return mMessagesQueued;
+}
+
+uint64_t SendQueue::DatagramsSent()const
+{
+	return mDatagramsSent.load(std::memory_order_relaxed);
+}
+
+uint64_t SendQueue::DatagramsDropped()const
+{
+	return mRing.OverflowCount();
+}
+
+void SendQueue::Run()
+{
+	Datagram datagram;
+	for (;;)
+	{
+		WaitForSingleObject(mWakeEvent, INFINITE);
+
+		while (mRing.TryPop(datagram))
+		{
+			if (mBackend->SendTo((const char*)datagram.Data, datagram.Length, mDestAddr))
+			{
+				mDatagramsSent.fetch_add(1, std::memory_order_relaxed);
+				if (mStats != nullptr)
+				{
+					mStats->Add(NetStats::DatagramsOut);
+					mStats->Add(NetStats::BytesOut, datagram.Length);
+				}
+				if (mCapture != nullptr)
+					mCapture->Record(NetCaptureWriter::Sent, datagram.Data, datagram.Length);
+			}
+		}
+
+		if (!mRunning)
+			return;
+	}
+}
@@ -0,0 +1,99 @@
+//***************************************************************************************
+// SendQueue.h
+//
+// Outgoing message queue for the client socket.  The game thread appends encoded
+// messages during a tick; they are packed back to back into one datagram, up to
+// MaxDatagramSize, and handed to a dedicated network thread on Flush.  The server
+// address is resolved once in Start, so no send ever parses an address string, and
+// no socket call ever runs on the render thread.
+//
+// Every message starts with the common header, which carries its length, so the
+// receiver walks a datagram message by message.  With a ReliableChannel attached,
+// each datagram opens with the channel header and closes with whatever reliable
+// messages are due, and Flush sends a datagram for a due retransmit even when no
+// other message was appended.
+//***************************************************************************************
+
+#pragma once
+
+#include "SocketBackend.h"
+#include "SpscRing.h"
+#include "ReliableChannel.h"
+#include "NetStats.h"
+#include "NetCapture.h"
+#include <atomic>
+#include <thread>
+
+class SendQueue
+{
+public:
+	// Leaves room for IP and UDP headers inside a typical 1280-1500 byte path MTU.
+	static const size_t MaxDatagramSize = 1200;
+
+	SendQueue() = default;
+	SendQueue(const SendQueue& rhs) = delete;
+	SendQueue& operator=(const SendQueue& rhs) = delete;
+	~SendQueue();
+
+	// Resolves host once and starts the network thread.  backend must outlive Stop.
+	bool Start(SocketBackend* backend, const char* host, int port);
+	void Stop();
+
+	// Attaches a reliable channel to seal every datagram with.  Call before Start;
+	// channel must outlive Stop.
+	void SetChannel(ReliableChannel* channel);
+
+	// Counts every datagram the network thread sends, and its bytes, in stats.  Call
+	// before Start; stats must outlive Stop.
+	void SetStats(NetStats* stats);
+
+	// Records every datagram the network thread sends.  Call before Start; capture
+	// must outlive Stop.
+	void SetCapture(NetCaptureWriter* capture);
+
+	// Game thread only.  Adds one encoded message to the datagram being built,
+	// flushing first if it would not fit.
+	bool Append(const uint8_t* data, size_t length);
+
+	// Game thread only.  Hands the datagram being built, if any, to the network thread.
+	// Before Start, as when replaying a capture, the datagram is dropped instead.
+	void Flush();
+
+	uint64_t MessagesQueued()const;
+	uint64_t DatagramsSent()const;
+	uint64_t DatagramsDropped()const;
+
+private:
+	struct Datagram
+	{
+		uint16_t Length = 0;
+		uint8_t Data[MaxDatagramSize];
+	};
+
+	void Run();
+
+private:
+	void Reset();
+
+	// Bytes at the front of each datagram that the channel fills in on Flush.
+	size_t HeaderReserve()const;
+
+	// Room left when the channel seals a datagram, so retransmits still fit.
+	static const size_t ReliableReserve = 2 * (ReliableChannel::ReliableHeaderSize + ReliableChannel::MaxReliableSize);
+
+	SocketBackend* mBackend = nullptr;
+	ReliableChannel* mChannel = nullptr;
+	NetStats* mStats = nullptr;
+	NetCaptureWriter* mCapture = nullptr;
+	sockaddr_in mDestAddr = {};
+
+	Datagram mPending;
+	SpscRing<Datagram, 64> mRing;
+
+	HANDLE mWakeEvent = nullptr;
+	std::thread mThread;
+	std::atomic<bool> mRunning{ false };
+
+	uint64_t mMessagesQueued = 0;
+	std::atomic<uint64_t> mDatagramsSent{ 0 };
+};
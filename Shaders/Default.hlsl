@@ -20,7 +20,9 @@
 // Include structures and functions for lighting.
 #include "LightingUtil.hlsl"
 
-Texture2D    gDiffuseMap : register(t0);
+// Every texture of the scene in one table; materials pick theirs by index.  The
+// size must match gMaxTextures in StencilApp.cpp.
+Texture2D    gTextureMaps[128] : register(t0);
 
 
 SamplerState gsamPointWrap        : register(s0);
@@ -30,11 +32,37 @@ SamplerState gsamLinearClamp      : register(s3);
 SamplerState gsamAnisotropicWrap  : register(s4);
 SamplerState gsamAnisotropicClamp : register(s5);
 
-// Constant data that varies per frame.
-cbuffer cbPerObject : register(b0)
+struct InstanceData
 {
-    float4x4 gWorld;
-	float4x4 gTexTransform;
+	float4x4 World;
+	float4x4 TexTransform;
+};
+
+struct MaterialData
+{
+	float4   DiffuseAlbedo;
+	float3   FresnelR0;
+	float    Roughness;
+	float4x4 MatTransform;
+
+	// Streamed textures only have mips from MinLod on resident.
+	uint     DiffuseMapIndex;
+	float    MinLod;
+	uint     MatPad0;
+	uint     MatPad1;
+};
+
+// Every instance and every material of the frame.  Space1 keeps them clear of the
+// texture registers.
+StructuredBuffer<InstanceData> gInstanceData : register(t0, space1);
+StructuredBuffer<MaterialData> gMaterialData : register(t1, space1);
+
+// The only state that changes between draws: the material, and where the draw's
+// instances start, since SV_InstanceID counts from 0 for every draw.
+cbuffer cbDraw : register(b0)
+{
+	uint gMaterialIndex;
+	uint gBaseInstance;
 };
 
 // Constant data that varies per material.
@@ -68,14 +96,6 @@ cbuffer cbPass : register(b1)
     Light gLights[MaxLights];
 };
 
-cbuffer cbMaterial : register(b2)
-{
-	float4   gDiffuseAlbedo;
-    float3   gFresnelR0;
-    float    gRoughness;
-	float4x4 gMatTransform;
-};
-
 struct VertexIn
 {
 	float3 PosL    : POSITION;
@@ -91,30 +111,47 @@ struct VertexOut
 	float2 TexC    : TEXCOORD;
 };
 
-VertexOut VS(VertexIn vin)
+VertexOut VS(VertexIn vin, uint instanceID : SV_InstanceID)
 {
 	VertexOut vout = (VertexOut)0.0f;
+
+	// Fetch the instance and material data.
+	InstanceData instData = gInstanceData[gBaseInstance + instanceID];
+	MaterialData matData = gMaterialData[gMaterialIndex];
+	float4x4 world = instData.World;
+	float4x4 texTransform = instData.TexTransform;
 	
     // Transform to world space.
-    float4 posW = mul(float4(vin.PosL, 1.0f), gWorld);
+    float4 posW = mul(float4(vin.PosL, 1.0f), world);
     vout.PosW = posW.xyz;
 
     // Assumes nonuniform scaling; otherwise, need to use inverse-transpose of world matrix.
-    vout.NormalW = mul(vin.NormalL, (float3x3)gWorld);
+    vout.NormalW = mul(vin.NormalL, (float3x3)world);
 
     // Transform to homogeneous clip space.
     vout.PosH = mul(posW, gViewProj);
 	
 	// Output vertex attributes for interpolation across triangle.
-	float4 texC = mul(float4(vin.TexC, 0.0f, 1.0f), gTexTransform);
-	vout.TexC = mul(texC, gMatTransform).xy;
+	float4 texC = mul(float4(vin.TexC, 0.0f, 1.0f), texTransform);
+	vout.TexC = mul(texC, matData.MatTransform).xy;
 
     return vout;
 }
 
 float4 PS(VertexOut pin) : SV_Target
 {
-    float4 diffuseAlbedo = gDiffuseMap.Sample(gsamAnisotropicWrap, pin.TexC) * gDiffuseAlbedo;
+	// Fetch the material data.  gMaterialIndex is the same for the whole draw, so
+	// the texture index is uniform too.
+	MaterialData matData = gMaterialData[gMaterialIndex];
+	uint diffuseMapIndex = matData.DiffuseMapIndex;
+
+	// Streamed textures only have mips from MinLod on resident.  Scaling the
+	// gradients pushes the level of detail up to it without losing anisotropy.
+	float lod = gTextureMaps[diffuseMapIndex].CalculateLevelOfDetailUnclamped(gsamAnisotropicWrap, pin.TexC);
+	float gradScale = exp2(max(matData.MinLod - lod, 0.0f));
+	float2 texDdx = ddx(pin.TexC) * gradScale;
+	float2 texDdy = ddy(pin.TexC) * gradScale;
+    float4 diffuseAlbedo = gTextureMaps[diffuseMapIndex].SampleGrad(gsamAnisotropicWrap, pin.TexC, texDdx, texDdy) * matData.DiffuseAlbedo;
 	
 #ifdef ALPHA_TEST
 	// Discard pixel if texture alpha < 0.1.  We do this test as soon 
@@ -134,8 +171,8 @@ float4 PS(VertexOut pin) : SV_Target
     // Light terms.
     float4 ambient = gAmbientLight*diffuseAlbedo;
 
-    const float shininess = 1.0f - gRoughness;
-    Material mat = { diffuseAlbedo, gFresnelR0, shininess };
+    const float shininess = 1.0f - matData.Roughness;
+    Material mat = { diffuseAlbedo, matData.FresnelR0, shininess };
     float3 shadowFactor = 1.0f;
     float4 directLight = ComputeLighting(gLights, mat, pin.PosW,
         pin.NormalW, toEyeW, shadowFactor);
@@ -0,0 +1,423 @@
+//***************************************************************************************
+// SnapshotCodec.h
+//
+// Binary world snapshots.  Positions are quantized to 16-bit fixed point inside the
+// room bounds, health to 7 bits, and everything is bit-packed.  A snapshot can be
+// encoded against a baseline the client has acknowledged, in which case only the
+// fields that changed since that baseline are written.  With no baseline the same
+// encoding describes every field, which is the full-snapshot fallback.
+//
+// The server keeps the snapshots it sent to each client and encodes against the
+// newest one that client acknowledged, falling back to a full snapshot when it has
+// no ack or the acked snapshot is older than it keeps.  The client keeps the
+// snapshots it decoded so it can resolve any baseline the server picks, and acks
+// each one it decodes.
+//
+// Snapshots are filtered per client by area of interest.  A client subscribes with
+// where its camera is and a radius; players inside the radius are in every
+// snapshot, players outside it only in every farInterval-th, staggered by id so the
+// far ones spread over the snapshots between.  The subscriber itself is always
+// included.  connectedMask still names every connected player, so a player left out
+// of a snapshot is not mistaken for one who left.  A client that never subscribed
+// gets every player in every snapshot.
+//
+// Snapshot layout, following the common header:
+//   [4]  uint32 seq
+//   [8]  uint32 baselineSeq        0 = full snapshot
+//   [12] uint32 connectedMask      bit i set = player i is connected
+//   [16] bits   presentMask:32     bit i set = player i is in the snapshot
+//        for each present player, in id order:
+//          bits changedMask:6      x, y, z, health, ack, name
+//          bits x:16, y:16, z:16   if changed
+//          bits health:7           if changed
+//          bits ack:32             if changed
+//          bits nameLength:5, name:8 * nameLength   if changed
+//
+// Ack layout, following the common header:
+//   [4]  uint16 playerId
+//   [6]  uint32 snapshotSeq
+//
+// Subscribe layout, following the common header:
+//   [4]  uint16 playerId
+//   [6]  uint8  farInterval        0 = never send players outside the radius
+//   [7]  uint8  reserved
+//   [8]  float  x, y, z            centre of interest, the camera position
+//   [20] float  radius             <= 0 = every player in every snapshot
+//
+// Sent unreliably; clients resend it as the camera moves and once a second.
+//***************************************************************************************
+
+#pragma once
+
+#include "NetProtocol.h"
+
+namespace NetProtocol
+{
+	const size_t kSnapshotFixedSize = 16;
+	const size_t kAckSize = 10;
+	const size_t kSubscribeSize = 24;
+
+	// What clients subscribe with unless told otherwise.  The room is about 36 by 30,
+	// so the radius covers most of it from the middle.
+	const float kDefaultInterestRadius = 25.0f;
+	const uint8_t kDefaultFarInterval = 4;
+
+	static_assert(kMaxPlayers <= 32, "presentMask holds one bit per player.");
+
+	// Room bounds that positions are quantized within.  Anything outside is clamped.
+	const float kWorldMinX = -14.0f, kWorldMaxX = 22.0f;
+	const float kWorldMinY = 0.0f, kWorldMaxY = 10.0f;
+	const float kWorldMinZ = -15.0f, kWorldMaxZ = 15.0f;
+	const unsigned kPositionBits = 16;
+
+	const unsigned kHealthBits = 7;
+	const unsigned kNameLengthBits = 5;
+
+	static_assert(kMaxNameLength < (1u << kNameLengthBits), "nameLength field too narrow.");
+
+	enum SnapshotField : uint32_t
+	{
+		FieldX = 1 << 0,
+		FieldY = 1 << 1,
+		FieldZ = 1 << 2,
+		FieldHealth = 1 << 3,
+		FieldAck = 1 << 4,
+		FieldName = 1 << 5,
+		FieldCount = 6
+	};
+
+	struct WorldSnapshot
+	{
+		uint32_t seq = 0;
+		uint32_t connectedMask = 0;
+		uint32_t presentMask = 0;
+		PlayerState players[kMaxPlayers];
+	};
+
+	struct Subscription
+	{
+		uint16_t playerId = 0;
+		uint8_t farInterval = kDefaultFarInterval;
+		float x = 0.0f;
+		float y = 0.0f;
+		float z = 0.0f;
+		float radius = 0.0f;
+	};
+
+	// Sequential bit writer over a caller-provided buffer, least significant bit first.
+	class BitWriter
+	{
+	public:
+		BitWriter(uint8_t* data, size_t capacity) : mData(data), mCapacity(capacity) {}
+
+		void Write(uint32_t value, unsigned bits)
+		{
+			while (bits > 0)
+			{
+				size_t byte = mBitPos >> 3;
+				if (byte >= mCapacity)
+				{
+					mOverflow = true;
+					return;
+				}
+
+				unsigned shift = mBitPos & 7;
+				unsigned take = (8 - shift) < bits ? (8 - shift) : bits;
+				if (shift == 0)
+					mData[byte] = 0;
+				mData[byte] |= static_cast<uint8_t>((value & ((1u << take) - 1)) << shift);
+
+				value >>= take;
+				bits -= take;
+				mBitPos += take;
+			}
+		}
+
+		size_t BytesUsed()const { return (mBitPos + 7) >> 3; }
+		bool Overflowed()const { return mOverflow; }
+
+	private:
+		uint8_t* mData;
+		size_t mCapacity;
+		size_t mBitPos = 0;
+		bool mOverflow = false;
+	};
+
+	class BitReader
+	{
+	public:
+		BitReader(const uint8_t* data, size_t size) : mData(data), mSize(size) {}
+
+		uint32_t Read(unsigned bits)
+		{
+			uint32_t value = 0;
+			unsigned written = 0;
+			while (bits > 0)
+			{
+				size_t byte = mBitPos >> 3;
+				if (byte >= mSize)
+				{
+					mOverflow = true;
+					return 0;
+				}
+
+				unsigned shift = mBitPos & 7;
+				unsigned take = (8 - shift) < bits ? (8 - shift) : bits;
+				uint32_t chunk = (mData[byte] >> shift) & ((1u << take) - 1);
+				value |= chunk << written;
+
+				written += take;
+				bits -= take;
+				mBitPos += take;
+			}
+			return value;
+		}
+
+		bool Overflowed()const { return mOverflow; }
+
+	private:
+		const uint8_t* mData;
+		size_t mSize;
+		size_t mBitPos = 0;
+		bool mOverflow = false;
+	};
+
+	inline uint32_t Quantize(float value, float minValue, float maxValue, unsigned bits)
+	{
+		const uint32_t steps = (1u << bits) - 1;
+		float t = (value - minValue) / (maxValue - minValue);
+		t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+		return static_cast<uint32_t>(t * steps + 0.5f);
+	}
+
+	inline float Dequantize(uint32_t q, float minValue, float maxValue, unsigned bits)
+	{
+		const uint32_t steps = (1u << bits) - 1;
+		return minValue + (maxValue - minValue) * (static_cast<float>(q) / steps);
+	}
+
+	inline uint32_t QuantizeHealth(int health)
+	{
+		const int maxHealth = (1 << kHealthBits) - 1;
+		return static_cast<uint32_t>(health < 0 ? 0 : (health > maxHealth ? maxHealth : health));
+	}
+
+	struct QuantizedPlayer
+	{
+		uint32_t x, y, z, health;
+	};
+
+	inline QuantizedPlayer QuantizePlayer(const PlayerState& state)
+	{
+		QuantizedPlayer q;
+		q.x = Quantize(state.x, kWorldMinX, kWorldMaxX, kPositionBits);
+		q.y = Quantize(state.y, kWorldMinY, kWorldMaxY, kPositionBits);
+		q.z = Quantize(state.z, kWorldMinZ, kWorldMaxZ, kPositionBits);
+		q.health = QuantizeHealth(state.health);
+		return q;
+	}
+
+	// Encodes current against baseline, or in full if baseline is null.  Returns the
+	// number of bytes written, or 0 if capacity is too small.
+	inline size_t EncodeSnapshot(const WorldSnapshot& current, const WorldSnapshot* baseline, uint8_t* out, size_t capacity)
+	{
+		if (capacity < kSnapshotFixedSize)
+			return 0;
+
+		StoreU32(out + 4, current.seq);
+		StoreU32(out + 8, baseline != nullptr ? baseline->seq : 0);
+		StoreU32(out + 12, current.connectedMask | current.presentMask);
+
+		BitWriter writer(out + kSnapshotFixedSize, capacity - kSnapshotFixedSize);
+		writer.Write(current.presentMask, 32);
+
+		const PlayerState empty;
+		for (uint32_t i = 0; i < kMaxPlayers; ++i)
+		{
+			if ((current.presentMask & (1u << i)) == 0)
+				continue;
+
+			const PlayerState& state = current.players[i];
+			const PlayerState& base = (baseline != nullptr && (baseline->presentMask & (1u << i))) ? baseline->players[i] : empty;
+
+			// Compare quantized values, so motion below one step costs nothing.
+			QuantizedPlayer q = QuantizePlayer(state);
+			QuantizedPlayer qb = QuantizePlayer(base);
+
+			uint32_t changed = 0;
+			if (q.x != qb.x) changed |= FieldX;
+			if (q.y != qb.y) changed |= FieldY;
+			if (q.z != qb.z) changed |= FieldZ;
+			if (q.health != qb.health) changed |= FieldHealth;
+			if (state.ack != base.ack) changed |= FieldAck;
+			if (state.nameLength != base.nameLength || memcmp(state.name, base.name, state.nameLength) != 0) changed |= FieldName;
+
+			writer.Write(changed, FieldCount);
+			if (changed & FieldX) writer.Write(q.x, kPositionBits);
+			if (changed & FieldY) writer.Write(q.y, kPositionBits);
+			if (changed & FieldZ) writer.Write(q.z, kPositionBits);
+			if (changed & FieldHealth) writer.Write(q.health, kHealthBits);
+			if (changed & FieldAck) writer.Write(state.ack, 32);
+			if (changed & FieldName)
+			{
+				writer.Write(state.nameLength, kNameLengthBits);
+				for (uint8_t c = 0; c < state.nameLength; ++c)
+					writer.Write(static_cast<uint8_t>(state.name[c]), 8);
+			}
+		}
+
+		if (writer.Overflowed())
+			return 0;
+
+		size_t length = kSnapshotFixedSize + writer.BytesUsed();
+		WriteHeader(out, PacketType::Snapshot, length);
+		return length;
+	}
+
+	// Reads the sequence numbers of a snapshot so the caller can find its baseline.
+	inline bool ReadSnapshotSeq(const uint8_t* data, size_t size, uint32_t& seq, uint32_t& baselineSeq)
+	{
+		PacketType type;
+		size_t length = ReadHeader(data, size, type);
+		if (length < kSnapshotFixedSize || type != PacketType::Snapshot)
+			return false;
+
+		seq = LoadU32(data + 4);
+		baselineSeq = LoadU32(data + 8);
+		return true;
+	}
+
+	// Decodes a snapshot on top of baseline, which must be the snapshot named by its
+	// baselineSeq (or null for a full snapshot).  Present players are stamped with
+	// the snapshot's seq.  Returns false on malformed data.
+	inline bool DecodeSnapshot(const uint8_t* data, size_t size, const WorldSnapshot* baseline, WorldSnapshot& out)
+	{
+		uint32_t seq, baselineSeq;
+		if (!ReadSnapshotSeq(data, size, seq, baselineSeq))
+			return false;
+
+		if ((baselineSeq != 0) != (baseline != nullptr) || (baseline != nullptr && baseline->seq != baselineSeq))
+			return false;
+
+		size_t length = LoadU16(data + 2);
+		BitReader reader(data + kSnapshotFixedSize, length - kSnapshotFixedSize);
+
+		out.seq = seq;
+		out.presentMask = reader.Read(32);
+		out.connectedMask = LoadU32(data + 12) | out.presentMask;
+
+		const PlayerState empty;
+		for (uint32_t i = 0; i < kMaxPlayers; ++i)
+		{
+			if ((out.presentMask & (1u << i)) == 0)
+				continue;
+
+			PlayerState& state = out.players[i];
+			state = (baseline != nullptr && (baseline->presentMask & (1u << i))) ? baseline->players[i] : empty;
+
+			uint32_t changed = reader.Read(FieldCount);
+			if (changed & FieldX) state.x = Dequantize(reader.Read(kPositionBits), kWorldMinX, kWorldMaxX, kPositionBits);
+			if (changed & FieldY) state.y = Dequantize(reader.Read(kPositionBits), kWorldMinY, kWorldMaxY, kPositionBits);
+			if (changed & FieldZ) state.z = Dequantize(reader.Read(kPositionBits), kWorldMinZ, kWorldMaxZ, kPositionBits);
+			if (changed & FieldHealth) state.health = static_cast<int>(reader.Read(kHealthBits));
+			if (changed & FieldAck) state.ack = reader.Read(32);
+			if (changed & FieldName)
+			{
+				state.nameLength = static_cast<uint8_t>(reader.Read(kNameLengthBits));
+				if (state.nameLength > kMaxNameLength)
+					return false;
+				for (uint8_t c = 0; c < state.nameLength; ++c)
+					state.name[c] = static_cast<char>(reader.Read(8));
+			}
+
+			state.seq = seq;
+		}
+
+		return !reader.Overflowed();
+	}
+
+	inline size_t EncodeAck(uint16_t playerId, uint32_t snapshotSeq, uint8_t* out, size_t capacity)
+	{
+		if (capacity < kAckSize)
+			return 0;
+
+		WriteHeader(out, PacketType::Ack, kAckSize);
+		StoreU16(out + 4, playerId);
+		StoreU32(out + 6, snapshotSeq);
+		return kAckSize;
+	}
+
+	inline bool DecodeAck(const uint8_t* data, size_t size, uint16_t& playerId, uint32_t& snapshotSeq)
+	{
+		PacketType type;
+		size_t length = ReadHeader(data, size, type);
+		if (length < kAckSize || type != PacketType::Ack)
+			return false;
+
+		playerId = LoadU16(data + 4);
+		snapshotSeq = LoadU32(data + 6);
+		return true;
+	}
+
+	inline size_t EncodeSubscribe(const Subscription& subscription, uint8_t* out, size_t capacity)
+	{
+		if (capacity < kSubscribeSize)
+			return 0;
+
+		WriteHeader(out, PacketType::Subscribe, kSubscribeSize);
+		StoreU16(out + 4, subscription.playerId);
+		out[6] = subscription.farInterval;
+		out[7] = 0;
+		StoreF32(out + 8, subscription.x);
+		StoreF32(out + 12, subscription.y);
+		StoreF32(out + 16, subscription.z);
+		StoreF32(out + 20, subscription.radius);
+		return kSubscribeSize;
+	}
+
+	inline bool DecodeSubscribe(const uint8_t* data, size_t size, Subscription& subscription)
+	{
+		PacketType type;
+		size_t length = ReadHeader(data, size, type);
+		if (length < kSubscribeSize || type != PacketType::Subscribe)
+			return false;
+
+		subscription.playerId = LoadU16(data + 4);
+		subscription.farInterval = data[6];
+		subscription.x = LoadF32(data + 8);
+		subscription.y = LoadF32(data + 12);
+		subscription.z = LoadF32(data + 16);
+		subscription.radius = LoadF32(data + 20);
+		return true;
+	}
+
+	// The players of world that belong in snapshot seq for subscription, as a
+	// presentMask.  Copy world with this mask and encode it as usual: players that
+	// drop out are simply absent, and one coming back is encoded against whatever
+	// the baseline last held for it.
+	inline uint32_t RelevantPlayers(const WorldSnapshot& world, const Subscription& subscription, uint32_t seq)
+	{
+		if (subscription.radius <= 0.0f)
+			return world.presentMask;
+
+		const float radiusSq = subscription.radius * subscription.radius;
+		uint32_t mask = 0;
+		for (uint32_t i = 0; i < kMaxPlayers; ++i)
+		{
+			if ((world.presentMask & (1u << i)) == 0)
+				continue;
+
+			const PlayerState& state = world.players[i];
+			float dx = state.x - subscription.x;
+			float dy = state.y - subscription.y;
+			float dz = state.z - subscription.z;
+			bool inside = dx * dx + dy * dy + dz * dz <= radiusSq;
+
+			bool due = inside || i == subscription.playerId ||
+				(subscription.farInterval != 0 && (seq + i) % subscription.farInterval == 0);
+			if (due)
+				mask |= 1u << i;
+		}
+		return mask;
+	}
+}
@@ -0,0 +1,269 @@
+//***************************************************************************************
+// SocketBackend.cpp
+//***************************************************************************************
+
+#include "SocketBackend.h"
+
+SocketBackend::~SocketBackend()
+{
+	if (mSocket != INVALID_SOCKET)
+		closesocket(mSocket);
+}
+
+std::unique_ptr<SocketBackend> SocketBackend::Create(SocketBackendType type)
+{
+	std::unique_ptr<SocketBackend> backend;
+
+	if (type == SocketBackendType::RegisteredIO)
+	{
+		backend = std::make_unique<RegisteredIOBackend>();
+		if (!backend->Open())
+		{
+			OutputDebugStringA("Registered I/O unavailable, falling back to recvfrom.\n");
+			backend.reset();
+		}
+	}
+
+	if (backend == nullptr)
+	{
+		backend = std::make_unique<RecvFromBackend>();
+		if (!backend->Open())
+		{
+			OutputDebugStringA("recvfrom backend could not open a socket.\n");
+			backend.reset();
+		}
+	}
+
+	return backend;
+}
+
+SOCKET SocketBackend::GetSocket()const
+{
+	return mSocket;
+}
+
+bool SocketBackend::SendTo(const char* data, int length, const sockaddr_in& destAddr)
+{
+	return sendto(mSocket, data, length, 0, (const sockaddr*)&destAddr, sizeof(destAddr)) == length;
+}
+
+bool SocketBackend::BindAnyPort()
+{
+	// Receives are posted before the first send, so the socket has to be bound up
+	// front rather than implicitly by sendto.
+	sockaddr_in localAddr = {};
+	localAddr.sin_family = AF_INET;
+	localAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	localAddr.sin_port = 0;
+
+	return bind(mSocket, (const sockaddr*)&localAddr, sizeof(localAddr)) == 0;
+}
+
+//
+// RecvFromBackend
+//
+
+bool RecvFromBackend::Open()
+{
+	mSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (mSocket == INVALID_SOCKET)
+		return false;
+
+	DWORD timeout = ReceiveTimeoutMs;
+	setsockopt(mSocket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+	mSlots.resize(MaxBatchSize * SlotSize);
+
+	return BindAnyPort();
+}
+
+int RecvFromBackend::Receive(Datagram* datagrams, int maxCount)
+{
+	maxCount = (std::min)(maxCount, MaxBatchSize);
+
+	int count = 0;
+	while (count < maxCount)
+	{
+		// Only the first datagram is waited for; after that, keep reading while the
+		// socket still has data queued.
+		if (count > 0)
+		{
+			u_long pending = 0;
+			if (ioctlsocket(mSocket, FIONREAD, &pending) != 0 || pending == 0)
+				break;
+		}
+
+		Datagram& datagram = datagrams[count];
+		char* slot = &mSlots[count * SlotSize];
+		int fromSize = sizeof(datagram.From);
+
+		int bytesReceived = recvfrom(mSocket, slot, SlotSize, 0, (sockaddr*)&datagram.From, &fromSize);
+		if (bytesReceived <= 0)
+			break;
+
+		datagram.Data = slot;
+		datagram.Length = bytesReceived;
+		++count;
+	}
+
+	return count;
+}
+
+const char* RecvFromBackend::Name()const
+{
+	return "recvfrom";
+}
+
+//
+// RegisteredIOBackend
+//
+
+RegisteredIOBackend::~RegisteredIOBackend()
+{
+	// Closing the socket also closes its request queue.
+	if (mSocket != INVALID_SOCKET)
+	{
+		closesocket(mSocket);
+		mSocket = INVALID_SOCKET;
+	}
+
+	if (mCompletionQueue != RIO_INVALID_CQ)
+		mRio.RIOCloseCompletionQueue(mCompletionQueue);
+
+	if (mPoolId != RIO_INVALID_BUFFERID)
+		mRio.RIODeregisterBuffer(mPoolId);
+
+	if (mPool != nullptr)
+		VirtualFree(mPool, 0, MEM_RELEASE);
+
+	if (mCompletionEvent != nullptr)
+		CloseHandle(mCompletionEvent);
+}
+
+bool RegisteredIOBackend::Open()
+{
+	mSocket = WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, nullptr, 0, WSA_FLAG_REGISTERED_IO);
+	if (mSocket == INVALID_SOCKET)
+		return false;
+
+	GUID functionTableId = WSAID_MULTIPLE_RIO;
+	DWORD bytes = 0;
+	if (WSAIoctl(mSocket, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER,
+		&functionTableId, sizeof(functionTableId), &mRio, sizeof(mRio), &bytes, nullptr, nullptr) != 0)
+		return false;
+
+	if (!BindAnyPort())
+		return false;
+
+	// One allocation for every data and address slot, registered once so the kernel
+	// can write datagrams straight into it.
+	mPoolSize = SlotCount * (SlotSize + sizeof(SOCKADDR_INET));
+	mPool = (char*)VirtualAlloc(nullptr, mPoolSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (mPool == nullptr)
+		return false;
+
+	mPoolId = mRio.RIORegisterBuffer(mPool, (DWORD)mPoolSize);
+	if (mPoolId == RIO_INVALID_BUFFERID)
+		return false;
+
+	mCompletionEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+	if (mCompletionEvent == nullptr)
+		return false;
+
+	RIO_NOTIFICATION_COMPLETION notify = {};
+	notify.Type = RIO_EVENT_COMPLETION;
+	notify.Event.EventHandle = mCompletionEvent;
+	notify.Event.NotifyReset = FALSE;
+
+	// Room for every posted receive plus the one send slot the request queue requires.
+	mCompletionQueue = mRio.RIOCreateCompletionQueue(SlotCount + 1, &notify);
+	if (mCompletionQueue == RIO_INVALID_CQ)
+		return false;
+
+	// Sends go through sendto, so the request queue only ever holds receives.
+	mRequestQueue = mRio.RIOCreateRequestQueue(mSocket, SlotCount, 1, 1, 1,
+		mCompletionQueue, mCompletionQueue, nullptr);
+	if (mRequestQueue == RIO_INVALID_RQ)
+		return false;
+
+	for (ULONG slot = 0; slot < SlotCount; ++slot)
+	{
+		if (!PostReceive(slot))
+			return false;
+	}
+	mRio.RIOReceive(mRequestQueue, nullptr, 0, RIO_MSG_COMMIT_ONLY, nullptr);
+
+	mSlotsInUse.reserve(SlotCount);
+
+	return true;
+}
+
+bool RegisteredIOBackend::PostReceive(ULONG slot)
+{
+	RIO_BUF data;
+	data.BufferId = mPoolId;
+	data.Offset = slot * SlotSize;
+	data.Length = SlotSize;
+
+	RIO_BUF address;
+	address.BufferId = mPoolId;
+	address.Offset = SlotCount * SlotSize + slot * sizeof(SOCKADDR_INET);
+	address.Length = sizeof(SOCKADDR_INET);
+
+	// Deferred: the whole batch of reposts is committed with a single call.
+	return mRio.RIOReceiveEx(mRequestQueue, &data, 1, nullptr, &address, nullptr, nullptr,
+		RIO_MSG_DEFER, reinterpret_cast<PVOID>(static_cast<ULONG_PTR>(slot))) != FALSE;
+}
+
+int RegisteredIOBackend::Receive(Datagram* datagrams, int maxCount)
+{
+	// The caller is done with the previous batch, so those slots can take new datagrams.
+	if (!mSlotsInUse.empty())
+	{
+		for (ULONG slot : mSlotsInUse)
+			PostReceive(slot);
+		mRio.RIOReceive(mRequestQueue, nullptr, 0, RIO_MSG_COMMIT_ONLY, nullptr);
+		mSlotsInUse.clear();
+	}
+
+	RIORESULT results[SlotCount];
+	ULONG resultCapacity = (ULONG)(std::min)(maxCount, SlotCount);
+
+	ULONG count = mRio.RIODequeueCompletion(mCompletionQueue, results, resultCapacity);
+	if (count == 0)
+	{
+		// Nothing ready yet; ask to be signalled on the next completion.
+		mRio.RIONotify(mCompletionQueue);
+		if (WaitForSingleObject(mCompletionEvent, ReceiveTimeoutMs) != WAIT_OBJECT_0)
+			return 0;
+
+		count = mRio.RIODequeueCompletion(mCompletionQueue, results, resultCapacity);
+	}
+
+	if (count == RIO_CORRUPT_CQ)
+		return 0;
+
+	int received = 0;
+	for (ULONG i = 0; i < count; ++i)
+	{
+		ULONG slot = (ULONG)results[i].RequestContext;
+		mSlotsInUse.push_back(slot);
+
+		if (results[i].Status != NO_ERROR || results[i].BytesTransferred == 0)
+			continue;
+
+		const SOCKADDR_INET* from = (const SOCKADDR_INET*)(mPool + SlotCount * SlotSize + slot * sizeof(SOCKADDR_INET));
+
+		Datagram& datagram = datagrams[received++];
+		datagram.Data = mPool + slot * SlotSize;
+		datagram.Length = (int)results[i].BytesTransferred;
+		datagram.From = from->Ipv4;
+	}
+
+	return received;
+}
+
+const char* RegisteredIOBackend::Name()const
+{
+	return "Registered I/O";
+}
@@ -0,0 +1,121 @@
+//***************************************************************************************
+// SocketBackend.h
+//
+// Receive path for the client's UDP socket.  A backend owns the socket and hands back
+// datagrams in batches: each call to Receive blocks until at least one datagram is
+// available and then returns every datagram it can get without blocking again.  The
+// returned Datagram entries point straight into buffers owned by the backend, so
+// nothing is copied on the way to the caller.
+//
+// Two implementations are provided:
+//   RecvFrom     - the plain blocking recvfrom loop, one kernel call per datagram.
+//   RegisteredIO - Windows Registered I/O.  Receives are posted up front into a
+//                  preregistered buffer pool and completions are dequeued in bulk,
+//                  so a burst of datagrams costs one kernel transition.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+#include <mswsock.h>
+
+enum class SocketBackendType
+{
+	RecvFrom,
+	RegisteredIO
+};
+
+struct Datagram
+{
+	// Valid until the next call to Receive on the same backend.
+	const char* Data = nullptr;
+	int Length = 0;
+	sockaddr_in From = {};
+};
+
+class SocketBackend
+{
+public:
+	// Every slot holds one whole datagram, so it must fit the largest message we accept.
+	static const int SlotSize = 4096;
+
+	// Longest time Receive blocks before returning 0, so the receiver thread can notice
+	// it has been asked to stop.
+	static const DWORD ReceiveTimeoutMs = 100;
+
+	// Most datagrams a caller needs room for in one call to Receive.
+	static const int MaxBatchSize = 64;
+
+	SocketBackend() = default;
+	SocketBackend(const SocketBackend& rhs) = delete;
+	SocketBackend& operator=(const SocketBackend& rhs) = delete;
+	virtual ~SocketBackend();
+
+	// Creates the preferred backend, falling back to RecvFrom if it cannot be opened.
+	// Returns nullptr if neither can.
+	static std::unique_ptr<SocketBackend> Create(SocketBackendType type);
+
+	// Creates and binds the socket.  Returns false if the backend is unavailable.
+	virtual bool Open() = 0;
+
+	// Blocks for up to ReceiveTimeoutMs and fills at most maxCount entries.  Returns
+	// the number of datagrams received.  Only one thread may call Receive.
+	virtual int Receive(Datagram* datagrams, int maxCount) = 0;
+
+	virtual const char* Name()const = 0;
+
+	SOCKET GetSocket()const;
+
+	// Sends are a handful per frame, so every backend goes through a plain sendto.
+	bool SendTo(const char* data, int length, const sockaddr_in& destAddr);
+
+protected:
+	bool BindAnyPort();
+
+protected:
+	SOCKET mSocket = INVALID_SOCKET;
+};
+
+class RecvFromBackend : public SocketBackend
+{
+public:
+	bool Open()override;
+	int Receive(Datagram* datagrams, int maxCount)override;
+	const char* Name()const override;
+
+private:
+	// One slot per datagram of the current batch.
+	std::vector<char> mSlots;
+};
+
+class RegisteredIOBackend : public SocketBackend
+{
+public:
+	// Receives kept posted to the kernel at any time.
+	static const int SlotCount = 256;
+
+	~RegisteredIOBackend()override;
+
+	bool Open()override;
+	int Receive(Datagram* datagrams, int maxCount)override;
+	const char* Name()const override;
+
+private:
+	bool PostReceive(ULONG slot);
+
+private:
+	RIO_EXTENSION_FUNCTION_TABLE mRio = {};
+
+	// SlotCount data slots followed by SlotCount sender address slots, allocated
+	// page-aligned and registered with the kernel once.
+	char* mPool = nullptr;
+	size_t mPoolSize = 0;
+	RIO_BUFFERID mPoolId = RIO_INVALID_BUFFERID;
+
+	RIO_CQ mCompletionQueue = RIO_INVALID_CQ;
+	RIO_RQ mRequestQueue = RIO_INVALID_RQ;
+	HANDLE mCompletionEvent = nullptr;
+
+	// Slots handed out by the previous Receive; they are reposted on the next one.
+	std::vector<ULONG> mSlotsInUse;
+};
@@ -0,0 +1,91 @@
+//***************************************************************************************
+// SpscRing.h
+//
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+// The producer only writes mTail and the consumer only writes mHead, so neither side
+// ever blocks the other.  Each index lives on its own cache line to avoid false
+// sharing, and each side caches the other's index so the shared line is only read
+// when the ring looks full (producer) or empty (consumer).
+//***************************************************************************************
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+template<typename T, size_t Capacity>
+class SpscRing
+{
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two.");
+
+public:
+	SpscRing() = default;
+	SpscRing(const SpscRing& rhs) = delete;
+	SpscRing& operator=(const SpscRing& rhs) = delete;
+
+	// Producer side.  Returns false and counts an overflow if the ring is full.
+	bool TryPush(const T& item)
+	{
+		const size_t tail = mTail.load(std::memory_order_relaxed);
+		if (tail - mCachedHead == Capacity)
+		{
+			mCachedHead = mHead.load(std::memory_order_acquire);
+			if (tail - mCachedHead == Capacity)
+			{
+				mOverflowCount.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		}
+
+		mItems[tail & (Capacity - 1)] = item;
+		mTail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side.  Returns false if the ring is empty.
+	bool TryPop(T& item)
+	{
+		const size_t head = mHead.load(std::memory_order_relaxed);
+		if (head == mCachedTail)
+		{
+			mCachedTail = mTail.load(std::memory_order_acquire);
+			if (head == mCachedTail)
+				return false;
+		}
+
+		item = mItems[head & (Capacity - 1)];
+		mHead.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Approximate number of queued items; exact only when called from the consumer
+	// with the producer idle.
+	size_t Size()const
+	{
+		return mTail.load(std::memory_order_acquire) - mHead.load(std::memory_order_acquire);
+	}
+
+	// Number of pushes rejected because the ring was full.
+	uint64_t OverflowCount()const
+	{
+		return mOverflowCount.load(std::memory_order_relaxed);
+	}
+
+	static constexpr size_t GetCapacity()
+	{
+		return Capacity;
+	}
+
+private:
+	// Consumer-owned.
+	alignas(64) std::atomic<size_t> mHead{ 0 };
+	size_t mCachedTail = 0;
+
+	// Producer-owned.
+	alignas(64) std::atomic<size_t> mTail{ 0 };
+	size_t mCachedHead = 0;
+	std::atomic<uint64_t> mOverflowCount{ 0 };
+
+	alignas(64) T mItems[Capacity];
+};
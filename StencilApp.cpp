@@ -10,52 +10,40 @@
 #include "FrameResource.h"
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include "Camera.h"
-#include <queue>
+#include "NetProtocol.h"
+#include "SnapshotCodec.h"
+#include "SpscRing.h"
+#include "PredictionBuffer.h"
+#include "InterpolationBuffer.h"
+#include "ThreadPool.h"
+#include "MeshCache.h"
+#include "PipelineLibrary.h"
+#include "GpuMemory.h"
+#include "TextureStreamer.h"
+#include "EntityRegistry.h"
+#include "TransformKernel.h"
+#include "BotHost.h"
 
 using Microsoft::WRL::ComPtr;
 using namespace DirectX;
 using namespace DirectX::PackedVector;
+using NetProtocol::Packet;
 
 #pragma comment(lib, "d3dcompiler.lib")
 #pragma comment(lib, "D3D12.lib")
 
-const int gNumFrameResources = 3;
+int gNumFrameResources = 3;
 
-struct Packet {
-
-	// 0 = movement
-	uint8_t packetType;
-
-	// 1 to 3
-	uint16_t playerId;
-
-	// 0 = stationary
-	// 1 = moving
-	uint8_t movementState;
-
-	// 0 = x, y
-	// 1 = x, +y
-	// 2 = x, -y
-	// 3 = +x, y
-	// 4 = -x, y
-	// 5 = +x, +y
-	// 6 = -x, +y
-	// 7 = -x, +y
-	// 8 = +x, -y
-	uint8_t direction;
-
-	uint32_t timestamp;
-
-	std::string name;
-};
+// Size of the shader-visible texture table; must match gTextureMaps in Default.hlsl.
+const UINT gMaxTextures = 128;
 
 enum class ControlledObject {
-	Skull1,
-	Skull2,
+	Player,
 	Car
 };
-ControlledObject mControlledObject = ControlledObject::Skull1;
+ControlledObject mControlledObject = ControlledObject::Player;
 // Lightweight structure stores parameters to draw a shape.  This will
 // vary from app-to-app.
 struct RenderItem
@@ -68,16 +56,22 @@ struct RenderItem
 	XMFLOAT4X4 World = MathHelper::Identity4x4();
 
 	XMFLOAT4X4 TexTransform = MathHelper::Identity4x4();
-	//BoundingBox Bounds;
 
-	// Dirty flag indicating the object data has changed and we need to update the constant buffer.
-	// Because we have an object cbuffer for each FrameResource, we have to apply the
-	// update to each FrameResource.  Thus, when we modify obect data we should set 
-	// NumFramesDirty = gNumFrameResources so that each frame resource gets the update.
+	// Local-space bounds of the submesh, and its coarser levels, if it has any.
+	BoundingBox Bounds;
+	std::vector<SubmeshLod> Lods;
+
+	// Dirty flag indicating the object data has changed and we need to update the instance buffer.
+	// Because we have an instance buffer for each FrameResource, we have to apply the
+	// update to each FrameResource.  Thus, when we modify object data we call
+	// MarkDirty, which sets NumFramesDirty = gNumFrameResources and queues the item
+	// so that each frame resource gets the update.
 	int NumFramesDirty = gNumFrameResources;
+	bool InDirtyList = false;
 
-	// Index into GPU constant buffer corresponding to the ObjectCB for this render item.
-	UINT ObjCBIndex = -1;
+	// Slots in the frame's instance buffer holding this item's data, one for each
+	// batch it is drawn in.  Assigned by BuildRenderBatches.
+	std::vector<UINT> InstanceSlots;
 
 	Material* Mat = nullptr;
 	MeshGeometry* Geo = nullptr;
@@ -89,6 +83,31 @@ struct RenderItem
 	UINT IndexCount = 0;
 	UINT StartIndexLocation = 0;
 	int BaseVertexLocation = 0;
+
+	// Pooled items that are not in use are skipped by culling.
+	bool Enabled = true;
+};
+
+// Render items of one layer that share geometry, submesh and material.  The layer
+// fixes the PSO, so each batch is drawn with a single instanced draw; its items'
+// instance data sits contiguously in the instance buffer from BaseInstance on.
+struct RenderBatch
+{
+	MeshGeometry* Geo = nullptr;
+	Material* Mat = nullptr;
+	D3D12_PRIMITIVE_TOPOLOGY PrimitiveType = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
+	UINT IndexCount = 0;
+	UINT StartIndexLocation = 0;
+	int BaseVertexLocation = 0;
+
+	BoundingBox Bounds;
+	std::vector<SubmeshLod> Lods;
+
+	UINT BaseInstance = 0;
+	std::vector<RenderItem*> Items;
+
+	// Indices into Items that survived culling this frame, in ascending order.
+	std::vector<UINT> Visible;
 };
 
 enum class RenderLayer : int
@@ -108,30 +127,41 @@ public:
 	StencilApp(const StencilApp& rhs) = delete;
 	StencilApp& operator=(const StencilApp& rhs) = delete;
 	~StencilApp();
-	int player = 1;
 	bool running;
 
-	std::string receivedMessage;
 	std::mutex messageMutex;
-	std::mutex movementMutex;
 
 	void ProcessPositionData(const GameTimer& gt);
 
 	void OutputDebugMessage(const std::string& message);
 
-	void SendAcknowledgement(SOCKET udpSocket);
+	void SendAcknowledgement();
+	void UpdateSubscription(float dt);
+
+	void StartAsyncMessageReceiver(std::atomic<bool>& isRunning);
+
+	// -replay <file>: received datagrams from a capture are fed to HandleDatagram at
+	// their recorded pace instead of from the socket, which is never opened.
+	void StartReplay(std::atomic<bool>& isRunning);
 
-	void StartAsyncMessageReceiver(SOCKET& udpSocket, std::atomic<bool>& isRunning);
+	// -replay <file> -replayfast: runs the whole capture through the parse and update
+	// paths as fast as possible, reports the timings and exits.
+	int RunReplayBenchmark();
+	void HandleDatagram(const char* data, int length);
+	void HandleMessage(const uint8_t* data, size_t length);
 
 	virtual bool Initialize()override;
 
 private:
 	virtual void OnResize()override;
 	virtual void Update(const GameTimer& gt)override;
+	virtual void FixedUpdate(float dt)override;
 	void UpdateGameState(const GameTimer& gt);
 	void SendPacket(const Packet& packet);
-	void ParsePacket(const char* buf, Packet& packet);
+	bool ParsePacket(const char* buf, int length, Packet& packet);
 	virtual void Draw(const GameTimer& gt)override;
+	virtual std::wstring ExtraFrameStats()override;
+	virtual std::wstring ProfileFrameStats()override;
 
 	virtual void OnMouseDown(WPARAM btnState, int x, int y)override;
 	virtual void OnMouseUp(WPARAM btnState, int x, int y)override;
@@ -139,54 +169,139 @@ private:
 
 	void OnKeyboardInput(const GameTimer& gt);
 	void SendSkullPositionUpdate(const XMFLOAT3& skullPosition);
-	void UpdateSkullWorldMatrix(const XMFLOAT3& position, RenderItem* skullRitem, RenderItem* reflectedRitem, RenderItem* shadowedRitem);
 	void UpdateCubeWorldMatrix(const XMFLOAT3& position, RenderItem* skullRitem, RenderItem* reflectedRitem);
 	void UpdateCamera(const GameTimer& gt);
 	void AnimateMaterials(const GameTimer& gt);
-	void UpdateObjectCBs(const GameTimer& gt);
-	void UpdatePlayers(int player, float x, float y, float z, int health);
-	void ProcessMessages(const std::string& buffer);
-	void UpdateMaterialCBs(const GameTimer& gt);
+	void UpdateInstanceBuffer(const GameTimer& gt);
+	void MarkDirty(RenderItem* ri);
+	void QueueInstanceUpload(RenderItem* ri);
+	void UpdatePlayerTransforms();
+	void UpdatePlayers(int player, float x, float y, float z, int health, float dt);
+	uint32_t AddPlayer(uint16_t playerId);
+	void RemovePlayer(uint16_t playerId);
+	void UpdatePlayerWorldMatrix(uint32_t slot, const XMFLOAT3& position);
+	XMFLOAT3 SpawnPosition(uint16_t playerId)const;
+	void ProcessMessages();
+	bool ApplyBinarySnapshot(const uint8_t* data, size_t length, uint32_t localSeq, uint32_t& connectedMask);
+	void StoreSnapshot(const char* buf, int length);
+	void DrainPackets();
+	void UpdateNetStats(const GameTimer& gt);
+	void UpdateMaterialBuffer(const GameTimer& gt);
 	void UpdateMainPassCB(const GameTimer& gt);
 	void UpdateReflectedPassCB(const GameTimer& gt);
-	void BuildCarGeometry();
+	void CullRenderItems();
+	bool CullBatches(std::vector<RenderBatch>& batches, const BoundingFrustum& frustum, BoundingBox* visibleBounds);
+	bool BuildMirrorFrustum(const BoundingBox& mirrorBounds, CXMMATRIX view, CXMMATRIX invView, BoundingFrustum& frustum)const;
+	bool LayerVisible(RenderLayer layer)const;
 	void UpdateCubeFaceReflection(RenderItem* cubeFaceRitem);
 	void SetFloorMatrix(const XMFLOAT3& position, RenderItem* carRitem, RenderItem* reflectedRitem);
 
-	void UpdatePosition(bool A, bool D, bool W, bool S, float dt, XMFLOAT3* position);
 	void UpdatePosition(bool A, bool D, bool W, bool S, float dt);
-	void UpdatePosition(Packet packet, float dt);
-	void UpdatePosition();
+	XMFLOAT3* ControlledPosition();
+	void UpdateControlledWorldMatrix();
+	void SimulateInput(float dt);
 	void ContinuousMovement(const GameTimer& gt);
-	void LoadTextures();
+	void BuildWorkerPool();
+	void StartAssetLoad();
+	void LoadAssets();
+	bool WaitForAssets();
+	void LoadTexture(ID3D12GraphicsCommandList* cmdList, const std::string& name, const std::wstring& filename);
+	void UpdateTextureStreaming();
+	void RequestTextureMips();
+	void CompileShader(const std::string& name, const D3D_SHADER_MACRO* defines, const std::string& entrypoint, const std::string& target);
 	void BuildRootSignature();
 	void BuildDescriptorHeaps();
-	void BuildShadersAndInputLayout();
-	void BuildRoomGeometry();
-	void BuildCubeMirrorGeometry();
-	void BuildSkull2Geometry();
-	void BuildSkullGeometry();
+	void BuildInputLayout();
+	void BuildRoomGeometry(ID3D12GraphicsCommandList* cmdList);
+	void BuildCubeMirrorGeometry(ID3D12GraphicsCommandList* cmdList);
+	void BuildMeshGeometry(ID3D12GraphicsCommandList* cmdList, const std::string& geoName, const std::string& submeshName, const std::wstring& sourcePath);
 	void BuildPSOs();
 	void BuildFrameResources();
 	void BuildMaterials();
+	void AddMaterial(std::unique_ptr<Material> mat);
 	void BuildRenderItems();
-	void DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderItem*>& ritems);
+	void BuildRenderBatches();
+	void BuildLayerCommandLists();
+	void RecordLayer(RenderLayer layer);
+	void DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderBatch>& batches, UINT lodBias);
+	UINT SelectLod(const RenderBatch& batch, UINT lodBias)const;
 
 	std::array<const CD3DX12_STATIC_SAMPLER_DESC, 6> GetStaticSamplers();
 
 private:
 
-	XMFLOAT3 skull1 = { 0.0f, 1.0f, -10.0f };
-	XMFLOAT3 skull2 = { 5.0f, 1.0f, -10.0f };
 	XMFLOAT3 cube1 = { 0.0f, 1.0f, 0.0f };
 	XMFLOAT3 car1 = { 0.0f, 1.0f, -10.0f };
+
+	// Every connected player, the local one included, in slots from a free list.
+	// Players get a slot the first time we hear of them and lose it when a snapshot
+	// no longer lists them as connected.
+	EntityRegistry mPlayers{ NetProtocol::kMaxPlayers, NetProtocol::kMaxPlayers };
+	uint32_t mLocalSlot = EntityRegistry::InvalidSlot;
+
+	// Skulls and the car share a model transform and mirror, so one kernel builds
+	// all of their matrices.  Players that moved this frame are queued with where
+	// to draw them and transformed together in UpdatePlayerTransforms.
+	TransformKernel mEntityTransforms;
+	std::vector<XMFLOAT3> mPlayerDrawPositions;
+	std::vector<uint32_t> mMovedPlayers;
+	std::vector<TransformKernel::Target> mTransformTargets;
+
+	// Controlled object's position at the start of the last fixed tick, blended
+	// toward its current position when drawing.
+	ControlledObject mPrevSimObject = ControlledObject::Player;
+	XMFLOAT3 mPrevSimPosition = { 0.0f, 1.0f, -10.0f };
 	XMFLOAT3 floor1 = { 0.0f, 1.0f, 0.0f };
 	RenderItem* mymSkullRitem;
 	RenderItem* mymReflectedSkullRitem;
 	RenderItem* mymShadowedSkullRitem;
 
-	Packet lastPacket;
-	int movementState = 0;
+	// Decoded packets handed from the receiver thread to the game thread.
+	SpscRing<Packet, 256> mPacketRing;
+	std::atomic<bool> mReceiverRunning{ false };
+	std::thread mReceiverThread;
+
+	// Most recent packet applied for each player, in timestamp order.
+	std::array<Packet, NetProtocol::kMaxPlayers> mPlayerPackets;
+	uint64_t mStalePacketCount = 0;
+
+	// Inputs applied to the local player that the server has not acknowledged yet.
+	PredictionBuffer mPrediction;
+
+	// Timestamped positions of every remote player.  They are drawn this far behind
+	// the newest sample, and extrapolated for at most mMaxExtrapolationMs once
+	// samples stop arriving.
+	std::array<InterpolationBuffer, NetProtocol::kMaxPlayers> mRemotePlayers;
+	float mInterpolationDelayMs = 100.0f;
+	float mMaxExtrapolationMs = 250.0f;
+
+	// Latest world-state snapshot, written by the receiver thread under messageMutex.
+	// mSnapshotSeq is bumped after every store so the game thread can tell whether
+	// anything new has arrived without taking the lock.
+	std::array<char, NetProtocol::kMaxSnapshotSize> mSnapshotBuffer;
+	size_t mSnapshotLength = 0;
+	std::atomic<uint32_t> mSnapshotSeq{ 0 };
+
+	// Game-thread copy of the snapshot being parsed and the state decoded from it.
+	std::array<char, NetProtocol::kMaxSnapshotSize> mSnapshotScratch;
+	uint32_t mProcessedSnapshotSeq = 0;
+	std::array<NetProtocol::PlayerState, NetProtocol::kMaxPlayers> mPlayerStates;
+
+	// Recently decoded binary snapshots, indexed by server seq, so any baseline the
+	// server encodes a delta against can be found.  mAckedSnapshotSeq is the newest
+	// one applied to mPlayerStates and acknowledged.
+	std::array<NetProtocol::WorldSnapshot, 32> mSnapshotHistory;
+	uint32_t mAckedSnapshotSeq = 0;
+
+	// Area of interest the server filters our snapshots by: players within
+	// mInterestRadius of the camera in every snapshot, the rest in every
+	// mInterestFarInterval-th.  A radius of 0 never subscribes, so every snapshot
+	// carries everyone.  It goes unreliably and is resent when the camera has moved
+	// a tenth of the radius, or after a second regardless.
+	float mInterestRadius = NetProtocol::kDefaultInterestRadius;
+	uint8_t mInterestFarInterval = NetProtocol::kDefaultFarInterval;
+	XMFLOAT3 mSubscribedPosition = { 0.0f, 0.0f, 0.0f };
+	float mSubscriptionAge = 1.0f;
 
 	std::vector<std::unique_ptr<FrameResource>> mFrameResources;
 	FrameResource* mCurrFrameResource = nullptr;
@@ -199,31 +314,91 @@ private:
 	ComPtr<ID3D12DescriptorHeap> mSrvDescriptorHeap = nullptr;
 
 	std::unordered_map<std::string, std::unique_ptr<MeshGeometry>> mGeometries;
-	std::unordered_map<std::string, std::unique_ptr<Material>> mMaterials;
+	// Materials indexed by MatCBIndex, and by name for building render items.
+	std::vector<std::unique_ptr<Material>> mMaterials;
+	std::unordered_map<std::string, Material*> mMaterialLookup;
 	std::unordered_map<std::string, std::unique_ptr<Texture>> mTextures;
 	std::unordered_map<std::string, ComPtr<ID3DBlob>> mShaders;
 	std::unordered_map<std::string, ComPtr<ID3D12PipelineState>> mPSOs;
+	PipelineLibrary mPipelineLibrary;
+
+	// Timestamps around every layer's command list, one range per RenderLayer.
+	GpuProfiler mGpuProfiler;
 
 	std::vector<D3D12_INPUT_ELEMENT_DESC> mInputLayout;
 
+	// Startup loading.  Textures, meshes and shaders are loaded by jobs on
+	// mRenderWorkers, driven from mLoaderThread so the main thread can keep pumping
+	// messages.  Each job uploads through its own copy list; all of them run on
+	// mCopyQueue, and the direct queue waits on mCopyFence before using the results.
+	// mAssetMutex guards the asset maps while the jobs fill them in.  Static vertex
+	// and index buffers are placed in mStaticBuffers and staged through mUploadArena,
+	// whose pages are released as soon as the copy queue has finished with them.
+	ComPtr<ID3D12CommandQueue> mCopyQueue;
+	ComPtr<ID3D12Fence> mCopyFence;
+	UINT64 mCopyFenceValue = 0;
+	std::vector<ComPtr<ID3D12CommandAllocator>> mCopyCmdAllocs;
+	std::vector<ComPtr<ID3D12GraphicsCommandList>> mCopyCmdLists;
+	std::thread mLoaderThread;
+	HANDLE mAssetsLoadedEvent = nullptr;
+	std::exception_ptr mLoadError;
+	std::mutex mAssetMutex;
+	std::unique_ptr<StaticBufferHeap> mStaticBuffers;
+	std::unique_ptr<UploadArena> mUploadArena;
+
+	// With -streamtextures, textures load only their low mips and stream the rest as
+	// they come into view, within -texturebudget MB.  Materials sample no finer than
+	// their texture's resident mips.  mSrvStreamIds maps SRV heap slots to streamer
+	// ids, -1 for textures loaded whole.
+	std::unique_ptr<TextureStreamer> mTextureStreamer;
+	std::vector<int> mSrvStreamIds;
+
 	// Cache render items of interest.
 	RenderItem* mCubeRitem = nullptr;
 	RenderItem* mFloorItem = nullptr;
 	RenderItem* mReflectedFloorItem = nullptr;
 	RenderItem* mCarRitem = nullptr;
 	RenderItem* mReflectedCarRitem = nullptr;
-	RenderItem* mSkullRitem = nullptr;
-	RenderItem* mReflectedSkullRitem = nullptr;
-	RenderItem* mShadowedSkullRitem = nullptr;
-	RenderItem* mSkullRitem_2 = nullptr;
-	RenderItem* mReflectedSkullRitem_2 = nullptr;
-	RenderItem* mShadowedSkullRitem_2 = nullptr;
 
 	// List of all the render items.
 	std::vector<std::unique_ptr<RenderItem>> mAllRitems;
 
-	// Render items divided by PSO.
+	// Skulls for players, built disabled for every possible player and handed out
+	// as they join.  Each entry is the mAllRitems index of a skull; its reflection
+	// and shadow follow it.
+	std::vector<uint32_t> mFreePlayerRitems;
+
+	// Items whose instance data still has to reach some frame resource, and a CPU
+	// copy of the whole instance buffer in slot order.  Only queued items are
+	// visited each frame; the slots between them are copied straight from
+	// mInstanceData, so the upload is one block.
+	std::vector<RenderItem*> mDirtyRitems;
+	std::vector<InstanceData> mInstanceData;
+
+	// Each layer is recorded into its own command list, on mRenderWorkers, and the
+	// lists are executed in layer order between the frame's begin and end lists.
+	ComPtr<ID3D12GraphicsCommandList> mLayerCmdLists[(int)RenderLayer::Count];
+	ComPtr<ID3D12GraphicsCommandList> mEndCmdList;
+	std::unique_ptr<ThreadPool> mRenderWorkers;
+
+	// Render items divided by PSO, and grouped within each layer for instancing.
 	std::vector<RenderItem*> mRitemLayer[(int)RenderLayer::Count];
+	std::vector<RenderBatch> mBatchLayer[(int)RenderLayer::Count];
+	UINT mInstanceCount = 0;
+
+	// Camera frustum in view space, rebuilt with the projection.  -nocull turns
+	// culling off to compare against.
+	BoundingFrustum mCamFrustum;
+	bool mFrustumCullingEnabled = true;
+
+	// False while no mirror face is on screen: nothing can be seen in it, so the
+	// stencil and reflection layers are not recorded at all.
+	bool mMirrorVisible = true;
+	UINT mVisibleInstanceCount = 0;
+
+	// A mesh switches to a coarser LOD once the error of that level projects to no
+	// more than this many pixels.  -loderror overrides it.
+	float mLodPixelError = 1.0f;
 
 	PassConstants mMainPassCB;
 	PassConstants mReflectedPassCB;
@@ -234,6 +409,8 @@ private:
 	Camera mCamera;
 
 	POINT mLastMousePos;
+
+	std::wstring mReplayFile;
 };
 
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE prevInstance,
@@ -244,12 +421,37 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE prevInstance,
 	_CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
 #endif
 
+	// Offline step: refresh every model cache and exit without creating a window.
+	if (d3dUtil::HasCommandLineFlag(L"bakemeshes"))
+	{
+		const wchar_t* models[] = { L"Models/skull.txt", L"Models/car.txt" };
+		for (const wchar_t* model : models)
+		{
+			if (!MeshCache::Bake(model))
+				OutputDebugStringW((std::wstring(L"Failed to bake ") + model + L"\n").c_str());
+		}
+		return 0;
+	}
+
+	// Load testing: simulated players only, with no window or device.
+	if (d3dUtil::HasCommandLineFlag(L"bots"))
+	{
+		BotHost bots;
+		if (!bots.Initialize(D3DApp::DefaultServerHost, D3DApp::DefaultServerPort))
+			return 1;
+
+		return bots.Run();
+	}
+
 	try
 	{
 		StencilApp theApp(hInstance);
 		if (!theApp.Initialize())
 			return 0;
 
+		if (d3dUtil::HasCommandLineFlag(L"replayfast"))
+			return theApp.RunReplayBenchmark();
+
 		return theApp.Run();
 	}
 	catch (DxException& e)
@@ -267,8 +469,27 @@ StencilApp::StencilApp(HINSTANCE hInstance)
 
 StencilApp::~StencilApp()
 {
+	// Receive wakes at least every ReceiveTimeoutMs, so the thread notices the flag
+	// and exits before the socket backend it reads from is destroyed.
+	mReceiverRunning = false;
+	if (mReceiverThread.joinable())
+		mReceiverThread.join();
+
+	// Only still running if Initialize threw while assets were loading.
+	if (mLoaderThread.joinable())
+		mLoaderThread.join();
+
 	if (md3dDevice != nullptr)
+	{
+		// Uploads must land before the copy allocators are released, even if the
+		// direct queue never got as far as waiting for them.
+		if (mCopyFence != nullptr)
+			mCommandQueue->Wait(mCopyFence.Get(), mCopyFenceValue);
 		FlushCommandQueue();
+	}
+
+	if (mAssetsLoadedEvent != nullptr)
+		CloseHandle(mAssetsLoadedEvent);
 }
 
 
@@ -278,118 +499,386 @@ void StencilApp::OutputDebugMessage(const std::string& message) {
 }
 
 
-void StencilApp::ParsePacket(const char* buf, Packet& packet) {
-	std::string data(buf);
-	size_t pos = 0;
+bool StencilApp::ParsePacket(const char* buf, int length, Packet& packet) {
+	if (length <= 0)
+		return false;
 
-	packet.packetType = static_cast<uint8_t>(std::stoi(data.substr(pos++, 1)));
-	packet.playerId = static_cast<uint16_t>(std::stoi(data.substr(pos++, 1)));
-	packet.movementState = static_cast<uint8_t>(std::stoi(data.substr(pos++, 1)));
-	packet.direction = static_cast<uint8_t>(std::stoi(data.substr(pos++, 1)));
+	return NetProtocol::DecodePacket(reinterpret_cast<const uint8_t*>(buf), static_cast<size_t>(length), packet);
+}
 
-	size_t nameStart = pos;
-	while (nameStart < data.length() && std::isdigit(data[nameStart])) {
-		++nameStart;
-	}
-	packet.timestamp = static_cast<uint32_t>(std::stoul(data.substr(pos, nameStart - pos)));
-	pos = nameStart;
+void StencilApp::StartAsyncMessageReceiver(std::atomic<bool>& isRunning) {
+	mReceiverThread = std::thread([this, &isRunning]() {
+		Profiler::SetThreadName("Receiver");
+		Datagram datagrams[SocketBackend::MaxBatchSize];
+		while (isRunning) {
+			// Each wakeup hands back every datagram the backend has ready, pointing
+			// into its own buffers.
+			int count = mSocketBackend->Receive(datagrams, SocketBackend::MaxBatchSize);
+			if (count == 0)
+				continue;
+
+			PROFILE_SCOPE("HandleDatagrams");
+			for (int i = 0; i < count; ++i) {
+				mCapture.Record(NetCaptureWriter::Received, datagrams[i].Data, datagrams[i].Length);
+
+				LARGE_INTEGER start, end;
+				QueryPerformanceCounter(&start);
+				HandleDatagram(datagrams[i].Data, datagrams[i].Length);
+				QueryPerformanceCounter(&end);
+
+				mNetStats.Add(NetStats::DatagramsIn);
+				mNetStats.Add(NetStats::BytesIn, static_cast<uint64_t>(datagrams[i].Length));
+				mNetStats.Add(NetStats::ParseTicks, static_cast<uint64_t>(end.QuadPart - start.QuadPart));
+			}
+		}
+	});
 }
 
-auto packetComparator = [](const Packet& lhs, const Packet& rhs) {
-	return lhs.timestamp > rhs.timestamp;
-};
+void StencilApp::StartReplay(std::atomic<bool>& isRunning) {
+	mReceiverThread = std::thread([this, &isRunning]() {
+		Profiler::SetThreadName("Replay");
 
-std::priority_queue<Packet, std::vector<Packet>, decltype(packetComparator)> packetQueue(packetComparator);
-std::mutex packetQueueMutex;
+		NetCaptureReader reader;
+		if (!reader.Open(mReplayFile)) {
+			OutputDebugMessage("Failed to open network capture");
+			return;
+		}
 
-void StencilApp::StartAsyncMessageReceiver(SOCKET& udpSocket, std::atomic<bool>& isRunning) {
-	std::thread receiverThread([=, &udpSocket, &isRunning]() {
-		char buffer[64];
-		while (isRunning) {
-			sockaddr_in senderAddr;
-			int senderAddrSize = sizeof(senderAddr);
-
-			int bytesReceived = recvfrom(udpSocket, buffer, sizeof(buffer), 0, (sockaddr*)&senderAddr, &senderAddrSize);
-			if (bytesReceived > 0) {
-				std::lock_guard<std::mutex> guard(this->movementMutex);
-				ParsePacket(buffer, this->lastPacket);
-				if (this->lastPacket.movementState == 0) {
-					// When movementState is 0, stop moving
-					this->movementState = 0;
-				}
-				else {
-					// Update direction and keep moving
-					this->movementState = 1;
-				}
-			}
+		// What we sent is produced afresh by this run's own input.
+		auto start = std::chrono::steady_clock::now();
+		NetCaptureReader::Record record;
+		while (isRunning && reader.Next(record)) {
+			if (record.Direction != NetCaptureWriter::Received)
+				continue;
+
+			// Short sleeps so a shutdown is noticed during long gaps.
+			auto due = start + std::chrono::microseconds(record.TimeUs);
+			for (auto now = std::chrono::steady_clock::now(); isRunning && now < due; now = std::chrono::steady_clock::now())
+				std::this_thread::sleep_for((std::min)(std::chrono::duration_cast<std::chrono::milliseconds>(due - now), std::chrono::milliseconds(100)));
+
+			HandleDatagram(reinterpret_cast<const char*>(record.Data.data()), static_cast<int>(record.Data.size()));
 		}
+		OutputDebugMessage("Network replay finished");
 	});
-	receiverThread.detach(); // Detach the thread so it runs independently
 }
-void ProcessPackets() {
-	
+
+int StencilApp::RunReplayBenchmark() {
+	NetCaptureReader reader;
+	if (!reader.Open(mReplayFile)) {
+		OutputDebugMessage("Failed to open network capture");
+		return 1;
+	}
+
+	// Everything runs on this thread, so the ring is drained after every datagram and
+	// never overflows.  Inputs we sent are replayed through UpdatePosition.
+	uint64_t received = 0;
+	uint64_t inputs = 0;
+	int64_t parseTicks = 0;
+	int64_t updateTicks = 0;
+	int64_t inputTicks = 0;
+
+	int64_t start = Profiler::Now();
+	NetCaptureReader::Record record;
+	while (reader.Next(record)) {
+		const uint8_t* bytes = record.Data.data();
+		size_t remaining = record.Data.size();
+
+		if (record.Direction == NetCaptureWriter::Received) {
+			int64_t t0 = Profiler::Now();
+			HandleDatagram(reinterpret_cast<const char*>(bytes), static_cast<int>(remaining));
+			int64_t t1 = Profiler::Now();
+			DrainPackets();
+			ProcessMessages();
+			int64_t t2 = Profiler::Now();
+
+			parseTicks += t1 - t0;
+			updateTicks += t2 - t1;
+			++received;
+			continue;
+		}
+
+		int64_t t0 = Profiler::Now();
+		NetProtocol::PacketType type;
+		size_t messageLength;
+		while ((messageLength = NetProtocol::ReadHeader(bytes, remaining, type)) != 0) {
+			Packet packet;
+			if (type == NetProtocol::PacketType::Movement &&
+				NetProtocol::DecodePacket(bytes, messageLength, packet) && packet.movementState != 0) {
+				// Inverse of DetermineDirection.
+				static const uint8_t directionKeys[] = {
+					0,
+					PredictionBuffer::KeyW, PredictionBuffer::KeyS, PredictionBuffer::KeyD, PredictionBuffer::KeyA,
+					PredictionBuffer::KeyW | PredictionBuffer::KeyD, PredictionBuffer::KeyW | PredictionBuffer::KeyA,
+					PredictionBuffer::KeyS | PredictionBuffer::KeyA, PredictionBuffer::KeyS | PredictionBuffer::KeyD
+				};
+				uint8_t keys = packet.direction < _countof(directionKeys) ? directionKeys[packet.direction] : 0;
+				UpdatePosition((keys & PredictionBuffer::KeyA) != 0, (keys & PredictionBuffer::KeyD) != 0,
+					(keys & PredictionBuffer::KeyW) != 0, (keys & PredictionBuffer::KeyS) != 0,
+					packet.inputUs / 1000000.0f);
+				++inputs;
+			}
+
+			bytes += messageLength;
+			remaining -= messageLength;
+		}
+		inputTicks += Profiler::Now() - t0;
+	}
+	double totalMs = Profiler::TicksToMs(Profiler::Now() - start);
+
+	std::ostringstream oss;
+	oss.setf(std::ios::fixed);
+	oss.precision(3);
+	oss << "Replayed " << received << " datagrams and " << inputs << " inputs in " << totalMs << " ms\n"
+		<< "  parse:   " << (received ? Profiler::TicksToMs(parseTicks) * 1000.0 / received : 0.0) << " us/datagram\n"
+		<< "  update:  " << (received ? Profiler::TicksToMs(updateTicks) * 1000.0 / received : 0.0) << " us/datagram\n"
+		<< "  input:   " << (inputs ? Profiler::TicksToMs(inputTicks) * 1000.0 / inputs : 0.0) << " us/input\n";
+	OutputDebugStringA(oss.str().c_str());
+	return 0;
+}
+
+void StencilApp::HandleDatagram(const char* data, int length) {
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+	size_t remaining = static_cast<size_t>(length);
+
+	// Anything without a message header is the server's world-state text.
+	NetProtocol::PacketType type;
+	if (NetProtocol::ReadHeader(bytes, remaining, type) == 0) {
+		StoreSnapshot(data, length);
+		return;
+	}
+
+	// Senders coalesce a tick's messages, so walk every one in the datagram.
+	uint32_t now = NetProtocol::NowMs();
+	size_t messageLength;
+	while ((messageLength = NetProtocol::ReadHeader(bytes, remaining, type)) != 0) {
+		if (type == NetProtocol::PacketType::Channel) {
+			mChannel.ReceiveHeader(bytes, messageLength, now);
+		}
+		else if (type == NetProtocol::PacketType::Reliable) {
+			// Handled once each, in the order the server sent them.
+			mChannel.ReceiveReliable(bytes, messageLength, [this](const uint8_t* inner, size_t innerLength) {
+				HandleMessage(inner, innerLength);
+			});
+		}
+		else {
+			HandleMessage(bytes, messageLength);
+		}
+
+		bytes += messageLength;
+		remaining -= messageLength;
+	}
+}
+
+void StencilApp::HandleMessage(const uint8_t* data, size_t length) {
+	NetProtocol::PacketType type;
+	size_t messageLength = NetProtocol::ReadHeader(data, length, type);
+	if (messageLength == 0)
+		return;
+
+	mNetStats.Add(NetStats::MessagesIn);
+
+	const char* message = reinterpret_cast<const char*>(data);
+	Packet packet;
+	if (type == NetProtocol::PacketType::Snapshot) {
+		StoreSnapshot(message, static_cast<int>(messageLength));
+	}
+	else if (ParsePacket(message, static_cast<int>(messageLength), packet)) {
+		// The ring counts the packet as an overflow if the game thread has fallen behind.
+		mPacketRing.TryPush(packet);
+	}
+}
+
+void StencilApp::StoreSnapshot(const char* buf, int length) {
+	size_t size = MathHelper::Min(static_cast<size_t>(length), mSnapshotBuffer.size());
+
+	std::lock_guard<std::mutex> guard(this->messageMutex);
+	memcpy(mSnapshotBuffer.data(), buf, size);
+	mSnapshotLength = size;
+	mSnapshotSeq.fetch_add(1, std::memory_order_release);
 }
 
+void StencilApp::DrainPackets() {
+	PROFILE_SCOPE("DrainPackets");
+	uint32_t now = NetProtocol::NowMs();
+
+	Packet packet;
+	while (mPacketRing.TryPop(packet)) {
+		if (packet.playerId >= mPlayerPackets.size())
+			continue;
+
+		// Packets from one player are applied in send order.  Anything older than the
+		// last one applied arrived out of order and would rewind that player.
+		Packet& last = mPlayerPackets[packet.playerId];
+		if (last.timestamp != 0 && static_cast<int32_t>(packet.timestamp - last.timestamp) < 0) {
+			++mStalePacketCount;
+			continue;
+		}
+		last = packet;
+
+		if (packet.playerId != id) {
+			mRemotePlayers[packet.playerId].Push(packet.timestamp, XMFLOAT3(packet.x, packet.y, packet.z), now);
+		}
+	}
+}
+
+
+void StencilApp::UpdateNetStats(const GameTimer& gt) {
+	if (!mNetStats.SampleDue(gt.TotalTime()))
+		return;
+
+	NetStats::External external;
+	external.DroppedIn = mPacketRing.OverflowCount();
+	external.DroppedOut = mSendQueue.DatagramsDropped();
+	external.OutOfOrder = mStalePacketCount;
+	external.Retransmits = mChannel.RetransmitCount();
+	external.QueueDepth = static_cast<uint32_t>(mPacketRing.Size());
+	external.RttMs = mChannel.SmoothedRttMs();
+	mNetStats.Update(gt.TotalTime(), external);
+}
 
 void StencilApp::ContinuousMovement(const GameTimer& gt) {
-	std::lock_guard<std::mutex> guard(this->movementMutex);
-	float dt = gt.DeltaTime();
-	if (this->movementState == 1) {
-		this->UpdatePosition(this->lastPacket, dt);
+	// Remote players are drawn from their sample history rather than integrated
+	// here, so their motion no longer depends on our frame rate or on every packet
+	// arriving.
+	uint32_t now = NetProtocol::NowMs();
+	for (size_t i = 0; i < mRemotePlayers.size(); ++i) {
+		if (static_cast<int>(i) == id)
+			continue;
+
+		XMFLOAT3 position;
+		if (mRemotePlayers[i].Sample(now, mInterpolationDelayMs, mMaxExtrapolationMs, position)) {
+			UpdatePlayers(static_cast<int>(i), position.x, position.y, position.z, mPlayerStates[i].health, gt.DeltaTime());
+		}
 	}
-	else {
-		this->UpdatePosition();
+	UpdateControlledWorldMatrix();
+}
+
+std::wstring StencilApp::ExtraFrameStats()
+{
+	// Worst jitter and totals across every remote player we have heard from.
+	float jitterMs = 0.0f;
+	uint32_t buffered = 0;
+	uint64_t late = 0;
+	uint64_t extrapolated = 0;
+	uint64_t starved = 0;
+	for (const InterpolationBuffer& remote : mRemotePlayers) {
+		if (remote.Empty())
+			continue;
+
+		const InterpolationBuffer::Stats& stats = remote.GetStats();
+		jitterMs = MathHelper::Max(jitterMs, stats.JitterMs);
+		buffered += stats.Buffered;
+		late += stats.Late;
+		extrapolated += stats.Extrapolated;
+		starved += stats.Starved;
 	}
+
+	return L"   jitter: " + std::to_wstring(jitterMs) +
+		L"ms   buffered: " + std::to_wstring(buffered) +
+		L"   late: " + std::to_wstring(late) +
+		L"   extrap: " + std::to_wstring(extrapolated) +
+		L"   starved: " + std::to_wstring(starved) +
+		L"   players: " + std::to_wstring(mPlayers.ActiveCount()) +
+		L"   drawn: " + std::to_wstring(mVisibleInstanceCount) + L"/" + std::to_wstring(mInstanceCount) +
+		(mMirrorVisible ? L"" : L"   mirror culled") +
+		mNetStats.CaptionText();
 }
 
 
+std::wstring StencilApp::ProfileFrameStats()
+{
+	std::wostringstream oss;
+	oss.setf(std::ios::fixed);
+	oss.precision(2);
+	oss << L"   gpu";
+	for (UINT range = 0; range < mGpuProfiler.RangeCount(); ++range)
+		oss << L"  " << mGpuProfiler.RangeName(range) << L": " << mGpuProfiler.AverageMs(range);
+
+	return D3DApp::ProfileFrameStats() + oss.str();
+}
+
 bool StencilApp::Initialize()
 {
 	if (!D3DApp::Initialize())
 		return false;
 
-	// Reset the command list to prep for initialization commands.
-	ThrowIfFailed(mCommandList->Reset(mDirectCmdListAlloc.Get(), nullptr));
-
 	// Get the increment size of a descriptor in this heap type.  This is hardware specific, 
 	// so we have to query this information.
 	mCbvSrvDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
 
 	mCamera.SetPosition(0.0f, 2.0f, -15.0f);
-	LoadTextures();
+
+	// Assets load in the background; meanwhile build what does not depend on them.
+	BuildWorkerPool();
+	StartAssetLoad();
 	BuildRootSignature();
-	BuildDescriptorHeaps();
-	BuildShadersAndInputLayout();
-	BuildRoomGeometry();
-	BuildSkullGeometry();
-	BuildSkull2Geometry();
-	BuildCubeMirrorGeometry();
-	BuildCarGeometry();
+	BuildInputLayout();
 	BuildMaterials();
+	if (!WaitForAssets())
+		return false;
+
+	// Reset the command list to prep for initialization commands.  Not before now:
+	// a resize while loading resets it in OnResize.
+	ThrowIfFailed(mCommandList->Reset(mDirectCmdListAlloc.Get(), nullptr));
+
+	BuildDescriptorHeaps();
 	BuildRenderItems();
+	BuildRenderBatches();
+	mLodPixelError = d3dUtil::GetCommandLineFloat(L"loderror", mLodPixelError);
+	mFrustumCullingEnabled = !d3dUtil::HasCommandLineFlag(L"nocull");
+	mInterestRadius = MathHelper::Max(d3dUtil::GetCommandLineFloat(L"interest", mInterestRadius), 0.0f);
+	mInterestFarInterval = (uint8_t)MathHelper::Clamp((int)d3dUtil::GetCommandLineFloat(L"interestfar", mInterestFarInterval), 0, 255);
+
+	// -netcsv <file> logs every network stats sample for offline analysis.
+	std::wstring netCsv;
+	if (d3dUtil::GetCommandLineValue(L"netcsv", netCsv) && !mNetStats.OpenCsv(netCsv))
+		OutputDebugStringA("Failed to open network stats CSV\n");
+
+	mEntityTransforms.SetLocalTransform(XMMatrixRotationY(0.5f * MathHelper::Pi) * XMMatrixScaling(0.45f, 0.45f, 0.45f));
+	mEntityTransforms.SetMirrorPlane(XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f)); // xy plane
+	mPlayerDrawPositions.resize(mPlayers.Capacity());
 	BuildFrameResources();
+	mGpuProfiler.Initialize(md3dDevice.Get(), mCommandQueue.Get(), gNumFrameResources,
+		{ "Opaque", "Mirrors", "Reflected", "Transparent", "Shadow" });
+	BuildLayerCommandLists();
 	BuildPSOs();
-	Connect();
+	bool replay = d3dUtil::GetCommandLineValue(L"replay", mReplayFile);
+	if (replay)
+		InitNetworking();
+	else
+		Connect();
+
+	mLocalSlot = AddPlayer(static_cast<uint16_t>(id));
+	mPlayers.Position[mLocalSlot] = SpawnPosition(static_cast<uint16_t>(id));
+	mPlayers.Health[mLocalSlot] = health;
+	mPlayers.NameId[mLocalSlot] = mPlayers.InternName(name);
+	mPrevSimPosition = mPlayers.Position[mLocalSlot];
 
 	Packet packet;
 	packet.packetType = 1;
 	packet.playerId = id;
 	packet.direction = 0;
-	packet.name = name;
 	packet.movementState = 0;
-	auto now = std::chrono::system_clock::now();
-	auto duration = now.time_since_epoch();
-	packet.timestamp = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(duration).count());
+	packet.timestamp = NetProtocol::NowMs();
+	packet.x = mPlayers.Position[mLocalSlot].x;
+	packet.y = mPlayers.Position[mLocalSlot].y;
+	packet.z = mPlayers.Position[mLocalSlot].z;
 
 	SendPacket(packet);
+	mSendQueue.Flush();
 
 	UpdateCubeWorldMatrix(car1, mCarRitem, mReflectedCarRitem);
 	//SetFloorMatrix(floor1, mFloorItem, mReflectedFloorItem);
-	UpdateSkullWorldMatrix(skull1, mSkullRitem, mReflectedSkullRitem, mShadowedSkullRitem);
-	UpdateSkullWorldMatrix(skull2, mSkullRitem_2, mReflectedSkullRitem_2, mShadowedSkullRitem_2);
+	UpdatePlayerWorldMatrix(mLocalSlot, mPlayers.Position[mLocalSlot]);
 
-	std::atomic<bool> isRunning(true);
-	StartAsyncMessageReceiver(clientSocket, isRunning);
+	// Without a socket Connect has already reported why; there is nothing to receive.
+	mReceiverRunning = true;
+	if (replay) {
+		if (!d3dUtil::HasCommandLineFlag(L"replayfast"))
+			StartReplay(mReceiverRunning);
+	}
+	else if (mSocketBackend != nullptr)
+		StartAsyncMessageReceiver(mReceiverRunning);
 
 	// Execute the initialization commands.
 	ThrowIfFailed(mCommandList->Close());
@@ -398,6 +887,26 @@ bool StencilApp::Initialize()
 
 	// Wait until initialization is complete.
 	FlushCommandQueue();
+
+	// The direct queue waited on the copy queue, so the uploads are done too and
+	// nothing needs the staging memory any more.
+	mCopyCmdLists.clear();
+	mCopyCmdAllocs.clear();
+	mUploadArena->Recycle(mCopyFence->GetCompletedValue());
+	mUploadArena->Trim();
+	for (auto& tex : mTextures)
+		tex.second->UploadHeap = nullptr;
+
+	std::ostringstream oss;
+	oss << "Static buffers: " << mStaticBuffers->BytesPlaced() / 1024 << " KB in "
+		<< mStaticBuffers->HeapCount() << " heap(s)\n";
+	if (mTextureStreamer != nullptr)
+	{
+		oss << "Streamed textures: " << mTextureStreamer->ResidentBytes() / 1024 << " KB resident at startup, "
+			<< (mTextureStreamer->Tiled() ? "tiled" : "committed, tiled resources unsupported") << "\n";
+		mTextureStreamer->Start();
+	}
+	OutputDebugStringA(oss.str().c_str());
 	return true;
 }
 
@@ -405,6 +914,8 @@ void StencilApp::OnResize()
 {
 	D3DApp::OnResize();
 	mCamera.SetLens(0.25f * MathHelper::Pi, AspectRatio(), 1.0f, 1000.0f);
+
+	BoundingFrustum::CreateFromMatrix(mCamFrustum, mCamera.GetProj());
 }
 
 void StencilApp::Update(const GameTimer& gt)
@@ -417,20 +928,29 @@ void StencilApp::Update(const GameTimer& gt)
 
 	// Has the GPU finished processing the commands of the current frame resource?
 	// If not, wait until the GPU has completed commands up to this fence point.
-	if (mCurrFrameResource->Fence != 0 && mFence->GetCompletedValue() < mCurrFrameResource->Fence)
+	if (mCurrFrameResource->Fence != 0)
 	{
-		HANDLE eventHandle = CreateEventEx(nullptr, false, false, EVENT_ALL_ACCESS);
-		ThrowIfFailed(mFence->SetEventOnCompletion(mCurrFrameResource->Fence, eventHandle));
-		WaitForSingleObject(eventHandle, INFINITE);
-		CloseHandle(eventHandle);
+		WaitForFence(mCurrFrameResource->Fence);
+
+		// This frame resource's timestamps have landed too.
+		mGpuProfiler.Collect(mCurrFrameResourceIndex);
 	}
+	DrainPackets();
+	UpdateNetStats(gt);
 	ContinuousMovement(gt);
 	AnimateMaterials(gt);
-	UpdateObjectCBs(gt);
-	UpdateMaterialCBs(gt);
+	UpdateTextureStreaming();
+	UpdateMaterialBuffer(gt);
 	UpdateMainPassCB(gt);
 	UpdateReflectedPassCB(gt);
-	ProcessMessages(receivedMessage);
+	UpdatePlayerTransforms();
+	UpdateInstanceBuffer(gt);
+	CullRenderItems();
+	RequestTextureMips();
+	ProcessMessages();
+
+	// Acks and anything else produced outside a tick.
+	mSendQueue.Flush();
 	//UpdateCubeFaceReflection(mCarRitem);
 
 	//UpdateGameState(gt);
@@ -447,10 +967,7 @@ void StencilApp::Draw(const GameTimer& gt)
 
 	// A command list can be reset after it has been added to the command queue via ExecuteCommandList.
 	// Reusing the command list reuses memory.
-	ThrowIfFailed(mCommandList->Reset(cmdListAlloc.Get(), mPSOs["opaque"].Get()));
-
-	mCommandList->RSSetViewports(1, &mScreenViewport);
-	mCommandList->RSSetScissorRects(1, &mScissorRect);
+	ThrowIfFailed(mCommandList->Reset(cmdListAlloc.Get(), nullptr));
 
 	// Indicate a state transition on the resource usage.
 	mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(CurrentBackBuffer(),
@@ -460,58 +977,55 @@ void StencilApp::Draw(const GameTimer& gt)
 	mCommandList->ClearRenderTargetView(CurrentBackBufferView(), (float*)&mMainPassCB.FogColor, 0, nullptr);
 	mCommandList->ClearDepthStencilView(DepthStencilView(), D3D12_CLEAR_FLAG_DEPTH | D3D12_CLEAR_FLAG_STENCIL, 1.0f, 0, 0, nullptr);
 
-	// Specify the buffers we are going to render to.
-	mCommandList->OMSetRenderTargets(1, &CurrentBackBufferView(), true, &DepthStencilView());
-
-	ID3D12DescriptorHeap* descriptorHeaps[] = { mSrvDescriptorHeap.Get() };
-	mCommandList->SetDescriptorHeaps(_countof(descriptorHeaps), descriptorHeaps);
-
-	mCommandList->SetGraphicsRootSignature(mRootSignature.Get());
-
-	UINT passCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(PassConstants));
-
-	// Draw opaque items--floors, walls, skull.
-	auto passCB = mCurrFrameResource->PassCB->Resource();
-	mCommandList->SetGraphicsRootConstantBufferView(2, passCB->GetGPUVirtualAddress());
-	DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Opaque]);
-
-	// Mark the visible mirror pixels in the stencil buffer with the value 1
-	mCommandList->OMSetStencilRef(1);
-	mCommandList->SetPipelineState(mPSOs["markStencilMirrors"].Get());
-	DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Mirrors]);
-
-	// Draw the reflection into the mirror only (only for pixels where the stencil buffer is 1).
-	// Note that we must supply a different per-pass constant buffer--one with the lights reflected.
-	mCommandList->SetGraphicsRootConstantBufferView(2, passCB->GetGPUVirtualAddress() + 1 * passCBByteSize);
-	mCommandList->SetPipelineState(mPSOs["drawStencilReflections"].Get());
-	DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Reflected]);
-
-	// Restore main pass constants and stencil ref.
-	mCommandList->SetGraphicsRootConstantBufferView(2, passCB->GetGPUVirtualAddress());
-	mCommandList->OMSetStencilRef(0);
+	ThrowIfFailed(mCommandList->Close());
 
-	// Draw mirror with transparency so reflection blends through.
-	mCommandList->SetPipelineState(mPSOs["transparent"].Get());
-	DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Transparent]);
+	// Record every layer at once; each touches only its own list and allocator.
+	mRenderWorkers->ParallelFor((UINT)RenderLayer::Count, [this](unsigned layer)
+	{
+		if (LayerVisible((RenderLayer)layer))
+		{
+			PROFILE_SCOPE("RecordLayer");
+			RecordLayer((RenderLayer)layer);
+		}
+	});
 
-	// Draw shadows for original skull
-	mCommandList->SetPipelineState(mPSOs["shadow"].Get());
-	DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Shadow]);
+	// The end list shares the frame's allocator with mCommandList, which is allowed
+	// because the two are never recording at the same time.
+	ThrowIfFailed(mEndCmdList->Reset(cmdListAlloc.Get(), nullptr));
 
 	// Indicate a state transition on the resource usage.
-	mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(CurrentBackBuffer(),
+	mEndCmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(CurrentBackBuffer(),
 		D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_PRESENT));
 
+	// Every layer that ran wrote its timestamps by now.
+	mGpuProfiler.Resolve(mEndCmdList.Get(), mCurrFrameResourceIndex);
+
 	// Done recording commands.
-	ThrowIfFailed(mCommandList->Close());
+	ThrowIfFailed(mEndCmdList->Close());
 
-	// Add the command list to the queue for execution.
-	ID3D12CommandList* cmdsLists[] = { mCommandList.Get() };
-	mCommandQueue->ExecuteCommandLists(_countof(cmdsLists), cmdsLists);
+	// Add the command lists to the queue for execution, in draw order.
+	static const RenderLayer drawOrder[] =
+	{
+		RenderLayer::Opaque, RenderLayer::Mirrors, RenderLayer::Reflected, RenderLayer::Transparent, RenderLayer::Shadow
+	};
+
+	ID3D12CommandList* cmdsLists[(int)RenderLayer::Count + 2];
+	UINT cmdListCount = 0;
+	cmdsLists[cmdListCount++] = mCommandList.Get();
+	for (RenderLayer layer : drawOrder)
+	{
+		if (LayerVisible(layer))
+			cmdsLists[cmdListCount++] = mLayerCmdLists[(int)layer].Get();
+	}
+	cmdsLists[cmdListCount++] = mEndCmdList.Get();
+	mCommandQueue->ExecuteCommandLists(cmdListCount, cmdsLists);
 
 	// Swap the back and front buffers
-	ThrowIfFailed(mSwapChain->Present(0, 0));
-	mCurrBackBuffer = (mCurrBackBuffer + 1) % SwapChainBufferCount;
+	{
+		PROFILE_SCOPE("Present");
+		ThrowIfFailed(mSwapChain->Present(mSyncInterval, 0));
+	}
+	mCurrBackBuffer = (mCurrBackBuffer + 1) % mSwapChainBufferCount;
 
 	// Advance the fence value to mark commands up to this fence point.
 	mCurrFrameResource->Fence = ++mCurrentFence;
@@ -520,6 +1034,77 @@ void StencilApp::Draw(const GameTimer& gt)
 	mCommandQueue->Signal(mFence.Get(), mCurrentFence);
 }
 
+void StencilApp::RecordLayer(RenderLayer layer)
+{
+	// Command lists inherit no state from the one before them, so each layer sets
+	// everything it draws with.
+	struct LayerState
+	{
+		const char* PSO;
+		UINT StencilRef;
+		UINT PassIndex;
+		UINT LodBias;
+	};
+
+	static const LayerState layerStates[(int)RenderLayer::Count] =
+	{
+		// Draw opaque items--floors, walls, skull.
+		{ "opaque", 0, 0, 0 },
+
+		// Mark the visible mirror pixels in the stencil buffer with the value 1
+		{ "markStencilMirrors", 1, 0, 0 },
+
+		// Draw the reflection into the mirror only (only for pixels where the stencil buffer is 1).
+		// Note that we must supply a different per-pass constant buffer--one with the lights reflected.
+		// Reflections are seen through the mirror's tint, so one LOD coarser will do.
+		{ "drawStencilReflections", 1, 1, 1 },
+
+		// Draw mirror with transparency so reflection blends through.
+		{ "transparent", 0, 0, 0 },
+
+		// Draw shadows for original skull.  Flat and blended, so one LOD coarser too.
+		{ "shadow", 0, 0, 1 },
+	};
+
+	const LayerState& state = layerStates[(int)layer];
+	auto cmdListAlloc = mCurrFrameResource->LayerCmdListAllocs[(int)layer];
+	auto cmdList = mLayerCmdLists[(int)layer].Get();
+
+	ThrowIfFailed(cmdListAlloc->Reset());
+	ThrowIfFailed(cmdList->Reset(cmdListAlloc.Get(), mPSOs.at(state.PSO).Get()));
+	mGpuProfiler.BeginRange(cmdList, mCurrFrameResourceIndex, (UINT)layer);
+
+	cmdList->RSSetViewports(1, &mScreenViewport);
+	cmdList->RSSetScissorRects(1, &mScissorRect);
+
+	// Specify the buffers we are going to render to.
+	cmdList->OMSetRenderTargets(1, &CurrentBackBufferView(), true, &DepthStencilView());
+	cmdList->OMSetStencilRef(state.StencilRef);
+
+	ID3D12DescriptorHeap* descriptorHeaps[] = { mSrvDescriptorHeap.Get() };
+	cmdList->SetDescriptorHeaps(_countof(descriptorHeaps), descriptorHeaps);
+
+	cmdList->SetGraphicsRootSignature(mRootSignature.Get());
+
+	// Everything but the per-draw constants is bound once per list: the shaders
+	// index the instance and material buffers and the texture table themselves.
+	auto instanceBuffer = mCurrFrameResource->InstanceBuffer->Resource();
+	cmdList->SetGraphicsRootShaderResourceView(1, instanceBuffer->GetGPUVirtualAddress());
+
+	auto matBuffer = mCurrFrameResource->MaterialBuffer->Resource();
+	cmdList->SetGraphicsRootShaderResourceView(2, matBuffer->GetGPUVirtualAddress());
+
+	UINT passCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(PassConstants));
+	auto passCB = mCurrFrameResource->PassCB->Resource();
+	cmdList->SetGraphicsRootConstantBufferView(3, passCB->GetGPUVirtualAddress() + state.PassIndex * passCBByteSize);
+
+	cmdList->SetGraphicsRootDescriptorTable(4, mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+
+	DrawRenderItems(cmdList, mBatchLayer[(int)layer], state.LodBias);
+
+	mGpuProfiler.EndRange(cmdList, mCurrFrameResourceIndex, (UINT)layer);
+	ThrowIfFailed(cmdList->Close());
+}
 
 void StencilApp::OnMouseDown(WPARAM btnState, int x, int y)
 {
@@ -588,134 +1173,76 @@ bool prevW = false;
 bool prevS = false;
 bool wasMoving = false;
 
-void StencilApp::UpdatePosition(bool A, bool D, bool W, bool S, float dt, XMFLOAT3* position) {
-	XMFLOAT3* skull = (player == 1) ? &skull1 : &skull2;
-	if (A) skull->x -= 1.0f * dt;
-	if (D) skull->x += 1.0f * dt;
-	if (W) skull->y += 1.0f * dt;
-	if (S) skull->y -= 1.0f * dt;
-	skull->y = MathHelper::Max(skull->y, 0.0f);
-	id == 2 ? UpdateSkullWorldMatrix(*skull, mSkullRitem_2, mReflectedSkullRitem_2, mShadowedSkullRitem_2)
-		: UpdateSkullWorldMatrix(*skull, mSkullRitem, mReflectedSkullRitem, mShadowedSkullRitem);
+void StencilApp::UpdatePosition(bool A, bool D, bool W, bool S, float dt)
+{
+	// Update the position of the currently controlled object based on input.  Its
+	// world matrix is set once per frame by UpdateControlledWorldMatrix.
+	PredictionBuffer::ApplyInput(PredictionBuffer::PackKeys(A, D, W, S), dt, *ControlledPosition());
 }
 
-void StencilApp::UpdatePosition(bool A, bool D, bool W, bool S, float dt)
+XMFLOAT3* StencilApp::ControlledPosition()
 {
-	// Determine which object is currently controlled
-	XMFLOAT3* position;
-	switch (mControlledObject) {
-	case ControlledObject::Skull1:
-		position = &skull1;
-		break;
-	case ControlledObject::Skull2:
-		position = &skull2;
-		break;
-	case ControlledObject::Car:
-		position = &car1; // Assuming you have carPosition defined similarly to skull1 and skull2
-		break;
-	}
-
-	// Update the position based on input
-	if (A) position->x -= 1.0f * dt;
-	if (D) position->x += 1.0f * dt;
-	if (W) position->y += 1.0f * dt;
-	if (S) position->y -= 1.0f * dt;
-	position->y = MathHelper::Max(position->y, 0.0f);
+	if (mControlledObject == ControlledObject::Car)
+		return &car1;
+
+	return &mPlayers.Position[mLocalSlot];
+}
+
+void StencilApp::UpdateControlledWorldMatrix()
+{
+	// Draw the controlled object between the last two simulated ticks.  Right after
+	// switching objects there is no previous tick for the new one, so use its current state.
+	XMFLOAT3* current = ControlledPosition();
+	XMFLOAT3 position = *current;
+	if (mPrevSimObject == mControlledObject) {
+		XMVECTOR p = XMVectorLerp(XMLoadFloat3(&mPrevSimPosition), XMLoadFloat3(current), SimAlpha());
+		XMStoreFloat3(&position, p);
+	}
 
 	// Call the appropriate function to update the world matrix
 	if (mControlledObject == ControlledObject::Car) {
-		UpdateCubeWorldMatrix(*position, mCarRitem, mReflectedCarRitem); // Assuming mCarRitem and mReflectedCarRitem are your car RenderItems
+		UpdateCubeWorldMatrix(position, mCarRitem, mReflectedCarRitem);
 	}
 	else {
-		// This assumes that skull objects are differentiated by an ID or a player variable.
-		// You may need to adjust based on your actual setup for identifying which skull is which.
-		if (mControlledObject == ControlledObject::Skull1) {
-			UpdateSkullWorldMatrix(*position, mSkullRitem, mReflectedSkullRitem, mShadowedSkullRitem);
-		}
-		else if (mControlledObject == ControlledObject::Skull2) {
-			UpdateSkullWorldMatrix(*position, mSkullRitem_2, mReflectedSkullRitem_2, mShadowedSkullRitem_2);
-		}
+		UpdatePlayerWorldMatrix(mLocalSlot, position);
 	}
 }
 
-
-void StencilApp::UpdatePosition() {
-	XMFLOAT3* skull = (player == 1) ? &skull1 : &skull2;
-	skull->y = MathHelper::Max(skull->y, 0.0f);
-	id == 2 ? UpdateSkullWorldMatrix(*skull, mSkullRitem_2, mReflectedSkullRitem_2, mShadowedSkullRitem_2)
-		: UpdateSkullWorldMatrix(*skull, mSkullRitem, mReflectedSkullRitem, mShadowedSkullRitem);
-}
-
-void StencilApp::UpdatePosition(Packet packet, float dt)
+void StencilApp::FixedUpdate(float dt)
 {
-	XMFLOAT3* skull = (packet.playerId == 1) ? &skull1 : &skull2;
-	if (packet.movementState == 1 && packet.playerId != id) {
-		switch (packet.direction) {
-		case 0:
-			break;
-		case 1:
-			skull->y += 1.0f * dt;
-			break;
-		case 2:
-			skull->y -= 1.0f * dt;
-			break;
-		case 3:
-			skull->x += 1.0f * dt;
-			break;
-		case 4:
-			skull->x -= 1.0f * dt;
-			break;
-		case 5:
-			skull->x += 1.0f * dt;
-			skull->y += 1.0f * dt;
-			break;
-		case 6:
-			skull->x -= 1.0f * dt;
-			skull->y += 1.0f * dt;
-			break;
-		case 7:
-			skull->x -= 1.0f * dt;
-			skull->y -= 1.0f * dt;
-			break;
-		case 8:
-			
-			skull->x += 1.0f * dt;
-			skull->y -= 1.0f * dt;
-			break;
-		}
-		skull->y = MathHelper::Max(skull->y, 0.0f);
-		
-		packet.playerId == 2 ? UpdateSkullWorldMatrix(*skull, mSkullRitem_2, mReflectedSkullRitem_2, mShadowedSkullRitem_2)
-			: UpdateSkullWorldMatrix(*skull, mSkullRitem, mReflectedSkullRitem, mShadowedSkullRitem);
+	// Keep the state this tick starts from so frames can blend toward the new one.
+	mPrevSimObject = mControlledObject;
+	mPrevSimPosition = *ControlledPosition();
+
+	SimulateInput(dt);
+	UpdateSubscription(dt);
 
+	if (mControlledObject == ControlledObject::Player) {
+		XMVECTOR delta = XMLoadFloat3(ControlledPosition()) - XMLoadFloat3(&mPrevSimPosition);
+		XMStoreFloat3(&mPlayers.Velocity[mLocalSlot], delta / dt);
 	}
-	this->lastPacket = packet;
 
+	// Everything this tick produced leaves in one datagram, along with any reliable
+	// messages that were waiting for room in the send window.
+	RetryReliable();
+	mSendQueue.Flush();
 }
 
-
 void StencilApp::OnKeyboardInput(const GameTimer& gt)
 {
 	const float dt = gt.DeltaTime();
 
-	if (GetAsyncKeyState('1') & 0x8000) {
-		mControlledObject = ControlledObject::Skull1;
-	}
-	if (GetAsyncKeyState('2') & 0x8000) {
-		mControlledObject = ControlledObject::Skull2;
+	// Inputs predicted before a switch were for the other object; drop them so a
+	// late ack cannot replay them onto the skull.
+	if ((GetAsyncKeyState('1') & 0x8000) && mControlledObject != ControlledObject::Player) {
+		mControlledObject = ControlledObject::Player;
+		mPrediction.Reset();
 	}
-	if (GetAsyncKeyState('3') & 0x8000) {
+	if ((GetAsyncKeyState('3') & 0x8000) && mControlledObject != ControlledObject::Car) {
 		mControlledObject = ControlledObject::Car;
+		mPrediction.Reset();
 	}
 
-
-	XMFLOAT3* currentSkullPosition = (player == 1) ? &skull1 : &skull2;
-
-	bool currentA = (GetAsyncKeyState('A') & 0x8000) != 0;
-	bool currentD = (GetAsyncKeyState('D') & 0x8000) != 0;
-	bool currentW = (GetAsyncKeyState('W') & 0x8000) != 0;
-	bool currentS = (GetAsyncKeyState('S') & 0x8000) != 0;
-
 	if (GetAsyncKeyState(VK_UP) & 0x8000)
 		mCamera.Walk(10.0f * dt);
 
@@ -727,80 +1254,81 @@ void StencilApp::OnKeyboardInput(const GameTimer& gt)
 
 	if (GetAsyncKeyState(VK_RIGHT) & 0x8000)
 		mCamera.Strafe(10.0f * dt);
+
 	mCamera.UpdateViewMatrix();
+}
+
+void StencilApp::SimulateInput(float dt)
+{
+	bool currentA = (GetAsyncKeyState('A') & 0x8000) != 0;
+	bool currentD = (GetAsyncKeyState('D') & 0x8000) != 0;
+	bool currentW = (GetAsyncKeyState('W') & 0x8000) != 0;
+	bool currentS = (GetAsyncKeyState('S') & 0x8000) != 0;
 
 	uint8_t newDirection = DetermineDirection(currentA, currentD, currentW, currentS);
-	bool justStartedMoving = !wasMoving && (currentA || currentD || currentW || currentS);
-	bool justStoppedMoving = wasMoving && !(currentA || currentD || currentW || currentS);
-	bool directionChanged = wasMoving && (newDirection != prevDirection);
-
-	if (justStartedMoving || directionChanged) {
-		// User began moving or changed direction
-		Packet movingPacket;
-		movingPacket.packetType = 0; // Movement
-		movingPacket.playerId = id;
-		movingPacket.movementState = 1; // Moving
-		movingPacket.direction = newDirection;
-
-		auto now = std::chrono::system_clock::now();
-		auto duration = now.time_since_epoch();
-		movingPacket.timestamp = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(duration).count());
-
-		SendPacket(movingPacket);
-	}
-	else if (justStoppedMoving) {
-		// User stopped moving, send a packet indicating stationary
-		Packet stopMovingPacket;
-		stopMovingPacket.packetType = 0; // Movement
-		stopMovingPacket.playerId = id;
-		stopMovingPacket.movementState = 0; // Not moving
-		stopMovingPacket.direction = 0; // Stationary
-
-		auto now = std::chrono::system_clock::now();
-		auto duration = now.time_since_epoch();
-		stopMovingPacket.timestamp = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(duration).count());
-
-		SendPacket(stopMovingPacket);
-	}
-
-	if (currentA || currentD || currentW || currentS) {
-		// Update position based on the currently controlled object
-		switch (mControlledObject) {
-		case ControlledObject::Skull1:
-			UpdatePosition(currentA, currentD, currentW, currentS, dt);
-			break;
-		case ControlledObject::Skull2:
-			UpdatePosition(currentA, currentD, currentW, currentS, dt);
-			break;
-		case ControlledObject::Car:
-			UpdatePosition(currentA, currentD, currentW, currentS, dt); // Assuming carPosition is defined
-			break;
+	bool moving = currentA || currentD || currentW || currentS;
+
+	// Every tick of held input is applied immediately and sent as its own numbered
+	// input, plus one for the tick the keys are released.  The duration is quantized
+	// to what goes on the wire so the server integrates exactly what we predicted.
+	if (moving || wasMoving) {
+		uint32_t inputUs = moving ? static_cast<uint32_t>(dt * 1000000.0f) : 0;
+		float inputDt = inputUs / 1000000.0f;
+
+		if (moving) {
+			// Update position based on the currently controlled object
+			UpdatePosition(currentA, currentD, currentW, currentS, inputDt);
 		}
-	}
 
+		// The keys drive the car, which the server does not simulate; as far as it
+		// knows the avatar is standing still.
+		bool drivingCar = mControlledObject == ControlledObject::Car;
+		XMFLOAT3* localSkull = &mPlayers.Position[mLocalSlot];
+		uint8_t keys = drivingCar ? 0 : PredictionBuffer::PackKeys(currentA, currentD, currentW, currentS);
+
+		Packet inputPacket;
+		inputPacket.packetType = 0; // Movement
+		inputPacket.playerId = id;
+		inputPacket.movementState = moving && !drivingCar ? 1 : 0;
+		inputPacket.direction = drivingCar ? 0 : newDirection;
+		inputPacket.timestamp = NetProtocol::NowMs();
+		inputPacket.inputSeq = mPrediction.Record(keys, inputDt, *localSkull);
+		inputPacket.inputUs = inputUs;
+		inputPacket.x = localSkull->x;
+		inputPacket.y = localSkull->y;
+		inputPacket.z = localSkull->z;
+
+		SendPacket(inputPacket);
+	}
 
 	prevA = currentA;
 	prevD = currentD;
 	prevW = currentW;
 	prevS = currentS;
-	wasMoving = currentA || currentD || currentW || currentS;
+	wasMoving = moving;
 	prevDirection = newDirection;
-
-	mCamera.UpdateViewMatrix();
 }
 
 void StencilApp::SendPacket(const Packet& packet) {
 
-	std::string buf;
-	buf.append(std::to_string(packet.packetType));
-	buf.append(std::to_string(packet.playerId));
-	buf.append(std::to_string(packet.movementState));
-	buf.append(std::to_string(packet.direction));
-	buf.append(std::to_string(packet.timestamp));
-	buf.append(name);
+	// Every packet carries the local player's name, as the text encoding did.
+	Packet out = packet;
+	NetProtocol::SetName(out, name.data(), name.size());
+
+	uint8_t buf[NetProtocol::kMaxPacketSize];
+	size_t length = NetProtocol::EncodePacket(out, buf, sizeof(buf));
+	if (length == 0)
+		return;
+
+	// A lost join would leave us invisible to everyone, so it goes on the reliable
+	// channel.  Movement is superseded every tick and is cheaper to just send again.
+	if (out.packetType == static_cast<uint8_t>(NetProtocol::PacketType::Join)) {
+		SendReliable(buf, length);
+		return;
+	}
 
-	// Assuming `socket` and `serverAddr` are defined and set up elsewhere
-	SendUDPMessage(clientSocket, buf.c_str(), "192.168.1.67", 8000);
+	// Coalesced with everything else sent this tick; see FixedUpdate.
+	mSendQueue.Append(buf, length);
 }
 void StencilApp::SendSkullPositionUpdate(const XMFLOAT3& skullPosition) 
 {
@@ -826,202 +1354,398 @@ void StencilApp::UpdateCubeFaceReflection(RenderItem* cubeFaceRitem)
 	XMStoreFloat4x4(&cubeFaceRitem->World, XMMatrixMultiply(XMLoadFloat4x4(&cubeFaceRitem->World), reflectionMatrix));
 
 	// Mark the item as dirty to update its buffer
-	cubeFaceRitem->NumFramesDirty = gNumFrameResources;
+	MarkDirty(cubeFaceRitem);
 }
 
 
-void StencilApp::UpdateSkullWorldMatrix(const XMFLOAT3& position, RenderItem* skullRitem, RenderItem* reflectedRitem, RenderItem* shadowedRitem)
+void StencilApp::UpdateCubeWorldMatrix(const XMFLOAT3& position, RenderItem* carRitem, RenderItem* reflectedRitem)
 {
-	XMMATRIX skullRotate = XMMatrixRotationY(0.5f * MathHelper::Pi);
-	XMMATRIX skullScale = XMMatrixScaling(0.45f, 0.45f, 0.45f);
-	XMMATRIX skullOffset = XMMatrixTranslation(position.x, position.y, position.z);
-	XMMATRIX skullWorld = skullRotate * skullScale * skullOffset;
+	// The car casts no shadow.
+	TransformKernel::Target target;
+	target.Rows[TransformKernel::World] = &carRitem->World;
+	target.Rows[TransformKernel::Reflected] = &reflectedRitem->World;
+	mEntityTransforms.Run(&position, &target, 1);
+
+	MarkDirty(carRitem);
+	MarkDirty(reflectedRitem);
+}
+
+void StencilApp::SetFloorMatrix(const XMFLOAT3& position, RenderItem* carRitem, RenderItem* reflectedRitem)
+{
+	TransformKernel::Target target;
+	target.Rows[TransformKernel::World] = &carRitem->World;
+	target.Rows[TransformKernel::Reflected] = &reflectedRitem->World;
+	mEntityTransforms.Run(&position, &target, 1);
+
+	MarkDirty(carRitem);
+	MarkDirty(reflectedRitem);
+}
 
-	XMVECTOR mirrorPlane = XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f); // xy plane
-	XMVECTOR shadowPlane = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f); // xz plane
-	XMVECTOR toMainLight = -XMLoadFloat3(&mMainPassCB.Lights[0].Direction);
-	XMMATRIX R = XMMatrixReflect(mirrorPlane);
-	XMMATRIX S = XMMatrixShadow(shadowPlane, toMainLight);
-	XMMATRIX shadowOffsetY = XMMatrixTranslation(0.0f, 0.001f, 0.0f);
 
-	XMStoreFloat4x4(&skullRitem->World, skullWorld);
-	XMStoreFloat4x4(&reflectedRitem->World, skullWorld * R);
-	XMStoreFloat4x4(&shadowedRitem->World, skullWorld * S * shadowOffsetY);
+void StencilApp::AnimateMaterials(const GameTimer& gt)
+{
 
-	skullRitem->NumFramesDirty = gNumFrameResources;
-	reflectedRitem->NumFramesDirty = gNumFrameResources;
-	shadowedRitem->NumFramesDirty = gNumFrameResources;
 }
 
-void StencilApp::UpdateCubeWorldMatrix(const XMFLOAT3& position, RenderItem* carRitem, RenderItem* reflectedRitem)
+void StencilApp::MarkDirty(RenderItem* ri)
 {
-	XMMATRIX carRotate = XMMatrixRotationY(0.5f * MathHelper::Pi);
-	XMMATRIX carScale = XMMatrixScaling(0.45f, 0.45f, 0.45f);
-	XMMATRIX carOffset = XMMatrixTranslation(position.x, position.y, position.z);
-	XMMATRIX carWorld = carRotate * carScale * carOffset;
+	// Converted once here; each frame resource then only copies the slots.
+	InstanceData data;
+	XMStoreFloat4x4(&data.World, XMMatrixTranspose(XMLoadFloat4x4(&ri->World)));
+	XMStoreFloat4x4(&data.TexTransform, XMMatrixTranspose(XMLoadFloat4x4(&ri->TexTransform)));
 
-	XMVECTOR mirrorPlane = XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f); // xy plane
-	XMVECTOR shadowPlane = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f); // xz plane
-	XMVECTOR toMainLight = -XMLoadFloat3(&mMainPassCB.Lights[0].Direction);
-	XMMATRIX R = XMMatrixReflect(mirrorPlane);
-	XMMATRIX S = XMMatrixShadow(shadowPlane, toMainLight);
-	XMMATRIX shadowOffsetY = XMMatrixTranslation(0.0f, 0.001f, 0.0f);
+	// An item drawn in several layers has a slot in each of their batches.
+	for (UINT slot : ri->InstanceSlots)
+		mInstanceData[slot] = data;
 
-	XMStoreFloat4x4(&carRitem->World, carWorld);
-	XMStoreFloat4x4(&reflectedRitem->World, carWorld * R);
-	//XMStoreFloat4x4(&shadowedRitem->World, skullWorld * S * shadowOffsetY);
+	QueueInstanceUpload(ri);
+}
 
-	carRitem->NumFramesDirty = gNumFrameResources;
-	reflectedRitem->NumFramesDirty = gNumFrameResources;
-	//shadowedRitem->NumFramesDirty = gNumFrameResources;
+void StencilApp::QueueInstanceUpload(RenderItem* ri)
+{
+	ri->NumFramesDirty = gNumFrameResources;
+	if (!ri->InDirtyList)
+	{
+		ri->InDirtyList = true;
+		mDirtyRitems.push_back(ri);
+	}
 }
 
-void StencilApp::SetFloorMatrix(const XMFLOAT3& position, RenderItem* carRitem, RenderItem* reflectedRitem)
+void StencilApp::UpdateInstanceBuffer(const GameTimer& gt)
 {
-	XMMATRIX carRotate = XMMatrixRotationY(0.5f * MathHelper::Pi);
-	XMMATRIX carScale = XMMatrixScaling(0.45f, 0.45f, 0.45f);
-	XMMATRIX carOffset = XMMatrixTranslation(position.x, position.y, position.z);
-	XMMATRIX carWorld = carRotate * carScale * carOffset;
+	PROFILE_SCOPE("UpdateInstanceBuffer");
+	if (mDirtyRitems.empty())
+		return;
 
-	XMVECTOR mirrorPlane = XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f); // xy plane
-	XMVECTOR shadowPlane = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f); // xz plane
-	XMVECTOR toMainLight = -XMLoadFloat3(&mMainPassCB.Lights[0].Direction);
-	XMMATRIX R = XMMatrixReflect(mirrorPlane);
-	XMMATRIX S = XMMatrixShadow(shadowPlane, toMainLight);
-	XMMATRIX shadowOffsetY = XMMatrixTranslation(0.0f, 0.001f, 0.0f);
+	UINT firstSlot = mInstanceCount;
+	UINT lastSlot = 0;
+	for (size_t i = 0; i < mDirtyRitems.size();)
+	{
+		RenderItem* e = mDirtyRitems[i];
+
+		// mInstanceData already holds the item's data.
+		for (UINT slot : e->InstanceSlots)
+		{
+			firstSlot = MathHelper::Min(firstSlot, slot);
+			lastSlot = MathHelper::Max(lastSlot, slot);
+		}
 
-	XMStoreFloat4x4(&carRitem->World, carWorld);
-	XMStoreFloat4x4(&reflectedRitem->World, carWorld * R);
-	//XMStoreFloat4x4(&shadowedRitem->World, skullWorld * S * shadowOffsetY);
+		// Next FrameResource need to be updated too.  Items that have reached every
+		// frame resource leave the list.
+		if (--e->NumFramesDirty == 0)
+		{
+			e->InDirtyList = false;
+			mDirtyRitems[i] = mDirtyRitems.back();
+			mDirtyRitems.pop_back();
+		}
+		else
+		{
+			++i;
+		}
+	}
 
-	carRitem->NumFramesDirty = gNumFrameResources;
-	reflectedRitem->NumFramesDirty = gNumFrameResources;
-	//shadowedRitem->NumFramesDirty = gNumFrameResources;
+	if (firstSlot <= lastSlot)
+	{
+		mCurrFrameResource->InstanceBuffer->CopyRange(firstSlot,
+			&mInstanceData[firstSlot], lastSlot - firstSlot + 1);
+	}
 }
 
+void StencilApp::UpdatePlayers(int player, float x, float y, float z, int health, float dt) {
+	uint32_t slot = AddPlayer(static_cast<uint16_t>(player));
+	if (slot == EntityRegistry::InvalidSlot)
+		return;
 
-void StencilApp::AnimateMaterials(const GameTimer& gt)
-{
+	mPlayers.Move(slot, XMFLOAT3(x, y, z), dt);
+	mPlayers.Health[slot] = health;
+	UpdatePlayerWorldMatrix(slot, mPlayers.Position[slot]);
+}
 
+uint32_t StencilApp::AddPlayer(uint16_t playerId) {
+	uint32_t slot = mPlayers.Find(playerId);
+	if (slot != EntityRegistry::InvalidSlot)
+		return slot;
+
+	// The pool holds a set of items for every slot, so it runs dry with the registry.
+	if (mFreePlayerRitems.empty())
+		return EntityRegistry::InvalidSlot;
+
+	slot = mPlayers.Join(playerId);
+	if (slot == EntityRegistry::InvalidSlot)
+		return slot;
+
+	uint32_t first = mFreePlayerRitems.back();
+	mFreePlayerRitems.pop_back();
+	mPlayers.Ritem[slot] = first;
+	mPlayers.ReflectedRitem[slot] = first + 1;
+	mPlayers.ShadowRitem[slot] = first + 2;
+
+	mAllRitems[mPlayers.Ritem[slot]]->Enabled = true;
+	mAllRitems[mPlayers.ReflectedRitem[slot]]->Enabled = true;
+	mAllRitems[mPlayers.ShadowRitem[slot]]->Enabled = true;
+	return slot;
 }
 
-void StencilApp::UpdateObjectCBs(const GameTimer& gt)
-{
-	auto currObjectCB = mCurrFrameResource->ObjectCB.get();
-	for (auto& e : mAllRitems)
-	{
-		// Only update the cbuffer data if the constants have changed.  
-		// This needs to be tracked per frame resource.
-		if (e->NumFramesDirty > 0)
-		{
-			XMMATRIX world = XMLoadFloat4x4(&e->World);
-			XMMATRIX texTransform = XMLoadFloat4x4(&e->TexTransform);
+void StencilApp::RemovePlayer(uint16_t playerId) {
+	// The local player stays for as long as we are running.
+	if (playerId == id)
+		return;
 
-			ObjectConstants objConstants;
-			XMStoreFloat4x4(&objConstants.World, XMMatrixTranspose(world));
-			XMStoreFloat4x4(&objConstants.TexTransform, XMMatrixTranspose(texTransform));
+	uint32_t slot = mPlayers.Leave(playerId);
+	if (slot == EntityRegistry::InvalidSlot)
+		return;
 
-			currObjectCB->CopyData(e->ObjCBIndex, objConstants);
+	mAllRitems[mPlayers.Ritem[slot]]->Enabled = false;
+	mAllRitems[mPlayers.ReflectedRitem[slot]]->Enabled = false;
+	mAllRitems[mPlayers.ShadowRitem[slot]]->Enabled = false;
+	mFreePlayerRitems.push_back(mPlayers.Ritem[slot]);
 
-			// Next FrameResource need to be updated too.
-			e->NumFramesDirty--;
+	// Someone joining later under the same id starts from a clean history.
+	mRemotePlayers[playerId] = InterpolationBuffer();
+	mPlayerPackets[playerId] = Packet();
+}
+
+void StencilApp::UpdatePlayerWorldMatrix(uint32_t slot, const XMFLOAT3& position) {
+	// Applied in UpdatePlayerTransforms, with every other player that moved.
+	mPlayerDrawPositions[slot] = position;
+	if (std::find(mMovedPlayers.begin(), mMovedPlayers.end(), slot) == mMovedPlayers.end())
+		mMovedPlayers.push_back(slot);
+}
+
+void StencilApp::UpdatePlayerTransforms() {
+	PROFILE_SCOPE("UpdatePlayerTransforms");
+	// A new light direction moves every shadow, not just the shadows of those who moved.
+	if (mEntityTransforms.SetShadowLight(mMainPassCB.Lights[0].Direction)) {
+		for (uint32_t slot = 0; slot < mPlayers.Capacity(); ++slot) {
+			if (mPlayers.Active[slot] &&
+				std::find(mMovedPlayers.begin(), mMovedPlayers.end(), slot) == mMovedPlayers.end())
+				mMovedPlayers.push_back(slot);
 		}
 	}
-}
 
-void StencilApp::UpdatePlayers(int player, float x, float y, float z, int health) {
-	if (player == 1) {
+	if (mMovedPlayers.empty())
+		return;
 
-		UpdateSkullWorldMatrix(
-			XMFLOAT3(x, y, z),
-			mSkullRitem,
-			mReflectedSkullRitem,
-			mShadowedSkullRitem
-		);
+	// Results go straight into the render items, for culling, and into the CPU copy
+	// of the instance buffer, already transposed.  Player items are drawn in one
+	// layer each, so each has a single instance slot.
+	mTransformTargets.clear();
+	for (uint32_t slot : mMovedPlayers) {
+		if (!mPlayers.Active[slot])
+			continue;
+
+		RenderItem* items[TransformKernel::MatrixCount] = {
+			mAllRitems[mPlayers.Ritem[slot]].get(),
+			mAllRitems[mPlayers.ReflectedRitem[slot]].get(),
+			mAllRitems[mPlayers.ShadowRitem[slot]].get()
+		};
+
+		TransformKernel::Target target;
+		target.Slot = slot;
+		for (int k = 0; k < TransformKernel::MatrixCount; ++k) {
+			target.Rows[k] = &items[k]->World;
+			target.Transposed[k] = &mInstanceData[items[k]->InstanceSlots[0]].World;
+		}
+		mTransformTargets.push_back(target);
 	}
-	else if (player == 2) {
-		UpdateSkullWorldMatrix(
-			XMFLOAT3(x, y, z),
-			mSkullRitem_2,
-			mReflectedSkullRitem_2,
-			mShadowedSkullRitem_2
-		);
+
+	mEntityTransforms.Run(mPlayerDrawPositions.data(), mTransformTargets.data(), mTransformTargets.size());
+
+	for (uint32_t slot : mMovedPlayers) {
+		if (!mPlayers.Active[slot])
+			continue;
+
+		QueueInstanceUpload(mAllRitems[mPlayers.Ritem[slot]].get());
+		QueueInstanceUpload(mAllRitems[mPlayers.ReflectedRitem[slot]].get());
+		QueueInstanceUpload(mAllRitems[mPlayers.ShadowRitem[slot]].get());
 	}
+	mMovedPlayers.clear();
 }
 
-void StencilApp::ProcessMessages(const std::string& buffer) {
-	std::istringstream iss(buffer);
-	std::string line;
-	while (std::getline(iss, line)) {
-		size_t start = 0;
-		while ((start = line.find('%', start)) != std::string::npos) {
-			// Extract the part after '%'
-			size_t end = line.find('%', start + 1); // Find the start of the next client data or end of string
-			std::string datagram = line.substr(start, end - start);
-
-			size_t pos = datagram.find(';');
-			std::string ip = datagram.substr(datagram.find("ip:") + 3, pos - (datagram.find("ip:") + 3));
-			datagram = datagram.substr(pos + 1);
+XMFLOAT3 StencilApp::SpawnPosition(uint16_t playerId)const {
+	// Rows of seven along the back of the room; players 1 and 2 keep the spots they
+	// always had.
+	float x = -10.0f + 5.0f * ((playerId + 1) % 7);
+	float z = -10.0f + 3.0f * ((playerId + 1) / 7);
+	return XMFLOAT3(x, 1.0f, z);
+}
 
-			pos = datagram.find(';');
-			std::string player_str = datagram.substr(datagram.find("player:") + 7, pos - (datagram.find("player:") + 7));
-			datagram = datagram.substr(pos + 1);
+void StencilApp::ProcessMessages() {
+	PROFILE_SCOPE("ProcessMessages");
+	// Nothing to do unless the receiver thread stored a new snapshot since last frame.
+	uint32_t seq = mSnapshotSeq.load(std::memory_order_acquire);
+	if (seq == mProcessedSnapshotSeq)
+		return;
 
-			pos = datagram.find(';');
-			std::string name = datagram.substr(datagram.find("name:") + 5, pos - (datagram.find("name:") + 5));
-			datagram = datagram.substr(pos + 1);
+	size_t length = 0;
+	{
+		std::lock_guard<std::mutex> guard(this->messageMutex);
+		length = mSnapshotLength;
+		memcpy(mSnapshotScratch.data(), mSnapshotBuffer.data(), length);
+		seq = mSnapshotSeq.load(std::memory_order_relaxed);
+	}
+	mProcessedSnapshotSeq = seq;
+
+	// Binary snapshots carry only what changed since a baseline we acknowledged;
+	// anything else is the older text format, which always describes every player.
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(mSnapshotScratch.data());
+	uint32_t snapshotSeq = 0;
+	uint32_t baselineSeq = 0;
+	uint32_t connectedMask = 0;
+	if (NetProtocol::ReadSnapshotSeq(bytes, length, snapshotSeq, baselineSeq)) {
+		if (!ApplyBinarySnapshot(bytes, length, seq, connectedMask))
+			return;
+	}
+	else {
+		// Text snapshots are never filtered, so anyone missing from one has left.
+		NetProtocol::ParseWorldSnapshot(std::string_view(mSnapshotScratch.data(), length),
+			seq, mPlayerStates.data(), mPlayerStates.size());
+		for (size_t i = 0; i < mPlayerStates.size(); ++i) {
+			if (mPlayerStates[i].seq == seq)
+				connectedMask |= 1u << i;
+		}
+	}
 
-			pos = datagram.find(';');
-			std::string health_str = datagram.substr(datagram.find("health:") + 7, pos - (datagram.find("health:") + 7));
-			datagram = datagram.substr(pos + 1);
+	// Whatever the server says, we are still here.
+	if (static_cast<size_t>(id) < mPlayerStates.size())
+		connectedMask |= 1u << id;
 
-			pos = datagram.find(';');
-			std::string x_str = datagram.substr(datagram.find("x:") + 2, pos - (datagram.find("x:") + 2));
-			datagram = datagram.substr(pos + 1);
+	for (size_t i = 0; i < mPlayerStates.size(); ++i) {
+		const NetProtocol::PlayerState& state = mPlayerStates[i];
 
-			pos = datagram.find(';');
-			std::string y_str = datagram.substr(datagram.find("y:") + 2, pos - (datagram.find("y:") + 2));
-			std::string z_str = datagram.substr(datagram.find("z:") + 2);
+		if ((connectedMask & (1u << i)) == 0) {
+			RemovePlayer(static_cast<uint16_t>(i));
+			continue;
+		}
 
-			int player = std::stoi(player_str);
-			float x = std::stof(x_str); // Assume x_str is extracted similarly as before
-			float y = std::stof(y_str); // Assume y_str is extracted similarly as before
-			float z = std::stof(z_str); // Assume z_str is extracted similarly as before
-			int health = std::stoi(health_str); // Assume health_str is extracted similarly as before
+		// Connected but outside our area of interest this time: keep what we last had.
+		if (state.seq != seq)
+			continue;
 
-			if (player != this->player) {
-				UpdatePlayers(player, x, y, z, health);
+		if (static_cast<int>(i) != id) {
+			// Packets carry timestamped positions and win once we have any; the
+			// untimed snapshot only places players we have not heard from directly.
+			if (mRemotePlayers[i].Empty())
+				UpdatePlayers(static_cast<int>(i), state.x, state.y, state.z, state.health, 0.0f);
+		}
+		else if (state.ack != 0) {
+			// The local player is predicted; the server's word only matters if it
+			// disagrees with what we predicted for the input it acknowledged.
+			XMFLOAT3* localSkull = &mPlayers.Position[mLocalSlot];
+			XMFLOAT3 authoritative(state.x, state.y, state.z);
+			if (mPrediction.Reconcile(state.ack, authoritative, *localSkull)) {
+				UpdatePlayers(id, localSkull->x, localSkull->y, localSkull->z, state.health, 0.0f);
 			}
+		}
 
-			if (end == std::string::npos) {
-				break; // Exit the loop if no more client data is found
-			}
-			else {
-				start = end; // Set up for the next iteration to find the next client data
-			}
+		uint32_t slot = mPlayers.Find(static_cast<uint16_t>(i));
+		std::string_view stateName(state.name, state.nameLength);
+		if (slot != EntityRegistry::InvalidSlot && mPlayers.Name(mPlayers.NameId[slot]) != stateName)
+			mPlayers.NameId[slot] = mPlayers.InternName(stateName);
+	}
+}
+
+bool StencilApp::ApplyBinarySnapshot(const uint8_t* data, size_t length, uint32_t localSeq, uint32_t& connectedMask) {
+	uint32_t snapshotSeq = 0;
+	uint32_t baselineSeq = 0;
+	NetProtocol::ReadSnapshotSeq(data, length, snapshotSeq, baselineSeq);
+
+	// A delta is only usable if we still hold its baseline.  If not, we simply do not
+	// ack it, and the server keeps encoding against an older ack or sends a full one.
+	const NetProtocol::WorldSnapshot* baseline = nullptr;
+	if (baselineSeq != 0) {
+		const NetProtocol::WorldSnapshot& candidate = mSnapshotHistory[baselineSeq % mSnapshotHistory.size()];
+		if (candidate.seq != baselineSeq)
+			return false;
+		baseline = &candidate;
+	}
+
+	NetProtocol::WorldSnapshot& decoded = mSnapshotHistory[snapshotSeq % mSnapshotHistory.size()];
+	if (&decoded == baseline || decoded.seq == snapshotSeq)
+		return false;
+
+	if (!NetProtocol::DecodeSnapshot(data, length, baseline, decoded)) {
+		decoded.seq = 0;
+		return false;
+	}
+
+	// The server encodes against the newest snapshot we ack.  One that arrived late
+	// is kept as a possible baseline but does not roll the world back.
+	bool newer = mAckedSnapshotSeq == 0 || static_cast<int32_t>(snapshotSeq - mAckedSnapshotSeq) > 0;
+	if (!newer)
+		return false;
+
+	mAckedSnapshotSeq = snapshotSeq;
+	SendAcknowledgement();
+
+	connectedMask = decoded.connectedMask;
+	for (uint32_t i = 0; i < NetProtocol::kMaxPlayers; ++i) {
+		if (decoded.presentMask & (1u << i)) {
+			mPlayerStates[i] = decoded.players[i];
+			mPlayerStates[i].seq = localSeq;
 		}
-		//SendAcknowledgement();
 	}
+	return true;
+}
+
+void StencilApp::SendAcknowledgement() {
+	uint8_t buf[NetProtocol::kAckSize];
+	size_t length = NetProtocol::EncodeAck(static_cast<uint16_t>(id), mAckedSnapshotSeq, buf, sizeof(buf));
+	if (length == 0)
+		return;
+
+	mSendQueue.Append(buf, length);
+}
+
+void StencilApp::UpdateSubscription(float dt) {
+	if (mInterestRadius <= 0.0f)
+		return;
+
+	mSubscriptionAge += dt;
+	XMFLOAT3 camera = mCamera.GetPosition3f();
+	float moved = XMVectorGetX(XMVector3Length(XMLoadFloat3(&camera) - XMLoadFloat3(&mSubscribedPosition)));
+	if (mSubscriptionAge < 1.0f && moved < 0.1f * mInterestRadius)
+		return;
+
+	NetProtocol::Subscription subscription;
+	subscription.playerId = static_cast<uint16_t>(id);
+	subscription.farInterval = mInterestFarInterval;
+	subscription.x = camera.x;
+	subscription.y = camera.y;
+	subscription.z = camera.z;
+	subscription.radius = mInterestRadius;
+
+	uint8_t buf[NetProtocol::kSubscribeSize];
+	size_t length = NetProtocol::EncodeSubscribe(subscription, buf, sizeof(buf));
+	if (length == 0)
+		return;
+
+	mSendQueue.Append(buf, length);
+	mSubscribedPosition = camera;
+	mSubscriptionAge = 0.0f;
 }
-void StencilApp::UpdateMaterialCBs(const GameTimer& gt)
+
+void StencilApp::UpdateMaterialBuffer(const GameTimer& gt)
 {
-	auto currMaterialCB = mCurrFrameResource->MaterialCB.get();
+	auto currMaterialBuffer = mCurrFrameResource->MaterialBuffer.get();
 	for (auto& e : mMaterials)
 	{
-		// Only update the cbuffer data if the constants have changed.  If the cbuffer
+		// Only update the buffer data if the constants have changed.  If the buffer
 		// data changes, it needs to be updated for each FrameResource.
-		Material* mat = e.second.get();
+		Material* mat = e.get();
 		if (mat->NumFramesDirty > 0)
 		{
 			XMMATRIX matTransform = XMLoadFloat4x4(&mat->MatTransform);
 
-			MaterialConstants matConstants;
-			matConstants.DiffuseAlbedo = mat->DiffuseAlbedo;
-			matConstants.FresnelR0 = mat->FresnelR0;
-			matConstants.Roughness = mat->Roughness;
-			XMStoreFloat4x4(&matConstants.MatTransform, XMMatrixTranspose(matTransform));
+			MaterialData matData;
+			matData.DiffuseAlbedo = mat->DiffuseAlbedo;
+			matData.FresnelR0 = mat->FresnelR0;
+			matData.Roughness = mat->Roughness;
+			XMStoreFloat4x4(&matData.MatTransform, XMMatrixTranspose(matTransform));
+			matData.DiffuseMapIndex = mat->DiffuseSrvHeapIndex;
+			matData.MinLod = mat->MinLod;
 
-			currMaterialCB->CopyData(mat->MatCBIndex, matConstants);
+			currMaterialBuffer->CopyData(mat->MatCBIndex, matData);
 
 			// Next FrameResource need to be updated too.
 			mat->NumFramesDirty--;
@@ -1029,125 +1753,451 @@ void StencilApp::UpdateMaterialCBs(const GameTimer& gt)
 	}
 }
 
-void StencilApp::UpdateMainPassCB(const GameTimer& gt)
+void StencilApp::UpdateMainPassCB(const GameTimer& gt)
+{
+	XMMATRIX view = mCamera.GetView();
+	XMMATRIX proj = mCamera.GetProj();
+
+	XMMATRIX viewProj = XMMatrixMultiply(view, proj);
+	XMMATRIX invView = XMMatrixInverse(&XMMatrixDeterminant(view), view);
+	XMMATRIX invProj = XMMatrixInverse(&XMMatrixDeterminant(proj), proj);
+	XMMATRIX invViewProj = XMMatrixInverse(&XMMatrixDeterminant(viewProj), viewProj);
+
+	XMStoreFloat4x4(&mMainPassCB.View, XMMatrixTranspose(view));
+	XMStoreFloat4x4(&mMainPassCB.InvView, XMMatrixTranspose(invView));
+	XMStoreFloat4x4(&mMainPassCB.Proj, XMMatrixTranspose(proj));
+	XMStoreFloat4x4(&mMainPassCB.InvProj, XMMatrixTranspose(invProj));
+	XMStoreFloat4x4(&mMainPassCB.ViewProj, XMMatrixTranspose(viewProj));
+	XMStoreFloat4x4(&mMainPassCB.InvViewProj, XMMatrixTranspose(invViewProj));
+	mMainPassCB.EyePosW = mCamera.GetPosition3f();
+	mMainPassCB.RenderTargetSize = XMFLOAT2((float)mClientWidth, (float)mClientHeight);
+	mMainPassCB.InvRenderTargetSize = XMFLOAT2(1.0f / mClientWidth, 1.0f / mClientHeight);
+	mMainPassCB.NearZ = 1.0f;
+	mMainPassCB.FarZ = 1000.0f;
+	mMainPassCB.TotalTime = gt.TotalTime();
+	mMainPassCB.DeltaTime = gt.DeltaTime();
+	mMainPassCB.AmbientLight = { 0.05f, 0.05f, 0.05f, 1.0f }; // Soft, almost dark
+	mMainPassCB.Lights[0].Direction = { 0.57735f, -0.57735f, 0.57735f }; // Example: coming from a diagonal above
+	mMainPassCB.Lights[0].Strength = { 0.4f, 0.4f, 0.45f }; // Brighter, cool light for a clear, directional effect
+
+
+	mMainPassCB.Lights[1].Position = { 5.0f, 0.0f, 10.0f }; // Position it strategically
+	mMainPassCB.Lights[1].Strength = { 1.0f, 0.8f, 0.6f }; // Bright, warm color
+	mMainPassCB.Lights[1].FalloffStart = 0.5f; // Tighter radius
+	mMainPassCB.Lights[1].FalloffEnd = 25.0f; // Shorter reach
+
+	mMainPassCB.Lights[2].Position = { -10.0f, 10.0f, -10.0f }; // Adjust position as needed
+	mMainPassCB.Lights[2].Direction = { 0.57735f, -0.57735f, 0.57735f };
+	mMainPassCB.Lights[2].Strength = { 0.9f, 0.8f, 0.7f }; // Slightly warm
+	mMainPassCB.Lights[2].FalloffStart = 1.0f;
+	mMainPassCB.Lights[2].FalloffEnd = 100.0f;
+	mMainPassCB.Lights[2].SpotPower = 1.0f;
+
+	// Main pass stored in index 2
+	auto currPassCB = mCurrFrameResource->PassCB.get();
+	currPassCB->CopyData(0, mMainPassCB);
+}
+
+void StencilApp::UpdateReflectedPassCB(const GameTimer& gt)
+{
+	mReflectedPassCB = mMainPassCB;
+
+	XMVECTOR mirrorPlane = XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f); // xy plane
+	XMMATRIX R = XMMatrixReflect(mirrorPlane);
+
+	// Reflect the lighting.
+	for (int i = 0; i < 3; ++i)
+	{
+		XMVECTOR lightDir = XMLoadFloat3(&mMainPassCB.Lights[i].Direction);
+		XMVECTOR reflectedLightDir = XMVector3TransformNormal(lightDir, R);
+		XMStoreFloat3(&mReflectedPassCB.Lights[i].Direction, reflectedLightDir);
+	}
+
+	// Reflected pass stored in index 1
+	auto currPassCB = mCurrFrameResource->PassCB.get();
+	currPassCB->CopyData(1, mReflectedPassCB);
+}
+
+void StencilApp::CullRenderItems()
+{
+	PROFILE_SCOPE("CullRenderItems");
+	XMMATRIX view = mCamera.GetView();
+	XMMATRIX invView = XMMatrixInverse(&XMMatrixDeterminant(view), view);
+
+	BoundingFrustum worldFrustum;
+	mCamFrustum.Transform(worldFrustum, invView);
+
+	mVisibleInstanceCount = 0;
+	CullBatches(mBatchLayer[(int)RenderLayer::Opaque], worldFrustum, nullptr);
+	CullBatches(mBatchLayer[(int)RenderLayer::Transparent], worldFrustum, nullptr);
+	CullBatches(mBatchLayer[(int)RenderLayer::Shadow], worldFrustum, nullptr);
+
+	// Reflections only show where a visible mirror marked the stencil buffer, so
+	// they are culled against the part of the frustum the mirrors cover.
+	BoundingBox mirrorBounds;
+	mMirrorVisible = CullBatches(mBatchLayer[(int)RenderLayer::Mirrors], worldFrustum, &mirrorBounds);
+
+	BoundingFrustum reflectedFrustum = worldFrustum;
+	if (mMirrorVisible && mFrustumCullingEnabled)
+		mMirrorVisible = BuildMirrorFrustum(mirrorBounds, view, invView, reflectedFrustum);
+
+	if (mMirrorVisible)
+	{
+		CullBatches(mBatchLayer[(int)RenderLayer::Reflected], reflectedFrustum, nullptr);
+	}
+	else
+	{
+		for (auto& batch : mBatchLayer[(int)RenderLayer::Reflected])
+			batch.Visible.clear();
+	}
+}
+
+bool StencilApp::CullBatches(std::vector<RenderBatch>& batches, const BoundingFrustum& frustum, BoundingBox* visibleBounds)
+{
+	bool anyVisible = false;
+	for (auto& batch : batches)
+	{
+		batch.Visible.clear();
+		for (UINT i = 0; i < (UINT)batch.Items.size(); ++i)
+		{
+			if (!batch.Items[i]->Enabled)
+				continue;
+
+			// The shadow matrices are projective (w = n.L), so transform the corners
+			// with the divide by w and box the results.
+			XMMATRIX world = XMLoadFloat4x4(&batch.Items[i]->World);
+			XMFLOAT3 corners[BoundingBox::CORNER_COUNT];
+			batch.Bounds.GetCorners(corners);
+			for (XMFLOAT3& corner : corners)
+				XMStoreFloat3(&corner, XMVector3TransformCoord(XMLoadFloat3(&corner), world));
+
+			BoundingBox worldBounds;
+			BoundingBox::CreateFromPoints(worldBounds, BoundingBox::CORNER_COUNT, corners, sizeof(XMFLOAT3));
+
+			if (mFrustumCullingEnabled && frustum.Contains(worldBounds) == DirectX::DISJOINT)
+				continue;
+
+			if (visibleBounds != nullptr)
+			{
+				if (anyVisible)
+					BoundingBox::CreateMerged(*visibleBounds, *visibleBounds, worldBounds);
+				else
+					*visibleBounds = worldBounds;
+			}
+
+			batch.Visible.push_back(i);
+			anyVisible = true;
+		}
+
+		mVisibleInstanceCount += (UINT)batch.Visible.size();
+	}
+
+	return anyVisible;
+}
+
+bool StencilApp::BuildMirrorFrustum(const BoundingBox& mirrorBounds, CXMMATRIX view, CXMMATRIX invView, BoundingFrustum& frustum)const
+{
+	// Narrow the sides of the view-space camera frustum to the slopes of the
+	// mirrors' corners; anything seen in them lies within those sides.
+	BoundingFrustum portal = mCamFrustum;
+
+	XMFLOAT3 corners[BoundingBox::CORNER_COUNT];
+	mirrorBounds.GetCorners(corners);
+
+	float minX = FLT_MAX, maxX = -FLT_MAX;
+	float minY = FLT_MAX, maxY = -FLT_MAX;
+	for (const XMFLOAT3& corner : corners)
+	{
+		XMFLOAT3 v;
+		XMStoreFloat3(&v, XMVector3TransformCoord(XMLoadFloat3(&corner), view));
+
+		// A corner level with or behind the eye spans the whole view; keep the
+		// camera frustum as it is.
+		if (v.z <= 0.0f)
+		{
+			portal.Transform(frustum, invView);
+			return true;
+		}
+
+		minX = MathHelper::Min(minX, v.x / v.z);
+		maxX = MathHelper::Max(maxX, v.x / v.z);
+		minY = MathHelper::Min(minY, v.y / v.z);
+		maxY = MathHelper::Max(maxY, v.y / v.z);
+	}
+
+	portal.LeftSlope = MathHelper::Max(portal.LeftSlope, minX);
+	portal.RightSlope = MathHelper::Min(portal.RightSlope, maxX);
+	portal.BottomSlope = MathHelper::Max(portal.BottomSlope, minY);
+	portal.TopSlope = MathHelper::Min(portal.TopSlope, maxY);
+	if (portal.LeftSlope >= portal.RightSlope || portal.BottomSlope >= portal.TopSlope)
+		return false;
+
+	portal.Transform(frustum, invView);
+	return true;
+}
+
+bool StencilApp::LayerVisible(RenderLayer layer)const
+{
+	if (layer == RenderLayer::Mirrors || layer == RenderLayer::Reflected)
+		return mMirrorVisible;
+
+	return true;
+}
+
+void StencilApp::BuildWorkerPool()
+{
+	// The main thread records a layer too, so one worker per extra core, up to one
+	// per layer.  -renderthreads overrides the count; 0 records everything inline.
+	unsigned cores = std::thread::hardware_concurrency();
+	unsigned workers = MathHelper::Min(cores > 1 ? cores - 1 : 0u, (unsigned)RenderLayer::Count - 1);
+	float requested = d3dUtil::GetCommandLineFloat(L"renderthreads", (float)workers);
+	workers = requested > 0.0f ? (unsigned)requested : 0;
+	mRenderWorkers = std::make_unique<ThreadPool>(workers);
+}
+
+void StencilApp::StartAssetLoad()
+{
+	D3D12_COMMAND_QUEUE_DESC queueDesc = {};
+	queueDesc.Type = D3D12_COMMAND_LIST_TYPE_COPY;
+	queueDesc.Flags = D3D12_COMMAND_QUEUE_FLAG_NONE;
+	ThrowIfFailed(md3dDevice->CreateCommandQueue(&queueDesc, IID_PPV_ARGS(&mCopyQueue)));
+
+	ThrowIfFailed(md3dDevice->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&mCopyFence)));
+
+	mStaticBuffers = std::make_unique<StaticBufferHeap>(md3dDevice.Get());
+	mUploadArena = std::make_unique<UploadArena>(md3dDevice.Get());
+
+	if (d3dUtil::HasCommandLineFlag(L"streamtextures"))
+	{
+		float budgetMB = MathHelper::Max(d3dUtil::GetCommandLineFloat(L"texturebudget", 256.0f), 1.0f);
+		mTextureStreamer = std::make_unique<TextureStreamer>(md3dDevice.Get(), mCopyQueue.Get(),
+			(UINT64)(budgetMB * 1024.0f * 1024.0f));
+	}
+
+	mAssetsLoadedEvent = CreateEventEx(nullptr, nullptr, CREATE_EVENT_MANUAL_RESET, EVENT_ALL_ACCESS);
+	if (mAssetsLoadedEvent == nullptr)
+		ThrowIfFailed(HRESULT_FROM_WIN32(GetLastError()));
+
+	mLoaderThread = std::thread([this]()
+	{
+		try
+		{
+			LoadAssets();
+		}
+		catch (...)
+		{
+			mLoadError = std::current_exception();
+		}
+		SetEvent(mAssetsLoadedEvent);
+	});
+}
+
+void StencilApp::LoadAssets()
+{
+	static const D3D_SHADER_MACRO defines[] =
+	{
+		"FOG", "1",
+		NULL, NULL
+	};
+
+	static const D3D_SHADER_MACRO alphaTestDefines[] =
+	{
+		"FOG", "1",
+		"ALPHA_TEST", "1",
+		NULL, NULL
+	};
+
+	// Each job is independent.  Ones that upload record into the copy list they are
+	// given; the shader jobs ignore theirs.
+	std::vector<std::function<void(ID3D12GraphicsCommandList*)>> jobs =
+	{
+		[this](ID3D12GraphicsCommandList* cmdList) { LoadTexture(cmdList, "bricksTex", L"Textures/bricks3.dds"); },
+		[this](ID3D12GraphicsCommandList* cmdList) { LoadTexture(cmdList, "checkboardTex", L"Textures/checkboard.dds"); },
+		[this](ID3D12GraphicsCommandList* cmdList) { LoadTexture(cmdList, "iceTex", L"Textures/ice.dds"); },
+		[this](ID3D12GraphicsCommandList* cmdList) { LoadTexture(cmdList, "white1x1Tex", L"Textures/white1x1.dds"); },
+		[this](ID3D12GraphicsCommandList* cmdList) { BuildMeshGeometry(cmdList, "skullGeo", "skull", L"Models/skull.txt"); },
+		[this](ID3D12GraphicsCommandList* cmdList) { BuildMeshGeometry(cmdList, "carGeo", "car", L"Models/car.txt"); },
+		[this](ID3D12GraphicsCommandList* cmdList) { BuildRoomGeometry(cmdList); },
+		[this](ID3D12GraphicsCommandList* cmdList) { BuildCubeMirrorGeometry(cmdList); },
+		[this](ID3D12GraphicsCommandList*) { CompileShader("standardVS", nullptr, "VS", "vs_5_1"); },
+		[this](ID3D12GraphicsCommandList*) { CompileShader("opaquePS", defines, "PS", "ps_5_1"); },
+		[this](ID3D12GraphicsCommandList*) { CompileShader("alphaTestedPS", alphaTestDefines, "PS", "ps_5_1"); },
+	};
+
+	// Command lists are not free-threaded, so every job gets its own.  They are kept
+	// until Initialize has seen the copy queue finish.
+	mCopyCmdAllocs.resize(jobs.size());
+	mCopyCmdLists.resize(jobs.size());
+	mRenderWorkers->ParallelFor((unsigned)jobs.size(), [&](unsigned i)
+	{
+		ThrowIfFailed(md3dDevice->CreateCommandAllocator(
+			D3D12_COMMAND_LIST_TYPE_COPY,
+			IID_PPV_ARGS(mCopyCmdAllocs[i].GetAddressOf())));
+
+		ThrowIfFailed(md3dDevice->CreateCommandList(
+			0,
+			D3D12_COMMAND_LIST_TYPE_COPY,
+			mCopyCmdAllocs[i].Get(),
+			nullptr,
+			IID_PPV_ARGS(mCopyCmdLists[i].GetAddressOf())));
+
+		jobs[i](mCopyCmdLists[i].Get());
+		ThrowIfFailed(mCopyCmdLists[i]->Close());
+	});
+
+	std::vector<ID3D12CommandList*> cmdsLists;
+	for (auto& cmdList : mCopyCmdLists)
+		cmdsLists.push_back(cmdList.Get());
+	mCopyQueue->ExecuteCommandLists((UINT)cmdsLists.size(), cmdsLists.data());
+
+	ThrowIfFailed(mCopyQueue->Signal(mCopyFence.Get(), ++mCopyFenceValue));
+	mUploadArena->Retire(mCopyFenceValue);
+}
+
+bool StencilApp::WaitForAssets()
+{
+	// Keep pumping messages until the loader is done, so the window can still be
+	// moved, resized or closed.  MsgWaitForMultipleObjects wakes for either.
+	bool quit = false;
+	while (MsgWaitForMultipleObjects(1, &mAssetsLoadedEvent, FALSE, INFINITE, QS_ALLINPUT) == WAIT_OBJECT_0 + 1)
+	{
+		MSG msg;
+		while (PeekMessage(&msg, 0, 0, 0, PM_REMOVE))
+		{
+			if (msg.message == WM_QUIT)
+				quit = true;
+
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+		}
+	}
+
+	mLoaderThread.join();
+	if (mLoadError)
+		std::rethrow_exception(mLoadError);
+
+	// GPU-side wait: nothing the direct queue runs from here on can see the
+	// resources before their copies have landed.
+	ThrowIfFailed(mCommandQueue->Wait(mCopyFence.Get(), mCopyFenceValue));
+
+	return !quit;
+}
+
+void StencilApp::LoadTexture(ID3D12GraphicsCommandList* cmdList, const std::string& name, const std::wstring& filename)
 {
-	XMMATRIX view = mCamera.GetView();
-	XMMATRIX proj = mCamera.GetProj();
+	auto tex = std::make_unique<Texture>();
+	tex->Name = name;
+	tex->Filename = filename;
 
-	XMMATRIX viewProj = XMMatrixMultiply(view, proj);
-	XMMATRIX invView = XMMatrixInverse(&XMMatrixDeterminant(view), view);
-	XMMATRIX invProj = XMMatrixInverse(&XMMatrixDeterminant(proj), proj);
-	XMMATRIX invViewProj = XMMatrixInverse(&XMMatrixDeterminant(viewProj), viewProj);
+	// Anything the streamer cannot handle is loaded whole.
+	if (mTextureStreamer != nullptr)
+		tex->StreamId = mTextureStreamer->Load(cmdList, tex->Filename, *mUploadArena, tex->Resource);
 
-	XMStoreFloat4x4(&mMainPassCB.View, XMMatrixTranspose(view));
-	XMStoreFloat4x4(&mMainPassCB.InvView, XMMatrixTranspose(invView));
-	XMStoreFloat4x4(&mMainPassCB.Proj, XMMatrixTranspose(proj));
-	XMStoreFloat4x4(&mMainPassCB.InvProj, XMMatrixTranspose(invProj));
-	XMStoreFloat4x4(&mMainPassCB.ViewProj, XMMatrixTranspose(viewProj));
-	XMStoreFloat4x4(&mMainPassCB.InvViewProj, XMMatrixTranspose(invViewProj));
-	mMainPassCB.EyePosW = mCamera.GetPosition3f();
-	mMainPassCB.RenderTargetSize = XMFLOAT2((float)mClientWidth, (float)mClientHeight);
-	mMainPassCB.InvRenderTargetSize = XMFLOAT2(1.0f / mClientWidth, 1.0f / mClientHeight);
-	mMainPassCB.NearZ = 1.0f;
-	mMainPassCB.FarZ = 1000.0f;
-	mMainPassCB.TotalTime = gt.TotalTime();
-	mMainPassCB.DeltaTime = gt.DeltaTime();
-	mMainPassCB.AmbientLight = { 0.05f, 0.05f, 0.05f, 1.0f }; // Soft, almost dark
-	mMainPassCB.Lights[0].Direction = { 0.57735f, -0.57735f, 0.57735f }; // Example: coming from a diagonal above
-	mMainPassCB.Lights[0].Strength = { 0.4f, 0.4f, 0.45f }; // Brighter, cool light for a clear, directional effect
+	if (tex->StreamId < 0)
+	{
+		ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
+			cmdList, tex->Filename.c_str(),
+			tex->Resource, tex->UploadHeap));
+	}
 
+	std::lock_guard<std::mutex> lock(mAssetMutex);
+	mTextures[tex->Name] = std::move(tex);
+}
 
-	mMainPassCB.Lights[1].Position = { 5.0f, 0.0f, 10.0f }; // Position it strategically
-	mMainPassCB.Lights[1].Strength = { 1.0f, 0.8f, 0.6f }; // Bright, warm color
-	mMainPassCB.Lights[1].FalloffStart = 0.5f; // Tighter radius
-	mMainPassCB.Lights[1].FalloffEnd = 25.0f; // Shorter reach
+void StencilApp::UpdateTextureStreaming()
+{
+	if (mTextureStreamer == nullptr)
+		return;
 
-	mMainPassCB.Lights[2].Position = { -10.0f, 10.0f, -10.0f }; // Adjust position as needed
-	mMainPassCB.Lights[2].Direction = { 0.57735f, -0.57735f, 0.57735f };
-	mMainPassCB.Lights[2].Strength = { 0.9f, 0.8f, 0.7f }; // Slightly warm
-	mMainPassCB.Lights[2].FalloffStart = 1.0f;
-	mMainPassCB.Lights[2].FalloffEnd = 100.0f;
-	mMainPassCB.Lights[2].SpotPower = 1.0f;
+	// mCurrentFence is what the last submitted frame signals.
+	mTextureStreamer->Update(mCommandQueue.Get(), mFence.Get(), mCurrentFence);
 
-	// Main pass stored in index 2
-	auto currPassCB = mCurrFrameResource->PassCB.get();
-	currPassCB->CopyData(0, mMainPassCB);
+	// A changed clamp goes to every frame resource, like any other material edit.
+	for (auto& e : mMaterials)
+	{
+		Material* mat = e.get();
+		int index = mat->DiffuseSrvHeapIndex;
+		float minLod = index >= 0 && index < (int)mSrvStreamIds.size() ? mTextureStreamer->MinLod(mSrvStreamIds[index]) : 0.0f;
+		if (mat->MinLod != minLod)
+		{
+			mat->MinLod = minLod;
+			mat->NumFramesDirty = gNumFrameResources;
+		}
+	}
 }
 
-void StencilApp::UpdateReflectedPassCB(const GameTimer& gt)
+void StencilApp::RequestTextureMips()
 {
-	mReflectedPassCB = mMainPassCB;
+	if (mTextureStreamer == nullptr)
+		return;
 
-	XMVECTOR mirrorPlane = XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f); // xy plane
-	XMMATRIX R = XMMatrixReflect(mirrorPlane);
+	// Height of one pixel at unit distance.
+	float pixelSize = 2.0f * tanf(0.5f * mCamera.GetFovY()) / (float)mClientHeight;
+	XMVECTOR eye = XMLoadFloat3(&mMainPassCB.EyePosW);
 
-	// Reflect the lighting.
-	for (int i = 0; i < 3; ++i)
+	for (const auto& batches : mBatchLayer)
 	{
-		XMVECTOR lightDir = XMLoadFloat3(&mMainPassCB.Lights[i].Direction);
-		XMVECTOR reflectedLightDir = XMVector3TransformNormal(lightDir, R);
-		XMStoreFloat3(&mReflectedPassCB.Lights[i].Direction, reflectedLightDir);
+		for (const RenderBatch& batch : batches)
+		{
+			int index = batch.Mat->DiffuseSrvHeapIndex;
+			int streamId = index >= 0 && index < (int)mSrvStreamIds.size() ? mSrvStreamIds[index] : -1;
+			if (streamId < 0)
+				continue;
+
+			XMMATRIX matTransform = XMLoadFloat4x4(&batch.Mat->MatTransform);
+			for (UINT i : batch.Visible)
+			{
+				RenderItem* ri = batch.Items[i];
+				XMMATRIX world = XMLoadFloat4x4(&ri->World);
+				float scale = sqrtf(MathHelper::Max(XMVectorGetX(XMVector3LengthSq(world.r[0])),
+					MathHelper::Max(XMVectorGetX(XMVector3LengthSq(world.r[1])), XMVectorGetX(XMVector3LengthSq(world.r[2])))));
+
+				XMVECTOR center = XMVector3TransformCoord(XMLoadFloat3(&batch.Bounds.Center), world);
+				float radius = XMVectorGetX(XMVector3Length(XMLoadFloat3(&batch.Bounds.Extents))) * scale;
+				float distance = MathHelper::Max(XMVectorGetX(XMVector3Length(center - eye)) - radius, mCamera.GetNearZ());
+
+				// Assume the texture coordinates span the item's bounds once, repeated as
+				// many times as the texture transforms scale them.
+				XMMATRIX texTransform = XMLoadFloat4x4(&ri->TexTransform) * matTransform;
+				float repeats = MathHelper::Max(XMVectorGetX(XMVector2Length(texTransform.r[0])),
+					XMVectorGetX(XMVector2Length(texTransform.r[1])));
+
+				float screenTexels = 2.0f * radius / (MathHelper::Max(repeats, 0.001f) * distance * pixelSize);
+				mTextureStreamer->Request(streamId, screenTexels);
+			}
+		}
 	}
-
-	// Reflected pass stored in index 1
-	auto currPassCB = mCurrFrameResource->PassCB.get();
-	currPassCB->CopyData(1, mReflectedPassCB);
 }
 
-void StencilApp::LoadTextures()
+void StencilApp::CompileShader(const std::string& name, const D3D_SHADER_MACRO* defines, const std::string& entrypoint, const std::string& target)
 {
-	auto bricksTex = std::make_unique<Texture>();
-	bricksTex->Name = "bricksTex";
-	bricksTex->Filename = L"Textures/bricks3.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), bricksTex->Filename.c_str(),
-		bricksTex->Resource, bricksTex->UploadHeap));
-
-	auto checkboardTex = std::make_unique<Texture>();
-	checkboardTex->Name = "checkboardTex";
-	checkboardTex->Filename = L"Textures/checkboard.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), checkboardTex->Filename.c_str(),
-		checkboardTex->Resource, checkboardTex->UploadHeap));
-
-	auto iceTex = std::make_unique<Texture>();
-	iceTex->Name = "iceTex";
-	iceTex->Filename = L"Textures/ice.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), iceTex->Filename.c_str(),
-		iceTex->Resource, iceTex->UploadHeap));
-
-	auto white1x1Tex = std::make_unique<Texture>();
-	white1x1Tex->Name = "white1x1Tex";
-	white1x1Tex->Filename = L"Textures/white1x1.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), white1x1Tex->Filename.c_str(),
-		white1x1Tex->Resource, white1x1Tex->UploadHeap));
-
-	mTextures[bricksTex->Name] = std::move(bricksTex);
-	mTextures[checkboardTex->Name] = std::move(checkboardTex);
-	mTextures[iceTex->Name] = std::move(iceTex);
-	mTextures[white1x1Tex->Name] = std::move(white1x1Tex);
+	ComPtr<ID3DBlob> byteCode = d3dUtil::CompileShaderCached(L"Shaders\\Default.hlsl", defines, entrypoint, target);
+
+	std::lock_guard<std::mutex> lock(mAssetMutex);
+	mShaders[name] = byteCode;
 }
 
 void StencilApp::BuildRootSignature()
 {
+	// The whole heap in one table, so binding it never changes between draws.
 	CD3DX12_DESCRIPTOR_RANGE texTable;
-	texTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 0);
+	texTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, gMaxTextures, 0);
 
 	// Root parameter can be a table, root descriptor or root constants.
-	CD3DX12_ROOT_PARAMETER slotRootParameter[4];
+	CD3DX12_ROOT_PARAMETER slotRootParameter[5];
 
 	// Perfomance TIP: Order from most frequent to least frequent.
-	slotRootParameter[0].InitAsDescriptorTable(1, &texTable, D3D12_SHADER_VISIBILITY_PIXEL);
-	slotRootParameter[1].InitAsConstantBufferView(0);
-	slotRootParameter[2].InitAsConstantBufferView(1);
-	slotRootParameter[3].InitAsConstantBufferView(2);
+	// Per draw, only the material index and base instance change.
+	slotRootParameter[0].InitAsConstants(2, 0);
+	slotRootParameter[1].InitAsShaderResourceView(0, 1);
+	slotRootParameter[2].InitAsShaderResourceView(1, 1);
+	slotRootParameter[3].InitAsConstantBufferView(1);
+	slotRootParameter[4].InitAsDescriptorTable(1, &texTable, D3D12_SHADER_VISIBILITY_PIXEL);
 
 	auto staticSamplers = GetStaticSamplers();
 
 	// A root signature is an array of root parameters.
-	CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(4, slotRootParameter,
+	CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(5, slotRootParameter,
 		(UINT)staticSamplers.size(), staticSamplers.data(),
 		D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT);
 
@@ -1176,7 +2226,7 @@ void StencilApp::BuildDescriptorHeaps()
 	// Create the SRV heap.
 	//
 	D3D12_DESCRIPTOR_HEAP_DESC srvHeapDesc = {};
-	srvHeapDesc.NumDescriptors = 4;
+	srvHeapDesc.NumDescriptors = gMaxTextures;
 	srvHeapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
 	srvHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
 	ThrowIfFailed(md3dDevice->CreateDescriptorHeap(&srvHeapDesc, IID_PPV_ARGS(&mSrvDescriptorHeap)));
@@ -1191,6 +2241,15 @@ void StencilApp::BuildDescriptorHeaps()
 	auto iceTex = mTextures["iceTex"]->Resource;
 	auto white1x1Tex = mTextures["white1x1Tex"]->Resource;
 
+	// In SRV heap order.
+	mSrvStreamIds =
+	{
+		mTextures["bricksTex"]->StreamId,
+		mTextures["checkboardTex"]->StreamId,
+		mTextures["iceTex"]->StreamId,
+		mTextures["white1x1Tex"]->StreamId
+	};
+
 	D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
 	srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
 	srvDesc.Format = bricksTex->GetDesc().Format;
@@ -1216,37 +2275,28 @@ void StencilApp::BuildDescriptorHeaps()
 
 	srvDesc.Format = white1x1Tex->GetDesc().Format;
 	md3dDevice->CreateShaderResourceView(white1x1Tex.Get(), &srvDesc, hDescriptor);
-}
-
-void StencilApp::BuildShadersAndInputLayout()
-{
-	const D3D_SHADER_MACRO defines[] =
-	{
-		"FOG", "1",
-		NULL, NULL
-	};
 
-	const D3D_SHADER_MACRO alphaTestDefines[] =
+	// The table spans the whole heap, and without resource binding tier 2 every
+	// descriptor in a bound table must be valid, so fill the rest with null views.
+	srvDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+	for (UINT i = (UINT)mSrvStreamIds.size(); i < gMaxTextures; ++i)
 	{
-		"FOG", "1",
-		"ALPHA_TEST", "1",
-		NULL, NULL
-	};
-
-	mShaders["standardVS"] = d3dUtil::CompileShader(L"Shaders\\Default.hlsl", nullptr, "VS", "vs_5_0");
-	mShaders["opaquePS"] = d3dUtil::CompileShader(L"Shaders\\Default.hlsl", defines, "PS", "ps_5_0");
-	mShaders["alphaTestedPS"] = d3dUtil::CompileShader(L"Shaders\\Default.hlsl", alphaTestDefines, "PS", "ps_5_0");
+		hDescriptor.Offset(1, mCbvSrvDescriptorSize);
+		md3dDevice->CreateShaderResourceView(nullptr, &srvDesc, hDescriptor);
+	}
+}
 
+void StencilApp::BuildInputLayout()
+{
 	mInputLayout =
 	{
 		{ "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
-		{ "COLOR", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, 12, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
 		{ "NORMAL", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 12, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
 		{ "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 24, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
 	};
 }
 
-void StencilApp::BuildRoomGeometry()
+void StencilApp::BuildRoomGeometry(ID3D12GraphicsCommandList* cmdList)
 {
 	// Create and specify geometry.  For this sample we draw a floor
 // and a wall with a mirror on it.  We put the floor, wall, and
@@ -1312,6 +2362,7 @@ void StencilApp::BuildRoomGeometry()
 	floorSubmesh.IndexCount = 36;
 	floorSubmesh.StartIndexLocation = 0;
 	floorSubmesh.BaseVertexLocation = 0;
+	BoundingBox::CreateFromPoints(floorSubmesh.Bounds, vertices.size(), &vertices[0].Pos, sizeof(Vertex));
 
 	
 	const UINT vbByteSize = (UINT)vertices.size() * sizeof(Vertex);
@@ -1326,11 +2377,11 @@ void StencilApp::BuildRoomGeometry()
 	ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
 	CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
 
-	geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
+	geo->VertexBufferGPU = mStaticBuffers->CreateBuffer(cmdList,
+		vertices.data(), vbByteSize, *mUploadArena);
 
-	geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
+	geo->IndexBufferGPU = mStaticBuffers->CreateBuffer(cmdList,
+		indices.data(), ibByteSize, *mUploadArena);
 
 	geo->VertexByteStride = sizeof(Vertex);
 	geo->VertexBufferByteSize = vbByteSize;
@@ -1339,10 +2390,11 @@ void StencilApp::BuildRoomGeometry()
 
 	geo->DrawArgs["floor"] = floorSubmesh;
 
+	std::lock_guard<std::mutex> lock(mAssetMutex);
 	mGeometries[geo->Name] = std::move(geo);
 }
 
-void StencilApp::BuildCubeMirrorGeometry() {
+void StencilApp::BuildCubeMirrorGeometry(ID3D12GraphicsCommandList* cmdList) {
 	 
 	std::vector<Vertex> vertices(24);
 
@@ -1414,10 +2466,10 @@ void StencilApp::BuildCubeMirrorGeometry() {
 	CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
 
 	// Create GPU resources
-	geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
-	geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
+	geo->VertexBufferGPU = mStaticBuffers->CreateBuffer(cmdList,
+		vertices.data(), vbByteSize, *mUploadArena);
+	geo->IndexBufferGPU = mStaticBuffers->CreateBuffer(cmdList,
+		indices.data(), ibByteSize, *mUploadArena);
 
 	// Set other geometry parameters
 	geo->VertexByteStride = sizeof(Vertex);
@@ -1432,262 +2484,67 @@ void StencilApp::BuildCubeMirrorGeometry() {
 		faceSubmesh.IndexCount = 6; // 2 triangles * 3 indices
 		faceSubmesh.StartIndexLocation = i * 6; // Each face has 6 indices
 		faceSubmesh.BaseVertexLocation = 0; // All vertices are in the same buffer
+		BoundingBox::CreateFromPoints(faceSubmesh.Bounds, 4, &vertices[i * 4].Pos, sizeof(Vertex)); // 4 vertices per face
 		geo->DrawArgs[faceNames[i]] = faceSubmesh;
 	}
 
+	std::lock_guard<std::mutex> lock(mAssetMutex);
 	mGeometries[geo->Name] = std::move(geo);
 }
-void StencilApp::BuildSkull2Geometry()
-{
-	std::ifstream fin("Models/skull2.txt");
-
-	if (!fin)
-	{
-		MessageBox(0, L"Models/skull2.txt not found.", 0, 0);
-		return;
-	}
-
-	UINT vcount = 0;
-	UINT tcount = 0;
-	std::string ignore;
-
-	fin >> ignore >> vcount;
-	fin >> ignore >> tcount;
-	fin >> ignore >> ignore >> ignore >> ignore;
-
-	std::vector<Vertex> vertices(vcount);
-	for (UINT i = 0; i < vcount; ++i)
-	{
-		fin >> vertices[i].Pos.x >> vertices[i].Pos.y >> vertices[i].Pos.z;
-		fin >> vertices[i].Normal.x >> vertices[i].Normal.y >> vertices[i].Normal.z;
-
-		// Model does not have texture coordinates, so just zero them out.
-		vertices[i].TexC = { 0.0f, 0.0f };
-	}
-
-	fin >> ignore;
-	fin >> ignore;
-	fin >> ignore;
-
-	std::vector<std::int32_t> indices(3 * tcount);
-	for (UINT i = 0; i < tcount; ++i)
-	{
-		fin >> indices[i * 3 + 0] >> indices[i * 3 + 1] >> indices[i * 3 + 2];
-	}
-
-	fin.close();
-
-	//
-	// Pack the indices of all the meshes into one index buffer.
-	//
-
-	const UINT vbByteSize = (UINT)vertices.size() * sizeof(Vertex);
-
-	const UINT ibByteSize = (UINT)indices.size() * sizeof(std::int32_t);
-
-	auto geo = std::make_unique<MeshGeometry>();
-	geo->Name = "skullGeo2";
-
-	ThrowIfFailed(D3DCreateBlob(vbByteSize, &geo->VertexBufferCPU));
-	CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertices.data(), vbByteSize);
-
-	ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
-	CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
-
-	geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
-
-	geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
-
-	geo->VertexByteStride = sizeof(Vertex);
-	geo->VertexBufferByteSize = vbByteSize;
-	geo->IndexFormat = DXGI_FORMAT_R32_UINT;
-	geo->IndexBufferByteSize = ibByteSize;
-
-	SubmeshGeometry submesh;
-	submesh.IndexCount = (UINT)indices.size();
-	submesh.StartIndexLocation = 0;
-	submesh.BaseVertexLocation = 0;
-
-	geo->DrawArgs["skull2"] = submesh;
-
-	mGeometries[geo->Name] = std::move(geo);
-}
-
-void StencilApp::BuildCarGeometry()
+void StencilApp::BuildMeshGeometry(ID3D12GraphicsCommandList* cmdList, const std::string& geoName, const std::string& submeshName, const std::wstring& sourcePath)
 {
-	std::ifstream fin("Models/car.txt");
-
-	if (!fin)
+	MeshCache mesh;
+	if (!mesh.Open(sourcePath))
 	{
-		MessageBox(0, L"Models/car.txt not found.", 0, 0);
+		MessageBox(0, (sourcePath + L" not found.").c_str(), 0, 0);
 		return;
 	}
 
-	UINT vcount = 0;
-	UINT tcount = 0;
-	std::string ignore;
-
-	fin >> ignore >> vcount;
-	fin >> ignore >> tcount;
-	fin >> ignore >> ignore >> ignore >> ignore;
-
-	XMFLOAT3 vMinf3(+MathHelper::Infinity, +MathHelper::Infinity, +MathHelper::Infinity);
-	XMFLOAT3 vMaxf3(-MathHelper::Infinity, -MathHelper::Infinity, -MathHelper::Infinity);
-
-	XMVECTOR vMin = XMLoadFloat3(&vMinf3);
-	XMVECTOR vMax = XMLoadFloat3(&vMaxf3);
-
-	std::vector<Vertex> vertices(vcount);
-	for (UINT i = 0; i < vcount; ++i)
-	{
-		fin >> vertices[i].Pos.x >> vertices[i].Pos.y >> vertices[i].Pos.z;
-		fin >> vertices[i].Normal.x >> vertices[i].Normal.y >> vertices[i].Normal.z;
-
-		XMVECTOR P = XMLoadFloat3(&vertices[i].Pos);
-
-		vertices[i].TexC = { 0.0f, 0.0f };
-
-		vMin = XMVectorMin(vMin, P);
-		vMax = XMVectorMax(vMax, P);
-	}
-
-	BoundingBox bounds;
-	XMStoreFloat3(&bounds.Center, 0.5f * (vMin + vMax));
-	XMStoreFloat3(&bounds.Extents, 0.5f * (vMax - vMin));
-
-	fin >> ignore;
-	fin >> ignore;
-	fin >> ignore;
-
-	std::vector<std::int32_t> indices(3 * tcount);
-	for (UINT i = 0; i < tcount; ++i)
-	{
-		fin >> indices[i * 3 + 0] >> indices[i * 3 + 1] >> indices[i * 3 + 2];
-	}
-
-	fin.close();
-
-	//
-	// Pack the indices of all the meshes into one index buffer.
-	//
-
-	const UINT vbByteSize = (UINT)vertices.size() * sizeof(Vertex);
-
-	const UINT ibByteSize = (UINT)indices.size() * sizeof(std::int32_t);
+	// The buffers are filled straight from the mapped cache; CreateBuffer copies into
+	// the upload arena before returning, so the view can be closed afterwards.
+	const UINT vbByteSize = mesh.VertexBufferByteSize();
+	const UINT ibByteSize = mesh.IndexBufferByteSize();
 
 	auto geo = std::make_unique<MeshGeometry>();
-	geo->Name = "carGeo";
-
-	ThrowIfFailed(D3DCreateBlob(vbByteSize, &geo->VertexBufferCPU));
-	CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertices.data(), vbByteSize);
-
-	ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
-	CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
+	geo->Name = geoName;
 
-	geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
+	geo->VertexBufferGPU = mStaticBuffers->CreateBuffer(cmdList,
+		mesh.Vertices(), vbByteSize, *mUploadArena);
 
-	geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
+	geo->IndexBufferGPU = mStaticBuffers->CreateBuffer(cmdList,
+		mesh.Indices(), ibByteSize, *mUploadArena);
 
 	geo->VertexByteStride = sizeof(Vertex);
 	geo->VertexBufferByteSize = vbByteSize;
-	geo->IndexFormat = DXGI_FORMAT_R32_UINT;
+	geo->IndexFormat = mesh.IndexFormat();
 	geo->IndexBufferByteSize = ibByteSize;
 
 	SubmeshGeometry submesh;
-	submesh.IndexCount = (UINT)indices.size();
-	submesh.StartIndexLocation = 0;
+	submesh.IndexCount = mesh.Lod(0).IndexCount;
+	submesh.StartIndexLocation = mesh.Lod(0).StartIndex;
 	submesh.BaseVertexLocation = 0;
-	submesh.Bounds = bounds;
-
-	geo->DrawArgs["car"] = submesh;
-
-	mGeometries[geo->Name] = std::move(geo);
-}
+	submesh.Bounds = mesh.Bounds();
 
-void StencilApp::BuildSkullGeometry()
-{
-	std::ifstream fin("Models/skull.txt");
-
-	if (!fin)
-	{
-		MessageBox(0, L"Models/skull.txt not found.", 0, 0);
-		return;
-	}
-
-	UINT vcount = 0;
-	UINT tcount = 0;
-	std::string ignore;
-
-	fin >> ignore >> vcount;
-	fin >> ignore >> tcount;
-	fin >> ignore >> ignore >> ignore >> ignore;
-
-	std::vector<Vertex> vertices(vcount);
-	for (UINT i = 0; i < vcount; ++i)
+	for (UINT i = 1; i < mesh.LodCount(); ++i)
 	{
-		fin >> vertices[i].Pos.x >> vertices[i].Pos.y >> vertices[i].Pos.z;
-		fin >> vertices[i].Normal.x >> vertices[i].Normal.y >> vertices[i].Normal.z;
-
-		// Model does not have texture coordinates, so just zero them out.
-		vertices[i].TexC = { 0.0f, 0.0f };
-	}
-
-	fin >> ignore;
-	fin >> ignore;
-	fin >> ignore;
-
-	std::vector<std::int32_t> indices(3 * tcount);
-	for (UINT i = 0; i < tcount; ++i)
-	{
-		fin >> indices[i * 3 + 0] >> indices[i * 3 + 1] >> indices[i * 3 + 2];
+		SubmeshLod lod;
+		lod.IndexCount = mesh.Lod(i).IndexCount;
+		lod.StartIndexLocation = mesh.Lod(i).StartIndex;
+		lod.Error = mesh.Lod(i).Error;
+		submesh.Lods.push_back(lod);
 	}
 
-	fin.close();
-
-	//
-	// Pack the indices of all the meshes into one index buffer.
-	//
-
-	const UINT vbByteSize = (UINT)vertices.size() * sizeof(Vertex);
-
-	const UINT ibByteSize = (UINT)indices.size() * sizeof(std::int32_t);
-
-	auto geo = std::make_unique<MeshGeometry>();
-	geo->Name = "skullGeo";
-
-	ThrowIfFailed(D3DCreateBlob(vbByteSize, &geo->VertexBufferCPU));
-	CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertices.data(), vbByteSize);
-
-	ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
-	CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
-
-	geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
-
-	geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
-
-	geo->VertexByteStride = sizeof(Vertex);
-	geo->VertexBufferByteSize = vbByteSize;
-	geo->IndexFormat = DXGI_FORMAT_R32_UINT;
-	geo->IndexBufferByteSize = ibByteSize;
-
-	SubmeshGeometry submesh;
-	submesh.IndexCount = (UINT)indices.size();
-	submesh.StartIndexLocation = 0;
-	submesh.BaseVertexLocation = 0;
-
-	geo->DrawArgs["skull"] = submesh;
+	geo->DrawArgs[submeshName] = submesh;
 
+	std::lock_guard<std::mutex> lock(mAssetMutex);
 	mGeometries[geo->Name] = std::move(geo);
 }
 
 void StencilApp::BuildPSOs()
 {
+	// PSOs seen on an earlier run come out of the library instead of being compiled.
+	mPipelineLibrary.Open(md3dDevice.Get(), L"ShaderCache/pipelines.bin");
+
 	D3D12_GRAPHICS_PIPELINE_STATE_DESC opaquePsoDesc;
 
 	//
@@ -1717,7 +2574,7 @@ void StencilApp::BuildPSOs()
 	opaquePsoDesc.SampleDesc.Count = m4xMsaaState ? 4 : 1;
 	opaquePsoDesc.SampleDesc.Quality = m4xMsaaState ? (m4xMsaaQuality - 1) : 0;
 	opaquePsoDesc.DSVFormat = mDepthStencilFormat;
-	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&opaquePsoDesc, IID_PPV_ARGS(&mPSOs["opaque"])));
+	mPSOs["opaque"] = mPipelineLibrary.CreateGraphicsPipeline(L"opaque", opaquePsoDesc);
 
 	//
 	// PSO for transparent objects
@@ -1739,7 +2596,7 @@ void StencilApp::BuildPSOs()
 
 	transparentPsoDesc.BlendState.RenderTarget[0] = transparencyBlendDesc;
 	transparentPsoDesc.RasterizerState.CullMode = D3D12_CULL_MODE_BACK;
-	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&transparentPsoDesc, IID_PPV_ARGS(&mPSOs["transparent"])));
+	mPSOs["transparent"] = mPipelineLibrary.CreateGraphicsPipeline(L"transparent", transparentPsoDesc);
 
 	//
 	// PSO for marking stencil mirrors.
@@ -1770,7 +2627,7 @@ void StencilApp::BuildPSOs()
 	D3D12_GRAPHICS_PIPELINE_STATE_DESC markMirrorsPsoDesc = opaquePsoDesc;
 	markMirrorsPsoDesc.BlendState = mirrorBlendState;
 	markMirrorsPsoDesc.DepthStencilState = mirrorDSS;
-	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&markMirrorsPsoDesc, IID_PPV_ARGS(&mPSOs["markStencilMirrors"])));
+	mPSOs["markStencilMirrors"] = mPipelineLibrary.CreateGraphicsPipeline(L"markStencilMirrors", markMirrorsPsoDesc);
 
 
 	//
@@ -1779,7 +2636,7 @@ void StencilApp::BuildPSOs()
 
 	D3D12_GRAPHICS_PIPELINE_STATE_DESC mirrorReflectionPsoDesc = opaquePsoDesc;
 	mirrorReflectionPsoDesc.DepthStencilState = mirrorDSS;
-	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&mirrorReflectionPsoDesc, IID_PPV_ARGS(&mPSOs["mirrorReflection"])));
+	mPSOs["mirrorReflection"] = mPipelineLibrary.CreateGraphicsPipeline(L"mirrorReflection", mirrorReflectionPsoDesc);
 
 	//
 	// PSO for stencil reflections.
@@ -1808,7 +2665,7 @@ void StencilApp::BuildPSOs()
 	drawReflectionsPsoDesc.DepthStencilState = reflectionsDSS;
 	drawReflectionsPsoDesc.RasterizerState.CullMode = D3D12_CULL_MODE_BACK;
 	drawReflectionsPsoDesc.RasterizerState.FrontCounterClockwise = true;
-	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&drawReflectionsPsoDesc, IID_PPV_ARGS(&mPSOs["drawStencilReflections"])));
+	mPSOs["drawStencilReflections"] = mPipelineLibrary.CreateGraphicsPipeline(L"drawStencilReflections", drawReflectionsPsoDesc);
 
 	//
 	// PSO for shadow objects
@@ -1836,7 +2693,14 @@ void StencilApp::BuildPSOs()
 
 	D3D12_GRAPHICS_PIPELINE_STATE_DESC shadowPsoDesc = transparentPsoDesc;
 	shadowPsoDesc.DepthStencilState = shadowDSS;
-	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&shadowPsoDesc, IID_PPV_ARGS(&mPSOs["shadow"])));
+	mPSOs["shadow"] = mPipelineLibrary.CreateGraphicsPipeline(L"shadow", shadowPsoDesc);
+
+	mPipelineLibrary.Save();
+
+	std::ostringstream oss;
+	oss << "Pipeline library: " << mPipelineLibrary.HitCount() << " loaded, "
+		<< mPipelineLibrary.MissCount() << " compiled\n";
+	OutputDebugStringA(oss.str().c_str());
 }
 
 void StencilApp::BuildFrameResources()
@@ -1844,15 +2708,38 @@ void StencilApp::BuildFrameResources()
 	for (int i = 0; i < gNumFrameResources; ++i)
 	{
 		mFrameResources.push_back(std::make_unique<FrameResource>(md3dDevice.Get(),
-			2, (UINT)mAllRitems.size(), (UINT)mMaterials.size()));
+			2, mInstanceCount, (UINT)mMaterials.size(), (UINT)RenderLayer::Count));
 	}
 }
 
+void StencilApp::BuildLayerCommandLists()
+{
+	for (int i = 0; i < (int)RenderLayer::Count; ++i)
+	{
+		ThrowIfFailed(md3dDevice->CreateCommandList(
+			0,
+			D3D12_COMMAND_LIST_TYPE_DIRECT,
+			mFrameResources[0]->LayerCmdListAllocs[i].Get(),
+			nullptr,
+			IID_PPV_ARGS(mLayerCmdLists[i].GetAddressOf())));
+
+		// Start off in a closed state; Draw resets each list before recording.
+		ThrowIfFailed(mLayerCmdLists[i]->Close());
+	}
+
+	ThrowIfFailed(md3dDevice->CreateCommandList(
+		0,
+		D3D12_COMMAND_LIST_TYPE_DIRECT,
+		mFrameResources[0]->CmdListAlloc.Get(),
+		nullptr,
+		IID_PPV_ARGS(mEndCmdList.GetAddressOf())));
+	ThrowIfFailed(mEndCmdList->Close());
+}
+
 void StencilApp::BuildMaterials()
 {
 	auto bricks = std::make_unique<Material>();
 	bricks->Name = "bricks";
-	bricks->MatCBIndex = 0;
 	bricks->DiffuseSrvHeapIndex = 0;
 	bricks->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 	bricks->FresnelR0 = XMFLOAT3(0.05f, 0.05f, 0.05f);
@@ -1860,7 +2747,6 @@ void StencilApp::BuildMaterials()
 
 	auto checkertile = std::make_unique<Material>();
 	checkertile->Name = "checkertile";
-	checkertile->MatCBIndex = 1;
 	checkertile->DiffuseSrvHeapIndex = 1;
 	checkertile->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 	checkertile->FresnelR0 = XMFLOAT3(0.07f, 0.07f, 0.07f);
@@ -1868,7 +2754,6 @@ void StencilApp::BuildMaterials()
 
 	auto icemirror = std::make_unique<Material>();
 	icemirror->Name = "icemirror";
-	icemirror->MatCBIndex = 2;
 	icemirror->DiffuseSrvHeapIndex = 2;
 	icemirror->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 0.3f);
 	icemirror->FresnelR0 = XMFLOAT3(0.1f, 0.1f, 0.1f);
@@ -1876,7 +2761,6 @@ void StencilApp::BuildMaterials()
 
 	auto gray0 = std::make_unique<Material>();
 	gray0->Name = "gray0";
-	gray0->MatCBIndex = 0;
 	gray0->DiffuseSrvHeapIndex = 0;
 	gray0->DiffuseAlbedo = XMFLOAT4(0.7f, 0.7f, 0.7f, 1.0f);
 	gray0->FresnelR0 = XMFLOAT3(0.04f, 0.04f, 0.04f);
@@ -1884,50 +2768,30 @@ void StencilApp::BuildMaterials()
 
 	auto highlight0 = std::make_unique<Material>();
 	highlight0->Name = "highlight0";
-	highlight0->MatCBIndex = 1;
 	highlight0->DiffuseSrvHeapIndex = 0;
 	highlight0->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 0.0f, 0.6f);
 	highlight0->FresnelR0 = XMFLOAT3(0.06f, 0.06f, 0.06f);
 	highlight0->Roughness = 0.0f;
 
 
-	mMaterials["gray0"] = std::move(gray0);
-	mMaterials["highlight0"] = std::move(highlight0);
+	AddMaterial(std::move(gray0));
+	AddMaterial(std::move(highlight0));
 	auto skullMat = std::make_unique<Material>();
 	skullMat->Name = "skullMat";
-	skullMat->MatCBIndex = 3;
 	skullMat->DiffuseSrvHeapIndex = 3;
 	skullMat->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 	skullMat->FresnelR0 = XMFLOAT3(0.05f, 0.05f, 0.05f);
 	skullMat->Roughness = 0.3f;
 
-	auto skullMat2 = std::make_unique<Material>();
-	skullMat2->Name = "skullMat2";
-	skullMat2->MatCBIndex = 4;
-	skullMat2->DiffuseSrvHeapIndex = 3;
-	skullMat2->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
-	skullMat2->FresnelR0 = XMFLOAT3(0.05f, 0.05f, 0.05f);
-	skullMat2->Roughness = 0.3f;
-
 	auto shadowMat = std::make_unique<Material>();
 	shadowMat->Name = "shadowMat";
-	shadowMat->MatCBIndex = 5;
 	shadowMat->DiffuseSrvHeapIndex = 3;
 	shadowMat->DiffuseAlbedo = XMFLOAT4(0.0f, 0.0f, 0.0f, 0.5f);
 	shadowMat->FresnelR0 = XMFLOAT3(0.001f, 0.001f, 0.001f);
 	shadowMat->Roughness = 0.0f;
 
-	auto shadowMat2 = std::make_unique<Material>();
-	shadowMat2->Name = "shadowMat2";
-	shadowMat2->MatCBIndex = 6;
-	shadowMat2->DiffuseSrvHeapIndex = 3;
-	shadowMat2->DiffuseAlbedo = XMFLOAT4(0.0f, 0.0f, 0.0f, 0.5f);
-	shadowMat2->FresnelR0 = XMFLOAT3(0.001f, 0.001f, 0.001f);
-	shadowMat2->Roughness = 0.0f;
-
 	auto mirrorMaterialFront = std::make_unique<Material>();
 	mirrorMaterialFront->Name = "mirrorFront";
-	mirrorMaterialFront->MatCBIndex = 7;
 	mirrorMaterialFront->DiffuseSrvHeapIndex = 3;
 	mirrorMaterialFront->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 0.3f);
 	mirrorMaterialFront->FresnelR0 = XMFLOAT3(0.1f, 0.1f, 0.1f);
@@ -1935,7 +2799,6 @@ void StencilApp::BuildMaterials()
 
 	auto mirrorMaterialBack = std::make_unique<Material>();
 	mirrorMaterialBack->Name = "mirrorBack";
-	mirrorMaterialBack->MatCBIndex = 8;
 	mirrorMaterialBack->DiffuseSrvHeapIndex = 3;
 	mirrorMaterialBack->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 0.3f);
 	mirrorMaterialBack->FresnelR0 = XMFLOAT3(0.1f, 0.1f, 0.1f);
@@ -1943,7 +2806,6 @@ void StencilApp::BuildMaterials()
 
 	auto mirrorMaterialLeft = std::make_unique<Material>();
 	mirrorMaterialLeft->Name = "mirrorLeft";
-	mirrorMaterialLeft->MatCBIndex = 9;
 	mirrorMaterialLeft->DiffuseSrvHeapIndex = 3;
 	mirrorMaterialLeft->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 0.3f);
 	mirrorMaterialLeft->FresnelR0 = XMFLOAT3(0.1f, 0.1f, 0.1f);
@@ -1951,7 +2813,6 @@ void StencilApp::BuildMaterials()
 
 	auto mirrorMaterialRight = std::make_unique<Material>();
 	mirrorMaterialRight->Name = "mirrorRight";
-	mirrorMaterialRight->MatCBIndex = 10;
 	mirrorMaterialRight->DiffuseSrvHeapIndex = 3;
 	mirrorMaterialRight->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 0.3f);
 	mirrorMaterialRight->FresnelR0 = XMFLOAT3(0.1f, 0.1f, 0.1f);
@@ -1959,7 +2820,6 @@ void StencilApp::BuildMaterials()
 
 	auto mirrorMaterialTop = std::make_unique<Material>();
 	mirrorMaterialTop->Name = "mirrorTop";
-	mirrorMaterialTop->MatCBIndex = 11;
 	mirrorMaterialTop->DiffuseSrvHeapIndex = 3;
 	mirrorMaterialTop->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 0.3f);
 	mirrorMaterialTop->FresnelR0 = XMFLOAT3(0.1f, 0.1f, 0.1f);
@@ -1967,25 +2827,30 @@ void StencilApp::BuildMaterials()
 
 	auto mirrorMaterialBottom = std::make_unique<Material>();
 	mirrorMaterialBottom->Name = "mirrorBottom";
-	mirrorMaterialBottom->MatCBIndex = 12;
 	mirrorMaterialBottom->DiffuseSrvHeapIndex = 3;
 	mirrorMaterialBottom->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 0.3f);
 	mirrorMaterialBottom->FresnelR0 = XMFLOAT3(0.1f, 0.1f, 0.1f);
 	mirrorMaterialBottom->Roughness = 0.5f;
 
-	mMaterials["bricks"] = std::move(bricks);
-	mMaterials["checkertile"] = std::move(checkertile);
-	mMaterials["icemirror"] = std::move(icemirror);
-	mMaterials["skullMat"] = std::move(skullMat);
-	mMaterials["skullMat2"] = std::move(skullMat2);
-	mMaterials["shadowMat"] = std::move(shadowMat);
-	mMaterials["shadowMat2"] = std::move(shadowMat2);
-	mMaterials["mirrorFront"] = std::move(mirrorMaterialFront);
-	mMaterials["mirrorBack"] = std::move(mirrorMaterialBack);
-	mMaterials["mirrorLeft"] = std::move(mirrorMaterialLeft);
-	mMaterials["mirrorRight"] = std::move(mirrorMaterialRight);
-	mMaterials["mirrorTop"] = std::move(mirrorMaterialTop);
-	mMaterials["mirrorBottom"] = std::move(mirrorMaterialBottom);
+	AddMaterial(std::move(bricks));
+	AddMaterial(std::move(checkertile));
+	AddMaterial(std::move(icemirror));
+	AddMaterial(std::move(skullMat));
+	AddMaterial(std::move(shadowMat));
+	AddMaterial(std::move(mirrorMaterialFront));
+	AddMaterial(std::move(mirrorMaterialBack));
+	AddMaterial(std::move(mirrorMaterialLeft));
+	AddMaterial(std::move(mirrorMaterialRight));
+	AddMaterial(std::move(mirrorMaterialTop));
+	AddMaterial(std::move(mirrorMaterialBottom));
+}
+
+void StencilApp::AddMaterial(std::unique_ptr<Material> mat)
+{
+	// Slots are handed out in order, so no two materials can share a cbuffer entry.
+	mat->MatCBIndex = (int)mMaterials.size();
+	mMaterialLookup[mat->Name] = mat.get();
+	mMaterials.push_back(std::move(mat));
 }
 
 void StencilApp::BuildRenderItems()
@@ -1993,21 +2858,20 @@ void StencilApp::BuildRenderItems()
 	auto floorRitem = std::make_unique<RenderItem>();
 	floorRitem->World = MathHelper::Identity4x4();
 	floorRitem->TexTransform = MathHelper::Identity4x4();
-	floorRitem->ObjCBIndex = 0;
-	floorRitem->Mat = mMaterials["icemirror"].get();
+	floorRitem->Mat = mMaterialLookup.at("icemirror");
 	floorRitem->Geo = mGeometries["roomGeo"].get();
 	floorRitem->PrimitiveType = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	floorRitem->IndexCount = floorRitem->Geo->DrawArgs["floor"].IndexCount;
 	floorRitem->StartIndexLocation = floorRitem->Geo->DrawArgs["floor"].StartIndexLocation;
 	floorRitem->BaseVertexLocation = floorRitem->Geo->DrawArgs["floor"].BaseVertexLocation;
+	floorRitem->Bounds = floorRitem->Geo->DrawArgs["floor"].Bounds;
 	mFloorItem = floorRitem.get();
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(floorRitem.get());
 
 	/*auto wallsRitem = std::make_unique<RenderItem>();
 	wallsRitem->World = MathHelper::Identity4x4();
 	wallsRitem->TexTransform = MathHelper::Identity4x4();
-	wallsRitem->ObjCBIndex = 1;
-	wallsRitem->Mat = mMaterials["bricks"].get();
+	wallsRitem->Mat = mMaterialLookup.at("bricks");
 	wallsRitem->Geo = mGeometries["roomGeo"].get();
 	wallsRitem->PrimitiveType = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	wallsRitem->IndexCount = wallsRitem->Geo->DrawArgs["wall"].IndexCount;
@@ -2016,70 +2880,10 @@ void StencilApp::BuildRenderItems()
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(wallsRitem.get());*/
 
 
-	auto skullRitem = std::make_unique<RenderItem>();
-	skullRitem->World = MathHelper::Identity4x4();
-	skullRitem->TexTransform = MathHelper::Identity4x4();
-	skullRitem->ObjCBIndex = 1;
-	skullRitem->Mat = mMaterials["skullMat"].get();
-	skullRitem->Geo = mGeometries["skullGeo"].get();
-	skullRitem->PrimitiveType = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
-	skullRitem->IndexCount = skullRitem->Geo->DrawArgs["skull"].IndexCount;
-	skullRitem->StartIndexLocation = skullRitem->Geo->DrawArgs["skull"].StartIndexLocation;
-	skullRitem->BaseVertexLocation = skullRitem->Geo->DrawArgs["skull"].BaseVertexLocation;
-	mSkullRitem = skullRitem.get();
-	mRitemLayer[(int)RenderLayer::Opaque].push_back(skullRitem.get());
-
-
-
-	// Reflected skull will have different world matrix, so it needs to be its own render item.
-	auto reflectedSkullRitem = std::make_unique<RenderItem>();
-	*reflectedSkullRitem = *skullRitem;
-	reflectedSkullRitem->ObjCBIndex = 2;
-	mReflectedSkullRitem = reflectedSkullRitem.get();
-	mRitemLayer[(int)RenderLayer::Reflected].push_back(reflectedSkullRitem.get());
-	
-	
-
-	// Shadowed skull will have different world matrix, so it needs to be its own render item.
-	auto shadowedSkullRitem = std::make_unique<RenderItem>();
-	*shadowedSkullRitem = *skullRitem;
-	shadowedSkullRitem->ObjCBIndex = 3;
-	shadowedSkullRitem->Mat = mMaterials["shadowMat"].get();
-	mShadowedSkullRitem = shadowedSkullRitem.get();
-	mRitemLayer[(int)RenderLayer::Shadow].push_back(shadowedSkullRitem.get());
-
-	auto skullRitem2 = std::make_unique<RenderItem>();
-	skullRitem2->World = MathHelper::Identity4x4();
-	skullRitem2->TexTransform = MathHelper::Identity4x4();
-	skullRitem2->ObjCBIndex = 4;
-	skullRitem2->Mat = mMaterials["skullMat2"].get();
-	skullRitem2->Geo = mGeometries["skullGeo2"].get();
-	skullRitem2->PrimitiveType = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
-	skullRitem2->IndexCount = skullRitem2->Geo->DrawArgs["skull2"].IndexCount;
-	skullRitem2->StartIndexLocation = skullRitem2->Geo->DrawArgs["skull2"].StartIndexLocation;
-	skullRitem2->BaseVertexLocation = skullRitem2->Geo->DrawArgs["skull2"].BaseVertexLocation;
-	mSkullRitem_2 = skullRitem2.get();
-	mRitemLayer[(int)RenderLayer::Opaque].push_back(skullRitem2.get());
-
-	auto reflectedSkullRitem2 = std::make_unique<RenderItem>();
-	*reflectedSkullRitem2 = *skullRitem2;
-	reflectedSkullRitem2->ObjCBIndex = 5;
-	mReflectedSkullRitem_2 = reflectedSkullRitem2.get();
-	mRitemLayer[(int)RenderLayer::Reflected].push_back(reflectedSkullRitem2.get());
-
-	// Shadowed skull will have different world matrix, so it needs to be its own render item.
-	auto shadowedSkullRitem2 = std::make_unique<RenderItem>();
-	*shadowedSkullRitem2 = *skullRitem2;
-	shadowedSkullRitem2->ObjCBIndex = 6;
-	shadowedSkullRitem2->Mat = mMaterials["shadowMat2"].get();
-	mShadowedSkullRitem_2 = shadowedSkullRitem2.get();
-	mRitemLayer[(int)RenderLayer::Shadow].push_back(shadowedSkullRitem2.get());
-
 	/*auto mirrorRitem = std::make_unique<RenderItem>();
 	mirrorRitem->World = MathHelper::Identity4x4();
 	mirrorRitem->TexTransform = MathHelper::Identity4x4();
-	mirrorRitem->ObjCBIndex = 7;
-	mirrorRitem->Mat = mMaterials["icemirror"].get();
+	mirrorRitem->Mat = mMaterialLookup.at("icemirror");
 	mirrorRitem->Geo = mGeometries["roomGeo"].get();
 	mirrorRitem->PrimitiveType = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	mirrorRitem->IndexCount = mirrorRitem->Geo->DrawArgs["mirror"].IndexCount;
@@ -2092,11 +2896,11 @@ void StencilApp::BuildRenderItems()
 	auto carRitem = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&carRitem->World, XMMatrixScaling(1.0f, 1.0f, 1.0f) * XMMatrixTranslation(0.0f, 1.0f, 0.0f));
 	XMStoreFloat4x4(&carRitem->TexTransform, XMMatrixScaling(1.0f, 1.0f, 1.0f));
-	carRitem->ObjCBIndex = 7;
-	carRitem->Mat = mMaterials["icemirror"].get();
+	carRitem->Mat = mMaterialLookup.at("icemirror");
 	carRitem->Geo = mGeometries["carGeo"].get();
 	carRitem->PrimitiveType = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
-	//carRitem->Bounds = carRitem->Geo->DrawArgs["car"].Bounds;
+	carRitem->Bounds = carRitem->Geo->DrawArgs["car"].Bounds;
+	carRitem->Lods = carRitem->Geo->DrawArgs["car"].Lods;
 	carRitem->IndexCount = carRitem->Geo->DrawArgs["car"].IndexCount;
 	carRitem->StartIndexLocation = carRitem->Geo->DrawArgs["car"].StartIndexLocation;
 	carRitem->BaseVertexLocation = carRitem->Geo->DrawArgs["car"].BaseVertexLocation;
@@ -2105,36 +2909,63 @@ void StencilApp::BuildRenderItems()
 
 	auto reflectedCarRitem = std::make_unique<RenderItem>();
 	*reflectedCarRitem = *carRitem;
-	reflectedCarRitem->ObjCBIndex = 8;
 	mReflectedCarRitem = reflectedCarRitem.get();
 	mRitemLayer[(int)RenderLayer::Reflected].push_back(reflectedCarRitem.get());
 
 	auto reflectedFloor = std::make_unique<RenderItem>();
 	*reflectedFloor = *floorRitem;
-	reflectedFloor->ObjCBIndex = 9;
 	mReflectedFloorItem = reflectedFloor.get();
 	mRitemLayer[(int)RenderLayer::Reflected].push_back(reflectedFloor.get());
 
 	mAllRitems.push_back(std::move(floorRitem));
 	//mAllRitems.push_back(std::move(wallsRitem));
-	mAllRitems.push_back(std::move(skullRitem));
-	mAllRitems.push_back(std::move(reflectedSkullRitem));
-	mAllRitems.push_back(std::move(shadowedSkullRitem));
-	mAllRitems.push_back(std::move(skullRitem2));
-	mAllRitems.push_back(std::move(reflectedSkullRitem2));
-	mAllRitems.push_back(std::move(shadowedSkullRitem2));
 	mAllRitems.push_back(std::move(carRitem));
 	mAllRitems.push_back(std::move(reflectedCarRitem));
 	mAllRitems.push_back(std::move(reflectedFloor));
 	//mAllRitems.push_back(std::move(mirrorRitem));
 
+	// A skull, its reflection and its shadow for every player there could be.  They
+	// all batch together, so unused ones cost nothing but their instance slots.
+	for (UINT i = 0; i < mPlayers.Capacity(); ++i)
+	{
+		auto skullRitem = std::make_unique<RenderItem>();
+		skullRitem->World = MathHelper::Identity4x4();
+		skullRitem->TexTransform = MathHelper::Identity4x4();
+		skullRitem->Mat = mMaterialLookup.at("skullMat");
+		skullRitem->Geo = mGeometries["skullGeo"].get();
+		skullRitem->PrimitiveType = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
+		skullRitem->IndexCount = skullRitem->Geo->DrawArgs["skull"].IndexCount;
+		skullRitem->StartIndexLocation = skullRitem->Geo->DrawArgs["skull"].StartIndexLocation;
+		skullRitem->BaseVertexLocation = skullRitem->Geo->DrawArgs["skull"].BaseVertexLocation;
+		skullRitem->Bounds = skullRitem->Geo->DrawArgs["skull"].Bounds;
+		skullRitem->Lods = skullRitem->Geo->DrawArgs["skull"].Lods;
+		skullRitem->Enabled = false;
+		mRitemLayer[(int)RenderLayer::Opaque].push_back(skullRitem.get());
+
+		// Reflected skull will have different world matrix, so it needs to be its own render item.
+		auto reflectedSkullRitem = std::make_unique<RenderItem>();
+		*reflectedSkullRitem = *skullRitem;
+		mRitemLayer[(int)RenderLayer::Reflected].push_back(reflectedSkullRitem.get());
+
+		// Shadowed skull will have different world matrix, so it needs to be its own render item.
+		auto shadowedSkullRitem = std::make_unique<RenderItem>();
+		*shadowedSkullRitem = *skullRitem;
+		shadowedSkullRitem->Mat = mMaterialLookup.at("shadowMat");
+		mRitemLayer[(int)RenderLayer::Shadow].push_back(shadowedSkullRitem.get());
+
+		// Handed out from the back, so lowest first.
+		mFreePlayerRitems.insert(mFreePlayerRitems.begin(), (uint32_t)mAllRitems.size());
+		mAllRitems.push_back(std::move(skullRitem));
+		mAllRitems.push_back(std::move(reflectedSkullRitem));
+		mAllRitems.push_back(std::move(shadowedSkullRitem));
+	}
+
 
 
 	DirectX::XMMATRIX cubeWorld = XMMatrixScaling(2.0f, 2.0f, 2.0f) * XMMatrixTranslation(0.0f, 2.0f, 0.0f);
 
 	// Names for each face of the cube
 	std::string cubeFaceNames[6] = { "Front", "Back","Right", "Left", "Top", "Bottom"  };
-	UINT k = 10; // Starting Object Constant Buffer Index for cube faces
 
 	for (int i = 0; i < 6; ++i) // Loop through all 6 faces
 	{
@@ -2142,8 +2973,7 @@ void StencilApp::BuildRenderItems()
 
 		// Set the world matrix for this cube face render item
 		XMStoreFloat4x4(&cubeFaceRitem->World, cubeWorld);
-		cubeFaceRitem->ObjCBIndex = k++; // Unique constant buffer index for each face
-		cubeFaceRitem->Mat = mMaterials["mirror" + cubeFaceNames[i]].get(); // Assign material to this face
+		cubeFaceRitem->Mat = mMaterialLookup.at("mirror" + cubeFaceNames[i]); // Assign material to this face
 		cubeFaceRitem->Geo = mGeometries["cubeGeo"].get(); // Use the same geometry for all faces
 		cubeFaceRitem->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 
@@ -2151,6 +2981,7 @@ void StencilApp::BuildRenderItems()
 		cubeFaceRitem->IndexCount = cubeFaceRitem->Geo->DrawArgs[cubeFaceNames[i]].IndexCount;
 		cubeFaceRitem->StartIndexLocation = cubeFaceRitem->Geo->DrawArgs[cubeFaceNames[i]].StartIndexLocation;
 		cubeFaceRitem->BaseVertexLocation = cubeFaceRitem->Geo->DrawArgs[cubeFaceNames[i]].BaseVertexLocation;
+		cubeFaceRitem->Bounds = cubeFaceRitem->Geo->DrawArgs[cubeFaceNames[i]].Bounds;
 
 		// Add this face's render item to the appropriate render layers
 		mRitemLayer[(int)RenderLayer::Transparent].push_back(cubeFaceRitem.get());
@@ -2159,34 +2990,162 @@ void StencilApp::BuildRenderItems()
 	}	
 }
 
-void StencilApp::DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderItem*>& ritems)
+void StencilApp::BuildRenderBatches()
+{
+	UINT instanceCount = 0;
+	for (int layer = 0; layer < (int)RenderLayer::Count; ++layer)
+	{
+		auto& batches = mBatchLayer[layer];
+
+		// Group the layer's items by what they draw, keeping the order in which each
+		// group first appears.
+		for (RenderItem* ri : mRitemLayer[layer])
+		{
+			auto batch = std::find_if(batches.begin(), batches.end(), [ri](const RenderBatch& b)
+			{
+				return b.Geo == ri->Geo && b.Mat == ri->Mat && b.PrimitiveType == ri->PrimitiveType &&
+					b.IndexCount == ri->IndexCount && b.StartIndexLocation == ri->StartIndexLocation &&
+					b.BaseVertexLocation == ri->BaseVertexLocation;
+			});
+
+			if (batch == batches.end())
+			{
+				RenderBatch b;
+				b.Geo = ri->Geo;
+				b.Mat = ri->Mat;
+				b.PrimitiveType = ri->PrimitiveType;
+				b.IndexCount = ri->IndexCount;
+				b.StartIndexLocation = ri->StartIndexLocation;
+				b.BaseVertexLocation = ri->BaseVertexLocation;
+				b.Bounds = ri->Bounds;
+				b.Lods = ri->Lods;
+				batches.push_back(b);
+				batch = batches.end() - 1;
+			}
+
+			batch->Items.push_back(ri);
+		}
+
+		// Draw batches of the same geometry and topology together, so the input
+		// assembler is rebound as rarely as possible.  Each layer has its own PSO
+		// already.  Transparent items keep their order, since it decides blending.
+		if (layer != (int)RenderLayer::Transparent)
+		{
+			std::vector<MeshGeometry*> geoOrder;
+			for (const auto& batch : batches)
+			{
+				if (std::find(geoOrder.begin(), geoOrder.end(), batch.Geo) == geoOrder.end())
+					geoOrder.push_back(batch.Geo);
+			}
+
+			std::stable_sort(batches.begin(), batches.end(), [&geoOrder](const RenderBatch& a, const RenderBatch& b)
+			{
+				auto geoA = std::find(geoOrder.begin(), geoOrder.end(), a.Geo);
+				auto geoB = std::find(geoOrder.begin(), geoOrder.end(), b.Geo);
+				if (geoA != geoB)
+					return geoA < geoB;
+				return a.PrimitiveType < b.PrimitiveType;
+			});
+		}
+
+		// Lay each batch's instances out back to back in the instance buffer.
+		for (auto& batch : batches)
+		{
+			batch.BaseInstance = instanceCount;
+			for (RenderItem* ri : batch.Items)
+				ri->InstanceSlots.push_back(instanceCount++);
+		}
+	}
+
+	mInstanceCount = instanceCount;
+	mInstanceData.resize(mInstanceCount);
+
+	// Every item starts out needing an upload to each frame resource.
+	for (auto& ri : mAllRitems)
+		MarkDirty(ri.get());
+}
+
+UINT StencilApp::SelectLod(const RenderBatch& batch, UINT lodBias)const
 {
-	UINT objCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(ObjectConstants));
-	UINT matCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(MaterialConstants));
+	if (batch.Lods.empty())
+		return 0;
+
+	// Height of one pixel at unit distance.
+	float pixelSize = 2.0f * tanf(0.5f * mCamera.GetFovY()) / (float)mClientHeight;
+	XMVECTOR eye = XMLoadFloat3(&mMainPassCB.EyePosW);
 
-	auto objectCB = mCurrFrameResource->ObjectCB->Resource();
-	auto matCB = mCurrFrameResource->MaterialCB->Resource();
+	// Every instance in the batch draws the same indices, so the nearest visible
+	// one decides.
+	UINT lod = (UINT)batch.Lods.size();
+	for (UINT i : batch.Visible)
+	{
+		RenderItem* ri = batch.Items[i];
+		XMMATRIX world = XMLoadFloat4x4(&ri->World);
+		float scale = sqrtf(MathHelper::Max(XMVectorGetX(XMVector3LengthSq(world.r[0])),
+			MathHelper::Max(XMVectorGetX(XMVector3LengthSq(world.r[1])), XMVectorGetX(XMVector3LengthSq(world.r[2])))));
+
+		XMVECTOR center = XMVector3TransformCoord(XMLoadFloat3(&batch.Bounds.Center), world);
+		float radius = XMVectorGetX(XMVector3Length(XMLoadFloat3(&batch.Bounds.Extents))) * scale;
+		float distance = MathHelper::Max(XMVectorGetX(XMVector3Length(center - eye)) - radius, mCamera.GetNearZ());
+
+		// The coarsest level whose error, in model units, stays under the limit.
+		float allowed = mLodPixelError * pixelSize * distance / scale;
+		UINT itemLod = 0;
+		while (itemLod < batch.Lods.size() && batch.Lods[itemLod].Error <= allowed)
+			++itemLod;
+
+		lod = MathHelper::Min(lod, itemLod);
+	}
+
+	return MathHelper::Min(lod + lodBias, (UINT)batch.Lods.size());
+}
 
-	// For each render item...
-	for (size_t i = 0; i < ritems.size(); ++i)
+void StencilApp::DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderBatch>& batches, UINT lodBias)
+{
+	// For each batch...
+	MeshGeometry* boundGeo = nullptr;
+	D3D12_PRIMITIVE_TOPOLOGY boundTopology = D3D_PRIMITIVE_TOPOLOGY_UNDEFINED;
+	for (const RenderBatch& batch : batches)
 	{
-		auto ri = ritems[i];
+		if (batch.Visible.empty())
+			continue;
+
+		// Batches that differ only by material or submesh share buffers.
+		if (batch.Geo != boundGeo)
+		{
+			cmdList->IASetVertexBuffers(0, 1, &batch.Geo->VertexBufferView());
+			cmdList->IASetIndexBuffer(&batch.Geo->IndexBufferView());
+			boundGeo = batch.Geo;
+		}
+		if (batch.PrimitiveType != boundTopology)
+		{
+			cmdList->IASetPrimitiveTopology(batch.PrimitiveType);
+			boundTopology = batch.PrimitiveType;
+		}
 
-		cmdList->IASetVertexBuffers(0, 1, &ri->Geo->VertexBufferView());
-		cmdList->IASetIndexBuffer(&ri->Geo->IndexBufferView());
-		cmdList->IASetPrimitiveTopology(ri->PrimitiveType);
+		// The shaders fetch the material, and its texture, by index.
+		cmdList->SetGraphicsRoot32BitConstant(0, batch.Mat->MatCBIndex, 0);
 
-		CD3DX12_GPU_DESCRIPTOR_HANDLE tex(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
-		tex.Offset(ri->Mat->DiffuseSrvHeapIndex, mCbvSrvDescriptorSize);
+		// Level 0 is the batch's own submesh.
+		UINT lod = SelectLod(batch, lodBias);
+		UINT indexCount = lod == 0 ? batch.IndexCount : batch.Lods[lod - 1].IndexCount;
+		UINT startIndex = lod == 0 ? batch.StartIndexLocation : batch.Lods[lod - 1].StartIndexLocation;
 
-		D3D12_GPU_VIRTUAL_ADDRESS objCBAddress = objectCB->GetGPUVirtualAddress() + ri->ObjCBIndex * objCBByteSize;
-		D3D12_GPU_VIRTUAL_ADDRESS matCBAddress = matCB->GetGPUVirtualAddress() + ri->Mat->MatCBIndex * matCBByteSize;
+		// Each run of visible items with consecutive slots is one draw.
+		for (size_t run = 0; run < batch.Visible.size();)
+		{
+			UINT first = batch.Visible[run];
+			UINT count = 1;
+			while (run + count < batch.Visible.size() && batch.Visible[run + count] == first + count)
+				++count;
 
-		cmdList->SetGraphicsRootDescriptorTable(0, tex);
-		cmdList->SetGraphicsRootConstantBufferView(1, objCBAddress);
-		cmdList->SetGraphicsRootConstantBufferView(3, matCBAddress);
+			// SV_InstanceID starts at 0 for every draw, so pass the run's first
+			// instance as a root constant rather than a start instance.
+			cmdList->SetGraphicsRoot32BitConstant(0, batch.BaseInstance + first, 1);
 
-		cmdList->DrawIndexedInstanced(ri->IndexCount, 1, ri->StartIndexLocation, ri->BaseVertexLocation, 0);
+			cmdList->DrawIndexedInstanced(indexCount, count, startIndex, batch.BaseVertexLocation, 0);
+			run += count;
+		}
 	}
 }
 
@@ -0,0 +1,662 @@
+//***************************************************************************************
+// TextureStreamer.cpp
+//***************************************************************************************
+
+#include "TextureStreamer.h"
+#include "DDSTextureLoader.h"
+#include "Profiler.h"
+
+using Microsoft::WRL::ComPtr;
+
+namespace
+{
+	// Tiles in each standard tile heap; a mip bigger than this gets a heap of its own.
+	const UINT kTilesPerHeap = 64;
+	const UINT64 kTileSize = D3D12_TILED_RESOURCE_TILE_SIZE_IN_BYTES;
+}
+
+TextureStreamer::TextureStreamer(ID3D12Device* device, ID3D12CommandQueue* copyQueue, UINT64 budgetBytes)
+	: mDevice(device), mCopyQueue(copyQueue), mBudgetBytes(budgetBytes), mArena(device)
+{
+	D3D12_FEATURE_DATA_D3D12_OPTIONS options = {};
+	if (SUCCEEDED(device->CheckFeatureSupport(D3D12_FEATURE_D3D12_OPTIONS, &options, sizeof(options))))
+		mTiled = options.TiledResourcesTier != D3D12_TILED_RESOURCES_TIER_NOT_SUPPORTED;
+
+	ThrowIfFailed(device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(mFence.GetAddressOf())));
+
+	ThrowIfFailed(device->CreateCommandAllocator(
+		D3D12_COMMAND_LIST_TYPE_COPY,
+		IID_PPV_ARGS(mCmdAlloc.GetAddressOf())));
+
+	ThrowIfFailed(device->CreateCommandList(
+		0,
+		D3D12_COMMAND_LIST_TYPE_COPY,
+		mCmdAlloc.Get(),
+		nullptr,
+		IID_PPV_ARGS(mCmdList.GetAddressOf())));
+
+	// The worker resets it for each job.
+	ThrowIfFailed(mCmdList->Close());
+}
+
+TextureStreamer::~TextureStreamer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mJobMutex);
+		mQuit = true;
+	}
+	mJobReady.notify_one();
+	if (mWorker.joinable())
+		mWorker.join();
+
+	// The allocator and staging pages must outlive the last copy.
+	if (mFence != nullptr && mFence->GetCompletedValue() < mFenceValue)
+	{
+		HANDLE eventHandle = CreateEventEx(nullptr, nullptr, 0, EVENT_ALL_ACCESS);
+		if (eventHandle != nullptr)
+		{
+			if (SUCCEEDED(mFence->SetEventOnCompletion(mFenceValue, eventHandle)))
+				WaitForSingleObject(eventHandle, INFINITE);
+			CloseHandle(eventHandle);
+		}
+	}
+
+	for (auto& tex : mTextures)
+		CloseFile(tex->File);
+}
+
+bool TextureStreamer::MapFile(const std::wstring& filename, MappedFile& file)
+{
+	file.File = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (file.File == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file.File, &size) || size.QuadPart == 0)
+		return false;
+
+	file.Mapping = CreateFileMappingW(file.File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (file.Mapping == nullptr)
+		return false;
+
+	file.View = (const uint8_t*)MapViewOfFile(file.Mapping, FILE_MAP_READ, 0, 0, 0);
+	if (file.View == nullptr)
+		return false;
+
+	file.Size = (size_t)size.QuadPart;
+	return true;
+}
+
+void TextureStreamer::CloseFile(MappedFile& file)
+{
+	if (file.View != nullptr)
+	{
+		UnmapViewOfFile(file.View);
+		file.View = nullptr;
+	}
+
+	if (file.Mapping != nullptr)
+	{
+		CloseHandle(file.Mapping);
+		file.Mapping = nullptr;
+	}
+
+	if (file.File != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(file.File);
+		file.File = INVALID_HANDLE_VALUE;
+	}
+}
+
+int TextureStreamer::Load(ID3D12GraphicsCommandList* cmdList, const std::wstring& filename, UploadArena& arena,
+	ComPtr<ID3D12Resource>& texture)
+{
+	auto tex = std::make_unique<StreamedTexture>();
+	tex->Filename = filename;
+
+	DirectX::DDS_TEXTURE_INFO12 info;
+	if (!MapFile(filename, tex->File) || FAILED(DirectX::GetDDSTextureInfo12(tex->File.View, tex->File.Size, info)))
+	{
+		CloseFile(tex->File);
+		return -1;
+	}
+
+	tex->Desc = info.Desc;
+	for (const auto& sub : info.Subresources)
+	{
+		tex->Offsets.push_back(sub.Offset);
+		tex->RowPitches.push_back(sub.RowPitch);
+	}
+
+	UINT mipLevels = tex->Desc.MipLevels;
+	UINT arraySize = tex->Desc.DepthOrArraySize;
+
+	// The first mip no larger than TailSize on either side.
+	UINT tailMip = 0;
+	while (tailMip + 1 < mipLevels &&
+		MathHelper::Max((UINT)(tex->Desc.Width >> tailMip), tex->Desc.Height >> tailMip) > TailSize)
+		++tailMip;
+
+	bool tiled = false;
+	if (mTiled)
+	{
+		// Some formats and shapes cannot be tiled on every tier; those are committed.
+		D3D12_RESOURCE_DESC desc = tex->Desc;
+		desc.Layout = D3D12_TEXTURE_LAYOUT_64KB_UNDEFINED_SWIZZLE;
+		tiled = SUCCEEDED(mDevice->CreateReservedResource(
+			&desc,
+			D3D12_RESOURCE_STATE_COMMON,
+			nullptr,
+			IID_PPV_ARGS(tex->Resource.GetAddressOf())));
+	}
+
+	if (tiled)
+	{
+		D3D12_PACKED_MIP_INFO packedMipInfo = {};
+		UINT subresourceCount = mipLevels;
+		std::vector<D3D12_SUBRESOURCE_TILING> tilings(mipLevels);
+		mDevice->GetResourceTiling(tex->Resource.Get(), nullptr, &packedMipInfo, nullptr,
+			&subresourceCount, 0, tilings.data());
+
+		tex->StandardMips = packedMipInfo.NumStandardMips;
+		for (UINT mip = 0; mip < tex->StandardMips; ++mip)
+			tex->MipTiles.push_back(tilings[mip].WidthInTiles * tilings[mip].HeightInTiles * tilings[mip].DepthInTiles);
+
+		// Packed mips are mapped as a unit, so they are all in the tail.
+		tailMip = MathHelper::Min(tailMip, tex->StandardMips);
+
+		// Each slice has its own packed mips, addressed from the first of them.
+		for (UINT slice = 0; slice < arraySize && packedMipInfo.NumPackedMips > 0; ++slice)
+		{
+			UINT subresource = D3D12CalcSubresource(tex->StandardMips, slice, 0, mipLevels, arraySize);
+			MapTiles(tex->Resource.Get(), subresource, AllocateTiles(packedMipInfo.NumTilesForPackedMips));
+		}
+
+		tex->Tiles.resize(tex->StandardMips);
+		for (UINT mip = tailMip; mip < tex->StandardMips; ++mip)
+		{
+			for (UINT slice = 0; slice < arraySize; ++slice)
+			{
+				tex->Tiles[mip].push_back(AllocateTiles(tex->MipTiles[mip]));
+				MapTiles(tex->Resource.Get(), D3D12CalcSubresource(mip, slice, 0, mipLevels, arraySize), tex->Tiles[mip].back());
+			}
+		}
+	}
+	else
+	{
+		tex->Resource = nullptr;
+		ThrowIfFailed(mDevice->CreateCommittedResource(
+			&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+			D3D12_HEAP_FLAG_NONE,
+			&tex->Desc,
+			D3D12_RESOURCE_STATE_COMMON,
+			nullptr,
+			IID_PPV_ARGS(tex->Resource.GetAddressOf())));
+
+		tex->StandardMips = mipLevels;
+
+		std::lock_guard<std::mutex> lock(mTileMutex);
+		mResidentBytes += mDevice->GetResourceAllocationInfo(0, 1, &tex->Desc).SizeInBytes;
+	}
+
+	tex->TailMip = tailMip;
+	tex->ResidentMip = tailMip;
+	tex->RequestedMip = tailMip;
+
+	// Left in COMMON: the copies promote it, and it decays back once the copy queue
+	// is done with it.
+	for (UINT mip = tailMip; mip < mipLevels; ++mip)
+		RecordMipUpload(cmdList, *tex, mip, arena);
+
+	texture = tex->Resource;
+
+	std::lock_guard<std::mutex> lock(mTextureMutex);
+	mTextures.push_back(std::move(tex));
+	return (int)mTextures.size() - 1;
+}
+
+void TextureStreamer::Start()
+{
+	mWorker = std::thread([this]() { WorkerMain(); });
+}
+
+void TextureStreamer::Request(int id, float screenTexels)
+{
+	if (id < 0)
+		return;
+
+	StreamedTexture& tex = *mTextures[id];
+
+	// The mip the sampler picks when the full width covers screenTexels pixels.
+	float lod = log2f((float)tex.Desc.Width / MathHelper::Max(screenTexels, 1.0f));
+	UINT mip = lod <= 0.0f ? 0 : MathHelper::Min((UINT)lod, (UINT)tex.Desc.MipLevels - 1);
+	tex.RequestedMip = MathHelper::Min(tex.RequestedMip, mip);
+}
+
+void TextureStreamer::Update(ID3D12CommandQueue* directQueue, ID3D12Fence* frameFence, UINT64 lastFrameFence)
+{
+	UINT64 completedFrame = frameFence->GetCompletedValue();
+	UINT64 completedStream = mFence->GetCompletedValue();
+	mArena.Recycle(completedStream);
+
+	{
+		std::lock_guard<std::mutex> lock(mJobMutex);
+		if (mJobState == JobState::Submitted && completedStream >= mJobFence)
+		{
+			// The copy has landed; frames may sample the new mip from this one on.
+			mTextures[mJobTexture]->ResidentMip = mJobMip;
+			mJobState = JobState::Idle;
+		}
+		else if (mJobState == JobState::Recorded)
+		{
+			StreamedTexture& tex = *mTextures[mJobTexture];
+
+			// Submitted frames may still be sampling the texture, and a texture cannot
+			// be read on one queue while another writes it.  So the copy waits for them,
+			// and the frame about to be recorded waits for the copy.
+			ThrowIfFailed(mCopyQueue->Wait(frameFence, lastFrameFence));
+
+			for (UINT slice = 0; !tex.Tiles.empty() && slice < tex.Tiles[mJobMip].size(); ++slice)
+			{
+				MapTiles(tex.Resource.Get(), D3D12CalcSubresource(mJobMip, slice, 0, tex.Desc.MipLevels, tex.Desc.DepthOrArraySize),
+					tex.Tiles[mJobMip][slice]);
+			}
+
+			ID3D12CommandList* cmdsLists[] = { mCmdList.Get() };
+			mCopyQueue->ExecuteCommandLists(_countof(cmdsLists), cmdsLists);
+			ThrowIfFailed(mCopyQueue->Signal(mFence.Get(), ++mFenceValue));
+			mArena.Retire(mFenceValue);
+			ThrowIfFailed(directQueue->Wait(mFence.Get(), mFenceValue));
+
+			mJobFence = mFenceValue;
+			mJobState = JobState::Submitted;
+		}
+	}
+
+	// Unmap evicted mips no frame can still sample.
+	bool unmapped = false;
+	for (size_t i = 0; i < mPendingUnmaps.size();)
+	{
+		PendingUnmap& pending = mPendingUnmaps[i];
+		if (pending.FrameFence > completedFrame)
+		{
+			++i;
+			continue;
+		}
+
+		StreamedTexture& tex = *mTextures[pending.Texture];
+		for (UINT slice = 0; slice < pending.Tiles.size(); ++slice)
+		{
+			UnmapTiles(tex.Resource.Get(), D3D12CalcSubresource(pending.Mip, slice, 0, tex.Desc.MipLevels, tex.Desc.DepthOrArraySize),
+				tex.MipTiles[pending.Mip]);
+			FreeTiles(pending.Tiles[slice]);
+		}
+		unmapped = true;
+
+		if (i + 1 < mPendingUnmaps.size())
+			pending = std::move(mPendingUnmaps.back());
+		mPendingUnmaps.pop_back();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mTileMutex);
+
+		// Heaps emptied now are released once the copy queue is past the unmapping.
+		if (unmapped)
+		{
+			ThrowIfFailed(mCopyQueue->Signal(mFence.Get(), ++mFenceValue));
+			for (auto& heap : mTileHeaps)
+			{
+				if (heap.Heap != nullptr && heap.FreeTiles.size() == heap.TileCount && heap.ReleaseFence == 0)
+					heap.ReleaseFence = mFenceValue;
+			}
+		}
+
+		for (auto& heap : mTileHeaps)
+		{
+			if (heap.Heap != nullptr && heap.ReleaseFence != 0 && heap.ReleaseFence <= completedStream)
+			{
+				heap.Heap = nullptr;
+				heap.TileCount = 0;
+				heap.FreeTiles.clear();
+				heap.ReleaseFence = 0;
+			}
+		}
+	}
+
+	// Committed textures keep every mip's memory whether it is loaded or not, so
+	// only tiled ones give anything back.
+	if (mTiled)
+	{
+		for (int id = 0; id < (int)mTextures.size(); ++id)
+		{
+			StreamedTexture& tex = *mTextures[id];
+			if (tex.RequestedMip > tex.ResidentMip)
+				++tex.UnwantedFrames;
+			else
+				tex.UnwantedFrames = 0;
+
+			if (tex.UnwantedFrames >= EvictFrames && CanEvict(id))
+			{
+				Evict(id, lastFrameFence);
+				tex.UnwantedFrames = 0;
+			}
+		}
+
+		// Over budget: the mips furthest finer than wanted go first.
+		while (ResidentBytes() > mBudgetBytes)
+		{
+			int victim = -1;
+			UINT victimExcess = 0;
+			for (int id = 0; id < (int)mTextures.size(); ++id)
+			{
+				const StreamedTexture& tex = *mTextures[id];
+				if (tex.RequestedMip > tex.ResidentMip && tex.RequestedMip - tex.ResidentMip > victimExcess && CanEvict(id))
+				{
+					victim = id;
+					victimExcess = tex.RequestedMip - tex.ResidentMip;
+				}
+			}
+
+			if (victim < 0)
+				break;
+			Evict(victim, lastFrameFence);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mJobMutex);
+		if (mJobState == JobState::Idle)
+		{
+			int id = PickNextLoad();
+			if (id >= 0)
+			{
+				StreamedTexture& tex = *mTextures[id];
+				UINT mip = tex.ResidentMip - 1;
+
+				// Tiles are taken now so the budget counts them while the copy is recorded.
+				if (!tex.Tiles.empty())
+				{
+					for (UINT slice = 0; slice < tex.Desc.DepthOrArraySize; ++slice)
+						tex.Tiles[mip].push_back(AllocateTiles(tex.MipTiles[mip]));
+				}
+
+				mJobTexture = id;
+				mJobMip = mip;
+				mJobState = JobState::Recording;
+				mJobReady.notify_one();
+			}
+		}
+	}
+
+	// Requests start over each frame; a texture nothing asks for wants only its tail.
+	for (auto& tex : mTextures)
+		tex->RequestedMip = tex->TailMip;
+}
+
+float TextureStreamer::MinLod(int id)const
+{
+	if (id < 0)
+		return 0.0f;
+
+	return (float)mTextures[id]->ResidentMip;
+}
+
+bool TextureStreamer::Tiled()const
+{
+	return mTiled;
+}
+
+UINT64 TextureStreamer::ResidentBytes()const
+{
+	std::lock_guard<std::mutex> lock(mTileMutex);
+	return mResidentBytes;
+}
+
+UINT64 TextureStreamer::BudgetBytes()const
+{
+	return mBudgetBytes;
+}
+
+void TextureStreamer::RecordMipUpload(ID3D12GraphicsCommandList* cmdList, StreamedTexture& tex, UINT mip, UploadArena& arena)
+{
+	D3D12_RESOURCE_DESC desc = tex.Resource->GetDesc();
+	for (UINT slice = 0; slice < desc.DepthOrArraySize; ++slice)
+	{
+		UINT subresource = D3D12CalcSubresource(mip, slice, 0, desc.MipLevels, desc.DepthOrArraySize);
+
+		D3D12_PLACED_SUBRESOURCE_FOOTPRINT footprint;
+		UINT numRows = 0;
+		UINT64 rowBytes = 0;
+		UINT64 totalBytes = 0;
+		mDevice->GetCopyableFootprints(&desc, subresource, 1, 0, &footprint, &numRows, &rowBytes, &totalBytes);
+
+		// Rows are copied straight out of the mapped file; the pages fault in here,
+		// off the main thread once streaming has started.
+		UploadArena::Allocation staging = arena.Allocate(totalBytes);
+		const uint8_t* src = tex.File.View + tex.Offsets[subresource];
+		uint8_t* dst = (uint8_t*)staging.CPU;
+		for (UINT row = 0; row < numRows; ++row)
+			memcpy(dst + (size_t)row * footprint.Footprint.RowPitch, src + (size_t)row * tex.RowPitches[subresource], (size_t)rowBytes);
+
+		footprint.Offset += staging.Offset;
+		CD3DX12_TEXTURE_COPY_LOCATION dstLocation(tex.Resource.Get(), subresource);
+		CD3DX12_TEXTURE_COPY_LOCATION srcLocation(staging.Resource, footprint);
+		cmdList->CopyTextureRegion(&dstLocation, 0, 0, 0, &srcLocation, nullptr);
+	}
+}
+
+UINT64 TextureStreamer::MipBytes(const StreamedTexture& tex, UINT mip)const
+{
+	if (tex.Tiles.empty() || mip >= tex.StandardMips)
+		return 0;
+
+	return (UINT64)tex.MipTiles[mip] * tex.Desc.DepthOrArraySize * kTileSize;
+}
+
+TextureStreamer::TileAllocation TextureStreamer::AllocateTiles(UINT count)
+{
+	std::lock_guard<std::mutex> lock(mTileMutex);
+
+	UINT heap = 0;
+	while (heap < mTileHeaps.size() && mTileHeaps[heap].FreeTiles.size() < count)
+		++heap;
+
+	if (heap == mTileHeaps.size())
+	{
+		// Reuse the slot of a released heap, so allocations keep their indices.
+		heap = 0;
+		while (heap < mTileHeaps.size() && mTileHeaps[heap].Heap != nullptr)
+			++heap;
+		if (heap == mTileHeaps.size())
+			mTileHeaps.push_back(TileHeap());
+
+		TileHeap& tileHeap = mTileHeaps[heap];
+		tileHeap.TileCount = MathHelper::Max(count, kTilesPerHeap);
+
+		D3D12_HEAP_DESC heapDesc = {};
+		heapDesc.SizeInBytes = tileHeap.TileCount * kTileSize;
+		heapDesc.Properties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+		heapDesc.Alignment = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+		heapDesc.Flags = D3D12_HEAP_FLAG_ALLOW_ONLY_NON_RT_DS_TEXTURES;
+		ThrowIfFailed(mDevice->CreateHeap(&heapDesc, IID_PPV_ARGS(tileHeap.Heap.GetAddressOf())));
+
+		// Highest first, so tiles are handed out in ascending runs.
+		for (UINT tile = tileHeap.TileCount; tile > 0; --tile)
+			tileHeap.FreeTiles.push_back(tile - 1);
+	}
+
+	TileHeap& tileHeap = mTileHeaps[heap];
+	tileHeap.ReleaseFence = 0;
+
+	TileAllocation alloc;
+	alloc.Heap = heap;
+	for (UINT i = 0; i < count; ++i)
+	{
+		alloc.Tiles.push_back(tileHeap.FreeTiles.back());
+		tileHeap.FreeTiles.pop_back();
+	}
+
+	mResidentBytes += count * kTileSize;
+	return alloc;
+}
+
+void TextureStreamer::FreeTiles(const TileAllocation& alloc)
+{
+	std::lock_guard<std::mutex> lock(mTileMutex);
+
+	// Evict already took the tiles out of mResidentBytes.
+	TileHeap& tileHeap = mTileHeaps[alloc.Heap];
+	for (auto it = alloc.Tiles.rbegin(); it != alloc.Tiles.rend(); ++it)
+		tileHeap.FreeTiles.push_back(*it);
+}
+
+void TextureStreamer::MapTiles(ID3D12Resource* resource, UINT subresource, const TileAllocation& alloc)
+{
+	// Consecutive heap tiles go in one range.
+	std::vector<UINT> rangeStarts;
+	std::vector<UINT> rangeCounts;
+	for (UINT tile : alloc.Tiles)
+	{
+		if (!rangeStarts.empty() && rangeStarts.back() + rangeCounts.back() == tile)
+		{
+			++rangeCounts.back();
+		}
+		else
+		{
+			rangeStarts.push_back(tile);
+			rangeCounts.push_back(1);
+		}
+	}
+
+	ID3D12Heap* heap = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mTileMutex);
+		heap = mTileHeaps[alloc.Heap].Heap.Get();
+	}
+
+	// The region runs through the subresource's tiles in order.
+	D3D12_TILED_RESOURCE_COORDINATE start = { 0, 0, 0, subresource };
+	D3D12_TILE_REGION_SIZE size = {};
+	size.NumTiles = (UINT)alloc.Tiles.size();
+	size.UseBox = FALSE;
+
+	mCopyQueue->UpdateTileMappings(resource, 1, &start, &size, heap,
+		(UINT)rangeStarts.size(), nullptr, rangeStarts.data(), rangeCounts.data(),
+		D3D12_TILE_MAPPING_FLAG_NONE);
+}
+
+void TextureStreamer::UnmapTiles(ID3D12Resource* resource, UINT subresource, UINT tileCount)
+{
+	D3D12_TILED_RESOURCE_COORDINATE start = { 0, 0, 0, subresource };
+	D3D12_TILE_REGION_SIZE size = {};
+	size.NumTiles = tileCount;
+	size.UseBox = FALSE;
+
+	D3D12_TILE_RANGE_FLAGS flags = D3D12_TILE_RANGE_FLAG_NULL;
+	mCopyQueue->UpdateTileMappings(resource, 1, &start, &size, nullptr,
+		1, &flags, nullptr, &tileCount, D3D12_TILE_MAPPING_FLAG_NONE);
+}
+
+bool TextureStreamer::CanEvict(int id)const
+{
+	const StreamedTexture& tex = *mTextures[id];
+	if (tex.Tiles.empty() || tex.ResidentMip >= tex.TailMip)
+		return false;
+
+	// Mips stay contiguous: nothing leaves a texture while its next mip is loading.
+	std::lock_guard<std::mutex> lock(mJobMutex);
+	return mJobState == JobState::Idle || mJobTexture != id;
+}
+
+void TextureStreamer::Evict(int id, UINT64 lastFrameFence)
+{
+	StreamedTexture& tex = *mTextures[id];
+	UINT mip = tex.ResidentMip;
+
+	// Raising ResidentMip raises MinLod for frames from this one on.  Frames up to
+	// lastFrameFence may have been recorded with the old value.
+	PendingUnmap pending;
+	pending.Texture = id;
+	pending.Mip = mip;
+	pending.FrameFence = lastFrameFence;
+	pending.Tiles = std::move(tex.Tiles[mip]);
+	mPendingUnmaps.push_back(std::move(pending));
+
+	tex.Tiles[mip].clear();
+	++tex.ResidentMip;
+
+	std::lock_guard<std::mutex> lock(mTileMutex);
+	mResidentBytes -= MipBytes(tex, mip);
+}
+
+int TextureStreamer::PickNextLoad()const
+{
+	// The texture furthest from what it wants, that the budget has room for.
+	int best = -1;
+	UINT bestShortfall = 0;
+	UINT64 residentBytes = ResidentBytes();
+	for (int id = 0; id < (int)mTextures.size(); ++id)
+	{
+		const StreamedTexture& tex = *mTextures[id];
+		if (tex.RequestedMip >= tex.ResidentMip || tex.ResidentMip - tex.RequestedMip <= bestShortfall)
+			continue;
+
+		UINT mip = tex.ResidentMip - 1;
+		if (mTiled && residentBytes + MipBytes(tex, mip) > mBudgetBytes)
+			continue;
+
+		// Its old tiles may still be waiting to be unmapped, which would land on top
+		// of new mappings.
+		bool unmapping = false;
+		for (const auto& pending : mPendingUnmaps)
+			unmapping = unmapping || (pending.Texture == id && pending.Mip == mip);
+		if (unmapping)
+			continue;
+
+		best = id;
+		bestShortfall = tex.ResidentMip - tex.RequestedMip;
+	}
+
+	return best;
+}
+
+void TextureStreamer::WorkerMain()
+{
+	Profiler::SetThreadName("TextureStreamer");
+
+	for (;;)
+	{
+		int id = -1;
+		UINT mip = 0;
+		{
+			std::unique_lock<std::mutex> lock(mJobMutex);
+			mJobReady.wait(lock, [this]() { return mQuit || mJobState == JobState::Recording; });
+			if (mQuit)
+				return;
+
+			id = mJobTexture;
+			mip = mJobMip;
+		}
+
+		StreamedTexture* tex = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(mTextureMutex);
+			tex = mTextures[id].get();
+		}
+
+		{
+			PROFILE_SCOPE("StreamMip");
+
+			// The previous job's copy completed before this one was handed out.
+			ThrowIfFailed(mCmdAlloc->Reset());
+			ThrowIfFailed(mCmdList->Reset(mCmdAlloc.Get(), nullptr));
+			RecordMipUpload(mCmdList.Get(), *tex, mip, mArena);
+			ThrowIfFailed(mCmdList->Close());
+		}
+
+		std::lock_guard<std::mutex> lock(mJobMutex);
+		mJobState = JobState::Recorded;
+	}
+}
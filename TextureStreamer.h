@@ -0,0 +1,201 @@
+//***************************************************************************************
+// TextureStreamer.h
+//
+// Streams DDS mips into GPU memory as they become visible, instead of loading every
+// texture whole at startup.
+//
+// Each file is memory-mapped for the life of the streamer and read straight from
+// the view; nothing is loaded into system memory first.  Textures are created as
+// reserved resources when the adapter supports tiled resources, so only mapped
+// 64 KB tiles cost memory.  At load only the low mips (TailSize texels and below,
+// plus the packed mip tail) are mapped and uploaded; the rest are left unmapped.
+//
+// Each frame the renderer reports, per texture, how many screen pixels its full
+// width covers at its nearest visible use.  That picks the mip the sampler would
+// choose, and Update streams toward it one mip at a time: a worker thread copies
+// the mip's rows out of the mapped file into an upload page and records the copy,
+// and Update submits it on the copy queue.  Mips that stay unwanted, or that the
+// budget needs back, are evicted: MinLod is raised first, and the tiles are
+// unmapped only once every frame that could still sample them has finished.
+//
+// Shaders must not sample finer than MinLod(id).  It only ever names mips whose
+// copies have completed, so nothing reads an unmapped tile.
+//
+// Without tiled resources the textures are committed with every mip.  Streaming
+// then still spreads the file I/O out over time, but saves no GPU memory.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+#include "GpuMemory.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+class TextureStreamer
+{
+public:
+	// Mips no larger than this many texels on a side are resident from the start.
+	static const UINT TailSize = 128;
+
+	// Frames a mip must go unwanted before it is evicted while under budget.
+	static const UINT EvictFrames = 120;
+
+	TextureStreamer(ID3D12Device* device, ID3D12CommandQueue* copyQueue, UINT64 budgetBytes);
+	TextureStreamer(const TextureStreamer& rhs) = delete;
+	TextureStreamer& operator=(const TextureStreamer& rhs) = delete;
+	~TextureStreamer();
+
+	// Any loader thread.  Maps filename, creates its texture in texture and records
+	// the upload of the low mips into cmdList, a copy list, staged through arena.
+	// Tile mappings for them go to the copy queue immediately, so cmdList must be
+	// executed on it afterwards.  Returns the id for Request and MinLod, or -1 if the
+	// file cannot be mapped or is not a 2D texture, array or cube.
+	int Load(ID3D12GraphicsCommandList* cmdList, const std::wstring& filename, UploadArena& arena,
+		Microsoft::WRL::ComPtr<ID3D12Resource>& texture);
+
+	// Starts streaming.  Call once the startup uploads have been submitted.
+	void Start();
+
+	// Main thread, between Updates.  screenTexels is how many pixels the texture's
+	// full width covers on screen; the largest of a frame's requests wins.
+	void Request(int id, float screenTexels);
+
+	// Main thread, once a frame, before MinLod is read for the frame's constants.
+	// frameFence is the direct queue's, and lastFrameFence the value the last
+	// submitted frame signals.  Work submitted here is waited on by directQueue, so
+	// the copy queue never writes a texture while a frame is reading it.
+	void Update(ID3D12CommandQueue* directQueue, ID3D12Fence* frameFence, UINT64 lastFrameFence);
+
+	// Most detailed mip of id that may be sampled.
+	float MinLod(int id)const;
+
+	bool Tiled()const;
+	UINT64 ResidentBytes()const;
+	UINT64 BudgetBytes()const;
+
+private:
+	struct MappedFile
+	{
+		HANDLE File = INVALID_HANDLE_VALUE;
+		HANDLE Mapping = nullptr;
+		const uint8_t* View = nullptr;
+		size_t Size = 0;
+	};
+
+	// Tiles from one heap, in the order they back the region they are mapped to.
+	struct TileAllocation
+	{
+		UINT Heap = 0;
+		std::vector<UINT> Tiles;
+	};
+
+	struct StreamedTexture
+	{
+		std::wstring Filename;
+		MappedFile File;
+		Microsoft::WRL::ComPtr<ID3D12Resource> Resource;
+		D3D12_RESOURCE_DESC Desc = {};
+
+		// Per subresource, where its data is in the mapped file.
+		std::vector<size_t> Offsets;
+		std::vector<UINT> RowPitches;
+
+		// Tiles each standard mip of one slice covers; empty when not tiled.
+		std::vector<UINT> MipTiles;
+		UINT StandardMips = 0;
+
+		// Mips [TailMip, MipLevels) never leave.  Mips [ResidentMip, MipLevels) are
+		// resident; ResidentMip only moves in Update.
+		UINT TailMip = 0;
+		UINT ResidentMip = 0;
+
+		// Tiles backing each standard mip, one allocation per slice, while mapped.
+		std::vector<std::vector<TileAllocation>> Tiles;
+
+		// Finest mip requested since the last Update, and how long the resident mips
+		// have been finer than wanted.
+		UINT RequestedMip = 0;
+		UINT UnwantedFrames = 0;
+	};
+
+	struct TileHeap
+	{
+		Microsoft::WRL::ComPtr<ID3D12Heap> Heap;
+		UINT TileCount = 0;
+		std::vector<UINT> FreeTiles;
+
+		// Once every tile is free: the stream fence value after their unmapping, when
+		// the heap can be released.
+		UINT64 ReleaseFence = 0;
+	};
+
+	// An evicted mip whose tiles are unmapped once frameFence reaches FrameFence.
+	struct PendingUnmap
+	{
+		int Texture = -1;
+		UINT Mip = 0;
+		UINT64 FrameFence = 0;
+		std::vector<TileAllocation> Tiles;
+	};
+
+	enum class JobState
+	{
+		Idle,
+		Recording,
+		Recorded,
+		Submitted
+	};
+
+	bool MapFile(const std::wstring& filename, MappedFile& file);
+	void CloseFile(MappedFile& file);
+
+	void RecordMipUpload(ID3D12GraphicsCommandList* cmdList, StreamedTexture& tex, UINT mip, UploadArena& arena);
+	UINT64 MipBytes(const StreamedTexture& tex, UINT mip)const;
+
+	TileAllocation AllocateTiles(UINT count);
+	void FreeTiles(const TileAllocation& alloc);
+	void MapTiles(ID3D12Resource* resource, UINT subresource, const TileAllocation& alloc);
+	void UnmapTiles(ID3D12Resource* resource, UINT subresource, UINT tileCount);
+
+	bool CanEvict(int id)const;
+	void Evict(int id, UINT64 lastFrameFence);
+	int PickNextLoad()const;
+	void WorkerMain();
+
+private:
+	ID3D12Device* mDevice = nullptr;
+	ID3D12CommandQueue* mCopyQueue = nullptr;
+	bool mTiled = false;
+	UINT64 mBudgetBytes = 0;
+	UINT64 mResidentBytes = 0;
+
+	// Guards mTextures while loader threads add to it; after Start only the main
+	// thread changes its entries, and the worker reads the one its job names.
+	mutable std::mutex mTextureMutex;
+	std::vector<std::unique_ptr<StreamedTexture>> mTextures;
+
+	// Tile heaps and mResidentBytes, guarded by mTileMutex for the loader threads.
+	mutable std::mutex mTileMutex;
+	std::vector<TileHeap> mTileHeaps;
+	std::vector<PendingUnmap> mPendingUnmaps;
+
+	// Streaming uploads have their own staging pages and fence, so their retire
+	// values never mix with the startup loader's.
+	UploadArena mArena;
+	Microsoft::WRL::ComPtr<ID3D12Fence> mFence;
+	UINT64 mFenceValue = 0;
+	Microsoft::WRL::ComPtr<ID3D12CommandAllocator> mCmdAlloc;
+	Microsoft::WRL::ComPtr<ID3D12GraphicsCommandList> mCmdList;
+
+	// One mip in flight at a time.  mJobMutex guards the job and its state.
+	std::thread mWorker;
+	mutable std::mutex mJobMutex;
+	std::condition_variable mJobReady;
+	JobState mJobState = JobState::Idle;
+	int mJobTexture = -1;
+	UINT mJobMip = 0;
+	UINT64 mJobFence = 0;
+	bool mQuit = false;
+};
@@ -0,0 +1,115 @@
+//***************************************************************************************
+// ThreadPool.cpp
+//***************************************************************************************
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned threadCount)
+{
+	for (unsigned i = 0; i < threadCount; ++i)
+		mWorkers.emplace_back([this]() { WorkerLoop(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStopping = true;
+	}
+	mWake.notify_all();
+
+	for (auto& worker : mWorkers)
+		worker.join();
+}
+
+void ThreadPool::ParallelFor(unsigned count, const std::function<void(unsigned)>& task)
+{
+	if (count == 0)
+		return;
+
+	uint32_t generation;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		generation = ++mGeneration;
+		mTask = &task;
+		mTaskCount = count;
+		mPending = count;
+		mNext = (uint64_t)generation << 32;
+	}
+	mWake.notify_all();
+
+	// The caller takes indices too rather than sitting idle.
+	RunTasks(generation, task, count);
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	mDone.wait(lock, [this]() { return mPending == 0; });
+
+	if (mError)
+	{
+		std::exception_ptr error = mError;
+		mError = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+unsigned ThreadPool::ThreadCount()const
+{
+	return (unsigned)mWorkers.size();
+}
+
+void ThreadPool::WorkerLoop()
+{
+	uint32_t seenGeneration = 0;
+	for (;;)
+	{
+		const std::function<void(unsigned)>* task;
+		unsigned count;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mWake.wait(lock, [&]() { return mStopping || mGeneration != seenGeneration; });
+			if (mStopping)
+				return;
+			seenGeneration = mGeneration;
+			task = mTask;
+			count = mTaskCount;
+		}
+
+		RunTasks(seenGeneration, *task, count);
+	}
+}
+
+void ThreadPool::RunTasks(uint32_t generation, const std::function<void(unsigned)>& task, unsigned count)
+{
+	for (;;)
+	{
+		// Only take an index from our own call, and only while any are left.  If the
+		// caller has moved on to a later call, its task and count are not ours.
+		uint64_t next = mNext.load();
+		unsigned i;
+		do
+		{
+			i = (unsigned)(next & 0xffffffffu);
+			if ((uint32_t)(next >> 32) != generation || i >= count)
+				return;
+		} while (!mNext.compare_exchange_weak(next, next + 1));
+
+		try
+		{
+			task(i);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (!mError)
+				mError = std::current_exception();
+		}
+
+		// The last task to finish wakes the caller.  Taking the lock first means the
+		// notify cannot land between its predicate check and its wait.
+		if (mPending.fetch_sub(1) == 1)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mDone.notify_one();
+		}
+	}
+}
@@ -0,0 +1,59 @@
+//***************************************************************************************
+// ThreadPool.h
+//
+// Fixed set of worker threads for fork/join work inside a frame.  ParallelFor hands
+// out indices [0, count) one at a time to the workers and to the calling thread, and
+// returns once every index has run.  Workers sleep on a condition variable between
+// calls, so an idle pool costs nothing.  If a task throws, the first exception is
+// rethrown from ParallelFor on the calling thread once the others have finished.
+//***************************************************************************************
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+	// threadCount workers in addition to the calling thread; 0 runs everything inline.
+	explicit ThreadPool(unsigned threadCount);
+	ThreadPool(const ThreadPool& rhs) = delete;
+	ThreadPool& operator=(const ThreadPool& rhs) = delete;
+	~ThreadPool();
+
+	// Runs task(i) for every i in [0, count).  Calls must not overlap.
+	void ParallelFor(unsigned count, const std::function<void(unsigned)>& task);
+
+	unsigned ThreadCount()const;
+
+private:
+	void WorkerLoop();
+	void RunTasks(uint32_t generation, const std::function<void(unsigned)>& task, unsigned count);
+
+private:
+	std::vector<std::thread> mWorkers;
+
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	std::condition_variable mDone;
+	uint32_t mGeneration = 0;
+	bool mStopping = false;
+	std::exception_ptr mError;
+
+	// The current call's task and count, guarded by mMutex; workers copy them when
+	// they wake.
+	const std::function<void(unsigned)>* mTask = nullptr;
+	unsigned mTaskCount = 0;
+
+	// Generation in the high 32 bits, next index in the low 32.  A worker still
+	// draining an earlier call sees the generation change and takes nothing.
+	std::atomic<uint64_t> mNext{ 0 };
+	std::atomic<unsigned> mPending{ 0 };
+};
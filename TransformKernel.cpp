@@ -0,0 +1,85 @@
+//***************************************************************************************
+// TransformKernel.cpp
+//***************************************************************************************
+
+#include "TransformKernel.h"
+
+using namespace DirectX;
+
+TransformKernel::TransformKernel()
+{
+	XMStoreFloat4x4(&mLocal, XMMatrixIdentity());
+	for (int i = 0; i < MatrixCount; ++i)
+		XMStoreFloat4x4(&mPost[i], XMMatrixIdentity());
+
+	UpdateProducts();
+}
+
+void TransformKernel::SetLocalTransform(FXMMATRIX local)
+{
+	XMStoreFloat4x4(&mLocal, local);
+	UpdateProducts();
+}
+
+void TransformKernel::SetMirrorPlane(FXMVECTOR plane)
+{
+	XMStoreFloat4x4(&mPost[Reflected], XMMatrixReflect(plane));
+	UpdateProducts();
+}
+
+bool TransformKernel::SetShadowLight(const XMFLOAT3& lightDirection)
+{
+	if (lightDirection.x == mLightDirection.x &&
+		lightDirection.y == mLightDirection.y &&
+		lightDirection.z == mLightDirection.z)
+		return false;
+
+	mLightDirection = lightDirection;
+
+	XMVECTOR shadowPlane = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f); // xz plane
+	XMVECTOR toMainLight = -XMLoadFloat3(&lightDirection);
+	XMMATRIX S = XMMatrixShadow(shadowPlane, toMainLight);
+	XMMATRIX shadowOffsetY = XMMatrixTranslation(0.0f, 0.001f, 0.0f);
+	XMStoreFloat4x4(&mPost[Shadow], S * shadowOffsetY);
+
+	UpdateProducts();
+	return true;
+}
+
+void TransformKernel::UpdateProducts()
+{
+	XMMATRIX local = XMLoadFloat4x4(&mLocal);
+	for (int i = 0; i < MatrixCount; ++i)
+		XMStoreFloat4x4(&mProducts[i], local * XMLoadFloat4x4(&mPost[i]));
+}
+
+void TransformKernel::Run(const XMFLOAT3* positions, const Target* targets, size_t count)const
+{
+	XMMATRIX products[MatrixCount];
+	XMMATRIX post[MatrixCount];
+	for (int k = 0; k < MatrixCount; ++k)
+	{
+		products[k] = XMLoadFloat4x4(&mProducts[k]);
+		post[k] = XMLoadFloat4x4(&mPost[k]);
+	}
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Target& target = targets[i];
+		XMVECTOR p = XMVectorSetW(XMLoadFloat3(&positions[target.Slot]), 1.0f);
+
+		for (int k = 0; k < MatrixCount; ++k)
+		{
+			if (target.Rows[k] == nullptr && target.Transposed[k] == nullptr)
+				continue;
+
+			XMMATRIX m = products[k];
+			m.r[3] = XMVector4Transform(p, post[k]);
+
+			if (target.Rows[k] != nullptr)
+				XMStoreFloat4x4(target.Rows[k], m);
+			if (target.Transposed[k] != nullptr)
+				XMStoreFloat4x4(target.Transposed[k], XMMatrixTranspose(m));
+		}
+	}
+}
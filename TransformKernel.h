@@ -0,0 +1,60 @@
+//***************************************************************************************
+// TransformKernel.h
+//
+// World, mirrored and planar-shadow matrices for many entities that share a model
+// transform and differ only in where they stand.  world = local * T(p) leaves the
+// local rows alone and puts p in the last row, so world * M keeps the rows of
+// local * M and only the last row, p * M, is per entity.  Those products are cached
+// with the mirror and shadow matrices, and Run does two vector transforms and the
+// stores for each entity.
+//***************************************************************************************
+
+#pragma once
+
+#include <DirectXMath.h>
+#include <cstddef>
+#include <cstdint>
+
+class TransformKernel
+{
+public:
+	enum Matrix
+	{
+		World = 0,
+		Reflected,
+		Shadow,
+		MatrixCount
+	};
+
+	// Where Run writes the matrices of one entity.  Any pointer may be null.
+	struct Target
+	{
+		uint32_t Slot = 0;                                      // into the positions passed to Run
+		DirectX::XMFLOAT4X4* Rows[MatrixCount] = {};            // row-major, as the CPU uses them
+		DirectX::XMFLOAT4X4* Transposed[MatrixCount] = {};      // as the shader reads them
+	};
+
+	TransformKernel();
+
+	// Rotation and scale applied before the translation.  Must be affine.
+	void SetLocalTransform(DirectX::FXMMATRIX local);
+
+	void SetMirrorPlane(DirectX::FXMVECTOR plane);
+
+	// Shadows fall on the y = 0 plane, raised slightly to stay out of it.  The
+	// matrix is only rebuilt when the direction changes; returns true if it was,
+	// since every entity's shadow is then out of date.
+	bool SetShadowLight(const DirectX::XMFLOAT3& lightDirection);
+
+	void Run(const DirectX::XMFLOAT3* positions, const Target* targets, size_t count)const;
+
+private:
+	void UpdateProducts();
+
+private:
+	DirectX::XMFLOAT4X4 mLocal;
+	DirectX::XMFLOAT4X4 mPost[MatrixCount];     // identity, mirror, shadow
+	DirectX::XMFLOAT4X4 mProducts[MatrixCount]; // local times each of mPost
+
+	DirectX::XMFLOAT3 mLightDirection = { 0.0f, 0.0f, 0.0f };
+};
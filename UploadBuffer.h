@@ -55,6 +55,20 @@ public:
         memcpy(&mMappedData[elementIndex*mElementByteSize], &data, sizeof(T));
     }
 
+    // Copies count consecutive elements starting at firstElement.  Elements of a
+    // non-constant buffer are tightly packed, so that is a single memcpy.
+    void CopyRange(int firstElement, const T* data, int count)
+    {
+        if(!mIsConstantBuffer)
+        {
+            memcpy(&mMappedData[firstElement*mElementByteSize], data, sizeof(T)*count);
+            return;
+        }
+
+        for(int i = 0; i < count; ++i)
+            CopyData(firstElement + i, data[i]);
+    }
+
 private:
     Microsoft::WRL::ComPtr<ID3D12Resource> mUploadBuffer;
     BYTE* mMappedData = nullptr;
@@ -5,6 +5,8 @@
 #include "d3dApp.h"
 #include <WindowsX.h>
 #include <thread>
+#include <cmath>
+#include <chrono>
 
 using Microsoft::WRL::ComPtr;
 using namespace std;
@@ -30,12 +32,19 @@ D3DApp::D3DApp(HINSTANCE hInstance)
     // Only one D3DApp can be constructed.
     assert(mApp == nullptr);
     mApp = this;
+
+	Profiler::SetThreadName("Main");
 }
 
 D3DApp::~D3DApp()
 {
 	if(md3dDevice != nullptr)
 		FlushCommandQueue();
+
+	if(mFrameLatencyWaitable != nullptr)
+		CloseHandle(mFrameLatencyWaitable);
+	if(mFenceEvent != nullptr)
+		CloseHandle(mFenceEvent);
 }
 
 HINSTANCE D3DApp::AppInst()const
@@ -83,13 +92,18 @@ SOCKET D3DApp::CreateUDPSocket()
 
 
 void D3DApp::SendUDPMessage(SOCKET udpSocket, const char* message, const char* ipAddress, int port)
+{
+	SendUDPMessage(udpSocket, message, (int)strlen(message), ipAddress, port);
+}
+
+void D3DApp::SendUDPMessage(SOCKET udpSocket, const char* data, int length, const char* ipAddress, int port)
 {
 	sockaddr_in destAddr;
 	destAddr.sin_family = AF_INET;
 	destAddr.sin_port = htons(port);
 	inet_pton(AF_INET, ipAddress, &destAddr.sin_addr);
 
-	int result = sendto(udpSocket, message, strlen(message), 0, (sockaddr*)&destAddr, sizeof(destAddr));
+	int result = sendto(udpSocket, data, length, 0, (sockaddr*)&destAddr, sizeof(destAddr));
 	if (result == SOCKET_ERROR)
 	{
 		// Handle error
@@ -97,32 +111,93 @@ void D3DApp::SendUDPMessage(SOCKET udpSocket, const char* message, const char* i
 	
 }
 
-void D3DApp::ReceiveMessagesAsync(SOCKET udpSocket, std::atomic<bool>& isRunning, std::string& receivedMessage)
-{
-	while (isRunning)
-	{
-		char buffer[1024];
-		sockaddr_in senderAddr;
-		int senderAddrSize = sizeof(senderAddr);
+void D3DApp::Connect() {
+	if (!D3DApp::connected) {
+		InitNetworking();
+		mSocketBackend = SocketBackend::Create(mSocketBackendType);
+		if (mSocketBackend == nullptr)
+		{
+			OutputDebugString(L"Failed to open a socket; running offline\n");
+			return;
+		}
+		this->clientSocket = mSocketBackend->GetSocket();
+		mSendQueue.SetChannel(&mChannel);
+		mSendQueue.SetStats(&mNetStats);
 
-		int bytesReceived = recvfrom(udpSocket, buffer, sizeof(buffer), 0, (sockaddr*)&senderAddr, &senderAddrSize);
-		if (bytesReceived > 0)
+		std::wstring capture;
+		if (d3dUtil::GetCommandLineValue(L"capture", capture))
 		{
-			std::string rm = buffer;
-			receivedMessage = rm;
+			if (mCapture.Open(capture))
+				mSendQueue.SetCapture(&mCapture);
+			else
+				OutputDebugString(L"Failed to open network capture\n");
 		}
+		if (!mSendQueue.Start(mSocketBackend.get(), mServerHost.c_str(), mServerPort))
+		{
+			// Nothing could be sent, so don't pretend to be connected.
+			OutputDebugString(L"Failed to start the send queue; running offline\n");
+			mSendQueue.Stop();
+			mSocketBackend.reset();
+			this->clientSocket = INVALID_SOCKET;
+			return;
+		}
+		D3DApp::connected = true;
 	}
 }
 
+void D3DApp::Disconnect() {
+	if (!D3DApp::connected)
+		return;
 
-void D3DApp::Connect() {
-	if (!D3DApp::connected) {
-		InitNetworking();
-		this->clientSocket = CreateUDPSocket();
-		D3DApp::connected = true;
+	uint8_t buf[NetProtocol::kLeaveSize];
+	size_t length = NetProtocol::EncodeLeave(static_cast<uint16_t>(id), buf, sizeof(buf));
+	SendReliable(buf, length);
+
+	// Keep resending until the server acks, but don't hold up shutdown for long.  The
+	// receiver thread is still running and processes the acks.
+	DWORD start = GetTickCount();
+	do
+	{
+		RetryReliable();
+		mSendQueue.Flush();
+		Sleep(20);
+	} while ((!mHeldReliable.empty() || mChannel.HasUnacked()) && GetTickCount() - start < mDisconnectLingerMs);
+
+	if (!mHeldReliable.empty() || mChannel.HasUnacked())
+		OutputDebugString(L"Leave was not acknowledged before disconnecting\n");
+	mHeldReliable.clear();
+
+	mSendQueue.Stop();
+	D3DApp::connected = false;
+}
+
+void D3DApp::SendReliable(const uint8_t* data, size_t length)
+{
+	// Nothing this large can ever be sent, so don't hold it back forever.
+	if (length > ReliableChannel::MaxReliableSize)
+	{
+		OutputDebugString(L"Reliable message too large; dropped\n");
+		return;
 	}
+
+	// Anything already held back goes first, to keep the channel's ordering.
+	if (mHeldReliable.empty() && mChannel.SendReliable(data, length))
+		return;
+
+	if (mHeldReliable.empty())
+		OutputDebugString(L"Reliable send window full; holding messages back\n");
+	mHeldReliable.emplace_back(data, data + length);
 }
 
+void D3DApp::RetryReliable()
+{
+	size_t sent = 0;
+	while (sent < mHeldReliable.size() &&
+		mChannel.SendReliable(mHeldReliable[sent].data(), mHeldReliable[sent].size()))
+		++sent;
+
+	mHeldReliable.erase(mHeldReliable.begin(), mHeldReliable.begin() + sent);
+}
 
 void D3DApp::Set4xMsaaState(bool value)
 {
@@ -144,6 +219,7 @@ int D3DApp::Run()
 	MSG msg = {0};
  
 	mTimer.Reset();
+	mSimAccumulator = 0.0;
 
 	while(msg.message != WM_QUIT)
 	{
@@ -161,8 +237,35 @@ int D3DApp::Run()
 			if( !mAppPaused )
 			{
 				CalculateFrameStats();
-				Update(mTimer);	
-                Draw(mTimer);
+
+				// Wait for the swap chain before sampling input, so what is drawn is
+				// as fresh as the latency setting allows.
+				WaitForFrameLatency();
+
+				// Run as many fixed ticks as the elapsed time covers.  If a long stall
+				// would need more than mMaxCatchUpTicks, the excess is dropped rather
+				// than letting the simulation spiral further behind.
+				const double tickDt = 1.0 / mTickRate;
+				mSimAccumulator += mTimer.DeltaTime();
+				int ticks = 0;
+				while(mSimAccumulator >= tickDt && ticks < mMaxCatchUpTicks)
+				{
+					PROFILE_SCOPE("FixedUpdate");
+					FixedUpdate((float)tickDt);
+					mSimAccumulator -= tickDt;
+					++ticks;
+				}
+				if(mSimAccumulator >= tickDt)
+					mSimAccumulator = fmod(mSimAccumulator, tickDt);
+
+				{
+					PROFILE_SCOPE("Update");
+					Update(mTimer);
+				}
+				{
+					PROFILE_SCOPE("Draw");
+					Draw(mTimer);
+				}
 			}
 			else
 			{
@@ -174,8 +277,32 @@ int D3DApp::Run()
 	return (int)msg.wParam;
 }
 
+float D3DApp::SimAlpha()const
+{
+	return (float)(mSimAccumulator * mTickRate);
+}
+
 bool D3DApp::Initialize()
 {
+	// -tickrate <hz> overrides whatever the derived class picked.
+	float tickRate = d3dUtil::GetCommandLineFloat(L"tickrate", mTickRate);
+	if(tickRate > 0.0f)
+		mTickRate = tickRate;
+
+	// Frame pacing overrides; see d3dApp.h.  Frame resources are sized before the
+	// derived class builds anything that depends on gNumFrameResources.
+	float frames = d3dUtil::GetCommandLineFloat(L"frames", (float)gNumFrameResources);
+	gNumFrameResources = MathHelper::Clamp((int)frames, 1, gMaxFrameResources);
+
+	float backBuffers = d3dUtil::GetCommandLineFloat(L"backbuffers", (float)mSwapChainBufferCount);
+	mSwapChainBufferCount = MathHelper::Clamp((int)backBuffers, 2, MaxSwapChainBufferCount);
+
+	float latency = d3dUtil::GetCommandLineFloat(L"latency", (float)mMaxFrameLatency);
+	mMaxFrameLatency = (UINT)MathHelper::Clamp((int)latency, 0, 16);
+
+	float syncInterval = d3dUtil::GetCommandLineFloat(L"vsync", (float)mSyncInterval);
+	mSyncInterval = (UINT)MathHelper::Clamp((int)syncInterval, 0, 4);
+
 	if(!InitMainWindow())
 		return false;
 
@@ -218,7 +345,7 @@ std::string D3DApp::GetIP() {
 void D3DApp::CreateRtvAndDsvDescriptorHeaps()
 {
     D3D12_DESCRIPTOR_HEAP_DESC rtvHeapDesc;
-    rtvHeapDesc.NumDescriptors = SwapChainBufferCount;
+    rtvHeapDesc.NumDescriptors = mSwapChainBufferCount;
     rtvHeapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_RTV;
     rtvHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_NONE;
 	rtvHeapDesc.NodeMask = 0;
@@ -247,21 +374,21 @@ void D3DApp::OnResize()
     ThrowIfFailed(mCommandList->Reset(mDirectCmdListAlloc.Get(), nullptr));
 
 	// Release the previous resources we will be recreating.
-	for (int i = 0; i < SwapChainBufferCount; ++i)
+	for (int i = 0; i < mSwapChainBufferCount; ++i)
 		mSwapChainBuffer[i].Reset();
     mDepthStencilBuffer.Reset();
 	
 	// Resize the swap chain.
     ThrowIfFailed(mSwapChain->ResizeBuffers(
-		SwapChainBufferCount, 
+		mSwapChainBufferCount, 
 		mClientWidth, mClientHeight, 
 		mBackBufferFormat, 
-		DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH));
+		SwapChainFlags()));
 
 	mCurrBackBuffer = 0;
  
 	CD3DX12_CPU_DESCRIPTOR_HANDLE rtvHeapHandle(mRtvHeap->GetCPUDescriptorHandleForHeapStart());
-	for (UINT i = 0; i < SwapChainBufferCount; i++)
+	for (int i = 0; i < mSwapChainBufferCount; i++)
 	{
 		ThrowIfFailed(mSwapChain->GetBuffer(i, IID_PPV_ARGS(&mSwapChainBuffer[i])));
 		md3dDevice->CreateRenderTargetView(mSwapChainBuffer[i].Get(), nullptr, rtvHeapHandle);
@@ -331,9 +458,6 @@ void D3DApp::OnResize()
 
     mScissorRect = { 0, 0, mClientWidth, mClientHeight };
 }
-std::string ip = D3DApp::GetIP();
-std::string leaving = "exit:" + ip;
-
 LRESULT D3DApp::MsgProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 {
 	switch( msg )
@@ -429,8 +553,7 @@ LRESULT D3DApp::MsgProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
  
 	// WM_DESTROY is sent when the window is being destroyed.
 	case WM_DESTROY:
-
-		SendUDPMessage(clientSocket, leaving.c_str(), "127.0.0.1", 8000);
+		Disconnect();
 		PostQuitMessage(0);
 		return 0;
 
@@ -466,6 +589,10 @@ LRESULT D3DApp::MsgProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
         }
         else if((int)wParam == VK_F2)
             Set4xMsaaState(!m4xMsaaState);
+        else if((int)wParam == VK_F3)
+            mShowProfile = !mShowProfile;
+        else if((int)wParam == VK_F4)
+            DumpProfile();
 
         return 0;
 	}
@@ -547,6 +674,10 @@ bool D3DApp::InitDirect3D()
 	ThrowIfFailed(md3dDevice->CreateFence(0, D3D12_FENCE_FLAG_NONE,
 		IID_PPV_ARGS(&mFence)));
 
+	mFenceEvent = CreateEventEx(nullptr, nullptr, 0, EVENT_ALL_ACCESS);
+	if(mFenceEvent == nullptr)
+		ThrowIfFailed(HRESULT_FROM_WIN32(GetLastError()));
+
 	mRtvDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_RTV);
 	mDsvDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_DSV);
 	mCbvSrvUavDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
@@ -619,17 +750,41 @@ void D3DApp::CreateSwapChain()
     sd.SampleDesc.Count = m4xMsaaState ? 4 : 1;
     sd.SampleDesc.Quality = m4xMsaaState ? (m4xMsaaQuality - 1) : 0;
     sd.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
-    sd.BufferCount = SwapChainBufferCount;
+    sd.BufferCount = mSwapChainBufferCount;
     sd.OutputWindow = mhMainWnd;
     sd.Windowed = true;
 	sd.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
-    sd.Flags = DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;
+    sd.Flags = SwapChainFlags();
 
 	// Note: Swap chain uses queue to perform flush.
     ThrowIfFailed(mdxgiFactory->CreateSwapChain(
 		mCommandQueue.Get(),
 		&sd, 
 		mSwapChain.GetAddressOf()));
+
+	if(mFrameLatencyWaitable != nullptr)
+	{
+		CloseHandle(mFrameLatencyWaitable);
+		mFrameLatencyWaitable = nullptr;
+	}
+
+	// A waitable swap chain lets us block before a frame starts instead of inside
+	// Present, and caps how many frames the display queue holds.
+	if(mMaxFrameLatency > 0)
+	{
+		ComPtr<IDXGISwapChain2> swapChain2;
+		ThrowIfFailed(mSwapChain.As(&swapChain2));
+		ThrowIfFailed(swapChain2->SetMaximumFrameLatency(mMaxFrameLatency));
+		mFrameLatencyWaitable = swapChain2->GetFrameLatencyWaitableObject();
+	}
+}
+
+UINT D3DApp::SwapChainFlags()const
+{
+	UINT flags = DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;
+	if(mMaxFrameLatency > 0)
+		flags |= DXGI_SWAP_CHAIN_FLAG_FRAME_LATENCY_WAITABLE_OBJECT;
+	return flags;
 }
 
 void D3DApp::FlushCommandQueue()
@@ -643,17 +798,36 @@ void D3DApp::FlushCommandQueue()
     ThrowIfFailed(mCommandQueue->Signal(mFence.Get(), mCurrentFence));
 
 	// Wait until the GPU has completed commands up to this fence point.
-    if(mFence->GetCompletedValue() < mCurrentFence)
-	{
-		HANDLE eventHandle = CreateEventEx(nullptr, false, false, EVENT_ALL_ACCESS);
+	WaitForFence(mCurrentFence);
+}
 
-        // Fire event when GPU hits current fence.  
-        ThrowIfFailed(mFence->SetEventOnCompletion(mCurrentFence, eventHandle));
+void D3DApp::WaitForFence(UINT64 fenceValue)
+{
+	if(mFence->GetCompletedValue() >= fenceValue)
+		return;
 
-        // Wait until the GPU hits current fence event is fired.
-		WaitForSingleObject(eventHandle, INFINITE);
-        CloseHandle(eventHandle);
-	}
+	PROFILE_SCOPE("FenceWait");
+	auto start = std::chrono::steady_clock::now();
+
+	// Fire event when GPU hits the fence.  
+	ThrowIfFailed(mFence->SetEventOnCompletion(fenceValue, mFenceEvent));
+	WaitForSingleObject(mFenceEvent, INFINITE);
+
+	mFenceWaitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void D3DApp::WaitForFrameLatency()
+{
+	if(mFrameLatencyWaitable == nullptr)
+		return;
+
+	PROFILE_SCOPE("PresentWait");
+	auto start = std::chrono::steady_clock::now();
+
+	// Bounded so a lost or minimized window cannot hang the loop.
+	WaitForSingleObjectEx(mFrameLatencyWaitable, 1000, TRUE);
+
+	mLatencyWaitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
 ID3D12Resource* D3DApp::CurrentBackBuffer()const
@@ -694,18 +868,57 @@ void D3DApp::CalculateFrameStats()
         wstring fpsStr = to_wstring(fps);
         wstring mspfStr = to_wstring(mspf);
 
+        // Per-frame averages of the time spent blocked each way.
+        wstring fenceWaitStr = to_wstring(mFenceWaitMs / frameCnt);
+        wstring latencyWaitStr = to_wstring(mLatencyWaitMs / frameCnt);
+
         wstring windowText = mMainWndCaption +
             L"    fps: " + fpsStr +
-            L"   mspf: " + mspfStr;
+            L"   mspf: " + mspfStr +
+            L"   gpu wait: " + fenceWaitStr +
+            L"   present wait: " + latencyWaitStr +
+            (mShowProfile ? ProfileFrameStats() : ExtraFrameStats());
 
         SetWindowText(mhMainWnd, windowText.c_str());
 		
 		// Reset for next average.
 		frameCnt = 0;
+		mFenceWaitMs = 0.0;
+		mLatencyWaitMs = 0.0;
 		timeElapsed += 1.0f;
 	}
 }
 
+std::wstring D3DApp::ProfileFrameStats()
+{
+	std::vector<Profiler::ScopeSummary> scopes;
+	Profiler::Summarize("Main", 1.0, scopes);
+
+	// Per call, so per-frame scopes read as ms per frame.
+	std::wostringstream oss;
+	oss.setf(std::ios::fixed);
+	oss.precision(2);
+	oss << L"   cpu";
+	for (const Profiler::ScopeSummary& scope : scopes)
+		oss << L"  " << scope.Name << L": " << scope.TotalMs / scope.Count;
+	return oss.str();
+}
+
+void D3DApp::DumpProfile()
+{
+	SYSTEMTIME time;
+	GetLocalTime(&time);
+
+	wchar_t filename[64];
+	swprintf_s(filename, L"profile_%04d%02d%02d_%02d%02d%02d.json",
+		time.wYear, time.wMonth, time.wDay, time.wHour, time.wMinute, time.wSecond);
+
+	if (Profiler::WriteChromeTrace(filename))
+		OutputDebugString((std::wstring(L"Wrote ") + filename + L"\n").c_str());
+	else
+		OutputDebugString(L"Failed to write profile\n");
+}
+
 void D3DApp::LogAdapters()
 {
     UINT i = 0;
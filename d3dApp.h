@@ -11,6 +11,9 @@
 
 #include "d3dUtil.h"
 #include "GameTimer.h"
+#include "SocketBackend.h"
+#include "SendQueue.h"
+#include "Profiler.h"
 
 // Link necessary d3d12 libraries.
 #pragma comment(lib,"d3dcompiler.lib")
@@ -40,21 +43,29 @@ public:
 	void InitNetworking();
 	SOCKET CreateUDPSocket();
 	static void SendUDPMessage(SOCKET udpSocket, const char* message, const char* ipAddress, int port);
-	void ReceiveMessagesAsync(SOCKET udpSocket, std::atomic<bool>& isRunning, std::string& receivedMessage);
-	void SetReceivedMessage(std::string str);
+	static void SendUDPMessage(SOCKET udpSocket, const char* data, int length, const char* ipAddress, int port);
 	static bool ReceiveUDPMessage(SOCKET udpSocket);
-	void StartAsyncMessageReceiver(SOCKET udpSocket, std::atomic<bool>& isRunning, std::string& receivedMessage);
 	void Connect();
+	void Disconnect();
+
+	// Queues a message on mChannel.  While its send window is full the message is
+	// held back, in order, and RetryReliable hands it over on a later tick.
+	void SendReliable(const uint8_t* data, size_t length);
+	void RetryReliable();
+
 	SOCKET clientSocket;
 	bool connected = false;
 	int Run();
-	std::string receivedMessage;
 
 	unsigned long long seqNum = 0;
 
 	std::string name;
 	int health;
 	int id;
+
+	// Relay used unless the derived class picks another; the bot host shares it.
+	static constexpr const char* DefaultServerHost = "192.168.1.67";
+	static const int DefaultServerPort = 8000;
  
     virtual bool Initialize();
 	static std::string GetIP();
@@ -66,11 +77,25 @@ protected:
 	virtual void Update(const GameTimer& gt)=0;
     virtual void Draw(const GameTimer& gt)=0;
 
+	// Called zero or more times per frame with a constant dt (1 / mTickRate) before
+	// Update.  Simulation belongs here so it is independent of the frame rate.
+	virtual void FixedUpdate(float dt){ }
+
 	// Convenience overrides for handling mouse input.
 	virtual void OnMouseDown(WPARAM btnState, int x, int y){ }
 	virtual void OnMouseUp(WPARAM btnState, int x, int y)  { }
 	virtual void OnMouseMove(WPARAM btnState, int x, int y){ }
 
+	// Text appended to the frame stats in the window caption.
+	virtual std::wstring ExtraFrameStats(){ return L""; }
+
+	// Shown instead of ExtraFrameStats while F3 is toggled on: where the main
+	// thread spent the last second.
+	virtual std::wstring ProfileFrameStats();
+
+	// F4: every profiler track as a Chrome trace in the working directory.
+	void DumpProfile();
+
 protected:
 
 	bool InitMainWindow();
@@ -80,12 +105,23 @@ protected:
 
 	void FlushCommandQueue();
 
+	// Blocks until the GPU reaches fenceValue, counting the time as fence wait.
+	void WaitForFence(UINT64 fenceValue);
+
+	// Blocks until the swap chain can queue another frame without exceeding
+	// mMaxFrameLatency, counting the time as latency wait.  No-op if not waitable.
+	void WaitForFrameLatency();
+	UINT SwapChainFlags()const;
+
 	ID3D12Resource* CurrentBackBuffer()const;
 	D3D12_CPU_DESCRIPTOR_HANDLE CurrentBackBufferView()const;
 	D3D12_CPU_DESCRIPTOR_HANDLE DepthStencilView()const;
 
 	void CalculateFrameStats();
 
+	// How far the current frame lies between the last two fixed ticks, in [0, 1).
+	float SimAlpha()const;
+
     void LogAdapters();
     void LogAdapterOutputs(IDXGIAdapter* adapter);
     void LogOutputDisplayModes(IDXGIOutput* output, DXGI_FORMAT format);
@@ -106,6 +142,12 @@ protected:
     bool      m4xMsaaState = false;    // 4X MSAA enabled
     UINT      m4xMsaaQuality = 0;      // quality level of 4X MSAA
 
+	// Fixed simulation rate in Hz, and the most ticks run in one frame before the
+	// simulation gives up catching up and drops the remaining time.
+	float mTickRate = 60.0f;
+	int mMaxCatchUpTicks = 5;
+	double mSimAccumulator = 0.0;
+
 	// Used to keep track of the delta-time and game time (4.4).
 	GameTimer mTimer;
 	
@@ -120,9 +162,10 @@ protected:
     Microsoft::WRL::ComPtr<ID3D12CommandAllocator> mDirectCmdListAlloc;
     Microsoft::WRL::ComPtr<ID3D12GraphicsCommandList> mCommandList;
 
-	static const int SwapChainBufferCount = 2;
+	static const int MaxSwapChainBufferCount = 4;
+	int mSwapChainBufferCount = 2;
 	int mCurrBackBuffer = 0;
-    Microsoft::WRL::ComPtr<ID3D12Resource> mSwapChainBuffer[SwapChainBufferCount];
+    Microsoft::WRL::ComPtr<ID3D12Resource> mSwapChainBuffer[MaxSwapChainBufferCount];
     Microsoft::WRL::ComPtr<ID3D12Resource> mDepthStencilBuffer;
 
     Microsoft::WRL::ComPtr<ID3D12DescriptorHeap> mRtvHeap;
@@ -131,6 +174,27 @@ protected:
     D3D12_VIEWPORT mScreenViewport; 
     D3D12_RECT mScissorRect;
 
+	// Frame pacing.  Each can be overridden on the command line without a rebuild:
+	//   -frames <n>       frame resources in flight (gNumFrameResources)
+	//   -backbuffers <n>  swap chain buffers
+	//   -latency <n>      frames the swap chain may queue; 0 = not waitable
+	//   -vsync <n>        Present sync interval
+	// Fewer frames and lower latency cut input-to-photon delay; more of each let
+	// the CPU run further ahead of the GPU for throughput.
+	UINT mMaxFrameLatency = 1;
+	UINT mSyncInterval = 0;
+	HANDLE mFrameLatencyWaitable = nullptr;
+
+	// Reused for every fence wait rather than created per wait.
+	HANDLE mFenceEvent = nullptr;
+
+	// Wait time accumulated since the last frame stats update, in milliseconds.
+	// Fence wait is the CPU stalled on the GPU (GPU-bound); latency wait is the CPU
+	// held back by the swap chain queue (display-bound).
+	double mFenceWaitMs = 0.0;
+	double mLatencyWaitMs = 0.0;
+	bool mShowProfile = false;
+
 	UINT mRtvDescriptorSize = 0;
 	UINT mDsvDescriptorSize = 0;
 	UINT mCbvSrvUavDescriptorSize = 0;
@@ -142,5 +206,27 @@ protected:
     DXGI_FORMAT mDepthStencilFormat = DXGI_FORMAT_D24_UNORM_S8_UINT;
 	int mClientWidth = 800;
 	int mClientHeight = 600;
+
+	// Receive path used for clientSocket.  Falls back to RecvFrom if Registered I/O
+	// is not available on this machine.
+	SocketBackendType mSocketBackendType = SocketBackendType::RegisteredIO;
+	std::unique_ptr<SocketBackend> mSocketBackend;
+
+	// Relay the client talks to.  Everything bound for it goes through mSendQueue,
+	// declared after mSocketBackend so its thread stops before the socket closes.
+	// Join and Leave ride on mChannel, counters go to mNetStats and datagrams are
+	// captured to mCapture, all of which must outlive mSendQueue.
+	std::string mServerHost = DefaultServerHost;
+	int mServerPort = DefaultServerPort;
+	NetStats mNetStats;
+	NetCaptureWriter mCapture; // -capture <file>
+	ReliableChannel mChannel;
+	SendQueue mSendQueue;
+
+	// Reliable messages waiting for room in mChannel's send window.
+	std::vector<std::vector<uint8_t>> mHeldReliable;
+
+	// How long Disconnect waits for the server to ack the Leave.
+	DWORD mDisconnectLingerMs = 1000;
 };
 
@@ -2,6 +2,9 @@
 #include "d3dUtil.h"
 #include <comdef.h>
 #include <fstream>
+#include <shellapi.h>
+
+#pragma comment(lib, "Shell32.lib")
 
 using Microsoft::WRL::ComPtr;
 
@@ -18,6 +21,55 @@ bool d3dUtil::IsKeyDown(int vkeyCode)
     return (GetAsyncKeyState(vkeyCode) & 0x8000) != 0;
 }
 
+static bool FindCommandLineArg(const std::wstring& name, std::wstring* value)
+{
+    int argc = 0;
+    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    if(argv == nullptr)
+        return false;
+
+    bool found = false;
+    std::wstring option = L"-" + name;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(option == argv[i])
+        {
+            if(value == nullptr)
+                found = true;
+            else if(i + 1 < argc)
+            {
+                *value = argv[i + 1];
+                found = true;
+            }
+            break;
+        }
+    }
+
+    LocalFree(argv);
+    return found;
+}
+
+bool d3dUtil::HasCommandLineFlag(const std::wstring& name)
+{
+    return FindCommandLineArg(name, nullptr);
+}
+
+bool d3dUtil::GetCommandLineValue(const std::wstring& name, std::wstring& value)
+{
+    return FindCommandLineArg(name, &value);
+}
+
+float d3dUtil::GetCommandLineFloat(const std::wstring& name, float defaultValue)
+{
+    std::wstring value;
+    if(!GetCommandLineValue(name, value))
+        return defaultValue;
+
+    wchar_t* end = nullptr;
+    float result = wcstof(value.c_str(), &end);
+    return end != value.c_str() ? result : defaultValue;
+}
+
 ComPtr<ID3DBlob> d3dUtil::LoadBinary(const std::wstring& filename)
 {
     std::ifstream fin(filename, std::ios::binary);
@@ -35,6 +87,22 @@ ComPtr<ID3DBlob> d3dUtil::LoadBinary(const std::wstring& filename)
     return blob;
 }
 
+bool d3dUtil::SaveBinary(const std::wstring& filename, const void* data, size_t byteSize)
+{
+    std::wstring tempName = filename + L".tmp";
+    {
+        std::ofstream fout(tempName, std::ios::binary | std::ios::trunc);
+        if(!fout)
+            return false;
+
+        fout.write((const char*)data, byteSize);
+        if(!fout)
+            return false;
+    }
+
+    return MoveFileExW(tempName.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
 Microsoft::WRL::ComPtr<ID3D12Resource> d3dUtil::CreateDefaultBuffer(
     ID3D12Device* device,
     ID3D12GraphicsCommandList* cmdList,
@@ -73,11 +141,17 @@ Microsoft::WRL::ComPtr<ID3D12Resource> d3dUtil::CreateDefaultBuffer(
     // Schedule to copy the data to the default buffer resource.  At a high level, the helper function UpdateSubresources
     // will copy the CPU memory into the intermediate upload heap.  Then, using ID3D12CommandList::CopySubresourceRegion,
     // the intermediate upload heap data will be copied to mBuffer.
-	cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(defaultBuffer.Get(), 
-		D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST));
+    // On a copy list the barriers are skipped, as only copy states are legal there.
+    // Buffers are promoted from COMMON implicitly, so the copy and the first read on
+    // the direct queue need no transitions.
+    bool copyList = cmdList->GetType() == D3D12_COMMAND_LIST_TYPE_COPY;
+    if(!copyList)
+	    cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(defaultBuffer.Get(), 
+		    D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST));
     UpdateSubresources<1>(cmdList, defaultBuffer.Get(), uploadBuffer.Get(), 0, 0, 1, &subResourceData);
-	cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(defaultBuffer.Get(),
-		D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_GENERIC_READ));
+    if(!copyList)
+	    cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(defaultBuffer.Get(),
+		    D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_GENERIC_READ));
 
     // Note: uploadBuffer has to be kept alive after the above function calls because
     // the command list has not been executed yet that performs the actual copy.
@@ -87,16 +161,101 @@ Microsoft::WRL::ComPtr<ID3D12Resource> d3dUtil::CreateDefaultBuffer(
     return defaultBuffer;
 }
 
+static UINT ShaderCompileFlags()
+{
+	UINT compileFlags = 0;
+#if defined(DEBUG) || defined(_DEBUG)  
+	compileFlags = D3DCOMPILE_DEBUG | D3DCOMPILE_SKIP_OPTIMIZATION;
+#endif
+	return compileFlags;
+}
+
+// 64-bit FNV-1a.
+static void HashBytes(uint64_t& hash, const void* data, size_t byteSize)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	for(size_t i = 0; i < byteSize; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+}
+
+// Hashes a shader source file and, recursively, the quoted files it #includes,
+// resolved the way D3D_COMPILE_STANDARD_FILE_INCLUDE does: relative to the
+// including file.
+static void HashShaderSource(uint64_t& hash, const std::wstring& filename, int depth)
+{
+	std::ifstream fin(filename, std::ios::binary);
+	std::string source((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+	HashBytes(hash, source.data(), source.size());
+
+	if(depth >= 8)
+		return;
+
+	size_t slash = filename.find_last_of(L"\\/");
+	std::wstring dir = slash == std::wstring::npos ? L"" : filename.substr(0, slash + 1);
+
+	size_t pos = 0;
+	while((pos = source.find("#include", pos)) != std::string::npos)
+	{
+		size_t open = source.find('"', pos);
+		size_t eol = source.find('\n', pos);
+		pos += 8;
+		if(open == std::string::npos || open > eol)
+			continue;
+
+		size_t close = source.find('"', open + 1);
+		if(close == std::string::npos || close > eol)
+			continue;
+
+		HashShaderSource(hash, dir + AnsiToWString(source.substr(open + 1, close - open - 1)), depth + 1);
+	}
+}
+
+ComPtr<ID3DBlob> d3dUtil::CompileShaderCached(
+	const std::wstring& filename,
+	const D3D_SHADER_MACRO* defines,
+	const std::string& entrypoint,
+	const std::string& target,
+	const std::wstring& cacheDir)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	HashShaderSource(hash, filename, 0);
+	for(const D3D_SHADER_MACRO* d = defines; d != nullptr && d->Name != nullptr; ++d)
+	{
+		HashBytes(hash, d->Name, strlen(d->Name) + 1);
+		HashBytes(hash, d->Definition, strlen(d->Definition) + 1);
+	}
+	HashBytes(hash, entrypoint.c_str(), entrypoint.size() + 1);
+	HashBytes(hash, target.c_str(), target.size() + 1);
+	UINT compileFlags = ShaderCompileFlags();
+	HashBytes(hash, &compileFlags, sizeof(compileFlags));
+
+	wchar_t key[17];
+	swprintf_s(key, L"%016llx", (unsigned long long)hash);
+	std::wstring cacheFile = cacheDir + L"/" + key + L".cso";
+
+	if(GetFileAttributesW(cacheFile.c_str()) != INVALID_FILE_ATTRIBUTES)
+		return LoadBinary(cacheFile);
+
+	ComPtr<ID3DBlob> byteCode = CompileShader(filename, defines, entrypoint, target);
+
+	// A cache that cannot be written only costs a compile next launch.
+	CreateDirectoryW(cacheDir.c_str(), nullptr);
+	if(!SaveBinary(cacheFile, byteCode->GetBufferPointer(), byteCode->GetBufferSize()))
+		OutputDebugStringA("Failed to write shader cache entry\n");
+
+	return byteCode;
+}
+
 ComPtr<ID3DBlob> d3dUtil::CompileShader(
 	const std::wstring& filename,
 	const D3D_SHADER_MACRO* defines,
 	const std::string& entrypoint,
 	const std::string& target)
 {
-	UINT compileFlags = 0;
-#if defined(DEBUG) || defined(_DEBUG)  
-	compileFlags = D3DCOMPILE_DEBUG | D3DCOMPILE_SKIP_OPTIMIZATION;
-#endif
+	UINT compileFlags = ShaderCompileFlags();
 
 	HRESULT hr = S_OK;
 
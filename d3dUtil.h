@@ -39,7 +39,10 @@
 
 #pragma comment(lib, "Ws2_32.lib")
 
-extern const int gNumFrameResources;
+// Frame resources in flight.  Set once at startup (-frames), before anything that
+// is sized or dirty-tracked by it is created.
+extern int gNumFrameResources;
+const int gMaxFrameResources = 8;
 
 inline void d3dSetDebugName(IDXGIObject* obj, const char* name)
 {
@@ -104,6 +107,11 @@ public:
 
     static bool IsKeyDown(int vkeyCode);
 
+    // Command-line options of the form "-name value" or a bare "-name".
+    static bool HasCommandLineFlag(const std::wstring& name);
+    static bool GetCommandLineValue(const std::wstring& name, std::wstring& value);
+    static float GetCommandLineFloat(const std::wstring& name, float defaultValue);
+
     static std::string ToString(HRESULT hr);
 
     static UINT CalcConstantBufferByteSize(UINT byteSize)
@@ -124,6 +132,10 @@ public:
 
     static Microsoft::WRL::ComPtr<ID3DBlob> LoadBinary(const std::wstring& filename);
 
+    // Writes through a temporary file that is then moved into place, so a reader
+    // never sees a partly written file.
+    static bool SaveBinary(const std::wstring& filename, const void* data, size_t byteSize);
+
     static Microsoft::WRL::ComPtr<ID3D12Resource> CreateDefaultBuffer(
         ID3D12Device* device,
         ID3D12GraphicsCommandList* cmdList,
@@ -136,6 +148,17 @@ public:
 		const D3D_SHADER_MACRO* defines,
 		const std::string& entrypoint,
 		const std::string& target);
+
+	// CompileShader behind an on-disk bytecode cache.  Blobs are stored in cacheDir as
+	// <key>.cso, where the key hashes the source and every file it #includes, the
+	// defines, entry point, target and compile flags.  Any change compiles once and
+	// is loaded with LoadBinary from then on.
+	static Microsoft::WRL::ComPtr<ID3DBlob> CompileShaderCached(
+		const std::wstring& filename,
+		const D3D_SHADER_MACRO* defines,
+		const std::string& entrypoint,
+		const std::string& target,
+		const std::wstring& cacheDir = L"ShaderCache");
 };
 
 class DxException
@@ -152,6 +175,15 @@ public:
     int LineNumber = -1;
 };
 
+// A coarser version of a submesh, drawn from the same buffers.  Error is the
+// largest distance, in model units, that simplification moved a vertex.
+struct SubmeshLod
+{
+	UINT IndexCount = 0;
+	UINT StartIndexLocation = 0;
+	float Error = 0.0f;
+};
+
 // Defines a subrange of geometry in a MeshGeometry.  This is for when multiple
 // geometries are stored in one vertex and index buffer.  It provides the offsets
 // and data needed to draw a subset of geometry stores in the vertex and index 
@@ -162,6 +194,9 @@ struct SubmeshGeometry
 	UINT StartIndexLocation = 0;
 	INT BaseVertexLocation = 0;
 
+	// Coarser levels after this one, finest first.  Empty if there are none.
+	std::vector<SubmeshLod> Lods;
+
     // Bounding box of the geometry defined by this submesh. 
     // This is used in later chapters of the book.
 	DirectX::BoundingBox Bounds;
@@ -234,16 +269,6 @@ struct Light
 
 #define MaxLights 16
 
-struct MaterialConstants
-{
-	DirectX::XMFLOAT4 DiffuseAlbedo = { 1.0f, 1.0f, 1.0f, 1.0f };
-	DirectX::XMFLOAT3 FresnelR0 = { 0.01f, 0.01f, 0.01f };
-	float Roughness = 0.25f;
-
-	// Used in texture mapping.
-	DirectX::XMFLOAT4X4 MatTransform = MathHelper::Identity4x4();
-};
-
 // Simple struct to represent a material for our demos.  A production 3D engine
 // would likely create a class hierarchy of Materials.
 struct Material
@@ -271,6 +296,9 @@ struct Material
 	DirectX::XMFLOAT3 FresnelR0 = { 0.01f, 0.01f, 0.01f };
 	float Roughness = .25f;
 	DirectX::XMFLOAT4X4 MatTransform = MathHelper::Identity4x4();
+
+	// Set from the texture streamer; 0 when the diffuse map is loaded whole.
+	float MinLod = 0.0f;
 };
 
 struct Texture
@@ -282,6 +310,9 @@ struct Texture
 
 	Microsoft::WRL::ComPtr<ID3D12Resource> Resource = nullptr;
 	Microsoft::WRL::ComPtr<ID3D12Resource> UploadHeap = nullptr;
+
+	// TextureStreamer id when streamed, otherwise -1.
+	int StreamId = -1;
 };
 
 #ifndef ThrowIfFailed